@@ -0,0 +1,24 @@
+/*
+ * VibeOS Structure Offsets Used From Assembly
+ *
+ * vectors.S saves and restores context through these. process.c checks
+ * them against the real structs with _Static_assert, so a new field in
+ * process_t, cpu_context_t or cpu_t that moves them fails the build.
+ * Plain #defines only - this is included from .S files.
+ */
+
+#ifndef ASM_OFFSETS_H
+#define ASM_OFFSETS_H
+
+// Offset of cpu_context_t within process_t
+#define CONTEXT_OFFSET 0x50
+
+// Offset of on_cpu within cpu_context_t (after fp_regs)
+#define CONTEXT_ON_CPU 0x320
+
+// TPIDR_EL1 points at this core's cpu_t: current process at +0x00,
+// kernel_context pointer at +0x08
+#define CPU_CURRENT     0x00
+#define CPU_KERNEL_CTX  0x08
+
+#endif
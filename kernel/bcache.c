@@ -0,0 +1,360 @@
+/*
+ * VibeOS Block Buffer Cache
+ *
+ * Fixed pool of sector buffers. A buffer is found by sector number through
+ * a chained hash table and sits on one LRU list (head = most recently
+ * used). Misses are read from disk in runs, so a cluster read that misses
+ * entirely is still one hal_blk_read. Write-back collects the dirty
+ * buffers, sorts them by sector and queues contiguous runs as one
+ * multi-block write each, a stage buffer's worth at a time, so the
+ * driver has them all in flight together.
+ */
+
+#include "bcache.h"
+#include "hal/hal.h"
+#include "memory.h"
+#include "printf.h"
+#include "string.h"
+
+#define BCACHE_BUCKETS    1024
+#define BCACHE_DIRTY_MAX  (BCACHE_SECTORS / 2)  // Write back early past this
+#define BCACHE_RUN_MAX    128                   // Sectors per write-back request
+#define BCACHE_STAGE      1024                  // Sectors queued per write-back batch
+#define BCACHE_BATCH_REQS 64                    // Requests queued per batch
+
+typedef struct bbuf {
+    uint32_t sector;
+    uint8_t valid;
+    uint8_t dirty;
+    struct bbuf *hash_next;
+    struct bbuf *lru_prev;
+    struct bbuf *lru_next;
+    uint8_t *data;
+} bbuf_t;
+
+static bbuf_t *bufs;
+static bbuf_t *hash_table[BCACHE_BUCKETS];
+static bbuf_t *lru_head;
+static bbuf_t *lru_tail;
+
+static bbuf_t **sort_buf;       // Dirty buffers, sorted during write-back
+static uint8_t *stage_buf;      // One write-back batch
+static hal_blk_req_t batch_reqs[BCACHE_BATCH_REQS];
+static int batch_first[BCACHE_BATCH_REQS];  // Index into sort_buf per request
+
+static uint64_t dirty_since;    // When the oldest dirty sector was dirtied
+static bcache_stats_t stats;
+
+static inline uint32_t hash_sector(uint32_t sector) {
+    return (sector * 2654435761U) >> 22;  // Top 10 bits -> BCACHE_BUCKETS
+}
+
+static bbuf_t *lookup(uint32_t sector) {
+    for (bbuf_t *b = hash_table[hash_sector(sector)]; b; b = b->hash_next) {
+        if (b->sector == sector) return b;
+    }
+    return NULL;
+}
+
+static void hash_remove(bbuf_t *b) {
+    bbuf_t **pp = &hash_table[hash_sector(b->sector)];
+    while (*pp && *pp != b) pp = &(*pp)->hash_next;
+    if (*pp) *pp = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static void lru_unlink(bbuf_t *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_head(bbuf_t *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static inline void lru_touch(bbuf_t *b) {
+    if (b != lru_head) {
+        lru_unlink(b);
+        lru_push_head(b);
+    }
+}
+
+static void mark_dirty(bbuf_t *b) {
+    if (!b->dirty) {
+        b->dirty = 1;
+        if (stats.dirty++ == 0) {
+            dirty_since = hal_get_time_ns();
+        }
+    }
+}
+
+// Take the least recently used buffer for a new sector. A dirty victim
+// means the cache is full of unwritten data, so write everything back -
+// sorted, that's far cheaper than writing the victim alone.
+static bbuf_t *alloc_buf(uint32_t sector) {
+    bbuf_t *b = lru_tail;
+    if (b->valid && b->dirty) {
+        bcache_sync();
+        if (b->dirty) return NULL;  // Disk error, keep the data
+    }
+
+    if (b->valid) {
+        hash_remove(b);
+        stats.cached--;
+    }
+    b->sector = sector;
+    b->valid = 1;
+    b->dirty = 0;
+    uint32_t h = hash_sector(sector);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+    stats.cached++;
+    lru_touch(b);
+    return b;
+}
+
+// Drop a buffer whose contents never arrived
+static void discard_buf(bbuf_t *b) {
+    hash_remove(b);
+    b->valid = 0;
+    stats.cached--;
+    lru_unlink(b);
+    // Back of the line, reused first
+    b->lru_prev = lru_tail;
+    b->lru_next = NULL;
+    if (lru_tail) lru_tail->lru_next = b;
+    lru_tail = b;
+    if (!lru_head) lru_head = b;
+}
+
+int bcache_init(void) {
+    bufs = malloc(BCACHE_SECTORS * sizeof(bbuf_t));
+    uint8_t *data = malloc(BCACHE_SECTORS * BCACHE_SECTOR_SIZE);
+    sort_buf = malloc(BCACHE_SECTORS * sizeof(bbuf_t *));
+    stage_buf = malloc(BCACHE_STAGE * BCACHE_SECTOR_SIZE);
+    if (!bufs || !data || !sort_buf || !stage_buf) {
+        printf("[BCACHE] Out of memory, running uncached\n");
+        if (bufs) free(bufs);
+        if (data) free(data);
+        if (sort_buf) free(sort_buf);
+        if (stage_buf) free(stage_buf);
+        bufs = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < BCACHE_BUCKETS; i++) {
+        hash_table[i] = NULL;
+    }
+    lru_head = lru_tail = NULL;
+    for (int i = 0; i < BCACHE_SECTORS; i++) {
+        bbuf_t *b = &bufs[i];
+        b->sector = 0;
+        b->valid = 0;
+        b->dirty = 0;
+        b->hash_next = NULL;
+        b->data = data + (size_t)i * BCACHE_SECTOR_SIZE;
+        lru_push_head(b);
+    }
+    memset(&stats, 0, sizeof(stats));
+
+    printf("[BCACHE] %d KB write-back block cache\n",
+           BCACHE_SECTORS * BCACHE_SECTOR_SIZE / 1024);
+    return 0;
+}
+
+int bcache_read(uint32_t sector, void *buf, uint32_t count) {
+    if (!bufs) return hal_blk_read(sector, buf, count);
+
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t i = 0;
+    while (i < count) {
+        bbuf_t *b = lookup(sector + i);
+        if (b) {
+            memcpy(dst + (size_t)i * BCACHE_SECTOR_SIZE, b->data, BCACHE_SECTOR_SIZE);
+            lru_touch(b);
+            stats.hits++;
+            i++;
+            continue;
+        }
+
+        // Read the whole run of misses, up to the next cached sector, in
+        // one request straight into the caller's buffer
+        uint32_t run = 1;
+        while (i + run < count && !lookup(sector + i + run)) run++;
+
+        uint8_t *run_buf = dst + (size_t)i * BCACHE_SECTOR_SIZE;
+        if (hal_blk_read(sector + i, run_buf, run) < 0) {
+            return -1;
+        }
+        stats.misses += run;
+
+        for (uint32_t j = 0; j < run; j++) {
+            b = alloc_buf(sector + i + j);
+            if (!b) break;  // Write-back failed - just don't cache the rest
+            memcpy(b->data, run_buf + (size_t)j * BCACHE_SECTOR_SIZE, BCACHE_SECTOR_SIZE);
+        }
+        i += run;
+    }
+    return 0;
+}
+
+int bcache_write(uint32_t sector, const void *buf, uint32_t count) {
+    if (!bufs) return hal_blk_write(sector, buf, count);
+
+    const uint8_t *src = (const uint8_t *)buf;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *data = src + (size_t)i * BCACHE_SECTOR_SIZE;
+        bbuf_t *b = lookup(sector + i);
+        if (b) {
+            lru_touch(b);
+        } else {
+            b = alloc_buf(sector + i);
+        }
+        if (!b) {
+            // No clean buffer to be had - write through
+            if (hal_blk_write(sector + i, data, 1) < 0) return -1;
+            stats.writebacks++;
+            continue;
+        }
+        memcpy(b->data, data, BCACHE_SECTOR_SIZE);
+        mark_dirty(b);
+    }
+
+    if (stats.dirty > BCACHE_DIRTY_MAX) {
+        return bcache_sync();
+    }
+    return 0;
+}
+
+uint8_t *bcache_get(uint32_t sector) {
+    if (!bufs) return NULL;
+
+    bbuf_t *b = lookup(sector);
+    if (b) {
+        lru_touch(b);
+        stats.hits++;
+        return b->data;
+    }
+
+    b = alloc_buf(sector);
+    if (!b) return NULL;
+    if (hal_blk_read(sector, b->data, 1) < 0) {
+        discard_buf(b);
+        return NULL;
+    }
+    stats.misses++;
+    return b->data;
+}
+
+void bcache_mark_dirty(uint32_t sector) {
+    bbuf_t *b = bufs ? lookup(sector) : NULL;
+    if (b) mark_dirty(b);
+}
+
+uint32_t bcache_clean_run(uint32_t sector, uint32_t count) {
+    if (!bufs || stats.dirty == 0) return count;
+
+    uint32_t n = 0;
+    while (n < count) {
+        bbuf_t *b = lookup(sector + n);
+        if (b && b->dirty) break;
+        n++;
+    }
+    return n;
+}
+
+int bcache_sync(void) {
+    if (!bufs || stats.dirty == 0) return 0;
+
+    // Collect and sort by sector (shell sort - a few thousand at most)
+    int n = 0;
+    for (int i = 0; i < BCACHE_SECTORS; i++) {
+        if (bufs[i].valid && bufs[i].dirty) {
+            sort_buf[n++] = &bufs[i];
+        }
+    }
+    for (int gap = n / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < n; i++) {
+            bbuf_t *tmp = sort_buf[i];
+            int j = i;
+            while (j >= gap && sort_buf[j - gap]->sector > tmp->sector) {
+                sort_buf[j] = sort_buf[j - gap];
+                j -= gap;
+            }
+            sort_buf[j] = tmp;
+        }
+    }
+
+    // Write contiguous runs, queueing a batch of them before waiting
+    int ret = 0;
+    int i = 0;
+    while (i < n) {
+        int nreq = 0;
+        int staged = 0;
+        while (i < n && nreq < BCACHE_BATCH_REQS && staged < BCACHE_STAGE) {
+            int run = 1;
+            while (i + run < n && run < BCACHE_RUN_MAX &&
+                   staged + run < BCACHE_STAGE &&
+                   sort_buf[i + run]->sector == sort_buf[i]->sector + run) {
+                run++;
+            }
+
+            uint8_t *src = stage_buf + (size_t)staged * BCACHE_SECTOR_SIZE;
+            for (int j = 0; j < run; j++) {
+                memcpy(src + (size_t)j * BCACHE_SECTOR_SIZE,
+                       sort_buf[i + j]->data, BCACHE_SECTOR_SIZE);
+            }
+
+            hal_blk_req_t *req = &batch_reqs[nreq];
+            req->sector = sort_buf[i]->sector;
+            req->count = run;
+            req->buf = src;
+            req->write = 1;
+            req->done = NULL;
+            batch_first[nreq] = i;
+            hal_blk_submit(req);
+
+            nreq++;
+            staged += run;
+            i += run;
+        }
+        hal_blk_kick();
+
+        for (int r = 0; r < nreq; r++) {
+            hal_blk_req_t *req = &batch_reqs[r];
+            if (hal_blk_wait(req) < 0) {
+                printf("[BCACHE] Write-back failed at sector %u (%u sectors)\n",
+                       req->sector, req->count);
+                ret = -1;
+                continue;
+            }
+            for (uint32_t j = 0; j < req->count; j++) {
+                sort_buf[batch_first[r] + j]->dirty = 0;
+            }
+            stats.dirty -= req->count;
+            stats.writebacks += req->count;
+        }
+    }
+
+    // Whatever failed gets another go after a full interval, not in a loop
+    if (stats.dirty) {
+        dirty_since = hal_get_time_ns();
+    }
+    return ret;
+}
+
+uint64_t bcache_writeback_due(void) {
+    if (stats.dirty == 0) return HAL_TIMER_NEVER;
+    return dirty_since + BCACHE_WRITEBACK_NS;
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+    *out = stats;
+}
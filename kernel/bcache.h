@@ -0,0 +1,56 @@
+/*
+ * VibeOS Block Buffer Cache
+ *
+ * Write-back cache of 512-byte disk sectors between the filesystem and
+ * hal_blk_read/hal_blk_write. Lookups go through a hash table, eviction is
+ * LRU. Writes only dirty the cached copy; dirty sectors go to disk in
+ * sector order when they get old, when the cache needs the room, or on
+ * bcache_sync().
+ *
+ * Not locked itself - every caller holds vfs_lock().
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+
+#define BCACHE_SECTOR_SIZE  512
+#define BCACHE_SECTORS      4096                // 2MB of cached sectors
+#define BCACHE_WRITEBACK_NS 2000000000ULL      // Dirty data reaches disk within ~2s
+
+typedef struct {
+    uint64_t hits;          // Sectors served from the cache
+    uint64_t misses;        // Sectors read from disk
+    uint64_t writebacks;    // Sectors written to disk
+    uint32_t cached;        // Sectors currently cached
+    uint32_t dirty;         // Sectors waiting for write-back
+} bcache_stats_t;
+
+// Allocate the cache. Before this, reads and writes go straight to disk.
+int bcache_init(void);
+
+// Read/write whole sectors (absolute sector numbers)
+int bcache_read(uint32_t sector, void *buf, uint32_t count);
+int bcache_write(uint32_t sector, const void *buf, uint32_t count);
+
+// Cached copy of one sector, read from disk on a miss. Valid until the
+// next bcache call; after changing it, call bcache_mark_dirty().
+uint8_t *bcache_get(uint32_t sector);
+void bcache_mark_dirty(uint32_t sector);
+
+// How many of count sectors from sector on have no unwritten changes,
+// i.e. can be read straight from disk (for readahead)
+uint32_t bcache_clean_run(uint32_t sector, uint32_t count);
+
+// Write every dirty sector to disk. Returns 0, or -1 if a write failed.
+int bcache_sync(void);
+
+// When the oldest dirty sector is due for write-back, HAL_TIMER_NEVER if
+// nothing is dirty. Idle kernel threads sleep no longer than this and
+// then call vfs_writeback().
+uint64_t bcache_writeback_due(void);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif
@@ -129,6 +129,42 @@ uint64_t elf_calc_size(const void *data, size_t size) {
     return max_addr - min_addr;
 }
 
+// Find the NT_VIBEOS_STACK note. The linker script keeps it in a PT_NOTE
+// segment; programs built without VIBE_STACK_SIZE() just have an empty one.
+uint64_t elf_stack_size(const void *data, size_t size) {
+    if (elf_validate(data, size) != 0) return 0;
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+    const uint8_t *base = (const uint8_t *)data;
+    size_t owner_len = sizeof(ELF_NOTE_VIBEOS);  // Includes the NUL
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(base + ehdr->e_phoff + i * ehdr->e_phentsize);
+        if (phdr->p_type != PT_NOTE) continue;
+        if (phdr->p_offset > size || phdr->p_filesz > size - phdr->p_offset) continue;
+
+        uint64_t off = phdr->p_offset;
+        uint64_t end = phdr->p_offset + phdr->p_filesz;
+        while (off + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr *note = (const Elf64_Nhdr *)(base + off);
+            uint64_t name_off = off + sizeof(Elf64_Nhdr);
+            uint64_t desc_off = name_off + ((note->n_namesz + 3) & ~3U);
+            uint64_t next = desc_off + ((note->n_descsz + 3) & ~3U);
+            if (next > end) break;
+
+            if (note->n_type == NT_VIBEOS_STACK && note->n_namesz == owner_len &&
+                note->n_descsz >= 4 &&
+                memcmp(base + name_off, ELF_NOTE_VIBEOS, owner_len) == 0) {
+                const uint8_t *d = base + desc_off;
+                return (uint64_t)d[0] | ((uint64_t)d[1] << 8) |
+                       ((uint64_t)d[2] << 16) | ((uint64_t)d[3] << 24);
+            }
+            off = next;
+        }
+    }
+    return 0;
+}
+
 // Process dynamic relocations for PIE binaries
 static void elf_process_relocations(uint64_t load_base, const Elf64_Dyn *dynamic) {
     uint64_t rela_addr = 0;
@@ -179,6 +215,63 @@ static void elf_process_relocations(uint64_t load_base, const Elf64_Dyn *dynamic
     // printf("[ELF] Applied %d relocations successfully\n", applied);
 }
 
+// Walk the PIE's RELA table for R_AARCH64_RELATIVE entries (see elf.h)
+int elf_relative_relocs(const void *data, size_t size, uint64_t load_base, uint32_t *out) {
+    if (elf_validate(data, size) != 0) return -1;
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
+    const uint8_t *base = (const uint8_t *)data;
+    if (ehdr->e_type != ET_DYN) return -1;
+
+    const Elf64_Dyn *dynamic = NULL;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(base + ehdr->e_phoff + i * ehdr->e_phentsize);
+        if (phdr->p_type == PT_DYNAMIC) {
+            dynamic = (const Elf64_Dyn *)(load_base + phdr->p_vaddr);
+        }
+    }
+    if (!dynamic) return 0;
+
+    uint64_t rela_addr = 0, rela_size = 0, rela_ent = sizeof(Elf64_Rela);
+    for (const Elf64_Dyn *dyn = dynamic; dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+            case DT_RELA:    rela_addr = dyn->d_val; break;
+            case DT_RELASZ:  rela_size = dyn->d_val; break;
+            case DT_RELAENT: rela_ent = dyn->d_val;  break;
+        }
+    }
+    if (rela_addr == 0 || rela_size == 0 || rela_ent == 0) return 0;
+
+    int count = 0;
+    for (uint64_t off = 0; off + sizeof(Elf64_Rela) <= rela_size; off += rela_ent) {
+        const Elf64_Rela *r = (const Elf64_Rela *)(load_base + rela_addr + off);
+        if ((r->r_info & 0xFFFFFFFF) != R_AARCH64_RELATIVE) continue;
+        if (out) out[count] = (uint32_t)r->r_offset;
+        count++;
+    }
+    return count;
+}
+
+// Make freshly written code visible to instruction fetch: clean the
+// D-cache to the point of unification, then invalidate the I-cache.
+// Needed whenever caches are on and a load area gets reused.
+void elf_sync_icache(uint64_t start, uint64_t size) {
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    uint64_t dline = 4UL << ((ctr >> 16) & 0xF);
+    uint64_t iline = 4UL << (ctr & 0xF);
+    uint64_t end = start + size;
+
+    for (uint64_t a = start & ~(dline - 1); a < end; a += dline) {
+        asm volatile("dc cvau, %0" :: "r"(a) : "memory");
+    }
+    asm volatile("dsb ish" ::: "memory");
+    for (uint64_t a = start & ~(iline - 1); a < end; a += iline) {
+        asm volatile("ic ivau, %0" :: "r"(a) : "memory");
+    }
+    asm volatile("dsb ish\n isb" ::: "memory");
+}
+
 // Load ELF at a specific base address
 int elf_load_at(const void *data, size_t size, uint64_t load_base, elf_load_info_t *info) {
     int valid = elf_validate(data, size);
@@ -195,6 +288,7 @@ int elf_load_at(const void *data, size_t size, uint64_t load_base, elf_load_info
     //        is_pie ? "PIE" : "EXEC", load_base, ehdr->e_phnum);
 
     uint64_t total_size = 0;
+    uint64_t load_lo = (uint64_t)-1, load_hi = 0;
     const Elf64_Dyn *dynamic = NULL;
 
     // Process program headers
@@ -236,6 +330,8 @@ int elf_load_at(const void *data, size_t size, uint64_t load_base, elf_load_info
 
         uint64_t seg_end = phdr->p_vaddr + phdr->p_memsz;
         if (seg_end > total_size) total_size = seg_end;
+        if (dest_addr < load_lo) load_lo = dest_addr;
+        if (dest_addr + phdr->p_memsz > load_hi) load_hi = dest_addr + phdr->p_memsz;
     }
 
     // Process relocations for PIE binaries
@@ -243,6 +339,10 @@ int elf_load_at(const void *data, size_t size, uint64_t load_base, elf_load_info
         elf_process_relocations(load_base, dynamic);
     }
 
+    if (load_hi > load_lo) {
+        elf_sync_icache(load_lo, load_hi - load_lo);
+    }
+
     // Calculate entry point
     uint64_t entry = is_pie ? (load_base + ehdr->e_entry) : ehdr->e_entry;
 
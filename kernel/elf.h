@@ -46,6 +46,18 @@ typedef struct {
 #define PT_LOAD    1
 #define PT_DYNAMIC 2
 #define PT_INTERP  3
+#define PT_NOTE    4
+
+// Note header, followed by the name and descriptor (each padded to 4 bytes)
+typedef struct {
+    uint32_t n_namesz;
+    uint32_t n_descsz;
+    uint32_t n_type;
+} Elf64_Nhdr;
+
+// VibeOS notes (owner "VibeOS"), see VIBE_STACK_SIZE() in vibe.h
+#define ELF_NOTE_VIBEOS     "VibeOS"
+#define NT_VIBEOS_STACK     1   // desc = uint32 stack size in bytes
 
 // Dynamic section entry
 typedef struct {
@@ -114,4 +126,17 @@ int elf_load_at(const void *data, size_t size, uint64_t base, elf_load_info_t *i
 // Calculate total memory size needed for ELF
 uint64_t elf_calc_size(const void *data, size_t size);
 
+// Stack size requested by the program's NT_VIBEOS_STACK note, 0 if none
+uint64_t elf_stack_size(const void *data, size_t size);
+
+// Offsets from load_base of the R_AARCH64_RELATIVE targets of a PIE just
+// loaded there by elf_load_at (out NULL to only count them). With these a
+// loaded copy can be moved to another base. Returns the count, -1 if the
+// program is not a PIE.
+int elf_relative_relocs(const void *data, size_t size, uint64_t load_base, uint32_t *out);
+
+// Make freshly written code at [start, start+size) visible to instruction
+// fetch
+void elf_sync_icache(uint64_t start, uint64_t size);
+
 #endif
@@ -0,0 +1,188 @@
+/*
+ * VibeOS Program Image Cache
+ *
+ * A small table of images, evicted least recently used first once it
+ * holds EXEC_CACHE_ENTRIES images or EXEC_CACHE_BYTES. An image being
+ * copied out holds a reference, so eviction only takes it out of the
+ * table and the last exec_cache_put() frees it.
+ */
+
+#include "execcache.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "string.h"
+
+static exec_image_t *table[EXEC_CACHE_ENTRIES];
+static uint64_t table_bytes;
+static uint64_t use_clock;
+static uint64_t stat_hits, stat_misses;
+static spinlock_t exec_lock = SPINLOCK_INIT;
+
+static uint64_t image_bytes(exec_image_t *img) {
+    return img->copy_size + (uint64_t)img->nrelocs * sizeof(uint32_t);
+}
+
+static void image_free(exec_image_t *img) {
+    free(img->image);
+    free(img->relocs);
+    free(img);
+}
+
+// Take table[i] out. Returns the image if nobody is using it, so the
+// caller can free it once the lock is dropped.
+static exec_image_t *table_remove(int i) {
+    exec_image_t *img = table[i];
+    table[i] = NULL;
+    table_bytes -= image_bytes(img);
+    img->dropped = 1;
+    return img->refs == 0 ? img : NULL;
+}
+
+exec_image_t *exec_cache_get(const char *abspath, const fat32_version_t *ver) {
+    exec_image_t *hit = NULL, *stale = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&exec_lock);
+    for (int i = 0; i < EXEC_CACHE_ENTRIES; i++) {
+        exec_image_t *img = table[i];
+        if (!img || strcmp(img->path, abspath) != 0) continue;
+
+        if (img->ver.first_cluster == ver->first_cluster &&
+            img->ver.size == ver->size && img->ver.stamp == ver->stamp) {
+            img->refs++;
+            img->last_used = ++use_clock;
+            hit = img;
+        } else {
+            stale = table_remove(i);    // The file changed
+        }
+        break;
+    }
+    if (hit) stat_hits++; else stat_misses++;
+    spin_unlock_irqrestore(&exec_lock, flags);
+
+    if (stale) image_free(stale);
+    return hit;
+}
+
+void exec_cache_put(exec_image_t *img) {
+    uint64_t flags = spin_lock_irqsave(&exec_lock);
+    int last = (--img->refs == 0 && img->dropped);
+    spin_unlock_irqrestore(&exec_lock, flags);
+
+    if (last) image_free(img);
+}
+
+void exec_cache_load(exec_image_t *img, uint64_t base, elf_load_info_t *info) {
+    uint8_t *dest = (uint8_t *)base;
+    memcpy(dest, img->image, img->copy_size);
+    if (img->load_size > img->copy_size) {
+        memset(dest + img->copy_size, 0, img->load_size - img->copy_size);
+    }
+
+    // Relocated words hold old base + addend
+    if (base != img->base) {
+        uint64_t delta = base - img->base;
+        for (int i = 0; i < img->nrelocs; i++) {
+            *(uint64_t *)(dest + img->relocs[i]) += delta;
+        }
+    }
+
+    elf_sync_icache(base, img->load_size);
+
+    info->entry = base + img->entry;
+    info->load_base = base;
+    info->load_size = img->load_size;
+}
+
+void exec_cache_add(const char *abspath, const fat32_version_t *ver,
+                    const void *elf, size_t elf_size, uint64_t base,
+                    const elf_load_info_t *info, uint64_t prog_size,
+                    uint64_t stack_size) {
+    if (info->load_size > EXEC_CACHE_MAX_IMAGE || strlen(abspath) >= VFS_MAX_PATH) {
+        return;
+    }
+
+    int nrelocs = elf_relative_relocs(elf, elf_size, base, NULL);
+    if (nrelocs < 0) return;    // Not a PIE, can only live at one address
+
+    // Only the file-backed part of the segments needs keeping
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf;
+    uint64_t copy_size = 0;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = (const Elf64_Phdr *)((const uint8_t *)elf + ehdr->e_phoff +
+                                                      i * ehdr->e_phentsize);
+        if (phdr->p_type != PT_LOAD) continue;
+        uint64_t end = phdr->p_vaddr + phdr->p_filesz;
+        if (end > copy_size) copy_size = end;
+    }
+    if (copy_size == 0 || copy_size > info->load_size) return;
+
+    exec_image_t *img = malloc(sizeof(exec_image_t));
+    if (!img) return;
+    img->image = malloc(copy_size);
+    img->relocs = nrelocs ? malloc(nrelocs * sizeof(uint32_t)) : NULL;
+    if (!img->image || (nrelocs && !img->relocs)) {
+        free(img->image);
+        free(img->relocs);
+        free(img);
+        return;
+    }
+
+    strcpy(img->path, abspath);
+    img->ver = *ver;
+    memcpy(img->image, (const void *)base, copy_size);
+    img->copy_size = copy_size;
+    img->load_size = info->load_size;
+    img->prog_size = prog_size;
+    img->stack_size = stack_size;
+    img->base = base;
+    img->entry = info->entry - base;
+    img->nrelocs = nrelocs ? elf_relative_relocs(elf, elf_size, base, img->relocs) : 0;
+    img->refs = 0;
+    img->dropped = 0;
+
+    exec_image_t *evicted[EXEC_CACHE_ENTRIES + 1];
+    int nevicted = 0;
+
+    uint64_t flags = spin_lock_irqsave(&exec_lock);
+    img->last_used = ++use_clock;
+
+    // Replace an older copy of the same program
+    for (int i = 0; i < EXEC_CACHE_ENTRIES; i++) {
+        if (table[i] && strcmp(table[i]->path, abspath) == 0) {
+            exec_image_t *old = table_remove(i);
+            if (old) evicted[nevicted++] = old;
+        }
+    }
+
+    // Make room: a free slot, and the byte budget
+    while (1) {
+        int free_slot = -1, lru = -1, count = 0;
+        for (int i = 0; i < EXEC_CACHE_ENTRIES; i++) {
+            if (!table[i]) {
+                if (free_slot < 0) free_slot = i;
+                continue;
+            }
+            count++;
+            if (lru < 0 || table[i]->last_used < table[lru]->last_used) lru = i;
+        }
+        if (free_slot >= 0 && table_bytes + image_bytes(img) <= EXEC_CACHE_BYTES) {
+            table[free_slot] = img;
+            table_bytes += image_bytes(img);
+            img = NULL;
+            break;
+        }
+        if (count == 0) break;      // Bigger than the whole budget
+        exec_image_t *old = table_remove(lru);
+        if (old) evicted[nevicted++] = old;
+    }
+    spin_unlock_irqrestore(&exec_lock, flags);
+
+    for (int i = 0; i < nevicted; i++) image_free(evicted[i]);
+    if (img) image_free(img);
+}
+
+void exec_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *bytes) {
+    if (hits) *hits = stat_hits;
+    if (misses) *misses = stat_misses;
+    if (bytes) *bytes = table_bytes;
+}
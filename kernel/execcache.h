@@ -0,0 +1,64 @@
+/*
+ * VibeOS Program Image Cache
+ *
+ * Keeps recently started programs as they looked right after loading:
+ * segments copied in, bss zeroed, relocated for the address they were
+ * loaded at. Starting one again copies that image into the new region
+ * and, if the region is somewhere else, adds the difference to each
+ * relocated word - no disk read and no ELF parsing.
+ *
+ * Images are keyed by absolute path and the file's fat32_version_t, so a
+ * rebuilt or rewritten program is loaded fresh. There is no MMU to map
+ * text into several processes, and code reaches its data PC-relative, so
+ * every instance gets its own copy; trailing bss is zeroed, not copied.
+ */
+
+#ifndef EXECCACHE_H
+#define EXECCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "elf.h"
+#include "fat32.h"
+#include "vfs.h"
+
+#define EXEC_CACHE_ENTRIES   16
+#define EXEC_CACHE_BYTES     (8 * 1024 * 1024)  // All cached images together
+#define EXEC_CACHE_MAX_IMAGE (2 * 1024 * 1024)  // Bigger programs always load from disk
+
+typedef struct exec_image {
+    char path[VFS_MAX_PATH];
+    fat32_version_t ver;
+    uint8_t *image;         // Loaded bytes, up to the end of the file-backed data
+    uint64_t copy_size;
+    uint64_t load_size;     // Image size including trailing bss
+    uint64_t prog_size;     // Region size the program asks for (elf_calc_size)
+    uint64_t stack_size;    // From its NT_VIBEOS_STACK note, 0 for the default
+    uint64_t base;          // Address the image is relocated for
+    uint64_t entry;         // Entry point, offset from base
+    uint32_t *relocs;       // Offsets of the R_AARCH64_RELATIVE words
+    int nrelocs;
+    int refs;               // Loads in progress
+    int dropped;            // Out of the table - freed on the last put
+    uint64_t last_used;
+} exec_image_t;
+
+// Cached image of the program at abspath if it is still version *ver,
+// with a reference held: exec_cache_load() it, then exec_cache_put().
+// NULL on a miss.
+exec_image_t *exec_cache_get(const char *abspath, const fat32_version_t *ver);
+void exec_cache_put(exec_image_t *img);
+
+// Copy a cached image to base (a region of at least img->prog_size)
+void exec_cache_load(exec_image_t *img, uint64_t base, elf_load_info_t *info);
+
+// Remember a program elf_load_at() just put at base, before it has run
+void exec_cache_add(const char *abspath, const fat32_version_t *ver,
+                    const void *elf, size_t elf_size, uint64_t base,
+                    const elf_load_info_t *info, uint64_t prog_size,
+                    uint64_t stack_size);
+
+// Loads served from the cache / from disk, bytes held
+void exec_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *bytes);
+
+#endif
@@ -6,6 +6,7 @@
  */
 
 #include "fat32.h"
+#include "bcache.h"
 #include "hal/hal.h"
 #include "printf.h"
 #include "string.h"
@@ -53,84 +54,72 @@ static uint32_t partition_offset = 0;
 // Sector buffer
 static uint8_t sector_buf[512] __attribute__((aligned(16)));
 
+// Bumped by every operation that creates, removes or moves directory
+// entries, so open file handles know to look themselves up again
+static uint32_t fat32_generation = 1;
+
+// Change stamps for directory entries, keyed by where the entry sits.
+// Resizing a file through a handle bumps its entry's slot, so only handles
+// on that file (and any sharing the slot) reload; the entry's location is
+// stable until fat32_generation changes anyway.
+#define ENTRY_SLOTS 64
+static uint32_t entry_stamps[ENTRY_SLOTS];
+static uint32_t entry_seq;
+
+static uint32_t *entry_stamp(uint32_t dirent_cluster, uint32_t dirent_index) {
+    return &entry_stamps[(dirent_cluster * 31 + dirent_index) % ENTRY_SLOTS];
+}
+
+// Bumped whenever file data is overwritten in place, so readahead knows
+// its copy may be stale
+static uint32_t fat32_data_version = 1;
+
+// Change stamps for file contents, for caches that hold on to a file's
+// data (see fat32_file_version). Writing a file bumps the slot its first
+// cluster hashes to; files sharing a slot just invalidate each other.
+#define STAMP_SLOTS 64
+static uint32_t change_stamps[STAMP_SLOTS];
+static uint32_t change_seq;
+
+static void stamp_file(uint32_t first_cluster) {
+    change_stamps[first_cluster % STAMP_SLOTS] = ++change_seq;
+}
+
 // Cluster buffer (for reading directory entries)
 static uint8_t *cluster_buf = NULL;
 static uint32_t cluster_buf_size = 0;
 
-// FAT sector cache - avoids repeated disk reads when traversing cluster chains
-// Larger cache = fewer disk reads when scanning FAT (df, free space checks)
-#define FAT_CACHE_SIZE 64
-static struct {
-    uint32_t sector;      // Which FAT sector is cached (0 = invalid)
-    uint8_t data[512];    // Cached sector data
-    uint32_t lru_counter; // For LRU eviction
-} fat_cache[FAT_CACHE_SIZE];
-static uint32_t fat_cache_counter = 0;
-
 // Read a sector from disk (adds partition offset)
 static int read_sector(uint32_t sector, void *buf) {
-    return hal_blk_read(partition_offset + sector, buf, 1);
+    return bcache_read(partition_offset + sector, buf, 1);
 }
 
 // Write a sector to disk (adds partition offset)
 static int write_sector(uint32_t sector, const void *buf) {
-    return hal_blk_write(partition_offset + sector, buf, 1);
+    return bcache_write(partition_offset + sector, buf, 1);
 }
 
 // Write multiple sectors (adds partition offset)
 static int write_sectors(uint32_t sector, uint32_t count, const void *buf) {
-    return hal_blk_write(partition_offset + sector, buf, count);
+    return bcache_write(partition_offset + sector, buf, count);
 }
 
 // Read multiple sectors (adds partition offset)
 static int read_sectors(uint32_t sector, uint32_t count, void *buf) {
-    return hal_blk_read(partition_offset + sector, buf, count);
+    return bcache_read(partition_offset + sector, buf, count);
 }
 
-// Read a FAT sector with caching
+// Read a FAT sector through the block cache, without copying it out
 // Returns pointer to cached data, or NULL on error
 static uint8_t *fat_read_sector_cached(uint32_t sector) {
-    // Check if already cached
-    for (int i = 0; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == sector && fat_cache[i].sector != 0) {
-            fat_cache[i].lru_counter = ++fat_cache_counter;
-            return fat_cache[i].data;
-        }
-    }
-
-    // Not cached - find LRU entry to evict
-    int lru_idx = 0;
-    uint32_t min_counter = fat_cache[0].lru_counter;
-    for (int i = 1; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == 0) {
-            // Found empty slot, use it
-            lru_idx = i;
-            break;
-        }
-        if (fat_cache[i].lru_counter < min_counter) {
-            min_counter = fat_cache[i].lru_counter;
-            lru_idx = i;
-        }
-    }
+    uint8_t *data = bcache_get(partition_offset + sector);
+    if (data) return data;
 
-    // Read sector into cache
-    if (read_sector(sector, fat_cache[lru_idx].data) < 0) {
+    // No cache (it failed to allocate) - use the scratch sector
+    if (read_sector(sector, sector_buf) < 0) {
         return NULL;
     }
-
-    fat_cache[lru_idx].sector = sector;
-    fat_cache[lru_idx].lru_counter = ++fat_cache_counter;
-    return fat_cache[lru_idx].data;
-}
-
-// Invalidate a FAT sector in the cache (call after writes)
-static void fat_cache_invalidate(uint32_t sector) {
-    for (int i = 0; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == sector) {
-            fat_cache[i].sector = 0;
-            return;
-        }
-    }
+    return sector_buf;
 }
 
 // MBR partition entry structure
@@ -147,7 +136,7 @@ typedef struct __attribute__((packed)) {
 // Returns the starting sector of the partition, or 0 for raw disk
 static uint32_t find_fat32_partition(void) {
     // Read MBR (sector 0, bypassing partition_offset)
-    if (hal_blk_read(0, sector_buf, 1) < 0) {
+    if (bcache_read(0, sector_buf, 1) < 0) {
         printf("[FAT32] Failed to read MBR\n");
         return 0;
     }
@@ -204,6 +193,48 @@ static uint32_t find_fat32_partition(void) {
     return 0;
 }
 
+// ============================================================================
+// Free space tracking
+// ============================================================================
+//
+// One bit per cluster (set = in use), built from the FAT the first time a
+// cluster is allocated. The free count comes from the FSInfo sector at
+// mount, so df doesn't have to read the FAT at all. fat_set_cluster() keeps
+// both up to date from each entry's old and new value.
+
+#define FSINFO_LEAD_SIG    0x41615252
+#define FSINFO_STRUCT_SIG  0x61417272
+#define FSINFO_UNKNOWN     0xFFFFFFFF
+
+static uint32_t *free_map = NULL;
+static int free_map_failed = 0;             // Out of memory - scan the FAT
+static uint32_t free_count = FSINFO_UNKNOWN;
+static uint32_t next_free = 2;              // Where to start looking
+static uint32_t fsinfo_sector = 0;          // 0 if the volume has none
+static int fsinfo_dirty = 0;
+
+static inline int cluster_used(uint32_t cluster) {
+    return free_map[cluster >> 5] & (1U << (cluster & 31));
+}
+
+// A FAT entry changed from 'old' to 'value'
+static void free_space_update(uint32_t cluster, uint32_t old, uint32_t value) {
+    int was_free = (old == FAT32_FREE);
+    int now_free = ((value & 0x0FFFFFFF) == FAT32_FREE);
+    if (was_free == now_free) return;
+
+    if (free_map) {
+        free_map[cluster >> 5] ^= 1U << (cluster & 31);
+    }
+    if (free_count != FSINFO_UNKNOWN) {
+        free_count += now_free ? 1 : -1;
+    }
+    if (now_free && cluster < next_free) {
+        next_free = cluster;
+    }
+    fsinfo_dirty = 1;
+}
+
 // Get the first sector of a cluster
 static uint32_t cluster_to_sector(uint32_t cluster) {
     return fs.data_start + (cluster - 2) * fs.sectors_per_cluster;
@@ -232,24 +263,27 @@ static int fat_set_cluster(uint32_t cluster, uint32_t value) {
     uint32_t fat_sector = fs.reserved_sectors + (fat_offset / fs.bytes_per_sector);
     uint32_t entry_offset = fat_offset % fs.bytes_per_sector;
 
-    // Read current sector
-    if (read_sector(fat_sector, sector_buf) < 0) {
+    // Modify the entry in place (preserve high 4 bits). The block cache
+    // writes it back later, together with its neighbours.
+    uint8_t *data = fat_read_sector_cached(fat_sector);
+    if (!data) {
         return -1;
     }
-
-    // Modify entry (preserve high 4 bits)
-    uint32_t *entry = (uint32_t *)(sector_buf + entry_offset);
+    uint32_t *entry = (uint32_t *)(data + entry_offset);
+    uint32_t old = *entry & 0x0FFFFFFF;
     *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    free_space_update(cluster, old, value);
 
-    // Write to FAT1
-    if (write_sector(fat_sector, sector_buf) < 0) {
-        return -1;
+    if (data == sector_buf) {
+        if (write_sector(fat_sector, sector_buf) < 0) {
+            return -1;
+        }
+    } else {
+        bcache_mark_dirty(partition_offset + fat_sector);
+        memcpy(sector_buf, data, sizeof(sector_buf));
     }
 
-    // Invalidate cache for this sector (it's now stale)
-    fat_cache_invalidate(fat_sector);
-
-    // Write to FAT2 (if exists)
+    // Mirror to FAT2 (if exists)
     if (fs.num_fats > 1) {
         uint32_t fat2_sector = fat_sector + fs.fat_size;
         if (write_sector(fat2_sector, sector_buf) < 0) {
@@ -260,20 +294,211 @@ static int fat_set_cluster(uint32_t cluster, uint32_t value) {
     return 0;
 }
 
+// Build the free map with one pass over the FAT. The FAT is read in big
+// chunks straight from the disk - through the block cache it would only
+// push everything else out - so dirty FAT sectors are written first.
+static int free_map_build(void) {
+    uint32_t end = fs.total_clusters + 2;
+    uint32_t *map = malloc(((end + 31) / 32) * sizeof(uint32_t));
+    uint32_t chunk = 64;  // Sectors per read
+    uint32_t *fat = malloc(chunk * fs.bytes_per_sector);
+    if (!map || !fat) {
+        printf("[FAT32] No memory for free cluster map\n");
+        if (map) free(map);
+        if (fat) free(fat);
+        free_map_failed = 1;
+        return -1;
+    }
+    memset(map, 0, ((end + 31) / 32) * sizeof(uint32_t));
+    bcache_sync();
+
+    uint32_t per_sector = fs.bytes_per_sector / 4;
+    uint32_t count = 0;
+    for (uint32_t cluster = 0; cluster < end; cluster += chunk * per_sector) {
+        uint32_t sector = fs.reserved_sectors + cluster / per_sector;
+        if (hal_blk_read(partition_offset + sector, fat, chunk) < 0) {
+            printf("[FAT32] FAT read failed building free map\n");
+            free(map);
+            free(fat);
+            free_map_failed = 1;
+            return -1;
+        }
+        uint32_t n = chunk * per_sector;
+        if (n > end - cluster) n = end - cluster;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t c = cluster + i;
+            if (c < 2 || (fat[i] & 0x0FFFFFFF) != FAT32_FREE) {
+                map[c >> 5] |= 1U << (c & 31);
+            } else {
+                count++;
+            }
+        }
+    }
+    free(fat);
+
+    if (count != free_count) {
+        fsinfo_dirty = 1;  // FSInfo was stale or missing
+    }
+    free_map = map;
+    free_count = count;
+    printf("[FAT32] Free cluster map: %u of %u clusters free\n", count, fs.total_clusters);
+    return 0;
+}
+
+// First run of free clusters at or after the hint, wrapping around. Stops
+// at the first run of 'want'; if none is that long, returns the longest
+// one found. *len gets its length; returns 0 when the disk is full.
+static uint32_t free_map_find(uint32_t want, uint32_t *len) {
+    uint32_t end = fs.total_clusters + 2;
+    uint32_t c = (next_free >= 2 && next_free < end) ? next_free : 2;
+    uint32_t best = 0, best_len = 0;
+    uint32_t left = fs.total_clusters;
+
+    while (left > 0) {
+        if ((c & 31) == 0 && c + 32 <= end && free_map[c >> 5] == 0xFFFFFFFF) {
+            // 32 used clusters at a time
+            c += 32;
+            left = left > 32 ? left - 32 : 0;
+        } else if (cluster_used(c)) {
+            c++;
+            left--;
+        } else {
+            uint32_t run = 0;
+            while (run < want && c + run < end && !cluster_used(c + run)) run++;
+            if (run > best_len) {
+                best = c;
+                best_len = run;
+                if (run >= want) break;
+            }
+            c += run;
+            left = left > run ? left - run : 0;
+        }
+        if (c >= end) c = 2;
+    }
+
+    *len = best_len;
+    return best;
+}
+
+// Allocate up to 'want' contiguous clusters, chained together and ending
+// the chain, preferring the clusters right after 'prev' so a growing file
+// stays in one piece. Returns the first cluster and puts the count in
+// *got; returns 0 if the disk is full.
+static uint32_t fat_alloc_run(uint32_t prev, uint32_t want, uint32_t *got) {
+    uint32_t end = fs.total_clusters + 2;
+    if (!free_map && !free_map_failed) {
+        free_map_build();
+    }
+
+    if (!free_map) {
+        // No map - find a single free cluster the slow way
+        uint32_t start = (next_free >= 2 && next_free < end) ? next_free : 2;
+        for (uint32_t i = 0; i < fs.total_clusters; i++) {
+            uint32_t cluster = start + i;
+            if (cluster >= end) cluster -= fs.total_clusters;
+            if (fat_next_cluster(cluster) == FAT32_FREE) {
+                if (fat_set_cluster(cluster, FAT32_EOC) < 0) {
+                    return 0;
+                }
+                next_free = cluster + 1;
+                *got = 1;
+                return cluster;
+            }
+        }
+        return 0;
+    }
+
+    uint32_t first = 0, len = 0;
+    if (prev >= 2 && prev + 1 < end && !cluster_used(prev + 1)) {
+        first = prev + 1;
+        while (len < want && first + len < end && !cluster_used(first + len)) len++;
+    } else {
+        first = free_map_find(want, &len);
+        if (first == 0) return 0;  // No free clusters
+    }
+
+    // Chain back to front, so every entry is final when it's written
+    for (uint32_t i = len; i-- > 0; ) {
+        uint32_t value = (i == len - 1) ? FAT32_EOC : first + i + 1;
+        if (fat_set_cluster(first + i, value) < 0) {
+            for (uint32_t j = i + 1; j < len; j++) {
+                fat_set_cluster(first + j, FAT32_FREE);
+            }
+            return 0;
+        }
+    }
+
+    next_free = first + len;
+    *got = len;
+    return first;
+}
+
 // Find a free cluster and mark it as end-of-chain
 static uint32_t fat_alloc_cluster(void) {
-    // Start searching from cluster 2 (first data cluster)
-    for (uint32_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
-        uint32_t entry = fat_next_cluster(cluster);
-        if (entry == FAT32_FREE) {
-            // Mark as end of chain
-            if (fat_set_cluster(cluster, FAT32_EOC) < 0) {
-                return 0;
-            }
-            return cluster;
+    uint32_t got;
+    return fat_alloc_run(0, 1, &got);
+}
+
+// Pick up the free count and next-free hint from the FSInfo sector
+static void fsinfo_load(uint32_t sector) {
+    if (sector == 0 || sector >= fs.reserved_sectors) return;
+    if (read_sector(sector, sector_buf) < 0) return;
+
+    uint32_t *info = (uint32_t *)sector_buf;
+    if (info[0] != FSINFO_LEAD_SIG || info[484 / 4] != FSINFO_STRUCT_SIG) {
+        return;
+    }
+    fsinfo_sector = sector;
+
+    uint32_t count = info[488 / 4];
+    uint32_t hint = info[492 / 4];
+    if (count <= fs.total_clusters) {
+        free_count = count;
+    }
+    if (hint >= 2 && hint < fs.total_clusters + 2) {
+        next_free = hint;
+    }
+}
+
+// Write the free count and hint back to the FSInfo sector (into the cache;
+// it goes to disk with everything else)
+static int fsinfo_store(void) {
+    if (!fsinfo_sector || !fsinfo_dirty || free_count == FSINFO_UNKNOWN) {
+        return 0;
+    }
+
+    uint8_t *data = fat_read_sector_cached(fsinfo_sector);
+    if (!data) {
+        return -1;
+    }
+    uint32_t *info = (uint32_t *)data;
+    info[488 / 4] = free_count;
+    info[492 / 4] = next_free;
+
+    if (data == sector_buf) {
+        if (write_sector(fsinfo_sector, sector_buf) < 0) {
+            return -1;
         }
+    } else {
+        bcache_mark_dirty(partition_offset + fsinfo_sector);
+    }
+    fsinfo_dirty = 0;
+    return 0;
+}
+
+static void dcache_reset(void);
+static void dcache_report(void);
+
+int fat32_sync(void) {
+    dcache_report();
+    int ret = 0;
+    if (fs_initialized && fsinfo_store() < 0) {
+        ret = -1;
+    }
+    if (bcache_sync() < 0) {
+        ret = -1;
     }
-    return 0;  // No free clusters
+    return ret;
 }
 
 // Free a cluster chain starting at given cluster
@@ -349,6 +574,9 @@ static int name_match(const char *name1, const char *name2) {
 int fat32_init(void) {
     printf("[FAT32] Initializing...\n");
 
+    // All FAT32 disk I/O goes through the block cache
+    bcache_init();
+
     // Find FAT32 partition (handles MBR parsing)
     partition_offset = find_fat32_partition();
     printf("[FAT32] Partition offset: %u sectors\n", partition_offset);
@@ -410,6 +638,7 @@ int fat32_init(void) {
                             (sector_buf[46] << 16) | (sector_buf[47] << 24);
     uint32_t total_sectors_32 = sector_buf[32] | (sector_buf[33] << 8) |
                                 (sector_buf[34] << 16) | (sector_buf[35] << 24);
+    uint16_t fsinfo = sector_buf[48] | (sector_buf[49] << 8);
     printf("[FAT32] fat_size_32=%d root_cluster=%d total_sectors=%d\n",
            fat_size_32, root_cluster, total_sectors_32);
 
@@ -454,6 +683,19 @@ int fat32_init(void) {
         return -1;
     }
 
+    // Free space as of the last clean unmount (sector_buf is free again)
+    free_map = NULL;
+    free_map_failed = 0;
+    free_count = FSINFO_UNKNOWN;
+    next_free = 2;
+    fsinfo_sector = 0;
+    fsinfo_dirty = 0;
+    fsinfo_load(fsinfo);
+    if (free_count != FSINFO_UNKNOWN) {
+        printf("[FAT32] FSInfo: %u clusters free\n", free_count);
+    }
+
+    dcache_reset();
     fs_initialized = 1;
     printf("[FAT32] Filesystem ready!\n");
     return 0;
@@ -469,11 +711,188 @@ static uint32_t read32(uint8_t *p) {
     return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
 }
 
-// Find a directory entry by path component in a directory cluster chain
+// Entry handed back by lookups
+static fat32_dirent_t found_entry;
+
+// Build found_entry from a raw 32-byte directory entry
+static fat32_dirent_t *load_found_entry(const uint8_t *e) {
+    memcpy(found_entry.name, e, 11);
+    found_entry.attr = e[11];
+    found_entry.cluster_hi = read16((uint8_t *)e + 20);
+    found_entry.cluster_lo = read16((uint8_t *)e + 26);
+    found_entry.size = read32((uint8_t *)e + 28);
+    return &found_entry;
+}
+
+// ============================================================================
+// Directory entry cache
+// ============================================================================
+
+// Name lookups keyed by (directory cluster, name). A positive entry keeps
+// where the directory entry lives; a hit re-reads that one sector through
+// the block cache, so size and first cluster are never stale and only the
+// directory scan is saved. A negative entry records that the name is not
+// there. Creating or deleting a name forgets it, and removing a directory
+// forgets everything looked up in it.
+
+#define DCACHE_ENTRIES  512
+#define DCACHE_BUCKETS  256         // Power of 2
+#define DCACHE_NAME_MAX 48          // Longer names are always scanned for
+
+typedef struct dcache_entry {
+    uint32_t parent;                // Directory cluster, 0 if unused
+    uint32_t hash;
+    uint32_t ent_cluster;           // Where the entry lives (positive only)
+    uint32_t ent_index;
+    char short_name[11];            // What that slot should still hold
+    uint8_t negative;
+    char name[DCACHE_NAME_MAX];     // Compared case-insensitively
+    struct dcache_entry *hnext;     // Hash chain
+    struct dcache_entry *prev;      // LRU list, most recent first
+    struct dcache_entry *next;
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_ENTRIES];
+static dcache_entry_t *dcache_buckets[DCACHE_BUCKETS];
+static dcache_entry_t *dcache_head, *dcache_tail;
+static uint32_t dcache_used;
+static uint64_t dcache_hits, dcache_misses;
+static uint64_t dcache_reported;    // Lookups as of the last report
+
+#define DCACHE_REPORT_EVERY 1000    // Lookups between hit rate log lines
+
+static uint32_t dcache_hash(uint32_t parent, const char *name) {
+    uint32_t h = 2166136261u ^ parent;
+    for (; *name; name++) {
+        char c = *name;
+        if (c >= 'a' && c <= 'z') c -= 32;
+        h = (h ^ (uint8_t)c) * 16777619u;
+    }
+    return h;
+}
+
+static void dcache_lru_remove(dcache_entry_t *d) {
+    if (d->prev) d->prev->next = d->next; else dcache_head = d->next;
+    if (d->next) d->next->prev = d->prev; else dcache_tail = d->prev;
+}
+
+static void dcache_lru_push_front(dcache_entry_t *d) {
+    d->prev = NULL;
+    d->next = dcache_head;
+    if (dcache_head) dcache_head->prev = d; else dcache_tail = d;
+    dcache_head = d;
+}
+
+// Empty the cache (all entries unused, on the LRU list)
+static void dcache_reset(void) {
+    memset(dcache_buckets, 0, sizeof(dcache_buckets));
+    dcache_head = dcache_tail = NULL;
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        dcache[i].parent = 0;
+        dcache_lru_push_front(&dcache[i]);
+    }
+    dcache_used = 0;
+}
+
+// Drop an entry: out of its hash chain and to the LRU tail for reuse
+static void dcache_drop(dcache_entry_t *d) {
+    if (!d->parent) return;
+    dcache_entry_t **pp = &dcache_buckets[d->hash & (DCACHE_BUCKETS - 1)];
+    while (*pp && *pp != d) pp = &(*pp)->hnext;
+    if (*pp) *pp = d->hnext;
+    d->parent = 0;
+    dcache_used--;
+
+    dcache_lru_remove(d);
+    d->next = NULL;
+    d->prev = dcache_tail;
+    if (dcache_tail) dcache_tail->next = d; else dcache_head = d;
+    dcache_tail = d;
+}
+
+static dcache_entry_t *dcache_find(uint32_t parent, const char *name, uint32_t hash) {
+    dcache_entry_t *d = dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+    for (; d; d = d->hnext) {
+        if (d->hash == hash && d->parent == parent && name_match(d->name, name)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Remember a lookup result. e is the raw directory entry, NULL for "not there".
+static void dcache_insert(uint32_t parent, const char *name, uint32_t hash,
+                          const uint8_t *e, uint32_t ent_cluster, uint32_t ent_index) {
+    dcache_entry_t *d = dcache_find(parent, name, hash);
+    if (d) dcache_drop(d);
+
+    d = dcache_tail;            // Unused entries sit at the tail
+    dcache_drop(d);
+    d->parent = parent;
+    d->hash = hash;
+    d->negative = (e == NULL);
+    d->ent_cluster = ent_cluster;
+    d->ent_index = ent_index;
+    if (e) memcpy(d->short_name, e, 11);
+    strcpy(d->name, name);
+
+    dcache_entry_t **bucket = &dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+    d->hnext = *bucket;
+    *bucket = d;
+    dcache_lru_remove(d);
+    dcache_lru_push_front(d);
+    dcache_used++;
+}
+
+// A name in a directory was created or deleted
+static void dcache_forget(uint32_t parent, const char *name) {
+    if (strlen(name) >= DCACHE_NAME_MAX) return;
+    dcache_entry_t *d = dcache_find(parent, name, dcache_hash(parent, name));
+    if (d) dcache_drop(d);
+}
+
+// A directory is going away - its clusters may come back as another one
+static void dcache_forget_dir(uint32_t dir_cluster) {
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        if (dcache[i].parent == dir_cluster) dcache_drop(&dcache[i]);
+    }
+}
+
+// Re-read a positive entry's slot. NULL if it no longer holds the entry.
+static fat32_dirent_t *dcache_load(dcache_entry_t *d) {
+    uint32_t byte = d->ent_index * 32;
+    uint8_t *data = fat_read_sector_cached(cluster_to_sector(d->ent_cluster) +
+                                           byte / fs.bytes_per_sector);
+    if (!data) return NULL;
+
+    uint8_t *e = data + byte % fs.bytes_per_sector;
+    if (e[0] == 0x00 || e[0] == 0xE5 || e[11] == FAT_ATTR_LFN) return NULL;
+    if (memcmp(e, d->short_name, 11) != 0) return NULL;
+    return load_found_entry(e);
+}
+
+// Log the hit rate now and then. Called on every sync, which happens
+// every couple of seconds while the disk is busy.
+static void dcache_report(void) {
+    uint64_t total = dcache_hits + dcache_misses;
+    if (total - dcache_reported < DCACHE_REPORT_EVERY) return;
+    dcache_reported = total;
+    printf("[FAT32] dcache: %u%% of %u lookups hit, %u/%d entries\n",
+           (unsigned)(dcache_hits * 100 / total), (unsigned)total,
+           dcache_used, DCACHE_ENTRIES);
+}
+
+void fat32_dcache_stats(uint64_t *hits, uint64_t *misses, uint32_t *entries) {
+    if (hits) *hits = dcache_hits;
+    if (misses) *misses = dcache_misses;
+    if (entries) *entries = dcache_used;
+}
+
+// Scan a directory cluster chain for a name. *at_end is set when the
+// whole directory was seen without finding it (not on a disk error).
 // Returns the directory entry or NULL if not found
-static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
-                                          uint32_t *out_cluster, uint32_t *out_offset) {
-    static fat32_dirent_t found_entry;
+static fat32_dirent_t *scan_dir(uint32_t dir_cluster, const char *name,
+                                uint32_t *out_cluster, uint32_t *out_offset, int *at_end) {
     char entry_name[256];
     char lfn_name[256];
     int has_lfn = 0;
@@ -502,6 +921,7 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
 
             // End of directory
             if (first_byte == 0x00) {
+                *at_end = 1;
                 return NULL;
             }
 
@@ -566,15 +986,9 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
 
             // Compare names
             if (name_match(entry_name, name)) {
-                // Build found_entry from bytes
-                memcpy(found_entry.name, e, 11);
-                found_entry.attr = attr;
-                found_entry.cluster_hi = read16(e + 20);
-                found_entry.cluster_lo = read16(e + 26);
-                found_entry.size = read32(e + 28);
                 if (out_cluster) *out_cluster = cluster;
                 if (out_offset) *out_offset = i;
-                return &found_entry;
+                return load_found_entry(e);
             }
 
             has_lfn = 0;
@@ -584,13 +998,59 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
         cluster = fat_next_cluster(cluster);
     }
 
+    *at_end = 1;
     return NULL;
 }
 
-// Resolve a path to a directory entry
-// Returns the entry or NULL if not found
-static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
+// Find a directory entry by path component, through the dcache
+// Returns the directory entry or NULL if not found
+static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
+                                          uint32_t *out_cluster, uint32_t *out_offset) {
+    int at_end = 0;
+    if (strlen(name) >= DCACHE_NAME_MAX) {
+        return scan_dir(dir_cluster, name, out_cluster, out_offset, &at_end);
+    }
+
+    uint32_t hash = dcache_hash(dir_cluster, name);
+    dcache_entry_t *d = dcache_find(dir_cluster, name, hash);
+    if (d) {
+        fat32_dirent_t *entry = d->negative ? NULL : dcache_load(d);
+        if (d->negative || entry) {
+            dcache_hits++;
+            dcache_lru_remove(d);
+            dcache_lru_push_front(d);
+            if (entry) {
+                if (out_cluster) *out_cluster = d->ent_cluster;
+                if (out_offset) *out_offset = d->ent_index;
+            }
+            return entry;
+        }
+        dcache_drop(d);         // Slot changed under us - scan again
+    }
+
+    dcache_misses++;
+    uint32_t ent_cluster = 0, ent_index = 0;
+    fat32_dirent_t *entry = scan_dir(dir_cluster, name, &ent_cluster, &ent_index, &at_end);
+    if (entry) {
+        uint8_t raw[11];
+        memcpy(raw, entry->name, 11);
+        dcache_insert(dir_cluster, name, hash, raw, ent_cluster, ent_index);
+        if (out_cluster) *out_cluster = ent_cluster;
+        if (out_offset) *out_offset = ent_index;
+    } else if (at_end) {
+        dcache_insert(dir_cluster, name, hash, NULL, 0, 0);
+    }
+    return entry;
+}
+
+// Resolve a path to its directory entry. out_cluster gets the entry's own
+// first cluster; out_ent_cluster/out_ent_index (optional) say where the
+// entry itself lives, 0 for the root directory.
+static fat32_dirent_t *resolve_entry(const char *path, uint32_t *out_cluster,
+                                     uint32_t *out_ent_cluster, uint32_t *out_ent_index) {
     if (!fs_initialized || !path) return NULL;
+    if (out_ent_cluster) *out_ent_cluster = 0;
+    if (out_ent_index) *out_ent_index = 0;
 
     // Start at root
     uint32_t current_cluster = fs.root_cluster;
@@ -622,7 +1082,7 @@ static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
         if (component[0] == '\0') continue;
 
        // printf("[FAT32] resolve: looking for '%s' in cluster %u\n", component, current_cluster);
-        entry = find_entry_in_dir(current_cluster, component, NULL, NULL);
+        entry = find_entry_in_dir(current_cluster, component, out_ent_cluster, out_ent_index);
         if (!entry) {
             printf("[FAT32] resolve: '%s' not found!\n", component);
             return NULL;  // Not found
@@ -646,6 +1106,10 @@ static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
     return entry;
 }
 
+static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
+    return resolve_entry(path, out_cluster, NULL, NULL);
+}
+
 int fat32_read_file(const char *path, void *buf, size_t size) {
     if (!fs_initialized) return -1;
 
@@ -688,69 +1152,389 @@ int fat32_read_file(const char *path, void *buf, size_t size) {
 
 /*
  * Read file with offset support - avoids reading entire file for partial reads
+ * Goes through a throwaway handle, so contiguous clusters are still read
+ * in one request (no readahead though - that needs a handle that stays open)
  * Returns bytes read, or -1 on error
  */
 int fat32_read_file_offset(const char *path, void *buf, size_t size, size_t offset) {
-    if (!fs_initialized) return -1;
+    fat32_file_t *f = fat32_open(path);
+    if (!f) return -1;
 
-    uint32_t cluster;
-    fat32_dirent_t *entry = resolve_path(path, &cluster);
+    int ret = fat32_file_read(f, buf, size, offset);
+    fat32_close(f);
+    return ret;
+}
 
-    if (!entry) {
-        return -1;  // File not found
+// ============================================================================
+// Open files
+// ============================================================================
+
+// (Re)read the directory entry and start a fresh cluster map
+static int file_load(fat32_file_t *f) {
+    uint32_t cluster, ent_cluster, ent_index;
+    fat32_dirent_t *entry = resolve_entry(f->path, &cluster, &ent_cluster, &ent_index);
+    if (!entry) return -1;
+
+    f->dirent = *entry;
+    f->first_cluster = cluster;
+    f->dirent_cluster = ent_cluster;
+    f->dirent_index = ent_index;
+    f->generation = fat32_generation;
+    f->entry_stamp = *entry_stamp(ent_cluster, ent_index);
+
+    f->extent_count = 0;
+    f->mapped = 0;
+    f->next_cluster = (cluster >= 2) ? cluster : FAT32_EOC;
+    f->hint = 0;
+    return 0;
+}
+
+static void ra_drop(fat32_file_t *f);
+
+// Look the entry up again if the directories changed or another handle
+// resized this file since the handle last did
+static int file_revalidate(fat32_file_t *f) {
+    if (f->generation == fat32_generation &&
+        f->entry_stamp == *entry_stamp(f->dirent_cluster, f->dirent_index)) {
+        return 0;
     }
+    ra_drop(f);
+    return file_load(f);
+}
 
-    if (entry->attr & FAT_ATTR_DIRECTORY) {
-        return -1;  // Can't read a directory as a file
+// Add disk cluster c to the end of the cluster map
+static int file_add_cluster(fat32_file_t *f, uint32_t c) {
+    fat32_extent_t *last = f->extent_count ? &f->extents[f->extent_count - 1] : NULL;
+    if (last && last->disk_cluster + last->count == c) {
+        last->count++;
+    } else {
+        if (f->extent_count == f->extent_cap) {
+            int cap = f->extent_cap ? f->extent_cap * 2 : 8;
+            fat32_extent_t *ext = realloc(f->extents, cap * sizeof(fat32_extent_t));
+            if (!ext) return -1;
+            f->extents = ext;
+            f->extent_cap = cap;
+        }
+        last = &f->extents[f->extent_count++];
+        last->file_cluster = f->mapped;
+        last->disk_cluster = c;
+        last->count = 1;
     }
+    f->mapped++;
+    return 0;
+}
 
-    uint32_t file_size = entry->size;
+// Extend the cluster map so it covers file cluster 'index'. Only follows
+// the FAT from where the map ends, so a whole file costs one chain walk.
+static int file_map_to(fat32_file_t *f, uint32_t index) {
+    while (f->mapped <= index) {
+        uint32_t c = f->next_cluster;
+        if (c < 2 || c >= FAT32_EOC) return -1;
+        if (file_add_cluster(f, c) < 0) return -1;
+        f->next_cluster = fat_next_cluster(c);
+    }
+    return 0;
+}
 
-    // Handle offset beyond file
-    if (offset >= file_size) return 0;
+// Extent holding a mapped file cluster. Sequential reads stay in the hinted
+// extent or step to the next one; anything else is a binary search.
+static fat32_extent_t *file_find_extent(fat32_file_t *f, uint32_t index) {
+    int h = f->hint;
+    for (int i = h; i < f->extent_count && i <= h + 1; i++) {
+        fat32_extent_t *x = &f->extents[i];
+        if (index >= x->file_cluster && index < x->file_cluster + x->count) {
+            f->hint = i;
+            return x;
+        }
+    }
 
-    // Clamp size to what's available
-    if (offset + size > file_size) {
-        size = file_size - offset;
+    int lo = 0, hi = f->extent_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        fat32_extent_t *x = &f->extents[mid];
+        if (index < x->file_cluster) {
+            hi = mid - 1;
+        } else if (index >= x->file_cluster + x->count) {
+            lo = mid + 1;
+        } else {
+            f->hint = mid;
+            return x;
+        }
     }
-    if (size == 0) return 0;
+    return NULL;
+}
 
-    uint8_t *dst = (uint8_t *)buf;
-    size_t bytes_read = 0;
-    size_t file_pos = 0;  // Current position in file
+// ============================================================================
+// Readahead
+// ============================================================================
+
+// A handle whose reads keep starting where the last one ended gets two
+// windows: the one being read from, fetched in one request, and the one
+// after it, requested before it is needed. Small sequential reads then
+// mostly just copy. The window starts at RA_MIN and doubles with every
+// refill up to RA_MAX; it never crosses the end of an extent, so each
+// window is a single request. Large reads bypass this - they already go
+// to disk in contiguous runs.
+#define RA_MIN  (16 * 1024)
+#define RA_MAX  (128 * 1024)
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t pos;           // File offset of buf[0]
+    uint32_t len;           // Bytes of the file it holds, 0 = empty
+    int busy;               // req not yet waited for
+    hal_blk_req_t req;
+} ra_window_t;
+
+struct fat32_ra {
+    uint32_t expect;        // Where the next read starts if sequential
+    uint32_t size;          // Size of the next window
+    uint32_t version;       // fat32_data_version the windows match
+    int cur;                // Window being read from; the other is next
+    ra_window_t win[2];
+};
+
+static int ra_covers(ra_window_t *w, uint32_t pos) {
+    return w->len && pos >= w->pos && pos < w->pos + w->len;
+}
 
-    // Skip clusters until we reach the offset
-    while (cluster < FAT32_EOC && file_pos + cluster_buf_size <= offset) {
-        file_pos += cluster_buf_size;
-        cluster = fat_next_cluster(cluster);
+// Wait for a window's request. A failed read leaves it empty.
+static void ra_complete(ra_window_t *w) {
+    if (!w->busy) return;
+    if (hal_blk_wait(&w->req) < 0) w->len = 0;
+    w->busy = 0;
+}
+
+static void ra_empty(struct fat32_ra *ra) {
+    for (int i = 0; i < 2; i++) {
+        ra_complete(&ra->win[i]);
+        ra->win[i].len = 0;
     }
+}
 
-    // Now read clusters starting from the one containing offset
-    while (cluster < FAT32_EOC && bytes_read < size) {
-        if (read_cluster(cluster, cluster_buf) < 0) {
-            return -1;
-        }
+// Forget what was read ahead (the file's data or clusters changed)
+static void ra_drop(fat32_file_t *f) {
+    if (f->ra) ra_empty(f->ra);
+}
+
+static void ra_free(fat32_file_t *f) {
+    if (!f->ra) return;
+    ra_empty(f->ra);
+    for (int i = 0; i < 2; i++) {
+        if (f->ra->win[i].buf) free(f->ra->win[i].buf);
+    }
+    free(f->ra);
+    f->ra = NULL;
+}
 
-        // Calculate how much of this cluster to use
-        size_t cluster_offset = 0;
-        if (file_pos < offset) {
-            cluster_offset = offset - file_pos;
+// Start reading up to want bytes from file offset pos (sector aligned)
+// into w. Returns 0 if nothing was started.
+static int ra_start(fat32_file_t *f, ra_window_t *w, uint32_t pos, uint32_t want) {
+    uint32_t csize = cluster_buf_size;
+    uint32_t file_size = f->dirent.size;
+
+    w->len = 0;
+    if (pos >= file_size) return 0;
+    if (!w->buf) {
+        w->buf = malloc(RA_MAX > csize ? RA_MAX : csize);
+        if (!w->buf) return 0;
+    }
+
+    uint32_t index = pos / csize;
+    uint32_t first = (pos % csize) / fs.bytes_per_sector;
+    uint32_t last = (pos - pos % csize + want - 1) / csize;
+    if (last > (file_size - 1) / csize) last = (file_size - 1) / csize;
+    if (last < index) last = index;
+
+    file_map_to(f, last);
+    fat32_extent_t *x = (index < f->mapped) ? file_find_extent(f, index) : NULL;
+    if (!x) return 0;
+    uint32_t run_pos = index - x->file_cluster;
+    uint32_t n = last - index + 1;
+    if (n > x->count - run_pos) n = x->count - run_pos;
+
+    uint32_t sector = partition_offset + cluster_to_sector(x->disk_cluster + run_pos) + first;
+    uint32_t count = n * fs.sectors_per_cluster - first;
+
+    // Changes still in the cache are newer than the disk - stop before them
+    count = bcache_clean_run(sector, count);
+    if (count == 0) return 0;
+
+    w->pos = pos;
+    w->len = count * fs.bytes_per_sector;
+    if (w->len > file_size - pos) w->len = file_size - pos;
+
+    w->req.sector = sector;
+    w->req.count = count;
+    w->req.buf = w->buf;
+    w->req.write = 0;
+    w->req.done = NULL;
+    w->busy = 1;
+    hal_blk_submit(&w->req);
+    hal_blk_kick();
+    return 1;
+}
+
+// Copy what the readahead windows hold of a read, starting them first if
+// the read is sequential. Returns bytes copied from the front of the read.
+static size_t ra_read(fat32_file_t *f, uint8_t *dst, uint32_t offset, uint32_t size) {
+    struct fat32_ra *ra = f->ra;
+    if (!ra) {
+        // First read - just note where it ended
+        ra = malloc(sizeof(struct fat32_ra));
+        if (!ra) return 0;
+        memset(ra, 0, sizeof(*ra));
+        ra->expect = offset + size;
+        ra->version = fat32_data_version;
+        f->ra = ra;
+        return 0;
+    }
+
+    if (ra->version != fat32_data_version) {
+        ra_empty(ra);
+        ra->version = fat32_data_version;
+    }
+
+    int sequential = (offset == ra->expect);
+    ra->expect = offset + size;
+    if (!sequential) ra->size = 0;
+
+    size_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        ra_window_t *cur = &ra->win[ra->cur];
+        ra_window_t *next = &ra->win[ra->cur ^ 1];
+
+        if (!ra_covers(cur, pos)) {
+            if (ra_covers(next, pos)) {
+                // Moved on to the window read ahead
+                ra_complete(cur);
+                cur->len = 0;
+                ra->cur ^= 1;
+                continue;
+            }
+            if (!sequential || done > 0) break;
+
+            // Sequential, but nothing read ahead (yet): start from here
+            ra_empty(ra);
+            if (ra->size < RA_MIN) ra->size = RA_MIN;
+            if (!ra_start(f, cur, pos - pos % fs.bytes_per_sector, ra->size)) break;
         }
 
-        size_t available = cluster_buf_size - cluster_offset;
-        size_t to_copy = size - bytes_read;
-        if (to_copy > available) to_copy = available;
+        ra_complete(cur);
+        if (!ra_covers(cur, pos)) break;
 
-        memcpy(dst + bytes_read, cluster_buf + cluster_offset, to_copy);
-        bytes_read += to_copy;
-        file_pos += cluster_buf_size;
+        uint32_t n = cur->pos + cur->len - pos;
+        if (n > size - done) n = size - done;
+        memcpy(dst + done, cur->buf + (pos - cur->pos), n);
+        done += n;
+    }
 
-        cluster = fat_next_cluster(cluster);
+    // Keep the window after this one coming
+    ra_window_t *cur = &ra->win[ra->cur];
+    ra_window_t *next = &ra->win[ra->cur ^ 1];
+    if (sequential && cur->len && !next->len && !next->busy) {
+        if (ra->size < RA_MAX) ra->size *= 2;
+        ra_start(f, next, cur->pos + cur->len, ra->size);
+    }
+    return done;
+}
+
+fat32_file_t *fat32_open(const char *path) {
+    if (!fs_initialized || !path) return NULL;
+
+    fat32_file_t *f = malloc(sizeof(fat32_file_t));
+    if (!f) return NULL;
+    memset(f, 0, sizeof(*f));
+    strncpy(f->path, path, sizeof(f->path) - 1);
+
+    if (file_load(f) < 0) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+void fat32_close(fat32_file_t *f) {
+    if (!f) return;
+    ra_free(f);
+    if (f->extents) free(f->extents);
+    free(f);
+}
+
+int fat32_file_read(fat32_file_t *f, void *buf, size_t size, size_t offset) {
+    if (!fs_initialized || !f) return -1;
+
+    if (file_revalidate(f) < 0) {
+        return -1;  // Deleted or renamed since it was opened
+    }
+    if (f->dirent.attr & FAT_ATTR_DIRECTORY) {
+        return -1;
+    }
+
+    uint32_t file_size = f->dirent.size;
+    if (offset >= file_size) return 0;
+    if (offset + size > file_size) {
+        size = file_size - offset;
+    }
+    if (size == 0) return 0;
+
+    uint32_t csize = cluster_buf_size;
+    uint8_t *dst = (uint8_t *)buf;
+    size_t bytes_read = 0;
+
+    if (size < RA_MAX) {
+        bytes_read = ra_read(f, dst, offset, size);
+        if (bytes_read == size) return (int)size;
+    } else if (f->ra) {
+        f->ra->expect = offset + size;
+    }
+
+    // Map everything this read touches up front, so contiguous clusters
+    // can go out as one request. A short chain just ends the read early.
+    file_map_to(f, (uint32_t)((offset + size - 1) / csize));
+
+    while (bytes_read < size) {
+        size_t pos = offset + bytes_read;
+        uint32_t index = pos / csize;
+        uint32_t cluster_offset = pos % csize;
+
+        fat32_extent_t *x = (index < f->mapped) ? file_find_extent(f, index) : NULL;
+        if (!x) break;
+        uint32_t run_pos = index - x->file_cluster;
+        uint32_t disk = x->disk_cluster + run_pos;
+
+        size_t left = size - bytes_read;
+        if (cluster_offset == 0 && left >= csize) {
+            // Whole clusters: straight into the caller's buffer, as many
+            // as are contiguous on disk
+            uint32_t n = left / csize;
+            if (n > x->count - run_pos) n = x->count - run_pos;
+            if (read_sectors(cluster_to_sector(disk), n * fs.sectors_per_cluster,
+                             dst + bytes_read) < 0) {
+                return -1;
+            }
+            bytes_read += (size_t)n * csize;
+        } else {
+            // Partial cluster at either end
+            if (read_cluster(disk, cluster_buf) < 0) {
+                return -1;
+            }
+            size_t to_copy = csize - cluster_offset;
+            if (to_copy > left) to_copy = left;
+            memcpy(dst + bytes_read, cluster_buf + cluster_offset, to_copy);
+            bytes_read += to_copy;
+        }
     }
 
     return (int)bytes_read;
 }
 
+int fat32_file_length(fat32_file_t *f) {
+    if (!fs_initialized || !f || file_revalidate(f) < 0) return -1;
+    return (int)f->dirent.size;
+}
+
 int fat32_file_size(const char *path) {
     if (!fs_initialized) return -1;
 
@@ -880,6 +1664,124 @@ int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_dat
     return 0;
 }
 
+// ============================================================================
+// Directory cursors
+// ============================================================================
+
+// Add one long filename entry's characters to lfn_name. The entry marked
+// last comes first on disk and starts a new name.
+static void lfn_collect(const uint8_t *e, char *lfn_name, int *has_lfn) {
+    int seq = e[0] & 0x1F;
+    if (e[0] & 0x40) {
+        *has_lfn = 1;
+        memset(lfn_name, 0, 256);
+    }
+
+    static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    int base = (seq - 1) * 13;
+    for (int j = 0; j < 13; j++) {
+        uint16_t c = e[offsets[j]] | (e[offsets[j] + 1] << 8);
+        if (c == 0 || c == 0xFFFF) break;
+        if (base + j < 255) lfn_name[base + j] = (char)c;
+    }
+}
+
+fat32_dir_t *fat32_opendir(const char *path) {
+    if (!fs_initialized || !path) return NULL;
+
+    uint32_t cluster;
+    fat32_dirent_t *entry = resolve_path(path, &cluster);
+    if (!entry || !(entry->attr & FAT_ATTR_DIRECTORY)) return NULL;
+
+    int len = strlen(path);
+    if (len >= 256) return NULL;
+
+    fat32_dir_t *d = malloc(sizeof(fat32_dir_t));
+    if (!d) return NULL;
+    memcpy(d->path, path, len + 1);
+    d->first_cluster = cluster;
+    d->generation = fat32_generation;
+    fat32_rewinddir(d);
+    return d;
+}
+
+void fat32_closedir(fat32_dir_t *d) {
+    free(d);
+}
+
+void fat32_rewinddir(fat32_dir_t *d) {
+    d->cluster = d->first_cluster;
+    d->index = 0;
+}
+
+// Entries never move within a directory - creating fills a free slot and
+// deleting marks one free - so the cursor stays put across changes. Only
+// check that the directory itself is still there.
+static int dir_revalidate(fat32_dir_t *d) {
+    if (d->generation == fat32_generation) return 0;
+
+    uint32_t cluster;
+    fat32_dirent_t *entry = resolve_path(d->path, &cluster);
+    if (!entry || !(entry->attr & FAT_ATTR_DIRECTORY) || cluster != d->first_cluster) {
+        return -1;
+    }
+    d->generation = fat32_generation;
+    return 0;
+}
+
+int fat32_readdir(fat32_dir_t *d, fat32_dirinfo_t *out) {
+    if (!fs_initialized || !d || !out) return -1;
+    if (dir_revalidate(d) < 0) return -1;
+
+    uint32_t per_cluster = cluster_buf_size / 32;
+    uint32_t per_sector = fs.bytes_per_sector / 32;
+    char lfn_name[256];
+    int has_lfn = 0;
+
+    while (d->cluster >= 2 && d->cluster < FAT32_EOC) {
+        // The cursor only ever stops between complete entries, so a long
+        // name never straddles two calls
+        uint8_t *data = fat_read_sector_cached(cluster_to_sector(d->cluster) +
+                                               d->index / per_sector);
+        if (!data) return -1;
+
+        while (1) {
+            uint8_t *e = data + (d->index % per_sector) * 32;
+            uint8_t attr = e[11];
+
+            // End of directory - leave the cursor here, in case more is
+            // added before the next call
+            if (e[0] == 0x00) return 0;
+
+            d->index++;
+            if (d->index == per_cluster) {
+                d->index = 0;
+                d->cluster = fat_next_cluster(d->cluster);
+            }
+
+            if (e[0] == 0xE5) {
+                has_lfn = 0;
+            } else if (attr == FAT_ATTR_LFN) {
+                lfn_collect(e, lfn_name, &has_lfn);
+            } else if ((attr & FAT_ATTR_VOLUME_ID) || e[0] == '.') {
+                has_lfn = 0;        // Volume label, . and ..
+            } else {
+                if (has_lfn) {
+                    strcpy(out->name, lfn_name);
+                } else {
+                    fat_name_to_str((char *)e, out->name);
+                }
+                out->attr = attr;
+                out->size = read32(e + 28);
+                return 1;
+            }
+
+            if (d->index % per_sector == 0) break;  // Next sector
+        }
+    }
+    return 0;
+}
+
 fat32_fs_t *fat32_get_fs_info(void) {
     return fs_initialized ? &fs : NULL;
 }
@@ -1221,7 +2123,8 @@ static int find_free_dir_entries(uint32_t dir_cluster, int count,
 need_more:
     // We need to allocate new cluster(s) to complete the run
     while (run_len < count) {
-        uint32_t new_cluster = fat_alloc_cluster();
+        uint32_t got;
+        uint32_t new_cluster = fat_alloc_run(last_cluster, 1, &got);
         if (new_cluster == 0) return -1;
 
         // Link to chain
@@ -1328,6 +2231,7 @@ static void build_lfn_entry(uint8_t *e, int seq, int is_last, const char *name,
 // Create a new directory entry in a directory (with LFN support)
 // Returns 1 on success, 0 on error
 static uint32_t create_dir_entry(uint32_t parent_cluster, const char *name, uint8_t attr, uint32_t first_cluster) {
+    dcache_forget(parent_cluster, name);
     int name_len = strlen(name);
     int use_lfn = needs_lfn(name);
 
@@ -1441,6 +2345,7 @@ static int update_dir_entry(uint32_t dir_cluster, const char *name, uint32_t fir
 
 int fat32_create_file(const char *path) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char filename[256];
     uint32_t parent_cluster;
@@ -1465,6 +2370,7 @@ int fat32_create_file(const char *path) {
 
 int fat32_mkdir(const char *path) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char dirname[256];
     uint32_t parent_cluster;
@@ -1530,6 +2436,7 @@ int fat32_mkdir(const char *path) {
 
 int fat32_write_file(const char *path, const void *buf, size_t size) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char filename[256];
     uint32_t parent_cluster;
@@ -1566,39 +2473,53 @@ int fat32_write_file(const char *path, const void *buf, size_t size) {
     const uint8_t *src = (const uint8_t *)buf;
     size_t remaining = size;
 
-    for (uint32_t i = 0; i < clusters_needed; i++) {
-        uint32_t cluster = fat_alloc_cluster();
-        if (cluster == 0) {
+    // Allocated in contiguous runs where the free space allows
+    for (uint32_t i = 0; i < clusters_needed; ) {
+        uint32_t got;
+        uint32_t run = fat_alloc_run(prev_cluster, clusters_needed - i, &got);
+        if (run == 0) {
             // Out of space - free what we allocated
             if (first_cluster) fat_free_chain(first_cluster);
             return -1;
         }
 
         if (first_cluster == 0) {
-            first_cluster = cluster;
+            first_cluster = run;
         }
 
         if (prev_cluster) {
             // Link previous cluster to this one
-            fat_set_cluster(prev_cluster, cluster);
+            fat_set_cluster(prev_cluster, run);
         }
 
-        // Write data to this cluster
-        size_t to_write = remaining > cluster_size ? cluster_size : remaining;
-        memset(cluster_buf, 0, cluster_size);
-        memcpy(cluster_buf, src, to_write);
-
-        if (write_cluster(cluster, cluster_buf) < 0) {
+        // Whole clusters straight from the caller's buffer, the last
+        // partial one padded with zeros
+        uint32_t whole = remaining / cluster_size;
+        if (whole > got) whole = got;
+        if (whole && write_sectors(cluster_to_sector(run), whole * fs.sectors_per_cluster, src) < 0) {
             fat_free_chain(first_cluster);
             return -1;
         }
+        src += (size_t)whole * cluster_size;
+        remaining -= (size_t)whole * cluster_size;
+
+        if (whole < got) {
+            memset(cluster_buf, 0, cluster_size);
+            memcpy(cluster_buf, src, remaining);
+            if (write_cluster(run + whole, cluster_buf) < 0) {
+                fat_free_chain(first_cluster);
+                return -1;
+            }
+            src += remaining;
+            remaining = 0;
+        }
 
-        src += to_write;
-        remaining -= to_write;
-        prev_cluster = cluster;
+        i += got;
+        prev_cluster = run + got - 1;
     }
 
     // Update directory entry with new cluster and size
+    stamp_file(first_cluster);
     if (update_dir_entry(parent_cluster, filename, first_cluster, size) < 0) {
         if (first_cluster) fat_free_chain(first_cluster);
         return -1;
@@ -1612,9 +2533,285 @@ int fat32_write_file(const char *path, const void *buf, size_t size) {
     return (int)size;
 }
 
+// ============================================================================
+// Open files: writing in place
+// ============================================================================
+
+// Write the handle's first cluster and size into its directory entry.
+// Only the one sector holding the entry is touched.
+static int file_store_dirent(fat32_file_t *f) {
+    uint32_t byte = f->dirent_index * 32;
+    uint32_t sector = cluster_to_sector(f->dirent_cluster) + byte / fs.bytes_per_sector;
+    uint8_t *data = fat_read_sector_cached(sector);
+    if (!data) {
+        return -1;
+    }
+
+    uint8_t *e = data + byte % fs.bytes_per_sector;
+    write16(e + 20, (f->first_cluster >> 16) & 0xFFFF);  // cluster_hi
+    write16(e + 26, f->first_cluster & 0xFFFF);          // cluster_lo
+    write32(e + 28, f->dirent.size);
+
+    if (data == sector_buf) {
+        return write_sector(sector, sector_buf);
+    }
+    bcache_mark_dirty(partition_offset + sector);
+    return 0;
+}
+
+// Record a new size (and first cluster). Other handles on this file see
+// the entry's stamp change and reload; this one is already current.
+static int file_set_size(fat32_file_t *f, uint32_t size) {
+    stamp_file(f->first_cluster);
+    f->dirent.size = size;
+    f->dirent.cluster_hi = (f->first_cluster >> 16) & 0xFFFF;
+    f->dirent.cluster_lo = f->first_cluster & 0xFFFF;
+    f->entry_stamp = ++entry_seq;
+    *entry_stamp(f->dirent_cluster, f->dirent_index) = f->entry_stamp;
+    return file_store_dirent(f);
+}
+
+// Make the chain at least 'clusters' long, linking new clusters onto the
+// end of the existing one and into the map
+static int file_grow_chain(fat32_file_t *f, uint32_t clusters) {
+    if (clusters == 0) return 0;
+
+    // Map what's already there - a short chain just stops early
+    file_map_to(f, clusters - 1);
+    if (f->mapped >= clusters) return 0;
+    if (f->next_cluster >= 2 && f->next_cluster < FAT32_EOC) {
+        return -1;  // Chain goes on but the map couldn't grow
+    }
+
+    uint32_t last = 0;
+    if (f->extent_count) {
+        fat32_extent_t *x = &f->extents[f->extent_count - 1];
+        last = x->disk_cluster + x->count - 1;
+    }
+
+    while (f->mapped < clusters) {
+        uint32_t got;
+        uint32_t c = fat_alloc_run(last, clusters - f->mapped, &got);
+        if (c == 0) {
+            return -1;  // Disk full
+        }
+        if (last) {
+            if (fat_set_cluster(last, c) < 0) {
+                fat_free_chain(c);
+                return -1;
+            }
+        } else {
+            f->first_cluster = c;
+        }
+        for (uint32_t i = 0; i < got; i++) {
+            if (file_add_cluster(f, c + i) < 0) {
+                f->next_cluster = c + i;  // Linked but unmapped - map it later
+                return -1;
+            }
+        }
+        last = c + got - 1;
+    }
+    f->next_cluster = FAT32_EOC;
+    return 0;
+}
+
+// Forget the map from file cluster 'keep' on, after the chain was cut there
+static void file_trim_map(fat32_file_t *f, uint32_t keep) {
+    while (f->extent_count > 0) {
+        fat32_extent_t *x = &f->extents[f->extent_count - 1];
+        if (x->file_cluster >= keep) {
+            f->extent_count--;
+            continue;
+        }
+        if (x->file_cluster + x->count > keep) {
+            x->count = keep - x->file_cluster;
+        }
+        break;
+    }
+    f->mapped = keep;
+    f->next_cluster = FAT32_EOC;
+    f->hint = 0;
+}
+
+// Write a byte range the chain already covers; src NULL writes zeros.
+// Whole clusters and whole sectors go out as they are, only a partial
+// sector at either end is read first.
+static int file_write_range(fat32_file_t *f, const uint8_t *src, size_t size, size_t offset) {
+    uint32_t csize = cluster_buf_size;
+    uint32_t ssize = fs.bytes_per_sector;
+    size_t done = 0;
+
+    fat32_data_version++;
+    stamp_file(f->first_cluster);
+
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t index = pos / csize;
+        uint32_t cluster_offset = pos % csize;
+
+        fat32_extent_t *x = file_find_extent(f, index);
+        if (!x) return -1;
+        uint32_t run_pos = index - x->file_cluster;
+        uint32_t disk = x->disk_cluster + run_pos;
+
+        size_t left = size - done;
+        if (cluster_offset == 0 && left >= csize) {
+            // Whole clusters, as many as are contiguous on disk
+            uint32_t n = left / csize;
+            if (n > x->count - run_pos) n = x->count - run_pos;
+            if (src) {
+                if (write_sectors(cluster_to_sector(disk), n * fs.sectors_per_cluster,
+                                  src + done) < 0) {
+                    return -1;
+                }
+            } else {
+                for (uint32_t i = 0; i < n; i++) {
+                    if (zero_cluster(disk + i) < 0) return -1;
+                }
+            }
+            done += (size_t)n * csize;
+            continue;
+        }
+
+        size_t in_cluster = csize - cluster_offset;
+        if (in_cluster > left) in_cluster = left;
+        uint32_t sector = cluster_to_sector(disk) + cluster_offset / ssize;
+        uint32_t sector_offset = cluster_offset % ssize;
+
+        if (src && sector_offset == 0 && in_cluster >= ssize) {
+            // Whole sectors within the cluster
+            uint32_t n = in_cluster / ssize;
+            if (write_sectors(sector, n, src + done) < 0) {
+                return -1;
+            }
+            done += (size_t)n * ssize;
+            continue;
+        }
+
+        // One sector, read-modify-write unless it's all new
+        size_t to_copy = ssize - sector_offset;
+        if (to_copy > in_cluster) to_copy = in_cluster;
+        if (to_copy < ssize) {
+            if (read_sector(sector, sector_buf) < 0) {
+                return -1;
+            }
+        }
+        if (src) {
+            memcpy(sector_buf + sector_offset, src + done, to_copy);
+        } else {
+            memset(sector_buf + sector_offset, 0, to_copy);
+        }
+        if (write_sector(sector, sector_buf) < 0) {
+            return -1;
+        }
+        done += to_copy;
+    }
+    return 0;
+}
+
+// Grow to new_size: extend the chain and zero everything past the old end
+static int file_extend(fat32_file_t *f, size_t new_size) {
+    uint32_t old_size = f->dirent.size;
+    uint32_t old_first = f->first_cluster;
+    uint32_t csize = cluster_buf_size;
+
+    if (file_grow_chain(f, (new_size + csize - 1) / csize) < 0) {
+        // Keep any first cluster we did get, so it isn't lost
+        if (f->first_cluster != old_first) file_set_size(f, old_size);
+        return -1;
+    }
+    if (file_write_range(f, NULL, new_size - old_size, old_size) < 0) {
+        if (f->first_cluster != old_first) file_set_size(f, old_size);
+        return -1;
+    }
+    return 0;
+}
+
+int fat32_file_write(fat32_file_t *f, const void *buf, size_t size, size_t offset) {
+    if (!fs_initialized || !f) return -1;
+    if (file_revalidate(f) < 0) return -1;
+    if (f->dirent.attr & FAT_ATTR_DIRECTORY) return -1;
+    if (size == 0) return 0;
+    if (offset + size > 0xFFFFFFFFULL) return -1;  // FAT32 size limit
+
+    uint32_t old_size = f->dirent.size;
+    uint32_t old_first = f->first_cluster;
+    size_t end = offset + size;
+
+    // Past the old end: zero-fill any gap before offset, then extend the
+    // chain, so the data write below only lands on mapped clusters
+    if (offset > old_size && file_extend(f, offset) < 0) {
+        return -1;
+    }
+    uint32_t csize = cluster_buf_size;
+    if (end > old_size) {
+        if (file_grow_chain(f, (end + csize - 1) / csize) < 0) {
+            if (f->first_cluster != old_first) file_set_size(f, old_size);
+            return -1;
+        }
+    } else if (file_map_to(f, (end - 1) / csize) < 0) {
+        return -1;
+    }
+
+    if (file_write_range(f, (const uint8_t *)buf, size, offset) < 0) {
+        return -1;
+    }
+
+    if (end > old_size && file_set_size(f, end) < 0) {
+        return -1;
+    }
+    return (int)size;
+}
+
+int fat32_file_truncate(fat32_file_t *f, size_t size) {
+    if (!fs_initialized || !f) return -1;
+    if (file_revalidate(f) < 0) return -1;
+    if (f->dirent.attr & FAT_ATTR_DIRECTORY) return -1;
+    if (size > 0xFFFFFFFFULL) return -1;
+
+    uint32_t old_size = f->dirent.size;
+    if (size == old_size) return 0;
+
+    if (size > old_size) {
+        if (file_extend(f, size) < 0) {
+            return -1;
+        }
+        return file_set_size(f, size);
+    }
+
+    // Shrinking: cut the chain after the last cluster still needed
+    uint32_t csize = cluster_buf_size;
+    uint32_t keep = (size + csize - 1) / csize;
+    if (keep == 0) {
+        if (f->first_cluster >= 2) {
+            fat_free_chain(f->first_cluster);
+        }
+        f->first_cluster = 0;
+        file_trim_map(f, 0);
+    } else {
+        // Can't find where to cut: leave the file as it is rather than
+        // record a size the chain doesn't match
+        if (file_map_to(f, keep - 1) < 0) {
+            return -1;
+        }
+        fat32_extent_t *x = file_find_extent(f, keep - 1);
+        uint32_t last = x->disk_cluster + (keep - 1 - x->file_cluster);
+        uint32_t next = fat_next_cluster(last);
+        if (next >= 2 && next < FAT32_EOC) {
+            if (fat_set_cluster(last, FAT32_EOC) < 0) {
+                return -1;
+            }
+            fat_free_chain(next);
+        }
+        file_trim_map(f, keep);
+    }
+    return file_set_size(f, size);
+}
+
 // Delete a directory entry including its LFN entries
 // This finds all LFN entries associated with the 8.3 entry and marks them all as deleted
 static int delete_dir_entry_with_lfn(uint32_t dir_cluster, const char *name) {
+    dcache_forget(dir_cluster, name);
     uint32_t cluster = dir_cluster;
 
     // We need to track LFN entries that might precede the 8.3 entry
@@ -1748,6 +2945,7 @@ static int delete_dir_entry_with_lfn(uint32_t dir_cluster, const char *name) {
 
 int fat32_delete(const char *path) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char filename[256];
     uint32_t parent_cluster;
@@ -1778,6 +2976,7 @@ int fat32_delete(const char *path) {
 
 int fat32_rename(const char *oldpath, const char *newname) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char filename[256];
     uint32_t parent_cluster;
@@ -1862,6 +3061,7 @@ static int is_dir_empty(uint32_t dir_cluster) {
 
 int fat32_delete_dir(const char *path) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char dirname[256];
     uint32_t parent_cluster;
@@ -1889,6 +3089,7 @@ int fat32_delete_dir(const char *path) {
     }
 
     // Free the cluster chain
+    dcache_forget_dir(dir_cluster);
     if (dir_cluster >= 2 && dir_cluster < FAT32_EOC) {
         fat_free_chain(dir_cluster);
     }
@@ -1983,6 +3184,7 @@ static int delete_dir_contents(const char *dir_path) {
 
 int fat32_delete_recursive(const char *path) {
     if (!fs_initialized) return -1;
+    fat32_generation++;
 
     char name[256];
     uint32_t parent_cluster;
@@ -2004,6 +3206,7 @@ int fat32_delete_recursive(const char *path) {
         if (delete_dir_contents(path) < 0) {
             return -1;
         }
+        dcache_forget_dir(first_cluster);
     }
 
     // Free the cluster chain
@@ -2015,6 +3218,17 @@ int fat32_delete_recursive(const char *path) {
     return delete_dir_entry_with_lfn(parent_cluster, name);
 }
 
+int fat32_file_version(const char *path, fat32_version_t *ver) {
+    uint32_t cluster;
+    fat32_dirent_t *entry = resolve_path(path, &cluster);
+    if (!entry || (entry->attr & FAT_ATTR_DIRECTORY)) return -1;
+
+    ver->first_cluster = cluster;
+    ver->size = entry->size;
+    ver->stamp = change_stamps[cluster % STAMP_SLOTS];
+    return 0;
+}
+
 // Get total disk space in KB
 int fat32_get_total_kb(void) {
     if (!fs_initialized) return 0;
@@ -2023,18 +3237,27 @@ int fat32_get_total_kb(void) {
     return (int)(total_bytes / 1024);
 }
 
-// Get free disk space in KB (counts free clusters in FAT)
+// Get free disk space in KB. The free count is kept up to date as
+// clusters come and go; only a volume without a valid FSInfo needs one
+// pass over the FAT, the first time.
 int fat32_get_free_kb(void) {
     if (!fs_initialized) return 0;
 
-    uint32_t free_clusters = 0;
-    for (uint32_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
-        uint32_t entry = fat_next_cluster(cluster);
-        if (entry == FAT32_FREE) {
-            free_clusters++;
+    if (free_count == FSINFO_UNKNOWN && !free_map && !free_map_failed) {
+        free_map_build();
+    }
+    if (free_count == FSINFO_UNKNOWN) {
+        // No memory for the map - count the FAT entries
+        uint32_t count = 0;
+        for (uint32_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
+            if (fat_next_cluster(cluster) == FAT32_FREE) {
+                count++;
+            }
         }
+        free_count = count;
+        fsinfo_dirty = 1;
     }
 
-    uint64_t free_bytes = (uint64_t)free_clusters * fs.sectors_per_cluster * fs.bytes_per_sector;
+    uint64_t free_bytes = (uint64_t)free_count * fs.sectors_per_cluster * fs.bytes_per_sector;
     return (int)(free_bytes / 1024);
 }
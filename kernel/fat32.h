@@ -64,6 +64,35 @@ typedef struct {
     uint32_t total_clusters;
 } fat32_fs_t;
 
+// One contiguous run of a file's clusters
+typedef struct {
+    uint32_t file_cluster;      // Index of the run's first cluster in the file
+    uint32_t disk_cluster;      // Where that cluster is on disk
+    uint32_t count;             // Clusters in the run
+} fat32_extent_t;
+
+// Open file. Keeps the directory entry and a map of the cluster chain, so
+// reads neither walk the path nor follow the FAT from the start. The map
+// is filled in lazily as reads get further into the file.
+typedef struct {
+    char path[256];
+    fat32_dirent_t dirent;
+    uint32_t first_cluster;
+    uint32_t dirent_cluster;    // Directory cluster holding the entry
+    uint32_t dirent_index;      // Entry index within that cluster
+    uint32_t generation;        // Filesystem change count this matches
+    uint32_t entry_stamp;       // Entry change stamp this matches
+
+    fat32_extent_t *extents;
+    int extent_count;
+    int extent_cap;
+    uint32_t mapped;            // File clusters covered by extents
+    uint32_t next_cluster;      // Disk cluster after the mapped ones
+    int hint;                   // Extent the last lookup landed in
+
+    struct fat32_ra *ra;        // Readahead state, once the file is read
+} fat32_file_t;
+
 // Initialize FAT32 filesystem (reads from virtio-blk)
 int fat32_init(void);
 
@@ -79,6 +108,22 @@ int fat32_read_file(const char *path, void *buf, size_t size);
 // Returns: bytes read, or -1 on error
 int fat32_read_file_offset(const char *path, void *buf, size_t size, size_t offset);
 
+// Open files (see fat32_file_t)
+// fat32_open: NULL if not found
+// fat32_file_read: bytes read, or -1 on error. A handle notices when the
+// filesystem changed underneath it and looks its entry up again. Small
+// reads that follow on from the previous one are served from readahead.
+// fat32_file_write: write at offset in place, extending the cluster chain
+// as needed (a gap before offset reads as zeros). Bytes written, or -1.
+// fat32_file_truncate: cut to size, freeing clusters, or zero-extend.
+// fat32_file_length: current size, or -1 if the file is gone.
+fat32_file_t *fat32_open(const char *path);
+void fat32_close(fat32_file_t *f);
+int fat32_file_read(fat32_file_t *f, void *buf, size_t size, size_t offset);
+int fat32_file_write(fat32_file_t *f, const void *buf, size_t size, size_t offset);
+int fat32_file_truncate(fat32_file_t *f, size_t size);
+int fat32_file_length(fat32_file_t *f);
+
 // Get file size
 // Returns: file size in bytes, or -1 on error
 int fat32_file_size(const char *path);
@@ -94,6 +139,30 @@ int fat32_is_dir(const char *path);
 typedef void (*fat32_dir_callback)(const char *name, int is_dir, uint32_t size, void *user_data);
 int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_data);
 
+// Directory cursor: walks a directory once, one entry per call, instead
+// of listing it from the start every time
+typedef struct {
+    char path[256];
+    uint32_t first_cluster;     // The directory's own first cluster
+    uint32_t cluster;           // Where the cursor is (>= EOC past the end)
+    uint32_t index;             // Next entry within that cluster
+    uint32_t generation;        // Filesystem change count last checked
+} fat32_dir_t;
+
+typedef struct {
+    char name[256];
+    uint8_t attr;               // FAT_ATTR_* bits
+    uint32_t size;
+} fat32_dirinfo_t;
+
+// fat32_opendir: NULL if not found or not a directory
+// fat32_readdir: 1 with the next entry in *out (. and .. are skipped),
+// 0 at the end, -1 on error or if the directory was deleted
+fat32_dir_t *fat32_opendir(const char *path);
+int fat32_readdir(fat32_dir_t *d, fat32_dirinfo_t *out);
+void fat32_rewinddir(fat32_dir_t *d);
+void fat32_closedir(fat32_dir_t *d);
+
 // Get filesystem info
 fat32_fs_t *fat32_get_fs_info(void);
 
@@ -110,6 +179,10 @@ int fat32_mkdir(const char *path);
 // Returns bytes written, or -1 on error
 int fat32_write_file(const char *path, const void *buf, size_t size);
 
+// Write the free cluster count to FSInfo and flush the block cache
+// Returns 0 on success, -1 on a disk error
+int fat32_sync(void);
+
 // Delete a file (not directories)
 // Returns 0 on success, -1 on error
 int fat32_delete(const char *path);
@@ -128,11 +201,28 @@ int fat32_delete_recursive(const char *path);
 // Returns 0 on success, -1 on error
 int fat32_rename(const char *oldpath, const char *newname);
 
+// What a file's contents are right now, for caches of file data. Writing,
+// truncating, replacing or deleting the file changes at least one field
+// (this boot only - nothing is stored on disk).
+typedef struct fat32_version {
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t stamp;
+} fat32_version_t;
+
+// Returns 0, or -1 if not found or a directory
+int fat32_file_version(const char *path, fat32_version_t *ver);
+
 // Get disk space stats
 // Returns total disk space in KB
 int fat32_get_total_kb(void);
 
-// Returns free disk space in KB (counts free clusters)
+// Returns free disk space in KB (kept as a running count - cheap)
 int fat32_get_free_kb(void);
 
+// Directory entry cache counters: lookups answered from the cache
+// (including "not found"), lookups that scanned the directory, and
+// entries currently held
+void fat32_dcache_stats(uint64_t *hits, uint64_t *misses, uint32_t *entries);
+
 #endif
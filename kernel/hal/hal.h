@@ -47,19 +47,55 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void));
 
 /*
  * Timer
- * ARM Generic Timer is shared, but IRQ routing differs
+ * ARM Generic Timer is shared, but IRQ routing differs.
+ * Tickless: each core's timer is one-shot, programmed with the next
+ * scheduler deadline. CPU 0 adds a periodic housekeeping tick of
+ * interval_ms only while the platform needs one (USB keyboard polling
+ * on the Pi, audio refill on QEMU).
  */
 void hal_timer_init(uint32_t interval_ms);
-uint64_t hal_timer_get_ticks(void);
+uint64_t hal_timer_get_ticks(void);          // interval_ms ticks since boot
 void hal_timer_set_interval(uint32_t interval_ms);
+void hal_timer_set_deadline(uint64_t ns);    // This core's next event, HAL_TIMER_NEVER = none
+void hal_timer_start_housekeeping(void);     // Someone needs CPU 0's periodic tick again
+
+#define HAL_TIMER_NEVER (~0ULL)
 
 /*
- * Block Device (Storage)
- * Abstract disk access
+ * SMP
+ * Releasing parked secondary cores and their banked IRQ/timer setup.
  */
+int hal_cpu_start(int cpu, uint64_t entry);  // Release core into entry (-1 if absent)
+void hal_irq_init_secondary(void);           // Run on the secondary core itself
+void hal_timer_init_secondary(void);         // Arm this core's one-shot timer
+void hal_cpu_kick(int cpu);                  // IPI: make cpu run its scheduler
+
+/*
+ * Block Device (Storage)
+ * Abstract disk access. hal_blk_read/write block until done. Requests can
+ * also be queued with hal_blk_submit: the driver may hold them back to
+ * merge with neighbours until hal_blk_kick (or a wait) sends them off.
+ * done() is called on completion, possibly from the block IRQ handler.
+ */
+#define HAL_BLK_PENDING 1
+
+typedef struct hal_blk_req {
+    uint32_t sector;
+    uint32_t count;             // Sectors
+    void *buf;
+    int write;
+    volatile int status;        // HAL_BLK_PENDING, then 0 or -1
+    void (*done)(struct hal_blk_req *req);
+    void *priv;                 // For the submitter
+    struct hal_blk_req *next;   // Driver use
+} hal_blk_req_t;
+
 int hal_blk_init(void);
 int hal_blk_read(uint32_t sector, void *buf, uint32_t count);
 int hal_blk_write(uint32_t sector, const void *buf, uint32_t count);
+void hal_blk_submit(hal_blk_req_t *req);
+void hal_blk_kick(void);
+int hal_blk_wait(hal_blk_req_t *req);   // Returns the request's status
 
 /*
  * Input Devices
@@ -94,6 +130,12 @@ void hal_wfi(void);             // Wait for interrupt
  */
 uint32_t hal_get_time_us(void);
 
+/*
+ * Monotonic nanosecond clock from the ARM generic counter - the same
+ * clock hal_timer_set_deadline() takes, never wraps
+ */
+uint64_t hal_get_time_ns(void);
+
 /*
  * USB (Optional - not all platforms support this)
  * Returns 0 on success, -1 if not supported/failed
@@ -10,6 +10,8 @@
 #include "../../printf.h"
 #include "../../string.h"
 #include "../../memory.h"
+#include "../../process.h"
+#include "../../spinlock.h"
 
 /* LED for disk activity indicator - rate limited to ~20Hz */
 extern void led_toggle(void);
@@ -172,9 +174,31 @@ typedef struct __attribute__((aligned(32))) {
     uint32_t reserved[2];
 } emmc_dma_cb_t;
 
-static emmc_dma_cb_t __attribute__((aligned(32))) emmc_dma_cb;
+/*
+ * One multi-block command can scatter into (or gather from) several
+ * buffers: each gets its own control block, chained through nextconbk.
+ */
+#define EMMC_MAX_SEGS       32
+#define EMMC_MAX_BLOCKS     65535   /* BLKSIZECNT block count is 16 bits */
+#define EMMC_MERGE_BLOCKS   2048    /* Cap on requests merged into one command */
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t count;         /* Blocks */
+} emmc_seg_t;
+
+static emmc_dma_cb_t __attribute__((aligned(32))) emmc_dma_cbs[EMMC_MAX_SEGS];
 static int emmc_dma_enabled = 0;
 
+/* EMMC controller interrupt: VideoCore IRQ 62 = bank2 IRQ 30 */
+#define IRQ_VC_EMMC         (40 + 30)
+
+#define EMMC_POLL_NS        1000000ULL      /* Re-check even without the IRQ */
+#define EMMC_TIMEOUT_NS     5000000000ULL   /* Give up on a data transfer */
+
+/* Core waiting for a data transfer, kicked from the IRQ handler */
+static volatile int emmc_waiter = -1;
+
 /* Convert ARM physical address to bus address for DMA */
 static inline uint32_t arm_to_bus(void *ptr) {
     return ((uint32_t)(uint64_t)ptr) | 0xC0000000;
@@ -238,60 +262,146 @@ static int emmc_dma_wait(void) {
     return -1;
 }
 
+/* Stop a chain that will never finish (card error / timeout) */
+static void emmc_dma_abort(void) {
+    emmc_dma_write(DMA_CS, DMA_CS_RESET);
+    mem_barrier();
+    int timeout = 10000;
+    while ((emmc_dma_read(DMA_CS) & DMA_CS_RESET) && --timeout > 0) {
+        delay_us(1);
+    }
+    emmc_dma_write(DMA_CS, DMA_CS_END | DMA_CS_INT);
+    mem_barrier();
+}
+
+/* Reset the controller's data line after a failed transfer */
+static void emmc_reset_data(void) {
+    sdhci_write(REG_CTRL1, sdhci_read(REG_CTRL1) | (1 << 26));
+    int timeout = 10000;
+    while ((sdhci_read(REG_CTRL1) & (1 << 26)) && --timeout > 0) {
+        delay_us(1);
+    }
+}
+
 /*
- * DMA-based block read from EMMC
- * Uses DREQ pacing - DMA waits for EMMC to signal data ready
+ * EMMC interrupt: only used to wake the waiter. Signalling is switched
+ * off again here; the status stays latched in REG_INTR for the waiter.
  */
-static int read_data_blocks_dma(uint8_t *buf, uint32_t count) {
-    uint32_t bytes = count * 512;
+static void emmc_irq_handler(void) {
+    sdhci_write(REG_INTR_EN, 0);
+    mem_barrier();
 
-    /* Invalidate cache for destination buffer before DMA */
-    cache_invalidate(buf, bytes);
+    int cpu = emmc_waiter;
+    if (cpu >= 0 && cpu != cpu_this()->id) {
+        hal_cpu_kick(cpu);
+    }
+}
 
-    /* Set up DMA control block:
-     * - Read from EMMC DATA register (fixed address)
-     * - Write to buffer (incrementing address)
-     * - Use DREQ pacing from EMMC peripheral
-     */
-    emmc_dma_cb.ti = DMA_TI_DEST_INC | DMA_TI_WAIT_RESP |
+/*
+ * Wait for the data phase of the current command to finish, sleeping in
+ * wfi until the EMMC interrupt (or the poll deadline) wakes us
+ */
+static int emmc_wait_data(void) {
+    uint64_t give_up = hal_get_time_ns() + EMMC_TIMEOUT_NS;
+    uint32_t intr;
+    int ret = 0;
+
+    emmc_waiter = cpu_this()->id;
+    for (;;) {
+        uint64_t flags;
+        __asm__ volatile("mrs %0, daif" : "=r"(flags));
+        __asm__ volatile("msr daifset, #2" ::: "memory");
+
+        intr = sdhci_read(REG_INTR);
+        if (intr & (INTR_DATA_DONE | INTR_ERR)) {
+            __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+            break;
+        }
+
+        uint64_t now = hal_get_time_ns();
+        if (now >= give_up) {
+            __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+            printf("[SD] Data transfer timeout\n");
+            ret = -1;
+            break;
+        }
+
+        /* Status already latched raises the line straight away */
+        sdhci_write(REG_INTR_EN, INTR_DATA_DONE | INTR_ERR);
+        mem_barrier();
+        process_wait_event(now + EMMC_POLL_NS);
+
+        __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+    }
+    emmc_waiter = -1;
+
+    sdhci_write(REG_INTR_EN, 0);
+    sdhci_write(REG_INTR, INTR_DATA_DONE | INTR_ERR);
+
+    if (ret == 0 && (intr & INTR_ERR)) {
+        printf("[SD] Data transfer error: 0x%x\n", intr);
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Multi-block DMA transfer after CMD18/CMD25 has been issued. Builds one
+ * control block per segment, paced by the EMMC DREQ, and waits for the
+ * controller to report the data phase done.
+ */
+static int transfer_blocks_dma(int write, const emmc_seg_t *segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t bytes = segs[i].count * 512;
+        emmc_dma_cb_t *cb = &emmc_dma_cbs[i];
+
+        if (write) {
+            /* Make sure the data is in RAM, not just in our cache */
+            cache_clean(segs[i].buf, bytes);
+            cb->ti = DMA_TI_SRC_INC | DMA_TI_WAIT_RESP |
+                     DMA_TI_DEST_DREQ | DMA_TI_PERMAP(EMMC_DREQ);
+            cb->source_ad = arm_to_bus(segs[i].buf);
+            cb->dest_ad = EMMC_DATA_BUS;
+        } else {
+            /* No dirty lines may be written back over the DMA'd data */
+            cache_invalidate(segs[i].buf, bytes);
+            cb->ti = DMA_TI_DEST_INC | DMA_TI_WAIT_RESP |
                      DMA_TI_SRC_DREQ | DMA_TI_PERMAP(EMMC_DREQ);
-    emmc_dma_cb.source_ad = EMMC_DATA_BUS;
-    emmc_dma_cb.dest_ad = arm_to_bus(buf);
-    emmc_dma_cb.txfr_len = bytes;
-    emmc_dma_cb.stride = 0;
-    emmc_dma_cb.nextconbk = 0;
-
-    /* Clean cache for control block */
-    cache_clean(&emmc_dma_cb, sizeof(emmc_dma_cb));
+            cb->source_ad = EMMC_DATA_BUS;
+            cb->dest_ad = arm_to_bus(segs[i].buf);
+        }
+        cb->txfr_len = bytes;
+        cb->stride = 0;
+        cb->nextconbk = (i + 1 < nsegs) ? arm_to_bus(&emmc_dma_cbs[i + 1]) : 0;
+    }
+
+    /* Clean cache for the control blocks */
+    cache_clean(emmc_dma_cbs, nsegs * sizeof(emmc_dma_cb_t));
     mem_barrier();
 
-    /* Point DMA to control block and start */
-    emmc_dma_write(DMA_CONBLK_AD, arm_to_bus(&emmc_dma_cb));
+    /* Point DMA to the first control block and start */
+    emmc_dma_write(DMA_CONBLK_AD, arm_to_bus(&emmc_dma_cbs[0]));
     mem_barrier();
     emmc_dma_write(DMA_CS, DMA_CS_ACTIVE | DMA_CS_PRIORITY(8) | DMA_CS_PANIC_PRI(15) | DMA_CS_WAIT_WRITES);
 
-    /* Wait for DMA to complete */
-    if (emmc_dma_wait() < 0) {
-        printf("[SD] DMA read failed\n");
+    if (emmc_wait_data() < 0) {
+        emmc_dma_abort();
+        emmc_reset_data();
         return -1;
     }
 
-    /* Wait for EMMC transfer complete - tight poll */
-    uint32_t intr;
-    for (int i = 0; i < 10000000; i++) {
-        intr = sdhci_read(REG_INTR);
-        if (intr & (INTR_DATA_DONE | INTR_ERR)) break;
-    }
-
-    sdhci_write(REG_INTR, INTR_DATA_DONE | INTR_ERR);
-
-    if (intr & INTR_ERR) {
-        printf("[SD] DMA transfer complete error: 0x%x\n", intr);
+    /* Data phase is done, so the DMA has (nearly) drained the FIFO */
+    if (emmc_dma_wait() < 0) {
+        printf("[SD] DMA %s failed\n", write ? "write" : "read");
         return -1;
     }
 
-    /* Invalidate cache so CPU sees DMA-written data */
-    cache_invalidate(buf, bytes);
+    if (!write) {
+        /* Invalidate cache so CPU sees DMA-written data */
+        for (int i = 0; i < nsegs; i++) {
+            cache_invalidate(segs[i].buf, segs[i].count * 512);
+        }
+    }
 
     return 0;
 }
@@ -909,15 +1019,16 @@ int hal_blk_init(void) {
         printf("[SD] 4-bit mode enabled\n");
     }
 
+#ifdef PI_SD_HIGH_SPEED
     /*
-     * Try to enable High Speed mode (CMD6)
+     * Try to enable High Speed mode (CMD6), opt-in with SD_HIGH_SPEED=1
      * Arg: 0x80FFFFF1 = Switch, Access Mode = High Speed (function 1)
-     * Response is 512 bits (64 bytes) of switch status
+     * Response is 512 bits (64 bytes) of switch status; bits 379:376 say
+     * which function group 1 ended up with (0xF = switch refused)
      */
     sdhci_write(REG_BLKSIZECNT, (1 << 16) | 64);
     uint32_t cmd6_flags = TM_CMD_INDEX(6) | TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_DATA_READ;
     if (sd_command(cmd6_flags, 0x80FFFFF1, resp) == 0) {
-        /* Read 64 bytes of switch status (we don't really need it) */
         uint8_t switch_status[64];
         int hs_ok = 1;
         int hs_timeout = 100000;
@@ -939,16 +1050,24 @@ int hal_blk_init(void) {
                 if (intr & INTR_DATA_DONE) break;
             }
             sdhci_write(REG_INTR, INTR_DATA_DONE);
+            if ((switch_status[16] & 0xF) != 1) {
+                printf("[SD] Card refused High Speed mode\n");
+                hs_ok = 0;
+            }
         } else {
             hs_ok = 0;
         }
 
         if (hs_ok) {
-            /* Switch to 50 MHz for High Speed mode */
+            /* Sample on the rising edge, then switch to 50 MHz */
+            uint32_t ctrl0 = sdhci_read(REG_CTRL0);
+            ctrl0 |= (1 << 2);  /* HS_EN */
+            sdhci_write(REG_CTRL0, ctrl0);
             set_sd_clock(50000000);
             printf("[SD] High Speed mode enabled (50 MHz)\n");
         }
     }
+#endif
 
     card.ready = 1;
     printf("[SD] Initialization complete\n");
@@ -956,69 +1075,112 @@ int hal_blk_init(void) {
     /* Initialize DMA for faster block transfers */
     emmc_dma_init();
 
+    /* Data transfers complete through the EMMC interrupt */
+    hal_irq_register_handler(IRQ_VC_EMMC, emmc_irq_handler);
+    hal_irq_enable_irq(IRQ_VC_EMMC);
+
     return 0;
 }
 
 /*
- * Read sectors from the SD card
- * sector: starting sector number (512 bytes each)
- * buf: destination buffer
- * count: number of sectors to read
+ * One controller, one command at a time. Held across the whole transfer;
+ * preemption is off so the holder can't be switched out while another
+ * core spins on the lock.
  */
-int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
-    if (!card.ready) {
-        printf("[SD] Not initialized\n");
-        return -1;
-    }
+static spinlock_t emmc_lock = SPINLOCK_INIT;
 
-    if (count == 0) return 0;
+static void emmc_lock_acquire(void) {
+    preempt_disable();
+    spin_lock(&emmc_lock);
+}
+
+static void emmc_lock_release(void) {
+    spin_unlock(&emmc_lock);
+    preempt_enable();
+}
 
+/*
+ * Read or write total blocks starting at sector, scattered over segs.
+ * Several segments need DMA; single blocks go through the FIFO, where
+ * setting up DMA costs more than it saves. Caller holds emmc_lock.
+ */
+static int emmc_transfer(int write, uint32_t sector, const emmc_seg_t *segs,
+                         int nsegs, uint32_t total) {
     /* Disk activity LED */
     disk_activity_led();
 
     /* SDHC uses block addresses, SDSC uses byte addresses */
     uint32_t addr = card.is_sdhc ? sector : (sector * 512);
 
-    if (count == 1) {
-        /* Single block read - use CMD17 */
-        /* Note: DMA overhead too high for single 512-byte blocks, use FIFO */
+    if (total == 1) {
+        /* Single block - CMD17 / CMD24 */
         sdhci_write(REG_BLKSIZECNT, (1 << 16) | 512);
 
-        uint32_t cmd = TM_CMD_INDEX(17) | TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_DATA_READ;
+        uint32_t cmd = write ? (TM_CMD_INDEX(24) | TM_RSP_48 | TM_CRC_EN | TM_DATA)
+                             : (TM_CMD_INDEX(17) | TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_DATA_READ);
         if (sd_command(cmd, addr, NULL) < 0) {
-            printf("[SD] Read command failed at sector %u\n", sector);
+            printf("[SD] %s command failed at sector %u\n", write ? "Write" : "Read", sector);
             return -1;
         }
 
-        if (read_data_block(buf, 512) < 0) {
-            return -1;
-        }
-    } else {
-        /* Multi-block read - use CMD18 with auto CMD12 */
-        sdhci_write(REG_BLKSIZECNT, (count << 16) | 512);
+        return write ? write_data_block(segs[0].buf, 512)
+                     : read_data_block(segs[0].buf, 512);
+    }
 
-        uint32_t cmd = TM_CMD_INDEX(18) | TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_DATA_READ |
-                       TM_MULTI_BLK | TM_BLK_CNT_EN | TM_AUTO_CMD12;
-        if (sd_command(cmd, addr, NULL) < 0) {
-            printf("[SD] Multi-read command failed at sector %u\n", sector);
-            return -1;
-        }
+    /* Multi-block - CMD18 / CMD25 with auto CMD12 */
+    sdhci_write(REG_BLKSIZECNT, (total << 16) | 512);
 
-        /* Use DMA if available, fall back to FIFO */
-        if (emmc_dma_enabled) {
-            if (read_data_blocks_dma(buf, count) < 0) {
-                return -1;
-            }
-        } else {
-            if (read_data_blocks(buf, count) < 0) {
-                return -1;
-            }
-        }
+    uint32_t cmd = TM_CMD_INDEX(write ? 25 : 18) | TM_RSP_48 | TM_CRC_EN | TM_DATA |
+                   TM_MULTI_BLK | TM_BLK_CNT_EN | TM_AUTO_CMD12;
+    if (!write) cmd |= TM_DATA_READ;
+    if (sd_command(cmd, addr, NULL) < 0) {
+        printf("[SD] Multi-%s command failed at sector %u\n", write ? "write" : "read", sector);
+        return -1;
+    }
+
+    /* Use DMA if available, fall back to FIFO (one segment only) */
+    if (emmc_dma_enabled) {
+        return transfer_blocks_dma(write, segs, nsegs);
+    }
+    return write ? write_data_blocks(segs[0].buf, total)
+                 : read_data_blocks(segs[0].buf, total);
+}
+
+/* Plain read/write of one buffer, in commands of at most EMMC_MAX_BLOCKS */
+static int emmc_rw(int write, uint32_t sector, uint8_t *buf, uint32_t count) {
+    if (!card.ready) {
+        printf("[SD] Not initialized\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        emmc_seg_t seg;
+        seg.buf = buf;
+        seg.count = count > EMMC_MAX_BLOCKS ? EMMC_MAX_BLOCKS : count;
+
+        emmc_lock_acquire();
+        int ret = emmc_transfer(write, sector, &seg, 1, seg.count);
+        emmc_lock_release();
+        if (ret < 0) return -1;
+
+        sector += seg.count;
+        buf += (size_t)seg.count * 512;
+        count -= seg.count;
     }
 
     return 0;
 }
 
+/*
+ * Read sectors from the SD card
+ * sector: starting sector number (512 bytes each)
+ * buf: destination buffer
+ * count: number of sectors to read
+ */
+int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
+    return emmc_rw(0, sector, buf, count);
+}
+
 /*
  * Write sectors to the SD card
  * sector: starting sector number
@@ -1026,47 +1188,89 @@ int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
  * count: number of sectors to write
  */
 int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
-    if (!card.ready) {
-        printf("[SD] Not initialized\n");
-        return -1;
-    }
-
-    if (count == 0) return 0;
-
-    /* Disk activity LED */
-    disk_activity_led();
+    return emmc_rw(1, sector, (void *)buf, count);
+}
 
-    /* SDHC uses block addresses, SDSC uses byte addresses */
-    uint32_t addr = card.is_sdhc ? sector : (sector * 512);
+/*
+ * Request queue
+ * Submitted requests wait here, sorted by sector, until someone kicks or
+ * waits. Runs of adjacent requests in the same direction then go out as
+ * one multi-block command, DMA'd straight into each request's buffer.
+ */
+static hal_blk_req_t *emmc_queue;
+static spinlock_t emmc_queue_lock = SPINLOCK_INIT;
+
+void hal_blk_submit(hal_blk_req_t *req) {
+    req->status = HAL_BLK_PENDING;
+    req->next = NULL;
+    if (!card.ready || req->count == 0 || req->count > EMMC_MAX_BLOCKS) {
+        req->status = -1;
+        if (req->done) req->done(req);
+        return;
+    }
 
-    if (count == 1) {
-        /* Single block write - use CMD24 */
-        sdhci_write(REG_BLKSIZECNT, (1 << 16) | 512);
+    uint64_t flags = spin_lock_irqsave(&emmc_queue_lock);
+    hal_blk_req_t **pp = &emmc_queue;
+    while (*pp && (*pp)->sector <= req->sector) pp = &(*pp)->next;
+    req->next = *pp;
+    *pp = req;
+    spin_unlock_irqrestore(&emmc_queue_lock, flags);
+}
 
-        uint32_t cmd = TM_CMD_INDEX(24) | TM_RSP_48 | TM_CRC_EN | TM_DATA;
-        if (sd_command(cmd, addr, NULL) < 0) {
-            printf("[SD] Write command failed at sector %u\n", sector);
-            return -1;
+/* Run everything queued. Each command blocks (in wfi) until it's done. */
+void hal_blk_kick(void) {
+    for (;;) {
+        /* Take the head of the queue plus whatever directly follows it */
+        uint64_t flags = spin_lock_irqsave(&emmc_queue_lock);
+        hal_blk_req_t *first = emmc_queue;
+        if (!first) {
+            spin_unlock_irqrestore(&emmc_queue_lock, flags);
+            return;
         }
-
-        if (write_data_block(buf, 512) < 0) {
-            return -1;
+        hal_blk_req_t *last = first;
+        uint32_t total = first->count;
+        int nsegs = 1;
+        while (emmc_dma_enabled && last->next && nsegs < EMMC_MAX_SEGS &&
+               last->next->write == first->write &&
+               last->next->sector == last->sector + last->count &&
+               total + last->next->count <= EMMC_MERGE_BLOCKS) {
+            last = last->next;
+            total += last->count;
+            nsegs++;
         }
-    } else {
-        /* Multi-block write - use CMD25 with auto CMD12 */
-        sdhci_write(REG_BLKSIZECNT, (count << 16) | 512);
-
-        uint32_t cmd = TM_CMD_INDEX(25) | TM_RSP_48 | TM_CRC_EN | TM_DATA |
-                       TM_MULTI_BLK | TM_BLK_CNT_EN | TM_AUTO_CMD12;
-        if (sd_command(cmd, addr, NULL) < 0) {
-            printf("[SD] Multi-write command failed at sector %u\n", sector);
-            return -1;
+        emmc_queue = last->next;
+        last->next = NULL;
+        spin_unlock_irqrestore(&emmc_queue_lock, flags);
+
+        emmc_seg_t segs[EMMC_MAX_SEGS];
+        int i = 0;
+        for (hal_blk_req_t *r = first; r; r = r->next) {
+            segs[i].buf = r->buf;
+            segs[i].count = r->count;
+            i++;
         }
 
-        if (write_data_blocks(buf, count) < 0) {
-            return -1;
+        emmc_lock_acquire();
+        int ret = emmc_transfer(first->write, first->sector, segs, nsegs, total);
+        emmc_lock_release();
+
+        while (first) {
+            hal_blk_req_t *r = first;
+            first = r->next;
+            r->next = NULL;
+            r->status = (ret < 0) ? -1 : 0;
+            if (r->done) r->done(r);
         }
     }
+}
 
-    return 0;
+int hal_blk_wait(hal_blk_req_t *req) {
+    while (req->status == HAL_BLK_PENDING) {
+        hal_blk_kick();
+        if (req->status == HAL_BLK_PENDING) {
+            /* Another core has it in flight */
+            process_wait_event(hal_get_time_ns() + EMMC_POLL_NS);
+        }
+    }
+    return req->status;
 }
@@ -13,6 +13,7 @@
 #include "../../printf.h"
 #include "../../string.h"
 #include "../../process.h"
+#include "../../smp.h"
 
 void led_init(void);
 void led_toggle(void);
@@ -29,9 +30,17 @@ static volatile uint32_t *const core_timer_cfg     = (uint32_t *)(CORE_CTRL_BASE
 static volatile uint32_t *const core_timer_scale   = (uint32_t *)(CORE_CTRL_BASE + 0x08);
 static volatile uint32_t *const core_gpu_route     = (uint32_t *)(CORE_CTRL_BASE + 0x0C);
 static volatile uint32_t *const core0_timer_ctl    = (uint32_t *)(CORE_CTRL_BASE + 0x40);
-static volatile uint32_t *const core0_irq_src      = (uint32_t *)(CORE_CTRL_BASE + 0x60);
 
-/* Bits in core0_irq_src */
+/* Timer control and IRQ source registers repeat per core, 4 bytes apart */
+#define CORE_TIMER_CTL(n)   ((volatile uint32_t *)(uintptr_t)(CORE_CTRL_BASE + 0x40 + 4 * (n)))
+#define CORE_MBOX_CTL(n)    ((volatile uint32_t *)(uintptr_t)(CORE_CTRL_BASE + 0x50 + 4 * (n)))
+#define CORE_IRQ_SRC(n)     ((volatile uint32_t *)(uintptr_t)(CORE_CTRL_BASE + 0x60 + 4 * (n)))
+
+/* Mailbox 0 of each core is the reschedule IPI: write-set / read-clear */
+#define CORE_MBOX0_SET(n)   ((volatile uint32_t *)(uintptr_t)(CORE_CTRL_BASE + 0x80 + 16 * (n)))
+#define CORE_MBOX0_CLR(n)   ((volatile uint32_t *)(uintptr_t)(CORE_CTRL_BASE + 0xC0 + 16 * (n)))
+
+/* Bits in the core IRQ source registers */
 #define CORE_IRQ_PHYS_SECURE    0x01
 #define CORE_IRQ_PHYS_NONSEC    0x02
 #define CORE_IRQ_HYP_TIMER      0x04
@@ -87,8 +96,10 @@ static const uint8_t bank2_fast_irqs[] = { 21, 22, 23, 24, 25, 30 };
 #define IRQ_VC_USB          (8 + 9) /* USB is bank1 IRQ 9 */
 
 static void (*dispatch_table[TOTAL_IRQS])(void);
-static uint32_t tick_period_ms = 1;  // 1ms = 1000Hz polling (USB spec max)
-static uint64_t tick_count = 0;
+static uint64_t tick_ns = 10000000;         /* Tick / housekeeping period */
+static uint64_t housekeeping_count = 0;     /* Core 0 housekeeping ticks */
+static uint64_t housekeeping_next = 0;      /* Core 0, always running here */
+static uint64_t sched_deadline[MAX_CPUS];   /* Next scheduler event per core */
 
 /* Count trailing zeros - returns bit position of lowest set bit, or 32 if zero */
 static inline uint32_t ctz32(uint32_t v) {
@@ -211,7 +222,7 @@ static void service_peripheral_irqs(void) {
  * Top-level IRQ handler, called from exception vectors
  */
 void handle_irq(void) {
-    uint32_t src = *core0_irq_src;
+    uint32_t src = *CORE_IRQ_SRC(smp_cpu_id());
 
     /* Physical timer fired? */
     if (src & CORE_IRQ_PHYS_NONSEC) {
@@ -220,7 +231,14 @@ void handle_irq(void) {
         }
     }
 
-    /* Something from the VideoCore? */
+    /* Reschedule IPI from another core */
+    if (src & CORE_IRQ_MBOX0) {
+        int cpu = smp_cpu_id();
+        *CORE_MBOX0_CLR(cpu) = 0xFFFFFFFF;
+        process_schedule_from_irq();
+    }
+
+    /* Something from the VideoCore? (only routed to core 0) */
     if (src & CORE_IRQ_PERIPHERAL) {
         service_peripheral_irqs();
     }
@@ -236,20 +254,59 @@ void handle_irq(void) {
 #define DWC2_HPRT0      (*(volatile uint32_t *)(USB_BASE_ADDR + 0x440))
 #define DWC2_HFNUM      (*(volatile uint32_t *)(USB_BASE_ADDR + 0x408))
 
+/* Nanoseconds to generic counter ticks, without overflowing the multiply */
+static uint64_t ns_to_count(uint64_t ns) {
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (ns / 1000000000ULL) * freq + ((ns % 1000000000ULL) * freq) / 1000000000ULL;
+}
+
+/*
+ * Program this core's compare value for its earliest event.
+ * Caller has IRQs masked.
+ */
+static void timer_program(int cpu) {
+    uint64_t deadline = sched_deadline[cpu];
+    if (cpu == 0 && housekeeping_next < deadline) {
+        deadline = housekeeping_next;
+    }
+
+    if (deadline == HAL_TIMER_NEVER) {
+        /* Nothing to wake up for - leave the timer running but masked */
+        asm volatile("msr cntp_ctl_el0, %0" :: "r"(3UL));
+    } else {
+        asm volatile("msr cntp_cval_el0, %0" :: "r"(ns_to_count(deadline)));
+        asm volatile("msr cntp_ctl_el0, %0" :: "r"(1UL));
+    }
+    asm volatile("isb");
+}
+
 /*
- * Timer tick handler - reschedules itself for the next interval
+ * Timer handler - one-shot. Core 0 runs the periodic housekeeping (USB
+ * keyboard, LED) every tick; the scheduler programs everything else.
  */
 static void on_timer_tick(void) {
-    tick_count++;
+    int cpu = smp_cpu_id();
 
-    /* Reload for next tick */
-    uint64_t freq;
-    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
-    asm volatile("msr cntp_tval_el0, %0" :: "r"((freq * tick_period_ms) / 1000));
+    /* Secondary cores only need the scheduler */
+    if (cpu != 0) {
+        process_schedule_from_irq();
+        return;
+    }
+
+    uint64_t now = hal_get_time_ns();
+    if (now < housekeeping_next) {
+        process_schedule_from_irq();
+        return;
+    }
+
+    housekeeping_next += tick_ns;
+    if (housekeeping_next <= now) housekeeping_next = now + tick_ns;
+    housekeeping_count++;
 
     // Heartbeat LED - toggle every 500ms (50 ticks) = 1Hz
     // (Disk activity will override with faster blinks during I/O)
-    if ((tick_count % 50) == 0) {
+    if ((housekeeping_count % 50) == 0) {
         led_toggle();
     }
 
@@ -257,10 +314,9 @@ static void on_timer_tick(void) {
     // This is much more efficient than SOF-based polling (1000 IRQs/sec)
     hal_usb_keyboard_tick();
 
-    // Preemptive scheduling - switch every 20 ticks (200ms timeslice)
-    if ((tick_count % 20) == 0) {
-        process_schedule_from_irq();
-    }
+    // Scheduler - wakes sleepers, preempts, and programs the next
+    // event through hal_timer_set_deadline()
+    process_schedule_from_irq();
 
     // NOTE: Cursor blink disabled on Pi - was interfering with USB keyboard
     // TODO: Investigate why console_blink_cursor() breaks USB on real hardware
@@ -291,6 +347,16 @@ void hal_irq_init(void) {
     printf("[IRQ] Pi interrupt system ready\n");
 }
 
+/*
+ * Secondary cores: route this core's non-secure physical timer to its IRQ
+ * line. Peripheral interrupts stay on core 0.
+ */
+void hal_irq_init_secondary(void) {
+    *CORE_TIMER_CTL(smp_cpu_id()) = CORE_IRQ_PHYS_NONSEC;
+    *CORE_MBOX_CTL(smp_cpu_id()) = 1;   /* Mailbox 0 IRQ (reschedule IPI) */
+    mem_barrier();
+}
+
 void hal_irq_enable(void) {
     asm volatile("msr daifclr, #2" ::: "memory");
 }
@@ -339,27 +405,55 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void)) {
 /* ========== Timer HAL ========== */
 
 void hal_timer_init(uint32_t interval_ms) {
-    tick_period_ms = interval_ms;
-    tick_count = 0;
+    tick_ns = (uint64_t)interval_ms * 1000000ULL;
 
     uint64_t freq;
     asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
 
-    printf("[TIMER] Clock: %llu Hz, period: %u ms\n", freq, interval_ms);
+    printf("[TIMER] Clock: %llu Hz, tickless, housekeeping every %u ms\n", freq, interval_ms);
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        sched_deadline[i] = HAL_TIMER_NEVER;
+    }
+    housekeeping_next = hal_get_time_ns() + tick_ns;
 
-    /* Program countdown value */
-    asm volatile("msr cntp_tval_el0, %0" :: "r"((freq * interval_ms) / 1000));
+    /* Core 0 takes reschedule IPIs too */
+    *CORE_MBOX_CTL(0) = 1;
+    mem_barrier();
 
-    /* Enable timer, don't mask output */
-    asm volatile("msr cntp_ctl_el0, %0" :: "r"(1UL));
+    timer_program(0);
 
     printf("[TIMER] Generic timer running\n");
 }
 
+void hal_timer_init_secondary(void) {
+    timer_program(smp_cpu_id());
+}
+
+/* Derived from the counter - no periodic interrupt has to keep it going */
 uint64_t hal_timer_get_ticks(void) {
-    return tick_count;
+    return hal_get_time_ns() / tick_ns;
 }
 
 void hal_timer_set_interval(uint32_t interval_ms) {
-    tick_period_ms = interval_ms;
+    tick_ns = (uint64_t)interval_ms * 1000000ULL;
+}
+
+void hal_timer_set_deadline(uint64_t ns) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    int cpu = smp_cpu_id();
+    sched_deadline[cpu] = ns;
+    timer_program(cpu);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+/* Core 0's housekeeping tick never stops on the Pi (USB keyboard polling) */
+void hal_timer_start_housekeeping(void) {
+}
+
+void hal_cpu_kick(int cpu) {
+    mem_barrier();
+    *CORE_MBOX0_SET(cpu) = 1;
 }
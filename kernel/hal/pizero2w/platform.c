@@ -170,6 +170,16 @@ uint32_t hal_get_time_us(void) {
     return PI_SYSTIMER_LO;
 }
 
+// Monotonic nanoseconds from the ARM generic counter, not the system timer
+// above - timer deadlines are programmed against the counter. Split the
+// multiply so the intermediate doesn't overflow.
+uint64_t hal_get_time_ns(void) {
+    uint64_t cnt, freq;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(cnt) :: "memory");
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (cnt / freq) * 1000000000ULL + ((cnt % freq) * 1000000000ULL) / freq;
+}
+
 // CPU Info - BCM2710 with Cortex-A53 cores
 const char *hal_get_cpu_name(void) {
     return "Cortex-A53";
@@ -183,6 +193,23 @@ int hal_get_cpu_cores(void) {
     return 4;  // Pi Zero 2W has 4 cores
 }
 
+/*
+ * The firmware's armstub parks cores 1-3 in a wfe loop polling a spin
+ * table at 0xD8 + 8*core (cores arrive at EL2, SMPEN already set).
+ * Writing an entry address there and issuing SEV releases the core.
+ */
+#define SPIN_TABLE_BASE 0xD8
+
+int hal_cpu_start(int cpu, uint64_t entry) {
+    if (cpu < 1 || cpu > 3) return -1;
+    volatile uint64_t *slot = (volatile uint64_t *)(uintptr_t)(SPIN_TABLE_BASE + cpu * 8);
+    *slot = entry;
+    // The parked core polls with its caches off
+    asm volatile("dc civac, %0" :: "r"(slot) : "memory");
+    asm volatile("dsb sy; sev" ::: "memory");
+    return 0;
+}
+
 // USB Device List
 int hal_usb_get_device_count(void) {
     return usb_state.num_devices;
@@ -20,3 +20,15 @@ int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
 int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
     return virtio_blk_write(sector, count, buf);
 }
+
+void hal_blk_submit(hal_blk_req_t *req) {
+    virtio_blk_submit(req);
+}
+
+void hal_blk_kick(void) {
+    virtio_blk_kick();
+}
+
+int hal_blk_wait(hal_blk_req_t *req) {
+    return virtio_blk_wait(req);
+}
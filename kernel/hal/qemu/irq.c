@@ -9,8 +9,10 @@
 #include "../../printf.h"
 #include "../../irq.h"
 #include "../../virtio_sound.h"
+#include "../../net.h"
 #include "../../console.h"
 #include "../../process.h"
+#include "../../smp.h"
 
 // QEMU virt machine GIC addresses
 #define GICD_BASE   0x08000000UL  // Distributor
@@ -27,6 +29,7 @@
 #define GICD_IPRIORITYR(n) (*(volatile uint32_t *)(GICD_BASE + 0x400 + (n)*4))
 #define GICD_ITARGETSR(n)  (*(volatile uint32_t *)(GICD_BASE + 0x800 + (n)*4))
 #define GICD_ICFGR(n)      (*(volatile uint32_t *)(GICD_BASE + 0xC00 + (n)*4))
+#define GICD_SGIR          (*(volatile uint32_t *)(GICD_BASE + 0xF00))
 
 // GIC CPU Interface registers
 #define GICC_CTLR   (*(volatile uint32_t *)(GICC_BASE + 0x000))
@@ -37,16 +40,20 @@
 // Timer IRQ (EL1 Physical Timer is PPI 30)
 #define TIMER_IRQ   30
 
+// SGI used to kick another core into its scheduler
+#define IPI_RESCHEDULE  0
+
 // Maximum number of IRQs
 #define MAX_IRQS    128
 
 // IRQ handlers
 static void (*irq_handlers[MAX_IRQS])(void);
 
-// Timer state
-static uint64_t timer_ticks = 0;
-static uint32_t timer_interval_ticks = 0;
-static uint32_t timer_freq = 0;
+// Timer state - one-shot per core, see hal.h
+static uint64_t tick_ns = 10000000;           // Tick / housekeeping period
+static uint64_t timer_freq = 0;
+static uint64_t sched_deadline[MAX_CPUS];     // Next scheduler event per core
+static volatile uint64_t housekeeping_next;  // CPU 0 periodic tick, 0 = off
 
 // Memory barriers
 static inline void dsb(void) {
@@ -57,23 +64,63 @@ static inline void isb(void) {
     asm volatile("isb" ::: "memory");
 }
 
-// Timer IRQ handler
-static void timer_handler(void) {
-    timer_ticks++;
-
-    // Pump audio if playing
-    virtio_sound_pump();
+// Nanoseconds to generic counter ticks, without overflowing the multiply
+static uint64_t ns_to_count(uint64_t ns) {
+    return (ns / 1000000000ULL) * timer_freq +
+           ((ns % 1000000000ULL) * timer_freq) / 1000000000ULL;
+}
 
-    // Preemptive scheduling - switch every 20 ticks (200ms timeslice)
-    if ((timer_ticks % 20) == 0) {
-        process_schedule_from_irq();
+// Program this core's compare value for its earliest event. Caller has
+// IRQs masked.
+static void timer_program(int cpu) {
+    uint64_t deadline = sched_deadline[cpu];
+    if (cpu == 0 && housekeeping_next && housekeeping_next < deadline) {
+        deadline = housekeeping_next;
     }
 
-    // Reload timer
-    asm volatile("msr cntp_tval_el0, %0" :: "r"(timer_interval_ticks));
+    if (deadline == HAL_TIMER_NEVER) {
+        // Nothing to wake up for - leave the timer running but masked
+        asm volatile("msr cntp_ctl_el0, %0" :: "r"((uint64_t)3));
+    } else {
+        asm volatile("msr cntp_cval_el0, %0" :: "r"(ns_to_count(deadline)));
+        asm volatile("msr cntp_ctl_el0, %0" :: "r"((uint64_t)1));
+    }
     isb();
 }
 
+// Timer IRQ handler (every core has its own banked timer)
+static void timer_handler(void) {
+    int cpu = smp_cpu_id();
+
+    // Housekeeping tick - only kept running while audio is playing or
+    // TCP has timers set
+    if (cpu == 0 && housekeeping_next && hal_get_time_ns() >= housekeeping_next) {
+        // Pump audio if playing
+        virtio_sound_pump();
+
+        // Retransmissions, delayed ACKs
+        net_tick();
+
+        uint64_t now = hal_get_time_ns();
+        if (virtio_sound_is_playing() || net_timers_pending()) {
+            housekeeping_next += tick_ns;
+            if (housekeeping_next <= now) housekeeping_next = now + tick_ns;
+        } else {
+            housekeeping_next = 0;
+            // Playback started or a timer set since we looked would have
+            // seen the tick still on and not restarted it
+            dsb();
+            if (virtio_sound_is_playing() || net_timers_pending()) {
+                housekeeping_next = now + tick_ns;
+            }
+        }
+    }
+
+    // Scheduler - wakes sleepers, preempts, and programs this core's next
+    // event through hal_timer_set_deadline()
+    process_schedule_from_irq();
+}
+
 // ============================================================================
 // HAL Implementation
 // ============================================================================
@@ -134,6 +181,10 @@ void hal_irq_init(void) {
     }
     dsb();
 
+    // Reschedule IPI (SGI enables are banked per core)
+    GICD_ISENABLER(0) = 1 << IPI_RESCHEDULE;
+    dsb();
+
     // Enable distributor
     GICD_CTLR = 0x1;
     dsb();
@@ -147,6 +198,22 @@ void hal_irq_init(void) {
     printf("[IRQ] GIC initialized (Secure, Group 0)\n");
 }
 
+// Secondary cores: the SGI/PPI part of the distributor and the whole CPU
+// interface are banked per core, everything else was set up by CPU 0
+void hal_irq_init_secondary(void) {
+    GICD_IGROUPR(0) = 0x00000000;
+    for (uint32_t i = 0; i < 8; i++) {
+        GICD_IPRIORITYR(i) = 0xA0A0A0A0;
+    }
+    GICD_ISENABLER(0) = 1 << IPI_RESCHEDULE;
+    dsb();
+
+    GICC_PMR = 0xFF;
+    dsb();
+    GICC_CTLR = 0x1;
+    dsb();
+}
+
 void hal_irq_enable(void) {
     asm volatile("msr daifclr, #2" ::: "memory");
 }
@@ -186,19 +253,15 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void)) {
 void hal_timer_init(uint32_t interval_ms) {
     // Get timer frequency
     asm volatile("mrs %0, cntfrq_el0" : "=r"(timer_freq));
-    printf("[TIMER] Frequency: %u Hz\n", timer_freq);
+    printf("[TIMER] Frequency: %lu Hz\n", timer_freq);
 
-    // Calculate ticks per interval
-    timer_interval_ticks = (timer_freq / 1000) * interval_ms;
-    printf("[TIMER] Interval: %u ms (%u ticks)\n", interval_ms, timer_interval_ticks);
+    tick_ns = (uint64_t)interval_ms * 1000000ULL;
+    printf("[TIMER] Tickless, %u ms ticks, one-shot deadlines\n", interval_ms);
 
-    // Set timer value
-    asm volatile("msr cntp_tval_el0, %0" :: "r"(timer_interval_ticks));
-    isb();
-
-    // Enable timer
-    asm volatile("msr cntp_ctl_el0, %0" :: "r"((uint64_t)1));
-    isb();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        sched_deadline[i] = HAL_TIMER_NEVER;
+    }
+    timer_program(0);
 
     // Enable timer IRQ in GIC
     hal_irq_enable_irq(TIMER_IRQ);
@@ -206,12 +269,56 @@ void hal_timer_init(uint32_t interval_ms) {
     printf("[TIMER] Timer initialized\n");
 }
 
+void hal_timer_init_secondary(void) {
+    timer_program(smp_cpu_id());
+
+    // PPI enable bits are banked, so this enables it for this core
+    hal_irq_enable_irq(TIMER_IRQ);
+}
+
+// Derived from the counter - no periodic interrupt has to keep it going
 uint64_t hal_timer_get_ticks(void) {
-    return timer_ticks;
+    return hal_get_time_ns() / tick_ns;
 }
 
 void hal_timer_set_interval(uint32_t interval_ms) {
-    timer_interval_ticks = (timer_freq / 1000) * interval_ms;
+    tick_ns = (uint64_t)interval_ms * 1000000ULL;
+}
+
+void hal_timer_set_deadline(uint64_t ns) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    int cpu = smp_cpu_id();
+    sched_deadline[cpu] = ns;
+    timer_program(cpu);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+// Audio just started - CPU 0 has to pump it every tick from now on
+void hal_timer_start_housekeeping(void) {
+    // Order the caller's "playing"/timer store before reading the tick
+    // state - pairs with the recheck in timer_handler()
+    dsb();
+    if (housekeeping_next) return;
+    housekeeping_next = hal_get_time_ns() + tick_ns;
+    dsb();
+
+    if (smp_cpu_id() == 0) {
+        uint64_t flags;
+        asm volatile("mrs %0, daif" : "=r"(flags));
+        asm volatile("msr daifset, #2" ::: "memory");
+        timer_program(0);
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+    } else {
+        hal_cpu_kick(0);
+    }
+}
+
+void hal_cpu_kick(int cpu) {
+    dsb();
+    GICD_SGIR = (1u << (16 + cpu)) | IPI_RESCHEDULE;
+    dsb();
 }
 
 // ============================================================================
@@ -233,6 +340,9 @@ void handle_irq(void) {
     // Handle the interrupt
     if (irq == TIMER_IRQ) {
         timer_handler();
+    } else if (irq == IPI_RESCHEDULE) {
+        // Another core made work for us (or moved the wheel deadline)
+        process_schedule_from_irq();
     } else if (irq_handlers[irq]) {
         irq_handlers[irq]();
     } else {
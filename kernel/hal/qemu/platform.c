@@ -3,6 +3,7 @@
  */
 
 #include "../hal.h"
+#include "../../smp.h"
 
 const char *hal_platform_name(void) {
     return "QEMU virt (aarch64)";
@@ -22,6 +23,15 @@ uint32_t hal_get_time_us(void) {
     return (uint32_t)((cnt * 1000000ULL) / freq);
 }
 
+// Monotonic nanoseconds from the ARM generic counter. Split the multiply
+// so the intermediate doesn't overflow (cnt * 1e9 would after ~5 minutes)
+uint64_t hal_get_time_ns(void) {
+    uint64_t cnt, freq;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(cnt) :: "memory");
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (cnt / freq) * 1000000000ULL + ((cnt % freq) * 1000000000ULL) / freq;
+}
+
 // QEMU uses virtio for input, not USB
 int hal_usb_init(void) {
     return -1;  // Not supported on QEMU virt
@@ -100,7 +110,18 @@ uint32_t hal_get_cpu_freq_mhz(void) {
 }
 
 int hal_get_cpu_cores(void) {
-    return 1;  // Single core in QEMU by default
+    return smp_cpu_count();  // Whatever -smp gave us and came up
+}
+
+// Secondary cores wait in boot.S's hold pen for their slot to go non-zero
+extern volatile uint64_t smp_spin_table[];
+
+int hal_cpu_start(int cpu, uint64_t entry) {
+    if (cpu < 1 || cpu > 3) return -1;
+    smp_spin_table[cpu] = entry;
+    asm volatile("dc civac, %0" :: "r"(&smp_spin_table[cpu]) : "memory");
+    asm volatile("dsb sy; sev" ::: "memory");
+    return 0;
 }
 
 // USB Device List - QEMU uses virtio, no USB
@@ -74,21 +74,38 @@ void timer_set_interval(uint32_t interval_ms) {
     hal_timer_set_interval(interval_ms);
 }
 
+uint64_t timer_get_ns(void) {
+    return hal_get_time_ns();
+}
+
+// The timer is tickless, so there may be no interrupt coming at all -
+// bound the wait by a tick, as the old periodic timer did
 void wfi(void) {
-    asm volatile("wfi");
+    process_wait_event(hal_get_time_ns() + SCHED_TICK_NS);
 }
 
-void sleep_ms(uint32_t ms) {
-    // Timer runs at 100Hz (10ms per tick)
-    uint64_t ticks_to_wait = (ms + 9) / 10;
-    if (ticks_to_wait == 0) ticks_to_wait = 1;
+void sleep_ns(uint64_t ns) {
+    uint64_t target = hal_get_time_ns() + ns;
+
+    // A process blocks on the scheduler's timer wheel. The kernel thread
+    // (or anything that can't be switched away) waits in place instead.
+    if (process_sleep_until(target) == 0) {
+        return;
+    }
 
-    uint64_t target = hal_timer_get_ticks() + ticks_to_wait;
-    while (hal_timer_get_ticks() < target) {
-        wfi();
+    while (hal_get_time_ns() < target) {
+        process_wait_event(target);
     }
 }
 
+void sleep_us(uint32_t us) {
+    sleep_ns((uint64_t)us * 1000ULL);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_ns((uint64_t)ms * 1000000ULL);
+}
+
 // ============================================================================
 // Shared Exception Handlers (used by all platforms)
 // Called from vectors.S
@@ -32,14 +32,20 @@ void handle_serror(uint64_t esr);
 void timer_init(uint32_t interval_ms);
 void timer_set_interval(uint32_t interval_ms);
 
-// Get timer interrupt count (for debugging)
+// Ticks since boot (100 per second), derived from the counter
 uint64_t timer_get_ticks(void);
 
-// Wait for interrupt (low power sleep until next interrupt)
+// Monotonic nanoseconds since boot
+uint64_t timer_get_ns(void);
+
+// Wait for interrupt (low power sleep until next interrupt, at most a tick)
 void wfi(void);
 
-// Sleep for at least the specified number of milliseconds
-// Uses timer ticks (10ms resolution with 100Hz timer)
+// Sleep for at least the given time. The timer is tickless, so these are
+// exact to the deadline rather than rounded to ticks. A process is BLOCKED
+// until then, so its core goes to other work.
+void sleep_ns(uint64_t ns);
+void sleep_us(uint32_t us);
 void sleep_ms(uint32_t ms);
 
 #endif // IRQ_H
@@ -18,6 +18,8 @@
 #include "tls.h"
 #include "ttf.h"
 #include "klog.h"
+#include "bcache.h"
+#include "execcache.h"
 #include "hal/hal.h"
 
 // Global kernel API instance
@@ -93,6 +95,33 @@ static int kapi_spawn_args(const char *path, int argc, char **argv) {
     return pid;
 }
 
+// Disk usage goes straight to FAT32, so take the filesystem lock
+static int kapi_get_disk_total(void) {
+    vfs_lock();
+    int kb = fat32_get_total_kb();
+    vfs_unlock();
+    return kb;
+}
+
+static int kapi_get_disk_free(void) {
+    vfs_lock();
+    int kb = fat32_get_free_kb();
+    vfs_unlock();
+    return kb;
+}
+
+// Block cache counters - plain reads, sysmon can live with a torn update
+static void kapi_blk_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *writebacks,
+                                 uint32_t *cached, uint32_t *dirty) {
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+    if (hits) *hits = st.hits;
+    if (misses) *misses = st.misses;
+    if (writebacks) *writebacks = st.writebacks;
+    if (cached) *cached = st.cached;
+    if (dirty) *dirty = st.dirty;
+}
+
 // Wrapper for console color
 static void kapi_set_color(uint32_t fg, uint32_t bg) {
     console_set_color(fg, bg);
@@ -118,6 +147,45 @@ static int kapi_write(void *file, const char *buf, size_t size) {
     return vfs_write((vfs_node_t *)file, buf, size);
 }
 
+// Wrappers for positional write and truncate
+static int kapi_write_at(void *file, const char *buf, size_t size, size_t offset) {
+    return vfs_write_at((vfs_node_t *)file, buf, size, offset);
+}
+
+static int kapi_truncate(void *file, size_t size) {
+    return vfs_truncate((vfs_node_t *)file, size);
+}
+
+// Raw batched disk read: queue every request, then wait for them all, so
+// the driver sees the whole batch at once. Bypasses the block cache.
+static int kapi_blk_read_batch(const uint32_t *sectors, int n, uint32_t count, void *buf) {
+    if (n <= 0 || count == 0) return -1;
+    hal_blk_req_t *reqs = malloc(n * sizeof(hal_blk_req_t));
+    if (!reqs) return -1;
+
+    for (int i = 0; i < n; i++) {
+        reqs[i].sector = sectors[i];
+        reqs[i].count = count;
+        reqs[i].buf = (uint8_t *)buf + (size_t)i * count * 512;
+        reqs[i].write = 0;
+        reqs[i].done = NULL;
+        hal_blk_submit(&reqs[i]);
+    }
+    hal_blk_kick();
+
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (hal_blk_wait(&reqs[i]) < 0) ret = -1;
+    }
+    free(reqs);
+    return ret;
+}
+
+// Directory entry cache counters - plain reads, like blk_cache_stats
+static void kapi_dcache_stats(uint64_t *hits, uint64_t *misses, uint32_t *entries) {
+    fat32_dcache_stats(hits, misses, entries);
+}
+
 // Wrapper for is_dir
 static int kapi_is_dir(void *node) {
     return vfs_is_dir((vfs_node_t *)node);
@@ -165,6 +233,19 @@ static int kapi_readdir(void *dir, int index, char *name, size_t name_size, uint
     return vfs_readdir((vfs_node_t *)dir, index, name, name_size, type);
 }
 
+// Directory streams
+static void *kapi_opendir(const char *path) {
+    return (void *)vfs_opendir(path);
+}
+
+static int kapi_readdir_batch(void *dir, struct vfs_dirent *ents, int max) {
+    return vfs_readdir_batch((vfs_dir_t *)dir, ents, max);
+}
+
+static void kapi_closedir(void *dir) {
+    vfs_closedir((vfs_dir_t *)dir);
+}
+
 // Wrapper for set_cwd
 static int kapi_set_cwd(const char *path) {
     return vfs_set_cwd(path);
@@ -189,6 +270,38 @@ static void kapi_get_datetime(int *year, int *month, int *day,
     if (weekday) *weekday = dt.weekday;
 }
 
+// Wait for any of the items to be ready. Sockets and window events all
+// wake poll_wq, so one queue serves every item; the scan just runs again.
+// POLL_* bits are the same as TCP_POLL_*.
+static int kapi_poll(poll_item_t *items, int count, int timeout_ms) {
+    if (count < 0 || (count > 0 && !items)) return -1;
+    uint64_t deadline = timeout_ms < 0 ? HAL_TIMER_NEVER
+                        : hal_get_time_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    while (1) {
+        uint32_t seq = wait_queue_seq(&poll_wq);
+        int ready = 0;
+        for (int i = 0; i < count; i++) {
+            poll_item_t *it = &items[i];
+            int events = 0;
+            if (it->type == POLL_TCP) {
+                events = tcp_poll(it->handle);
+            } else if (it->type == POLL_TLS) {
+                events = tls_poll(it->handle);
+            } else if (it->type == POLL_WINDOW) {
+                if (kapi.window_has_event && kapi.window_has_event(it->handle)) events = POLL_IN;
+            }
+            it->revents = events & (it->events | POLL_HUP);
+            if (it->revents) ready++;
+        }
+        if (ready > 0 || hal_get_time_ns() >= deadline) return ready;
+        process_wait_on(&poll_wq, seq, deadline);
+    }
+}
+
+static void kapi_poll_wake(void) {
+    process_wake_all(&poll_wq);
+}
+
 void kapi_init(void) {
     kapi.version = KAPI_VERSION;
 
@@ -268,6 +381,7 @@ void kapi_init(void) {
     kapi.window_destroy = 0;
     kapi.window_get_buffer = 0;
     kapi.window_poll_event = 0;
+    kapi.window_has_event = 0;
     kapi.window_invalidate = 0;
     kapi.window_set_title = 0;
 
@@ -301,12 +415,12 @@ void kapi_init(void) {
     kapi.sound_is_paused = virtio_sound_is_paused;
 
     // Process info
-    kapi.get_process_count = process_count_ready;
+    kapi.get_process_count = process_count_active;
     kapi.get_process_info = process_get_info;
 
     // Disk info
-    kapi.get_disk_total = fat32_get_total_kb;
-    kapi.get_disk_free = fat32_get_free_kb;
+    kapi.get_disk_total = kapi_get_disk_total;
+    kapi.get_disk_free = kapi_get_disk_free;
 
     // RAM info
     kapi.get_ram_total = kapi_get_ram_total;
@@ -378,4 +492,55 @@ void kapi_init(void) {
     kapi.dma_copy_2d = hal_dma_copy_2d;
     kapi.dma_fb_copy = hal_dma_fb_copy;
     kapi.dma_fill = hal_dma_fill;
+
+    // Scheduling
+    kapi.set_priority = process_set_nice;
+    kapi.get_priority = process_get_nice;
+    kapi.sched_latency = process_sched_latency;
+
+    // High resolution time
+    kapi.get_time_ns = timer_get_ns;
+    kapi.sleep_us = sleep_us;
+
+    // Block cache
+    kapi.sync = vfs_sync;
+    kapi.blk_cache_stats = kapi_blk_cache_stats;
+
+    // Positional file I/O
+    kapi.write_at = kapi_write_at;
+    kapi.truncate = kapi_truncate;
+
+    // Raw block I/O
+    kapi.blk_read_batch = kapi_blk_read_batch;
+
+    // Directory entry cache
+    kapi.dcache_stats = kapi_dcache_stats;
+
+    // Directory streams
+    kapi.opendir = kapi_opendir;
+    kapi.readdir_batch = kapi_readdir_batch;
+    kapi.closedir = kapi_closedir;
+
+    // Program image cache
+    kapi.exec_cache_stats = exec_cache_stats;
+
+    // TCP counters
+    kapi.tcp_stats = tcp_get_stats;
+
+    // TCP server sockets
+    kapi.tcp_listen = tcp_listen;
+    kapi.tcp_accept = tcp_accept;
+
+    // Network stack profile
+    kapi.net_prof = net_get_prof;
+
+    // DNS without waiting
+    kapi.dns_lookup = dns_lookup;
+
+    // Sleeping network waits and poll
+    kapi.tcp_recv_wait = tcp_recv_wait;
+    kapi.tcp_accept_wait = tcp_accept_wait;
+    kapi.tls_recv_wait = tls_recv_wait;
+    kapi.poll = kapi_poll;
+    kapi.poll_wake = kapi_poll_wake;
 }
@@ -25,6 +25,7 @@
 #include "net.h"
 #include "ttf.h"
 #include "klog.h"
+#include "smp.h"
 #include "hal/hal.h"
 
 // UART functions now use HAL
@@ -60,6 +61,10 @@ void kernel_main(void) {
     uart_putc('\r');
     uart_putc('\n');
 
+    // Per-CPU state for the boot core (current_process lives there, and
+    // exception handlers may look at it)
+    process_cpu_init(0);
+
     // Initialize kernel log first (static buffer, no malloc needed)
     klog_init();
 
@@ -87,8 +92,10 @@ void kernel_main(void) {
     printf("[DEBUG] D-Cache (C bit): %s\n", (sctlr & 4) ? "ENABLED" : "DISABLED");
     printf("[DEBUG] I-Cache (I bit): %s\n", (sctlr & (1 << 12)) ? "ENABLED" : "DISABLED");
     printf("[DEBUG] Framebuffer at: 0x%lx\n", (uint64_t)fb_base);
+#ifdef TARGET_PI
     printf("[DEBUG] FB in cached region: %s\n",
            ((uint64_t)fb_base < 0x3E000000) ? "YES" : "NO (device memory!)");
+#endif
 
 #ifdef TARGET_PI
     // Try enabling D-cache now that everything is initialized
@@ -144,6 +151,9 @@ void kernel_main(void) {
     free(test2);
     printf("       Freed allocations. Free: %lu MB\n", memory_free() / 1024 / 1024);
 
+    // memset/memcpy bandwidth to the kernel log - caches are on by now
+    memory_bandwidth_bench();
+
     // Splash screen
     console_set_color(COLOR_GREEN, COLOR_BLACK);
     console_puts("  _   _ _ _          ___  ____  \n");
@@ -231,6 +241,14 @@ void kernel_main(void) {
     // Initialize block device (for persistent storage)
 #ifdef TARGET_QEMU
     virtio_blk_init();
+
+    // Register block IRQ handler - requests complete through it
+    uint32_t blk_irq = virtio_blk_get_irq();
+    if (blk_irq > 0) {
+        irq_register_handler(blk_irq, virtio_blk_irq_handler);
+        irq_enable_irq(blk_irq);
+        printf("[KERNEL] Block IRQ %d registered\n", blk_irq);
+    }
 #else
     // For Pi, use HAL block device (EMMC/SD card)
     if (hal_blk_init() < 0) {
@@ -245,16 +263,17 @@ void kernel_main(void) {
     // Initialize network device
     virtio_net_init();
 
-    // Register network IRQ handler
+    // Initialize network stack (IP, ARP, ICMP)
+    net_init();
+
+    // Register network IRQ handler - it runs the stack on received frames,
+    // so only once the stack is set up
     uint32_t net_irq = virtio_net_get_irq();
     if (net_irq > 0) {
-        irq_register_handler(net_irq, virtio_net_irq_handler);
+        irq_register_handler(net_irq, net_irq_handler);
         irq_enable_irq(net_irq);
         printf("[KERNEL] Network IRQ %d registered\n", net_irq);
     }
-
-    // Initialize network stack (IP, ARP, ICMP)
-    net_init();
 #endif
 
     // Initialize filesystem (will use FAT32 if disk available)
@@ -283,6 +302,9 @@ void kernel_main(void) {
 #endif
     // Pi: interrupts already enabled before USB init
 
+    // Release the other cores into the scheduler
+    smp_init();
+
     printf("\n");
     printf("[KERNEL] Starting shell...\n");
 
@@ -1,15 +1,33 @@
 /*
  * VibeOS Memory Management
  *
- * Simple first-fit heap allocator. Not the fastest, but easy to understand.
- * Each allocation has a header with size and free flag.
+ * Two-tier heap allocator, O(1) malloc and free in the common case:
+ *
+ * - Small requests (<= 1KB) are served from per-size-class slabs. A slab is
+ *   a 16KB chunk carved into equal slots with an intrusive free list, so
+ *   malloc/free are just a pointer pop/push.
+ *
+ * - Larger requests (and the slabs themselves) come from a segregated-fit
+ *   allocator with boundary tags. Free blocks sit in power-of-two bins that
+ *   are split into 8 sub-bins; two bitmaps find a big-enough bin without
+ *   scanning. Each block header records the size of the previous block when
+ *   that block is free, so free() coalesces with both neighbours directly.
  *
  * RAM is detected at runtime by parsing the Device Tree Blob (DTB).
+ * One IRQ-save spinlock covers the whole heap - every path under it is
+ * short and O(1).
+ *
+ * The program area between the heap and the kernel stack is managed
+ * separately, as a sorted list of free extents in 64KB granules. Each
+ * process takes one region for its image and stack and hands it back
+ * when the slot is freed.
  */
 
 #include "memory.h"
 #include "dtb.h"
 #include "printf.h"
+#include "string.h"
+#include "spinlock.h"
 
 // Detected RAM info (populated by memory_init)
 uint64_t ram_base;
@@ -19,23 +37,86 @@ uint64_t ram_size;
 uint64_t heap_start;
 uint64_t heap_end;
 
-// Block header - sits before each allocation
+// Program area bounds
+static uint64_t prog_start;
+static uint64_t prog_end;
+
+struct slab;
+
+// Block header - sits before every allocation (large blocks and slab slots)
 typedef struct block_header {
-    size_t size;                    // Size of data area (not including header)
-    uint8_t is_free;                // 1 if block is free, 0 if allocated
-    struct block_header *next;      // Next block in list
+    union {
+        size_t prev_size;           // Large block: size of previous block (only valid if it's free)
+        struct slab *slab;          // Slab slot: slab this slot belongs to
+    };
+    size_t size;                    // Block size including header, low bits are flags
 } block_header_t;
 
+// Flag bits stored in the low bits of block_header_t.size (sizes are 16-aligned)
+#define BLOCK_USED       0x1        // Block is allocated
+#define BLOCK_PREV_USED  0x2        // Previous block in memory is allocated
+#define BLOCK_SLAB       0x4        // Slot inside a slab (not a large block)
+#define BLOCK_SIZE_MASK  (~(size_t)0xF)
+
 #define HEADER_SIZE sizeof(block_header_t)
 #define ALIGN_UP(x, align) (((x) + ((align) - 1)) & ~((align) - 1))
 
-static block_header_t *free_list = NULL;
+// Free large blocks keep their list links in the (otherwise unused) payload
+typedef struct free_block {
+    block_header_t header;
+    struct free_block *next_free;
+    struct free_block *prev_free;
+} free_block_t;
+
+#define MIN_BLOCK_SIZE   sizeof(free_block_t)
+
+// Segregated free lists: first level = floor(log2(size)), second level
+// splits each power of two into SL_COUNT linear sub-ranges
+#define SL_BITS   3
+#define SL_COUNT  (1 << SL_BITS)
+#define FL_COUNT  40
+
+static free_block_t *free_lists[FL_COUNT][SL_COUNT];
+static uint64_t fl_bitmap;              // Bit n set: some sub-bin of first level n is non-empty
+static uint8_t sl_bitmap[FL_COUNT];     // Bit n set: free_lists[fl][n] is non-empty
+
+// Slab allocator for small objects
+#define SLAB_SIZE        (16 * 1024)
+#define SLAB_MAX_OBJECT  1024
+
+typedef struct slab {
+    struct slab *next;              // Partial list links (slabs with free slots)
+    struct slab *prev;
+    block_header_t *free_slots;     // Freed slots, linked through their payload
+    uint8_t *carve;                 // Next never-used slot
+    uint8_t *end;                   // End of slot area
+    uint16_t used;                  // Slots currently allocated
+    uint16_t total;                 // Slots in this slab
+    uint8_t cls;                    // Size class index
+} slab_t;
+
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(slab_t), 16)
+
+// Slot payload sizes - chosen so internal waste stays under ~25%
+static const uint16_t slab_class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024
+};
+#define SLAB_CLASSES (sizeof(slab_class_size) / sizeof(slab_class_size[0]))
+
+// Size -> class lookup, indexed by (size - 1) / 16
+static uint8_t slab_class_lut[SLAB_MAX_OBJECT / 16];
+
+static slab_t *slab_partial[SLAB_CLASSES];
 
 // O(1) counters - updated on malloc/free instead of scanning
-static size_t stat_used = 0;      // Total bytes in use (including headers)
-static size_t stat_free = 0;      // Total bytes free
+static size_t stat_used = 0;      // Bytes in live allocations and slab headers
+static size_t stat_free = 0;      // Bytes in free large blocks and free slab slots
 static int stat_alloc_count = 0;  // Number of active allocations
 
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
 // Defined in linker script - end of BSS in RAM
 // Declared as char[] so the symbol name gives the address directly
 extern char _bss_end[];
@@ -52,6 +133,405 @@ extern char _bss_end[];
 // Leave some room below stack for safety (1MB)
 #define STACK_BUFFER (1 * 1024 * 1024)
 
+#ifndef TARGET_PI
+// boot.S identity-maps only the first 1GB of RAM (L1[1]); the rest is
+// added here as more 1GB blocks, same attributes
+extern uint64_t page_table_l1[512];
+#define L1_BLOCK_SIZE   0x40000000ULL
+#define L1_BLOCK_NORMAL 0x705           // Normal Cacheable, Inner Shareable, AF
+
+static void map_ram(void) {
+    uint64_t end = ram_base + ram_size;
+    if (end > 512 * L1_BLOCK_SIZE) end = 512 * L1_BLOCK_SIZE;  // 39-bit VA
+
+    for (uint64_t pa = ram_base & ~(L1_BLOCK_SIZE - 1); pa < end; pa += L1_BLOCK_SIZE) {
+        uint64_t *entry = &page_table_l1[pa / L1_BLOCK_SIZE];
+        if (*entry == 0) *entry = pa | L1_BLOCK_NORMAL;
+    }
+
+    // Only invalid entries changed, and those are never held in the TLB,
+    // so making the stores visible to the table walker is enough
+    asm volatile("dsb ishst; isb" ::: "memory");
+}
+#endif
+
+// ============================================================================
+// Large block allocator (segregated fit + boundary tags)
+// ============================================================================
+
+static inline size_t block_size(block_header_t *b) {
+    return b->size & BLOCK_SIZE_MASK;
+}
+
+static inline block_header_t *block_next(block_header_t *b) {
+    return (block_header_t *)((uint8_t *)b + block_size(b));
+}
+
+// Map a block size to its (first level, second level) bin
+static inline void bin_index(size_t size, int *fl, int *sl) {
+    int f = 63 - __builtin_clzl(size);
+    *fl = f;
+    *sl = (int)(size >> (f - SL_BITS)) & (SL_COUNT - 1);
+}
+
+static void bin_insert(free_block_t *b) {
+    int fl, sl;
+    bin_index(block_size(&b->header), &fl, &sl);
+
+    b->prev_free = NULL;
+    b->next_free = free_lists[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    free_lists[fl][sl] = b;
+
+    fl_bitmap |= 1ULL << fl;
+    sl_bitmap[fl] |= 1 << sl;
+}
+
+static void bin_remove(free_block_t *b) {
+    int fl, sl;
+    bin_index(block_size(&b->header), &fl, &sl);
+
+    if (b->prev_free) {
+        b->prev_free->next_free = b->next_free;
+    } else {
+        free_lists[fl][sl] = b->next_free;
+    }
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1 << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+// Find a free block of at least `size` bytes without scanning.
+// Rounds the request up to the next sub-bin boundary so any block in the
+// chosen bin is guaranteed to fit.
+static free_block_t *bin_find(size_t size) {
+    int f = 63 - __builtin_clzl(size);
+    size_t rounded = size + (((size_t)1 << (f - SL_BITS)) - 1);
+
+    int fl, sl;
+    bin_index(rounded, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint64_t fl_map = (fl + 1 < FL_COUNT) ? (fl_bitmap & (~0ULL << (fl + 1))) : 0;
+        if (!fl_map) return NULL;
+        fl = __builtin_ctzl(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return free_lists[fl][sl];
+}
+
+// Mark the block after `b` as having a free predecessor of `size` bytes
+static inline void block_set_free_footer(block_header_t *b, size_t size) {
+    block_header_t *next = (block_header_t *)((uint8_t *)b + size);
+    next->prev_size = size;
+    next->size &= ~(size_t)BLOCK_PREV_USED;
+}
+
+// Split `b` (already removed from the bins) down to `size` bytes if the
+// remainder is big enough to be a block of its own
+static void block_trim(block_header_t *b, size_t size) {
+    size_t total = block_size(b);
+    if (total - size < MIN_BLOCK_SIZE) return;
+
+    block_header_t *rest = (block_header_t *)((uint8_t *)b + size);
+    size_t rest_size = total - size;
+    rest->size = rest_size | BLOCK_PREV_USED;
+    block_set_free_footer(rest, rest_size);
+    bin_insert((free_block_t *)rest);
+
+    b->size = size | (b->size & ~BLOCK_SIZE_MASK);
+    stat_free += rest_size;
+}
+
+// Allocate a large block of `size` bytes (header included, 16-aligned)
+static block_header_t *large_alloc(size_t size) {
+    free_block_t *fb = bin_find(size);
+    if (!fb) return NULL;
+
+    block_header_t *b = &fb->header;
+    bin_remove(fb);
+    stat_free -= block_size(b);
+
+    b->size |= BLOCK_USED;
+    block_trim(b, size);
+    block_next(b)->size |= BLOCK_PREV_USED;
+    return b;
+}
+
+static void large_free(block_header_t *b) {
+    size_t size = block_size(b);
+    stat_free += size;
+
+    // Coalesce with the following block
+    block_header_t *next = block_next(b);
+    if (!(next->size & BLOCK_USED)) {
+        bin_remove((free_block_t *)next);
+        size += block_size(next);
+    }
+
+    // Coalesce with the preceding block (its size is in our header)
+    if (!(b->size & BLOCK_PREV_USED)) {
+        block_header_t *prev = (block_header_t *)((uint8_t *)b - b->prev_size);
+        bin_remove((free_block_t *)prev);
+        size += block_size(prev);
+        b = prev;
+    }
+
+    b->size = size | (b->size & BLOCK_PREV_USED);
+    block_set_free_footer(b, size);
+    bin_insert((free_block_t *)b);
+}
+
+// ============================================================================
+// Slab allocator (small objects)
+// ============================================================================
+
+static void slab_list_add(slab_t *s) {
+    s->prev = NULL;
+    s->next = slab_partial[s->cls];
+    if (s->next) s->next->prev = s;
+    slab_partial[s->cls] = s;
+}
+
+static void slab_list_remove(slab_t *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        slab_partial[s->cls] = s->next;
+    }
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+// Bytes of a slab's backing block that no slot can use (slab header and
+// the tail after the last slot). Counted as used so used + free always
+// covers the whole heap.
+static size_t slab_overhead(slab_t *s) {
+    block_header_t *b = (block_header_t *)((uint8_t *)s - HEADER_SIZE);
+    return block_size(b) - (size_t)s->total * (HEADER_SIZE + slab_class_size[s->cls]);
+}
+
+static slab_t *slab_create(int cls) {
+    block_header_t *b = large_alloc(SLAB_SIZE);
+    if (!b) return NULL;
+
+    slab_t *s = (slab_t *)((uint8_t *)b + HEADER_SIZE);
+    size_t stride = HEADER_SIZE + slab_class_size[cls];
+    s->free_slots = NULL;
+    s->carve = (uint8_t *)s + SLAB_HEADER_SIZE;
+    s->end = (uint8_t *)b + SLAB_SIZE;
+    s->used = 0;
+    s->total = (uint16_t)((size_t)(s->end - s->carve) / stride);
+    s->cls = (uint8_t)cls;
+    slab_list_add(s);
+
+    // large_alloc took the block out of stat_free; its slots are free again
+    size_t overhead = slab_overhead(s);
+    stat_used += overhead;
+    stat_free += block_size(b) - overhead;
+    return s;
+}
+
+static void *slab_alloc(size_t size) {
+    int cls = slab_class_lut[(size - 1) >> 4];
+    slab_t *s = slab_partial[cls];
+    if (!s) {
+        s = slab_create(cls);
+        if (!s) return NULL;
+    }
+
+    block_header_t *slot = s->free_slots;
+    if (slot) {
+        s->free_slots = *(block_header_t **)(slot + 1);
+    } else {
+        // Slots are carved lazily so creating a slab stays O(1)
+        size_t stride = HEADER_SIZE + slab_class_size[cls];
+        slot = (block_header_t *)s->carve;
+        s->carve += stride;
+        slot->slab = s;
+        slot->size = stride | BLOCK_SLAB;
+    }
+
+    slot->size |= BLOCK_USED;
+    if (++s->used == s->total) {
+        slab_list_remove(s);
+    }
+
+    stat_used += block_size(slot);
+    stat_free -= block_size(slot);
+    return (void *)(slot + 1);
+}
+
+static void slab_free(block_header_t *slot) {
+    slab_t *s = slot->slab;
+
+    stat_used -= block_size(slot);
+    stat_free += block_size(slot);
+    slot->size &= ~(size_t)BLOCK_USED;
+    *(block_header_t **)(slot + 1) = s->free_slots;
+    s->free_slots = slot;
+
+    if (s->used-- == s->total) {
+        // Was full - make it available again
+        slab_list_add(s);
+    }
+
+    // Keep one empty slab per class around to avoid thrashing at the
+    // boundary, hand any others back to the large allocator
+    if (s->used == 0 && (s->next || s->prev)) {
+        slab_list_remove(s);
+        block_header_t *b = (block_header_t *)((uint8_t *)s - HEADER_SIZE);
+        size_t overhead = slab_overhead(s);
+        stat_used -= overhead;
+        stat_free -= block_size(b) - overhead;  // large_free adds it all back
+        large_free(b);
+    }
+}
+
+// ============================================================================
+// Program area
+// ============================================================================
+
+// Free extents, sorted by address and never adjacent (free() merges them).
+// Every live region can split at most one extent, so a few per process
+// slot is plenty.
+#define PROG_MAX_EXTENTS 64
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} prog_extent_t;
+
+static prog_extent_t prog_free_list[PROG_MAX_EXTENTS];
+static int prog_extents;
+static uint64_t prog_free_bytes;
+static spinlock_t prog_lock = SPINLOCK_INIT;
+
+static void prog_area_init(uint64_t start, uint64_t end) {
+    prog_start = start;
+    prog_end = end > start ? end : start;
+    prog_extents = 0;
+    prog_free_bytes = prog_end - prog_start;
+    if (prog_free_bytes) {
+        prog_free_list[0].base = prog_start;
+        prog_free_list[0].size = prog_free_bytes;
+        prog_extents = 1;
+    }
+}
+
+static void prog_remove_extent(int i) {
+    for (; i < prog_extents - 1; i++) {
+        prog_free_list[i] = prog_free_list[i + 1];
+    }
+    prog_extents--;
+}
+
+uint64_t prog_alloc(uint64_t size) {
+    if (size == 0) return 0;
+    size = ALIGN_UP(size, PROG_GRANULE);
+
+    uint64_t flags = spin_lock_irqsave(&prog_lock);
+
+    // Best fit keeps the big extents whole for big programs
+    int best = -1;
+    for (int i = 0; i < prog_extents; i++) {
+        if (prog_free_list[i].size >= size &&
+            (best < 0 || prog_free_list[i].size < prog_free_list[best].size)) {
+            best = i;
+            if (prog_free_list[i].size == size) break;
+        }
+    }
+
+    uint64_t base = 0;
+    if (best >= 0) {
+        prog_extent_t *e = &prog_free_list[best];
+        base = e->base;
+        e->base += size;
+        e->size -= size;
+        if (e->size == 0) prog_remove_extent(best);
+        prog_free_bytes -= size;
+    }
+
+    spin_unlock_irqrestore(&prog_lock, flags);
+    return base;
+}
+
+void prog_free(uint64_t base, uint64_t size) {
+    if (base == 0 || size == 0) return;
+    size = ALIGN_UP(size, PROG_GRANULE);
+
+    if (base < prog_start || base + size > prog_end) {
+        printf("[MEM] prog_free: 0x%lx+0x%lx outside program area\n", base, size);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&prog_lock);
+
+    // First extent above the region
+    int i = 0;
+    while (i < prog_extents && prog_free_list[i].base < base) i++;
+
+    prog_extent_t *prev = i > 0 ? &prog_free_list[i - 1] : NULL;
+    prog_extent_t *next = i < prog_extents ? &prog_free_list[i] : NULL;
+
+    if ((prev && prev->base + prev->size > base) ||
+        (next && base + size > next->base)) {
+        spin_unlock_irqrestore(&prog_lock, flags);
+        printf("[MEM] prog_free: double free of 0x%lx\n", base);
+        return;
+    }
+
+    int join_prev = prev && prev->base + prev->size == base;
+    int join_next = next && base + size == next->base;
+
+    if (join_prev && join_next) {
+        prev->size += size + next->size;
+        prog_remove_extent(i);
+    } else if (join_prev) {
+        prev->size += size;
+    } else if (join_next) {
+        next->base = base;
+        next->size += size;
+    } else if (prog_extents < PROG_MAX_EXTENTS) {
+        for (int j = prog_extents; j > i; j--) {
+            prog_free_list[j] = prog_free_list[j - 1];
+        }
+        prog_free_list[i].base = base;
+        prog_free_list[i].size = size;
+        prog_extents++;
+    } else {
+        // Can't happen with MAX_PROCESSES slots, but don't corrupt the list
+        spin_unlock_irqrestore(&prog_lock, flags);
+        printf("[MEM] prog_free: extent list full, leaking 0x%lx\n", size);
+        return;
+    }
+    prog_free_bytes += size;
+
+    spin_unlock_irqrestore(&prog_lock, flags);
+}
+
+uint64_t prog_area_start(void) {
+    return prog_start;
+}
+
+uint64_t prog_area_size(void) {
+    return prog_end - prog_start;
+}
+
+uint64_t prog_area_free(void) {
+    return prog_free_bytes;  // Kept up to date by alloc/free
+}
+
+// ============================================================================
+// Public API
+// ============================================================================
+
 void memory_init(void) {
     // Note: Don't use printf here - console isn't initialized yet!
 
@@ -70,6 +550,9 @@ void memory_init(void) {
         ram_base = mem_info.base;
         ram_size = mem_info.size;
     }
+#ifndef TARGET_PI
+    map_ram();
+#endif
 
     // Heap starts after BSS, aligned to 16 bytes
     // Add 64KB buffer after BSS for safety
@@ -92,105 +575,110 @@ void memory_init(void) {
         heap_max = heap_start + 64 * 1024 * 1024;
     }
 
-    heap_end = heap_max;
+    heap_end = heap_max & ~0xFULL;
 
     printf("[MEM] heap: 0x%lx - 0x%lx, stack at 0x%lx\n",
            heap_start, heap_end, (uint64_t)KERNEL_STACK_TOP);
 
-    // Initialize with one giant free block
-    free_list = (block_header_t *)heap_start;
-    free_list->size = heap_end - heap_start - HEADER_SIZE;
-    free_list->is_free = 1;
-    free_list->next = NULL;
+    prog_area_init(ALIGN_UP(heap_end, PROG_GRANULE),
+                   (heap_end + program_reserve) & ~(uint64_t)(PROG_GRANULE - 1));
+
+    // Build the small size -> slab class table
+    int cls = 0;
+    for (int i = 0; i < SLAB_MAX_OBJECT / 16; i++) {
+        while (slab_class_size[cls] < (i + 1) * 16) cls++;
+        slab_class_lut[i] = (uint8_t)cls;
+    }
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_partial[i] = NULL;
+    }
+
+    // Empty bins
+    fl_bitmap = 0;
+    for (int f = 0; f < FL_COUNT; f++) {
+        sl_bitmap[f] = 0;
+        for (int s = 0; s < SL_COUNT; s++) {
+            free_lists[f][s] = NULL;
+        }
+    }
+
+    // One giant free block, followed by a zero-size "used" sentinel so
+    // coalescing never runs off the end of the heap
+    block_header_t *first = (block_header_t *)heap_start;
+    block_header_t *sentinel = (block_header_t *)(heap_end - HEADER_SIZE);
+    size_t first_size = (uint64_t)sentinel - heap_start;
+
+    first->prev_size = 0;
+    first->size = first_size | BLOCK_PREV_USED;
+    sentinel->size = 0 | BLOCK_USED;
+    block_set_free_footer(first, first_size);
+    bin_insert((free_block_t *)first);
 
     // Initialize O(1) counters
     stat_used = 0;
-    stat_free = free_list->size;
+    stat_free = first_size;
     stat_alloc_count = 0;
 }
 
-void *malloc(size_t size) {
-    if (size == 0) return NULL;
-
-    // Align size to 16 bytes
-    size = ALIGN_UP(size, 16);
-
-    block_header_t *current = free_list;
-
-    // First-fit: find first block that's big enough
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            // Found a suitable block
-            size_t old_size = current->size;
-
-            // Split if there's enough room for another block
-            if (current->size >= size + HEADER_SIZE + 16) {
-                // Create new block after this allocation
-                block_header_t *new_block = (block_header_t *)((uint8_t *)current + HEADER_SIZE + size);
-                new_block->size = current->size - size - HEADER_SIZE;
-                new_block->is_free = 1;
-                new_block->next = current->next;
-
-                current->size = size;
-                current->next = new_block;
-
-                // Update counters: we used size+header, free lost size+header
-                stat_used += size + HEADER_SIZE;
-                stat_free -= size + HEADER_SIZE;
-            } else {
-                // No split: entire block becomes used
-                stat_used += old_size + HEADER_SIZE;
-                stat_free -= old_size;
-            }
-
-            current->is_free = 0;
-            stat_alloc_count++;
-            return (void *)((uint8_t *)current + HEADER_SIZE);
-        }
-        current = current->next;
+static void *heap_alloc(size_t size) {
+    void *ptr;
+    if (size <= SLAB_MAX_OBJECT) {
+        ptr = slab_alloc(size);
+    } else {
+        size_t need = ALIGN_UP(size + HEADER_SIZE, 16);
+        if (need < size) return NULL;  // Overflow
+        block_header_t *b = large_alloc(need);
+        if (!b) return NULL;
+        stat_used += block_size(b);
+        ptr = (void *)(b + 1);
     }
 
-    // No suitable block found
-    return NULL;
+    if (ptr) stat_alloc_count++;
+    return ptr;
 }
 
-void free(void *ptr) {
-    if (ptr == NULL) return;
+static void heap_free(void *ptr) {
+    block_header_t *block = (block_header_t *)ptr - 1;
 
-    // Get header
-    block_header_t *block = (block_header_t *)((uint8_t *)ptr - HEADER_SIZE);
+    if (!(block->size & BLOCK_USED)) {
+        printf("[MEM] free: bad or double free of %p\n", ptr);
+        return;
+    }
 
-    // Update counters before marking free
-    stat_used -= block->size + HEADER_SIZE;
-    stat_free += block->size;
     stat_alloc_count--;
 
-    block->is_free = 1;
-
-    // Coalesce adjacent free blocks
-    block_header_t *current = free_list;
-    while (current != NULL) {
-        if (current->is_free && current->next != NULL && current->next->is_free) {
-            // Merge with next block - reclaim header space
-            stat_free += HEADER_SIZE;
-            current->size += HEADER_SIZE + current->next->size;
-            current->next = current->next->next;
-            // Don't advance - check if we can merge again
-        } else {
-            current = current->next;
-        }
+    if (block->size & BLOCK_SLAB) {
+        slab_free(block);
+    } else {
+        stat_used -= block_size(block);
+        block->size &= ~(size_t)BLOCK_USED;
+        large_free(block);
     }
 }
 
+void *malloc(size_t size) {
+    if (size == 0) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    void *ptr = heap_alloc(size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) return;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    heap_free(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
 void *calloc(size_t nmemb, size_t size) {
     size_t total = nmemb * size;
+    if (size != 0 && total / size != nmemb) return NULL;  // Overflow
     void *ptr = malloc(total);
     if (ptr != NULL) {
-        // Zero the memory
-        uint8_t *p = (uint8_t *)ptr;
-        for (size_t i = 0; i < total; i++) {
-            p[i] = 0;
-        }
+        memset(ptr, 0, total);
     }
     return ptr;
 }
@@ -202,23 +690,43 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    block_header_t *block = (block_header_t *)((uint8_t *)ptr - HEADER_SIZE);
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    block_header_t *block = (block_header_t *)ptr - 1;
+    size_t capacity = (block->size & BLOCK_SLAB)
+        ? slab_class_size[block->slab->cls]
+        : block_size(block) - HEADER_SIZE;
 
     // If current block is big enough, just return it
-    if (block->size >= size) {
+    if (capacity >= size) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         return ptr;
     }
 
+    // Large block: try to grow in place into a free neighbour
+    if (!(block->size & BLOCK_SLAB)) {
+        size_t need = ALIGN_UP(size + HEADER_SIZE, 16);
+        block_header_t *next = block_next(block);
+        size_t cur = block_size(block);
+        if (need > size && !(next->size & BLOCK_USED) && cur + block_size(next) >= need) {
+            bin_remove((free_block_t *)next);
+            stat_free -= block_size(next);
+            block->size = (cur + block_size(next)) | (block->size & ~BLOCK_SIZE_MASK);
+            block_trim(block, need);
+            block_next(block)->size |= BLOCK_PREV_USED;
+            stat_used += block_size(block) - cur;
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return ptr;
+        }
+    }
+
     // Otherwise allocate new block and copy
-    void *new_ptr = malloc(size);
+    void *new_ptr = heap_alloc(size);
     if (new_ptr != NULL) {
-        uint8_t *src = (uint8_t *)ptr;
-        uint8_t *dst = (uint8_t *)new_ptr;
-        for (size_t i = 0; i < block->size; i++) {
-            dst[i] = src[i];
-        }
-        free(ptr);
+        memcpy(new_ptr, ptr, capacity);
+        heap_free(ptr);
     }
+    spin_unlock_irqrestore(&heap_lock, flags);
     return new_ptr;
 }
 
@@ -247,3 +755,42 @@ uint64_t memory_get_sp(void) {
 int memory_alloc_count(void) {
     return stat_alloc_count;  // O(1) - no scanning!
 }
+
+// Memory bandwidth (memcpy/memset over buffers bigger than the caches),
+// measured once at boot and by the kernel shell's membench command. Shows at a glance whether the
+// MMU and D-cache are doing their job - uncached RAM is an order of
+// magnitude slower.
+void memory_bandwidth_bench(void) {
+    const size_t len = 4 * 1024 * 1024;
+    const int rounds = 8;
+
+    uint8_t *src = malloc(len);
+    uint8_t *dst = malloc(len);
+    if (!src || !dst) {
+        free(src);
+        free(dst);
+        return;
+    }
+
+    uint64_t freq, start, end;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    asm volatile("mrs %0, cntpct_el0" : "=r"(start));
+    for (int i = 0; i < rounds; i++) {
+        memset(dst, i, len);
+    }
+    asm volatile("mrs %0, cntpct_el0" : "=r"(end));
+    uint64_t set_mbs = (uint64_t)rounds * (len >> 20) * freq / ((end - start) ? (end - start) : 1);
+
+    asm volatile("mrs %0, cntpct_el0" : "=r"(start));
+    for (int i = 0; i < rounds; i++) {
+        memcpy(dst, src, len);
+    }
+    asm volatile("mrs %0, cntpct_el0" : "=r"(end));
+    uint64_t cpy_mbs = (uint64_t)rounds * (len >> 20) * freq / ((end - start) ? (end - start) : 1);
+
+    free(src);
+    free(dst);
+
+    printf("[BENCH] Memory bandwidth: memset %lu MB/s, memcpy %lu MB/s\n", set_mbs, cpy_mbs);
+}
@@ -19,7 +19,7 @@ extern uint64_t heap_end;
 // Initialize memory management (parses DTB to detect RAM)
 void memory_init(void);
 
-// Simple heap allocator
+// Heap allocator (slabs for small objects, segregated fit for the rest)
 void *malloc(size_t size);
 void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
@@ -33,10 +33,22 @@ size_t memory_free(void);
 uint64_t memory_heap_start(void);
 uint64_t memory_heap_end(void);
 
+// Program area: where processes are loaded and get their stacks. Regions
+// are whole 64KB granules; free takes the size that was allocated.
+#define PROG_GRANULE 0x10000
+uint64_t prog_alloc(uint64_t size);             // Returns base, 0 if no room
+void prog_free(uint64_t base, uint64_t size);
+uint64_t prog_area_start(void);
+uint64_t prog_area_size(void);
+uint64_t prog_area_free(void);
+
 // Stack info (returns current SP)
 uint64_t memory_get_sp(void);
 
 // Count allocations (for debugging)
 int memory_alloc_count(void);
 
+// memset/memcpy bandwidth over 4MB buffers, printed (and so in the kernel log)
+void memory_bandwidth_bench(void);
+
 #endif
@@ -2,23 +2,76 @@
  * VibeOS Network Stack
  *
  * Ethernet, ARP, IP, ICMP implementation
+ *
+ * Received frames are processed as they arrive: the RX interrupt runs the
+ * stack over whatever the device has queued (the bottom half), so ARP
+ * replies, ACKs and data are handled whether or not anyone is waiting.
+ *
+ * Packets travel in pbufs. Outgoing ones are built with room in front,
+ * and IP, ethernet and the driver each put their header there; incoming
+ * ones stay in the driver's buffer while each layer steps past its own.
  */
 
 #include "net.h"
 #include "virtio_net.h"
+#include "pbuf.h"
+#include "process.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "memory.h"
+#include "hal/hal.h"
 #include "printf.h"
 #include "string.h"
 
+// Frames handed over per batch - the device gets the buffers back in
+// between, so a long burst never leaves the RX ring empty
+#define NET_RX_BATCH 32
+
 // Our MAC and IP
 static uint8_t our_mac[6];
 static uint32_t our_ip = NET_IP;
 
-// ARP table
-#define ARP_TABLE_SIZE 16
+// ARP neighbour cache: entries hashed by IP. An unresolved next hop
+// holds the packets sent to it until the reply comes in.
+#define ARP_TABLE_SIZE   64
+#define ARP_HASH_BITS    5
+#define ARP_HASH_SIZE    (1 << ARP_HASH_BITS)
+#define ARP_QUEUE_MAX    8              // Packets held per unresolved next hop
+#define ARP_RETRY_MS     1000
+#define ARP_MAX_RETRIES  3              // Unanswered requests before giving up
+#define ARP_REACHABLE_MS (60 * 1000)    // How long a reply is trusted
+
+#define ARP_FREE        0
+#define ARP_INCOMPLETE  1               // Asked, no answer yet; packets wait
+#define ARP_REACHABLE   2
+#define ARP_STALE       3               // Old MAC still used while asking again
+
+typedef struct arp_entry {
+    uint32_t ip;
+    uint8_t mac[6];
+    uint8_t state;
+    uint8_t retries;                    // Requests sent since the last reply
+    uint64_t deadline;                  // Next request, or when REACHABLE ends
+    uint64_t updated;                   // For eviction: oldest goes first
+    pbuf_t *queue;                      // Waiting packets, with a reference each
+    int queued;
+    struct arp_entry *hnext;
+} arp_entry_t;
+
 static arp_entry_t arp_table[ARP_TABLE_SIZE];
+static arp_entry_t *arp_hash[ARP_HASH_SIZE];
 
-// Packet buffer
-static uint8_t pkt_buf[1600];
+// Some entry has a request out (see net_tick())
+static volatile int arp_timers_pending;
+
+// Loopback: IP packets to ourselves, queued for the bottom half
+#define NET_LO_MAX 256
+static pbuf_t *lo_head, *lo_tail;
+static int lo_count;
+
+// Per-layer cost: packets and generic counter ticks, see net_get_prof()
+static uint64_t prof_packets[NET_PROF_COUNT];
+static uint64_t prof_ticks[NET_PROF_COUNT];
 
 // Broadcast MAC
 static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
@@ -27,6 +80,7 @@ static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 static volatile int ping_received = 0;
 static volatile uint16_t ping_id = 0;
 static volatile uint16_t ping_seq = 0;
+static wait_queue_t ping_wq = WAIT_QUEUE_INIT;
 
 // UDP listener table
 #define UDP_MAX_LISTENERS 8
@@ -56,6 +110,109 @@ static inline uint32_t ntohl(uint32_t x) {
     return htonl(x);
 }
 
+// Stack lock. Every public entry point takes it, and the bottom half runs
+// under it. Like the VFS lock it is held with IRQs on and only preemption
+// off, so the RX IRQ can land on the holder's core; the handler then leaves
+// the frames to the holder, which drains the RX ring before letting go.
+static spinlock_t net_spin = SPINLOCK_INIT;
+static volatile int net_owner = -1;
+static int net_depth = 0;
+
+static void net_rx_frame(pbuf_t *p);
+static void ip_input(pbuf_t *p);
+static int ip_output(pbuf_t *p, uint32_t dst_ip, uint8_t protocol);
+static void arp_send(uint16_t op, const uint8_t *dst_mac, uint32_t tpa);
+static void tcp_unreachable(uint32_t next_hop);
+
+static inline uint64_t prof_now(void) {
+    uint64_t t;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(t) :: "memory");
+    return t;
+}
+
+static inline void prof_add(int layer, uint64_t start, uint64_t packets) {
+    prof_ticks[layer] += prof_now() - start;
+    prof_packets[layer] += packets;
+}
+
+// Absolute deadline for a wait of timeout_ms
+static uint64_t net_deadline(uint32_t timeout_ms) {
+    if (timeout_ms == NET_WAIT_FOREVER) return HAL_TIMER_NEVER;
+    return hal_get_time_ns() + timeout_ms * 1000000ULL;
+}
+
+// Deliver what is queued on the loopback. Returns packets handled.
+static int lo_drain(void) {
+    int n = 0;
+    while (lo_head) {
+        pbuf_t *p = lo_head;
+        lo_head = p->next;
+        if (!lo_head) lo_tail = NULL;
+        p->next = NULL;
+        lo_count--;
+        ip_input(p);
+        pbuf_free(p);
+        n++;
+    }
+    return n;
+}
+
+// Run the driver's RX ring through the stack, a batch at a time
+static int net_rx_drain(void) {
+    uint64_t start = prof_now();
+    int n = virtio_net_rx_batch(net_rx_frame, NET_RX_BATCH);
+    if (n > 0) prof_add(NET_PROF_RX_DEV, start, n);
+    return n;
+}
+
+static void net_lock(void) {
+    preempt_disable();
+    int cpu = cpu_this()->id;
+    if (net_owner == cpu) {
+        net_depth++;
+        return;
+    }
+    spin_lock(&net_spin);
+    net_owner = cpu;
+    net_depth = 1;
+}
+
+// Run the bottom half, tell the device about what was sent meanwhile and
+// drop the lock. A frame that lands after the drain found the lock still
+// taken, so look once more after letting go.
+static void net_release(void) {
+    int cpu = cpu_this()->id;
+    while (1) {
+        while (lo_drain() + net_rx_drain() > 0) {
+        }
+        virtio_net_tx_flush();
+        net_owner = -1;
+        net_depth = 0;
+        spin_unlock(&net_spin);
+
+        if ((!virtio_net_has_packet() && !lo_head) || !spin_trylock(&net_spin)) break;
+        net_owner = cpu;
+        net_depth = 1;
+    }
+}
+
+static void net_unlock(void) {
+    if (net_depth > 1) net_depth--;
+    else net_release();
+    preempt_enable();
+}
+
+void net_irq_handler(void) {
+    virtio_net_irq_ack();
+
+    // Whoever holds the lock drains the ring on the way out
+    int cpu = cpu_this()->id;
+    if (net_owner == cpu || !spin_trylock(&net_spin)) return;
+    net_owner = cpu;
+    net_depth = 1;
+    net_release();
+}
+
 // IP to string (static buffer - not thread safe, but we're single-threaded)
 static char ip_str_buf[16];
 const char *ip_to_str(uint32_t ip) {
@@ -86,8 +243,13 @@ void net_init(void) {
 
     // Clear ARP table
     memset(arp_table, 0, sizeof(arp_table));
+    memset(arp_hash, 0, sizeof(arp_hash));
 
     printf("[NET] Stack initialized, IP=%s\n", ip_to_str(our_ip));
+
+    // Gratuitous ARP: whoever has our IP cached with another MAC updates
+    // it, and a machine already using the address would answer
+    arp_send(ARP_OP_REQUEST, broadcast_mac, our_ip);
 }
 
 uint32_t net_get_ip(void) {
@@ -98,81 +260,233 @@ void net_get_mac(uint8_t *mac) {
     memcpy(mac, our_mac, 6);
 }
 
-// Send ethernet frame
-int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len) {
-    if (len > NET_MTU - sizeof(eth_header_t)) {
+// Put the ethernet header in front of p and send it (under the lock)
+static int eth_output(pbuf_t *p, const uint8_t *dst_mac, uint16_t ethertype) {
+    if (p->len > NET_MTU - sizeof(eth_header_t) && !p->gso_size) {
         return -1;
     }
 
-    // Build frame
-    eth_header_t *eth = (eth_header_t *)pkt_buf;
+    uint64_t start = prof_now();
+    eth_header_t *eth = pbuf_push(p, sizeof(eth_header_t));
+    if (!eth) return -1;
     memcpy(eth->dst, dst_mac, 6);
     memcpy(eth->src, our_mac, 6);
     eth->ethertype = htons(ethertype);
 
-    memcpy(pkt_buf + sizeof(eth_header_t), data, len);
+    uint64_t dev_start = prof_now();
+    int ret = virtio_net_send(p);
+    prof_add(NET_PROF_TX_DEV, dev_start, 1);
+    pbuf_pull(p, sizeof(eth_header_t));
+    prof_add(NET_PROF_TX_ETH, start, 1);
+    return ret;
+}
 
-    return virtio_net_send(pkt_buf, sizeof(eth_header_t) + len);
+// Send ethernet frame
+int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len) {
+    net_lock();
+    pbuf_t *p = pbuf_alloc(len);
+    if (!p) {
+        net_unlock();
+        return -1;
+    }
+    memcpy(p->payload, data, len);
+    int ret = eth_output(p, dst_mac, ethertype);
+    pbuf_free(p);
+    net_unlock();
+    return ret;
 }
 
-// ARP table lookup
-const uint8_t *arp_lookup(uint32_t ip) {
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid && arp_table[i].ip == ip) {
-            return arp_table[i].mac;
-        }
+static inline uint32_t arp_hashfn(uint32_t ip) {
+    return (ip * 0x9e3779b1u) >> (32 - ARP_HASH_BITS);
+}
+
+static arp_entry_t *arp_find(uint32_t ip) {
+    for (arp_entry_t *e = arp_hash[arp_hashfn(ip)]; e; e = e->hnext) {
+        if (e->ip == ip) return e;
     }
     return NULL;
 }
 
-// Add/update ARP entry
-static void arp_add(uint32_t ip, const uint8_t *mac) {
-    // Check if already exists
-    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (arp_table[i].valid && arp_table[i].ip == ip) {
-            memcpy(arp_table[i].mac, mac, 6);
-            return;
-        }
+// Drop an entry and whatever was waiting on it
+static void arp_remove(arp_entry_t *e) {
+    arp_entry_t **pp = &arp_hash[arp_hashfn(e->ip)];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    while (e->queue) {
+        pbuf_t *p = e->queue;
+        e->queue = p->next;
+        p->next = NULL;
+        pbuf_free(p);
     }
+    e->queued = 0;
+    e->state = ARP_FREE;
+}
 
-    // Find free slot
+// New entry for ip: a free one, else the one updated longest ago
+static arp_entry_t *arp_new(uint32_t ip, uint8_t state) {
+    arp_entry_t *e = NULL;
     for (int i = 0; i < ARP_TABLE_SIZE; i++) {
-        if (!arp_table[i].valid) {
-            arp_table[i].ip = ip;
-            memcpy(arp_table[i].mac, mac, 6);
-            arp_table[i].valid = 1;
-            printf("[ARP] Added %s -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   ip_to_str(ip), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-            return;
+        arp_entry_t *c = &arp_table[i];
+        if (c->state == ARP_FREE) {
+            e = c;
+            break;
         }
+        if (!e || c->updated < e->updated) e = c;
     }
-
-    // Table full - overwrite first entry (simple LRU)
-    arp_table[0].ip = ip;
-    memcpy(arp_table[0].mac, mac, 6);
-    arp_table[0].valid = 1;
+    if (e->state != ARP_FREE) arp_remove(e);
+
+    e->ip = ip;
+    e->state = state;
+    e->retries = 0;
+    e->deadline = 0;
+    e->updated = hal_get_time_ns();
+    e->queue = NULL;
+    e->queued = 0;
+    uint32_t h = arp_hashfn(ip);
+    e->hnext = arp_hash[h];
+    arp_hash[h] = e;
+    return e;
 }
 
-// Send ARP request
-void arp_request(uint32_t ip) {
+// Send an ARP packet about us: a request for tpa (broadcast), or a reply
+// to dst_mac
+static void arp_send(uint16_t op, const uint8_t *dst_mac, uint32_t tpa) {
     arp_packet_t arp;
     arp.htype = htons(1);        // Ethernet
     arp.ptype = htons(0x0800);   // IPv4
     arp.hlen = 6;
     arp.plen = 4;
-    arp.oper = htons(ARP_OP_REQUEST);
+    arp.oper = htons(op);
     memcpy(arp.sha, our_mac, 6);
 
     // Convert our IP to network byte order
     uint32_t our_ip_net = htonl(our_ip);
     memcpy(arp.spa, &our_ip_net, 4);
 
-    memset(arp.tha, 0, 6);       // Unknown
-    uint32_t ip_net = htonl(ip);
+    if (op == ARP_OP_REQUEST) memset(arp.tha, 0, 6);    // Unknown
+    else memcpy(arp.tha, dst_mac, 6);
+    uint32_t ip_net = htonl(tpa);
     memcpy(arp.tpa, &ip_net, 4);
 
+    eth_send(dst_mac, ETH_TYPE_ARP, &arp, sizeof(arp));
+}
+
+// Ask for ip again and have net_tick() follow it up
+static void arp_solicit(arp_entry_t *e, uint64_t now) {
+    e->retries++;
+    e->deadline = now + ARP_RETRY_MS * 1000000ULL;
+    arp_request(e->ip);
+
+    arp_timers_pending = 1;
+    __sync_synchronize();
+    hal_timer_start_housekeeping();
+}
+
+// MAC to send p to next_hop with (under the lock). If it isn't known yet,
+// p waits on the entry - with a reference of its own, as it is - and is
+// sent when the reply comes in; returns NULL then.
+static const uint8_t *arp_output(uint32_t next_hop, pbuf_t *p) {
+    uint64_t now = hal_get_time_ns();
+    arp_entry_t *e = arp_find(next_hop);
+    if (!e) {
+        e = arp_new(next_hop, ARP_INCOMPLETE);
+        arp_solicit(e, now);
+    }
+
+    if (e->state == ARP_REACHABLE && now >= e->deadline) {
+        // Not heard from in a while: keep using it, but check
+        e->state = ARP_STALE;
+        e->retries = 0;
+        arp_solicit(e, now);
+    }
+    if (e->state != ARP_INCOMPLETE) return e->mac;
+
+    // Full queue: the oldest packet goes, like a loss on the wire
+    if (e->queued >= ARP_QUEUE_MAX) {
+        pbuf_t *old = e->queue;
+        e->queue = old->next;
+        old->next = NULL;
+        pbuf_free(old);
+        e->queued--;
+    }
+    pbuf_ref(p);
+    pbuf_t **pp = &e->queue;
+    while (*pp) pp = &(*pp)->next;
+    *pp = p;
+    e->queued++;
+    return NULL;
+}
+
+// A MAC for ip, from a reply or a request. Existing entries are always
+// updated; a new one is made only when the packet was meant for us
+// (RFC 826), so broadcasts on the segment don't churn the table.
+static void arp_update(uint32_t ip, const uint8_t *mac, int for_us) {
+    arp_entry_t *e = arp_find(ip);
+    if (!e) {
+        if (!for_us) return;
+        e = arp_new(ip, ARP_REACHABLE);
+        printf("[ARP] Added %s -> %02x:%02x:%02x:%02x:%02x:%02x\n",
+               ip_to_str(ip), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+
+    uint64_t now = hal_get_time_ns();
+    memcpy(e->mac, mac, 6);
+    e->state = ARP_REACHABLE;
+    e->retries = 0;
+    e->deadline = now + ARP_REACHABLE_MS * 1000000ULL;
+    e->updated = now;
+
+    // Send what was waiting, in order
+    while (e->queue) {
+        pbuf_t *p = e->queue;
+        e->queue = p->next;
+        p->next = NULL;
+        e->queued--;
+        eth_output(p, e->mac, ETH_TYPE_IP);
+        pbuf_free(p);
+    }
+}
+
+// Follow up requests that got no answer. Returns whether any are still
+// out.
+static int arp_tick(uint64_t now) {
+    int pending = 0;
+    for (int i = 0; i < ARP_TABLE_SIZE; i++) {
+        arp_entry_t *e = &arp_table[i];
+        if (e->state != ARP_INCOMPLETE && e->state != ARP_STALE) continue;
+
+        if (now >= e->deadline) {
+            if (e->retries >= ARP_MAX_RETRIES) {
+                // Gone. Connections still waiting to open towards it fail.
+                uint32_t ip = e->ip;
+                int incomplete = e->state == ARP_INCOMPLETE;
+                printf("[ARP] No reply from %s\n", ip_to_str(ip));
+                arp_remove(e);
+                if (incomplete) tcp_unreachable(ip);
+                continue;
+            }
+            arp_solicit(e, now);
+        }
+        pending = 1;
+    }
+    return pending;
+}
+
+// ARP table lookup
+const uint8_t *arp_lookup(uint32_t ip) {
+    const uint8_t *mac = NULL;
+    net_lock();
+    arp_entry_t *e = arp_find(ip);
+    if (e && e->state != ARP_INCOMPLETE) mac = e->mac;
+    net_unlock();
+    return mac;
+}
+
+// Send ARP request
+void arp_request(uint32_t ip) {
     printf("[ARP] Requesting %s\n", ip_to_str(ip));
-    eth_send(broadcast_mac, ETH_TYPE_ARP, &arp, sizeof(arp));
+    arp_send(ARP_OP_REQUEST, broadcast_mac, ip);
 }
 
 // Handle incoming ARP packet
@@ -193,28 +507,23 @@ static void arp_handle(const uint8_t *pkt, uint32_t len) {
 
     uint16_t op = ntohs(arp->oper);
 
-    // Learn sender's MAC (even if not for us)
-    arp_add(sender_ip, arp->sha);
+    if (sender_ip == our_ip) {
+        if (memcmp(arp->sha, our_mac, 6) != 0) {
+            printf("[ARP] %s is also used by %02x:%02x:%02x:%02x:%02x:%02x\n",
+                   ip_to_str(our_ip), arp->sha[0], arp->sha[1], arp->sha[2],
+                   arp->sha[3], arp->sha[4], arp->sha[5]);
+        }
+        return;
+    }
+
+    // Learn sender's MAC (new entries only if it is talking to us)
+    if (sender_ip != 0) arp_update(sender_ip, arp->sha, target_ip == our_ip);
 
     if (op == ARP_OP_REQUEST) {
         // Is this asking for our MAC?
         if (target_ip == our_ip) {
             printf("[ARP] Request for our IP from %s\n", ip_to_str(sender_ip));
-
-            // Send reply
-            arp_packet_t reply;
-            reply.htype = htons(1);
-            reply.ptype = htons(0x0800);
-            reply.hlen = 6;
-            reply.plen = 4;
-            reply.oper = htons(ARP_OP_REPLY);
-            memcpy(reply.sha, our_mac, 6);
-            uint32_t our_ip_net = htonl(our_ip);
-            memcpy(reply.spa, &our_ip_net, 4);
-            memcpy(reply.tha, arp->sha, 6);
-            memcpy(reply.tpa, arp->spa, 4);
-
-            eth_send(arp->sha, ETH_TYPE_ARP, &reply, sizeof(reply));
+            arp_send(ARP_OP_REPLY, arp->sha, sender_ip);
             printf("[ARP] Sent reply\n");
         }
     } else if (op == ARP_OP_REPLY) {
@@ -254,8 +563,9 @@ static void icmp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
         printf("[ICMP] Echo request from %s\n", ip_to_str(src_ip));
 
         // Send echo reply
-        uint8_t reply_buf[1500];
-        icmp_header_t *reply = (icmp_header_t *)reply_buf;
+        pbuf_t *p = pbuf_alloc(len);
+        if (!p) return;
+        icmp_header_t *reply = (icmp_header_t *)p->payload;
 
         reply->type = ICMP_ECHO_REPLY;
         reply->code = 0;
@@ -264,16 +574,14 @@ static void icmp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
         reply->seq = icmp->seq;
 
         // Copy data portion
-        uint32_t data_len = len - sizeof(icmp_header_t);
-        if (data_len > sizeof(reply_buf) - sizeof(icmp_header_t)) {
-            data_len = sizeof(reply_buf) - sizeof(icmp_header_t);
-        }
-        memcpy(reply_buf + sizeof(icmp_header_t), pkt + sizeof(icmp_header_t), data_len);
+        memcpy(p->payload + sizeof(icmp_header_t), pkt + sizeof(icmp_header_t),
+               len - sizeof(icmp_header_t));
 
         // Calculate checksum
-        reply->checksum = ip_checksum(reply_buf, sizeof(icmp_header_t) + data_len);
+        reply->checksum = ip_checksum(p->payload, len);
 
-        ip_send(src_ip, IP_PROTO_ICMP, reply_buf, sizeof(icmp_header_t) + data_len);
+        ip_output(p, src_ip, IP_PROTO_ICMP);
+        pbuf_free(p);
         printf("[ICMP] Sent echo reply\n");
     }
     else if (icmp->type == ICMP_ECHO_REPLY) {
@@ -283,6 +591,7 @@ static void icmp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
         // Check if this matches our pending ping
         if (ntohs(icmp->id) == ping_id && ntohs(icmp->seq) == ping_seq) {
             ping_received = 1;
+            process_wake_all(&ping_wq);
         }
     }
 }
@@ -316,68 +625,72 @@ static void udp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
 static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip);
 
 // Handle incoming IP packet
-static void ip_handle(const uint8_t *pkt, uint32_t len) {
-    if (len < sizeof(ip_header_t)) return;
+static void ip_input(pbuf_t *p) {
+    if (p->len < sizeof(ip_header_t)) return;
 
-    const ip_header_t *ip = (const ip_header_t *)pkt;
+    uint64_t start = prof_now();
+    const ip_header_t *ip = (const ip_header_t *)p->payload;
 
     // Check version
     if ((ip->version_ihl >> 4) != 4) return;
 
     // Get header length
     uint32_t ihl = (ip->version_ihl & 0x0f) * 4;
-    if (ihl < 20 || ihl > len) return;
+    uint32_t total_len = ntohs(ip->total_len);
+    if (ihl < 20 || ihl > total_len || total_len > p->len) return;
 
     // Check if it's for us
     uint32_t dst_ip = ntohl(ip->dst_ip);
     if (dst_ip != our_ip && dst_ip != 0xffffffff) return;
 
     uint32_t src_ip = ntohl(ip->src_ip);
-    uint32_t payload_len = ntohs(ip->total_len) - ihl;
-    const uint8_t *payload = pkt + ihl;
+    uint8_t protocol = ip->protocol;
+
+    // Drop ethernet padding, then step past the header
+    pbuf_trim(p, total_len);
+    pbuf_pull(p, ihl);
 
-    switch (ip->protocol) {
+    switch (protocol) {
         case IP_PROTO_ICMP:
-            icmp_handle(payload, payload_len, src_ip);
+            icmp_handle(p->payload, p->len, src_ip);
             break;
         case IP_PROTO_UDP:
-            udp_handle(payload, payload_len, src_ip);
+            udp_handle(p->payload, p->len, src_ip);
             break;
-        case IP_PROTO_TCP:
-            tcp_handle(payload, payload_len, src_ip);
+        case IP_PROTO_TCP: {
+            uint64_t tcp_start = prof_now();
+            tcp_handle(p->payload, p->len, src_ip);
+            prof_add(NET_PROF_RX_TCP, tcp_start, 1);
             break;
+        }
         default:
-            printf("[IP] Unknown protocol %d from %s\n", ip->protocol, ip_to_str(src_ip));
+            printf("[IP] Unknown protocol %d from %s\n", protocol, ip_to_str(src_ip));
             break;
     }
+    prof_add(NET_PROF_RX_IP, start, 1);
 }
 
-// Send IP packet
-int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
-    if (len > NET_MTU - sizeof(eth_header_t) - sizeof(ip_header_t)) {
-        return -1;
-    }
-
-    // Determine next hop MAC
-    const uint8_t *dst_mac;
-    uint32_t next_hop = dst_ip;
-
-    // If destination is not on local network, use gateway
+// Where a packet to dst_ip goes first: the gateway unless it is on the
+// local network
+static uint32_t ip_next_hop(uint32_t dst_ip) {
     if ((dst_ip & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
+        return NET_GATEWAY;
     }
+    return dst_ip;
+}
 
-    dst_mac = arp_lookup(next_hop);
-    if (!dst_mac) {
-        // Need to ARP first
-        printf("[IP] No ARP entry for %s, sending request\n", ip_to_str(next_hop));
-        arp_request(next_hop);
-        return -1;  // Caller should retry
+// Put the IP header in front of p and send it on (under the lock). p is
+// the caller's still; the loopback, and the ARP queue if the next hop's
+// MAC isn't known yet, take their own reference.
+static int ip_output(pbuf_t *p, uint32_t dst_ip, uint8_t protocol) {
+    if (p->len > NET_MTU - sizeof(eth_header_t) - sizeof(ip_header_t) && !p->gso_size) {
+        return -1;
     }
 
-    // Build IP packet
-    static uint8_t ip_buf[1600];
-    ip_header_t *ip = (ip_header_t *)ip_buf;
+    uint64_t start = prof_now();
+    uint32_t len = p->len;
+    ip_header_t *ip = pbuf_push(p, sizeof(ip_header_t));
+    if (!ip) return -1;
 
     ip->version_ihl = 0x45;  // IPv4, 20 byte header
     ip->tos = 0;
@@ -393,16 +706,64 @@ int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
     // Calculate header checksum
     ip->checksum = ip_checksum(ip, sizeof(ip_header_t));
 
-    // Copy payload
-    memcpy(ip_buf + sizeof(ip_header_t), data, len);
+    // To ourselves: handled when the lock is let go, like a received
+    // packet. The queue's reference is the last one by then, so the
+    // receive side can step through the headers.
+    int ret;
+    if (dst_ip == our_ip) {
+        ret = -1;
+        if (lo_count < NET_LO_MAX) {
+            pbuf_ref(p);
+            if (lo_tail) lo_tail->next = p;
+            else lo_head = p;
+            lo_tail = p;
+            lo_count++;
+            ret = 0;
+        }
+        prof_add(NET_PROF_TX_IP, start, 1);
+        return ret;
+    }
+
+    // Unresolved: queued, and sent with the ARP reply
+    const uint8_t *dst_mac = arp_output(ip_next_hop(dst_ip), p);
+    if (!dst_mac) {
+        prof_add(NET_PROF_TX_IP, start, 1);
+        return 0;
+    }
+
+    ret = eth_output(p, dst_mac, ETH_TYPE_IP);
+    pbuf_pull(p, sizeof(ip_header_t));
+    prof_add(NET_PROF_TX_IP, start, 1);
+    return ret;
+}
 
-    return eth_send(dst_mac, ETH_TYPE_IP, ip_buf, sizeof(ip_header_t) + len);
+// Send IP packet
+int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
+    net_lock();
+    pbuf_t *p = pbuf_alloc(len);
+    if (!p) {
+        net_unlock();
+        return -1;
+    }
+    memcpy(p->payload, data, len);
+    int ret = ip_output(p, dst_ip, protocol);
+    pbuf_free(p);
+    net_unlock();
+    return ret;
 }
 
 // Send ICMP echo request
 int icmp_send_echo_request(uint32_t dst_ip, uint16_t id, uint16_t seq, const void *data, uint32_t len) {
-    uint8_t icmp_buf[1500];
-    icmp_header_t *icmp = (icmp_header_t *)icmp_buf;
+    uint32_t max = NET_MTU - sizeof(eth_header_t) - sizeof(ip_header_t) - sizeof(icmp_header_t);
+    if (len > max) len = max;
+
+    net_lock();
+    pbuf_t *p = pbuf_alloc(sizeof(icmp_header_t) + len);
+    if (!p) {
+        net_unlock();
+        return -1;
+    }
+    icmp_header_t *icmp = (icmp_header_t *)p->payload;
 
     icmp->type = ICMP_ECHO_REQUEST;
     icmp->code = 0;
@@ -411,74 +772,70 @@ int icmp_send_echo_request(uint32_t dst_ip, uint16_t id, uint16_t seq, const voi
     icmp->seq = htons(seq);
 
     // Copy data
-    if (len > sizeof(icmp_buf) - sizeof(icmp_header_t)) {
-        len = sizeof(icmp_buf) - sizeof(icmp_header_t);
-    }
     if (data && len > 0) {
-        memcpy(icmp_buf + sizeof(icmp_header_t), data, len);
+        memcpy(p->payload + sizeof(icmp_header_t), data, len);
+    } else {
+        memset(p->payload + sizeof(icmp_header_t), 0, len);
     }
 
     // Calculate checksum
-    icmp->checksum = ip_checksum(icmp_buf, sizeof(icmp_header_t) + len);
+    icmp->checksum = ip_checksum(p->payload, p->len);
 
-    return ip_send(dst_ip, IP_PROTO_ICMP, icmp_buf, sizeof(icmp_header_t) + len);
+    int ret = ip_output(p, dst_ip, IP_PROTO_ICMP);
+    pbuf_free(p);
+    net_unlock();
+    return ret;
 }
 
-// Process incoming packets
-void net_poll(void) {
-    static uint8_t rx_buf[1600];
-
-    while (virtio_net_has_packet()) {
-        int len = virtio_net_recv(rx_buf, sizeof(rx_buf));
-        if (len <= 0) break;
-
-        if (len < (int)sizeof(eth_header_t)) continue;
-
-        eth_header_t *eth = (eth_header_t *)rx_buf;
-        uint16_t ethertype = ntohs(eth->ethertype);
-
-        const uint8_t *payload = rx_buf + sizeof(eth_header_t);
-        uint32_t payload_len = len - sizeof(eth_header_t);
-
-        switch (ethertype) {
-            case ETH_TYPE_ARP:
-                arp_handle(payload, payload_len);
-                break;
-            case ETH_TYPE_IP:
-                ip_handle(payload, payload_len);
-                break;
-            default:
-                // Ignore unknown ethertypes
-                break;
-        }
+// Handle one received frame (bottom half, under the stack lock)
+static void net_rx_frame(pbuf_t *p) {
+    if (p->len < sizeof(eth_header_t)) return;
+
+    uint64_t start = prof_now();
+    const eth_header_t *eth = (const eth_header_t *)p->payload;
+    uint16_t ethertype = ntohs(eth->ethertype);
+    pbuf_pull(p, sizeof(eth_header_t));
+
+    switch (ethertype) {
+        case ETH_TYPE_ARP:
+            arp_handle(p->payload, p->len);
+            break;
+        case ETH_TYPE_IP:
+            ip_input(p);
+            break;
+        default:
+            // Ignore unknown ethertypes
+            break;
     }
+    prof_add(NET_PROF_RX_ETH, start, 1);
 }
 
-// Blocking ping with timeout
-int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
-    // First, make sure we have ARP entry for the target (or gateway)
-    uint32_t next_hop = ip;
-    if ((ip & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
+int net_get_prof(uint64_t *packets, uint64_t *ns, int max) {
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq == 0) freq = 1;
+
+    net_lock();
+    for (int i = 0; i < max && i < NET_PROF_COUNT; i++) {
+        if (packets) packets[i] = prof_packets[i];
+        // Whole seconds and the rest separately, so the multiply can't overflow
+        if (ns) ns[i] = prof_ticks[i] / freq * 1000000000ULL +
+                        prof_ticks[i] % freq * 1000000000ULL / freq;
     }
+    net_unlock();
+    return NET_PROF_COUNT;
+}
 
-    // Try to get ARP entry, send request if needed
-    if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
-
-        // Wait for ARP reply (up to 1 second)
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            // Simple delay (~10ms)
-            for (volatile int j = 0; j < 100000; j++);
-        }
-
-        if (!arp_lookup(next_hop)) {
-            printf("[PING] ARP timeout for %s\n", ip_to_str(next_hop));
-            return -1;
-        }
-    }
+// Process incoming packets now. The RX IRQ normally gets there first;
+// this just drains whatever it hasn't.
+void net_poll(void) {
+    net_lock();
+    net_unlock();
+}
 
+// Blocking ping with timeout. An unresolved next hop holds the request
+// until ARP answers, so the first ping needs no separate wait.
+int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
     // Set up ping tracking
     ping_id = 0x1234;
     ping_seq = seq;
@@ -492,11 +849,12 @@ int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
         return -1;
     }
 
-    // Wait for reply
-    for (uint32_t i = 0; i < timeout_ms / 10 && !ping_received; i++) {
-        net_poll();
-        // Simple delay (~10ms)
-        for (volatile int j = 0; j < 100000; j++);
+    // Wait for reply - icmp_handle() wakes us
+    uint64_t deadline = net_deadline(timeout_ms);
+    while (!ping_received && hal_get_time_ns() < deadline) {
+        uint32_t wseq = wait_queue_seq(&ping_wq);
+        if (ping_received) break;
+        process_wait_on(&ping_wq, wseq, deadline);
     }
 
     if (ping_received) {
@@ -508,11 +866,14 @@ int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
 
 // UDP bind - register a listener for a port
 void udp_bind(uint16_t port, udp_recv_callback_t callback) {
+    net_lock();
+
     // Check if already bound
     for (int i = 0; i < UDP_MAX_LISTENERS; i++) {
         if (udp_listeners[i].port == port && udp_listeners[i].callback) {
             // Replace existing listener
             udp_listeners[i].callback = callback;
+            net_unlock();
             return;
         }
     }
@@ -522,22 +883,26 @@ void udp_bind(uint16_t port, udp_recv_callback_t callback) {
         if (!udp_listeners[i].callback) {
             udp_listeners[i].port = port;
             udp_listeners[i].callback = callback;
+            net_unlock();
             return;
         }
     }
 
+    net_unlock();
     printf("[UDP] No free listener slots!\n");
 }
 
 // UDP unbind - remove a listener
 void udp_unbind(uint16_t port) {
+    net_lock();
     for (int i = 0; i < UDP_MAX_LISTENERS; i++) {
         if (udp_listeners[i].port == port) {
             udp_listeners[i].callback = NULL;
             udp_listeners[i].port = 0;
-            return;
+            break;
         }
     }
+    net_unlock();
 }
 
 // Send UDP packet
@@ -547,8 +912,13 @@ int udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port, const void *
     }
 
     // Build UDP packet
-    uint8_t udp_buf[1500];
-    udp_header_t *udp = (udp_header_t *)udp_buf;
+    net_lock();
+    pbuf_t *p = pbuf_alloc(sizeof(udp_header_t) + len);
+    if (!p) {
+        net_unlock();
+        return -1;
+    }
+    udp_header_t *udp = (udp_header_t *)p->payload;
 
     udp->src_port = htons(src_port);
     udp->dst_port = htons(dst_port);
@@ -556,13 +926,44 @@ int udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port, const void *
     udp->checksum = 0;  // Checksum optional for IPv4
 
     // Copy data
-    memcpy(udp_buf + sizeof(udp_header_t), data, len);
+    memcpy(p->payload + sizeof(udp_header_t), data, len);
 
-    return ip_send(dst_ip, IP_PROTO_UDP, udp_buf, sizeof(udp_header_t) + len);
+    int ret = ip_output(p, dst_ip, IP_PROTO_UDP);
+    pbuf_free(p);
+    net_unlock();
+    return ret;
 }
 
-// DNS resolver
-// Simple implementation - sends query to NET_DNS and waits for response
+// ============ DNS resolver ============
+//
+// Answers are cached by hostname for as long as their TTL says, and
+// failures too (RFC 2308), so a page pulling many resources from one host
+// asks the server once. Queries go out from one bound port and are told
+// apart by their ID, so any number can be outstanding; net_tick() resends
+// the unanswered ones. dns_lookup() never waits - dns_resolve() is the
+// blocking wrapper around it.
+
+#define DNS_CACHE_SIZE   64
+#define DNS_HASH_BITS    5
+#define DNS_HASH_SIZE    (1 << DNS_HASH_BITS)
+#define DNS_NAME_MAX     254            // Longest name plus the terminator
+#define DNS_CLIENT_PORT  10053
+#define DNS_RETRY_MS     1000
+#define DNS_MAX_TRIES    3              // Queries sent before giving up
+#define DNS_MIN_TTL_S    5              // Floor, so TTL 0 can't make waiters ask forever
+#define DNS_MAX_TTL_S    86400
+#define DNS_NEG_TTL_S    60             // No such name, when the server sent no SOA
+#define DNS_NEG_MAX_S    300
+#define DNS_FAIL_TTL_S   5              // Timeouts and server errors
+
+#define DNS_FREE     0
+#define DNS_PENDING  1                  // Query out, deadline is the next resend
+#define DNS_VALID    2                  // ip good until deadline
+#define DNS_FAILED   3                  // Negative until deadline
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_SOA   6
+#define DNS_RCODE_NXDOMAIN 3
 
 // DNS header
 typedef struct __attribute__((packed)) {
@@ -574,83 +975,244 @@ typedef struct __attribute__((packed)) {
     uint16_t arcount;
 } dns_header_t;
 
-// DNS response state
-static volatile int dns_response_received = 0;
-static volatile uint32_t dns_resolved_ip = 0;
-static volatile uint16_t dns_query_id = 0;
+typedef struct dns_entry {
+    char name[DNS_NAME_MAX];            // Lower case
+    uint32_t hash;
+    uint32_t ip;
+    uint8_t state;
+    uint8_t tries;
+    uint16_t id;                        // Of the outstanding query
+    uint64_t deadline;
+    uint64_t used;                      // For eviction: oldest goes first
+    struct dns_entry *hnext;
+} dns_entry_t;
+
+static dns_entry_t dns_cache[DNS_CACHE_SIZE];
+static dns_entry_t *dns_hash[DNS_HASH_SIZE];
+static uint16_t dns_next_id;
+static int dns_bound;
+
+// Some query is outstanding (see net_tick())
+static volatile int dns_timers_pending;
+
+// Woken whenever a query settles
+static wait_queue_t dns_wq = WAIT_QUEUE_INIT;
+
+static inline char dns_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static uint32_t dns_hashfn(const char *name) {
+    uint32_t h = 2166136261u;           // FNV-1a
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static dns_entry_t *dns_find(const char *name, uint32_t hash) {
+    for (dns_entry_t *e = dns_hash[hash >> (32 - DNS_HASH_BITS)]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->name, name) == 0) return e;
+    }
+    return NULL;
+}
+
+// Free slot, or the entry used longest ago. Outstanding queries stay;
+// NULL if all of them are.
+static dns_entry_t *dns_new(const char *name, uint32_t hash) {
+    dns_entry_t *e = NULL;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry_t *c = &dns_cache[i];
+        if (c->state == DNS_FREE) {
+            e = c;
+            break;
+        }
+        if (c->state != DNS_PENDING && (!e || c->used < e->used)) e = c;
+    }
+    if (!e) return NULL;
+
+    if (e->state != DNS_FREE) {
+        dns_entry_t **pp = &dns_hash[e->hash >> (32 - DNS_HASH_BITS)];
+        while (*pp != e) pp = &(*pp)->hnext;
+        *pp = e->hnext;
+    }
+    strcpy(e->name, name);
+    e->hash = hash;
+    e->state = DNS_FAILED;
+    dns_entry_t **head = &dns_hash[hash >> (32 - DNS_HASH_BITS)];
+    e->hnext = *head;
+    *head = e;
+    return e;
+}
+
+static dns_entry_t *dns_find_id(uint16_t id) {
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (dns_cache[i].state == DNS_PENDING && dns_cache[i].id == id) return &dns_cache[i];
+    }
+    return NULL;
+}
+
+// Name as labels, into out (at least DNS_NAME_MAX + 1 bytes). Returns the
+// length, or 0 if a label is empty or too long.
+static uint32_t dns_encode_name(const char *name, uint8_t *out) {
+    uint8_t *ptr = out;
+    const char *src = name;
+    while (*src) {
+        const char *dot = src;
+        while (*dot && *dot != '.') dot++;
+
+        uint32_t label_len = dot - src;
+        if (label_len == 0 || label_len > 63) return 0;
+
+        *ptr++ = label_len;
+        while (src < dot) *ptr++ = *src++;
+        if (*src == '.') src++;
+    }
+    *ptr++ = 0;
+    return ptr - out;
+}
+
+// Send (or resend) e's query and have net_tick() follow it up
+static void dns_send_query(dns_entry_t *e, uint64_t now) {
+    uint8_t query[sizeof(dns_header_t) + DNS_NAME_MAX + 1 + 4];
+    dns_header_t *dns = (dns_header_t *)query;
+    dns->id = htons(e->id);
+    dns->flags = htons(0x0100);  // RD (recursion desired)
+    dns->qdcount = htons(1);
+    dns->ancount = 0;
+    dns->nscount = 0;
+    dns->arcount = 0;
+
+    uint8_t *ptr = query + sizeof(dns_header_t);
+    ptr += dns_encode_name(e->name, ptr);
+    *ptr++ = 0; *ptr++ = DNS_TYPE_A;    // QTYPE
+    *ptr++ = 0; *ptr++ = 1;             // QCLASS = IN
+
+    e->tries++;
+    e->deadline = now + DNS_RETRY_MS * 1000000ULL;
+    udp_send(NET_DNS, DNS_CLIENT_PORT, 53, query, ptr - query);
+
+    dns_timers_pending = 1;
+    __sync_synchronize();
+    hal_timer_start_housekeeping();
+}
+
+static void dns_settle(dns_entry_t *e, int state, uint32_t ip, uint32_t ttl_s) {
+    uint64_t now = hal_get_time_ns();
+    e->state = state;
+    e->ip = ip;
+    e->deadline = now + ttl_s * 1000000000ULL;
+    process_wake_all(&dns_wq);
+}
+
+// Step over a name, which may end in a compression pointer. NULL if it
+// runs past end.
+static const uint8_t *dns_skip_name(const uint8_t *p, const uint8_t *end) {
+    while (p < end) {
+        if ((*p & 0xc0) == 0xc0) return p + 2 <= end ? p + 2 : NULL;
+        if (*p == 0) return p + 1;
+        p += 1 + *p;
+    }
+    return NULL;
+}
+
+static uint32_t dns_clamp_ttl(uint32_t ttl, uint32_t lo, uint32_t hi) {
+    return ttl < lo ? lo : (ttl > hi ? hi : ttl);
+}
 
-// DNS response handler
+// Replies arrive here, under the lock, and settle the entry whose query
+// they answer
 static void dns_recv_handler(uint32_t src_ip, uint16_t src_port, uint16_t dst_port, const void *data, uint32_t len) {
-    (void)src_ip; (void)src_port; (void)dst_port;
+    (void)dst_port;
 
+    if (src_ip != NET_DNS || src_port != 53) return;
     if (len < sizeof(dns_header_t)) return;
 
     const dns_header_t *dns = (const dns_header_t *)data;
-
-    // Check if this is response to our query
-    if (ntohs(dns->id) != dns_query_id) return;
-
-    // Check flags: QR=1 (response), RCODE=0 (no error)
     uint16_t flags = ntohs(dns->flags);
     if (!(flags & 0x8000)) return;  // Not a response
-    if (flags & 0x000f) return;     // Error code set
+    if (ntohs(dns->qdcount) != 1) return;
 
-    uint16_t ancount = ntohs(dns->ancount);
-    if (ancount == 0) return;  // No answers
+    dns_entry_t *e = dns_find_id(ntohs(dns->id));
+    if (!e) return;  // Late, duplicate or forged
 
-    // Skip header and question section
+    // The question must be ours, or the ID was a coincidence
     const uint8_t *ptr = (const uint8_t *)data + sizeof(dns_header_t);
     const uint8_t *end = (const uint8_t *)data + len;
-
-    // Skip question (QNAME + QTYPE + QCLASS)
-    // QNAME is a sequence of labels ending with 0
-    while (ptr < end && *ptr != 0) {
-        if ((*ptr & 0xc0) == 0xc0) {
-            // Pointer - skip 2 bytes
-            ptr += 2;
-            goto parse_answer;
-        }
-        ptr += 1 + *ptr;  // Skip length byte + label
+    uint8_t qname[DNS_NAME_MAX + 1];
+    uint32_t qlen = dns_encode_name(e->name, qname);
+    if (ptr + qlen + 4 > end) return;
+    for (uint32_t i = 0; i < qlen; i++) {
+        if (dns_lower(ptr[i]) != qname[i]) return;
     }
-    if (ptr < end) ptr++;  // Skip null terminator
-    ptr += 4;  // Skip QTYPE (2) + QCLASS (2)
+    ptr += qlen + 4;  // QTYPE + QCLASS
 
-parse_answer:
-    // Parse answer records
-    for (int i = 0; i < ancount && ptr + 12 <= end; i++) {
-        // Skip NAME (may be pointer)
-        if ((*ptr & 0xc0) == 0xc0) {
-            ptr += 2;  // Pointer
-        } else {
-            while (ptr < end && *ptr != 0) {
-                ptr += 1 + *ptr;
-            }
-            if (ptr < end) ptr++;
-        }
+    int rcode = flags & 0x000f;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        printf("[DNS] Server error %d for %s\n", rcode, e->name);
+        dns_settle(e, DNS_FAILED, 0, DNS_FAIL_TTL_S);
+        return;
+    }
 
-        if (ptr + 10 > end) break;
+    // Walk the answers, then the authority section for an SOA. A CNAME
+    // chain is only as good as its shortest-lived link.
+    int answers = ntohs(dns->ancount);
+    int records = answers + ntohs(dns->nscount);
+    uint32_t ttl_min = DNS_MAX_TTL_S;
+    uint32_t neg_ttl = DNS_NEG_TTL_S;
+    for (int i = 0; i < records; i++) {
+        ptr = dns_skip_name(ptr, end);
+        if (!ptr || ptr + 10 > end) break;
 
         uint16_t type = (ptr[0] << 8) | ptr[1];
-        // uint16_t class = (ptr[2] << 8) | ptr[3];
-        // uint32_t ttl = (ptr[4] << 24) | (ptr[5] << 16) | (ptr[6] << 8) | ptr[7];
+        uint32_t ttl = ((uint32_t)ptr[4] << 24) | (ptr[5] << 16) | (ptr[6] << 8) | ptr[7];
         uint16_t rdlength = (ptr[8] << 8) | ptr[9];
         ptr += 10;
-
         if (ptr + rdlength > end) break;
 
-        // Type A = 1 (IPv4 address)
-        if (type == 1 && rdlength == 4) {
-            // Found an A record!
-            dns_resolved_ip = MAKE_IP(ptr[0], ptr[1], ptr[2], ptr[3]);
-            dns_response_received = 1;
-            return;
+        if (i < answers) {
+            if (ttl < ttl_min) ttl_min = ttl;
+            if (rcode == 0 && type == DNS_TYPE_A && rdlength == 4) {
+                uint32_t ip = MAKE_IP(ptr[0], ptr[1], ptr[2], ptr[3]);
+                dns_settle(e, DNS_VALID, ip,
+                           dns_clamp_ttl(ttl_min, DNS_MIN_TTL_S, DNS_MAX_TTL_S));
+                printf("[DNS] Resolved %s -> %s\n", e->name, ip_to_str(ip));
+                return;
+            }
+        } else if (type == DNS_TYPE_SOA && rdlength >= 20) {
+            // Negative TTL: the lesser of the SOA's own and its MINIMUM
+            const uint8_t *m = ptr + rdlength - 4;
+            uint32_t minimum = ((uint32_t)m[0] << 24) | (m[1] << 16) | (m[2] << 8) | m[3];
+            neg_ttl = ttl < minimum ? ttl : minimum;
         }
-
         ptr += rdlength;
     }
+
+    printf("[DNS] No address for %s\n", e->name);
+    dns_settle(e, DNS_FAILED, 0, dns_clamp_ttl(neg_ttl, DNS_MIN_TTL_S, DNS_NEG_MAX_S));
+}
+
+// Resend queries that got no answer. Returns whether any are still out.
+static int dns_tick(uint64_t now) {
+    int pending = 0;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry_t *e = &dns_cache[i];
+        if (e->state != DNS_PENDING) continue;
+
+        if (now >= e->deadline) {
+            if (e->tries >= DNS_MAX_TRIES) {
+                printf("[DNS] No reply for %s\n", e->name);
+                dns_settle(e, DNS_FAILED, 0, DNS_FAIL_TTL_S);
+                continue;
+            }
+            dns_send_query(e, now);
+        }
+        pending = 1;
+    }
+    return pending;
 }
 
-// Resolve hostname to IP
 // Check if string is an IP address (e.g., "10.0.2.2") and parse it
 static uint32_t parse_ip_string(const char *str) {
     uint8_t octets[4];
@@ -679,136 +1241,224 @@ static uint32_t parse_ip_string(const char *str) {
     return MAKE_IP(octets[0], octets[1], octets[2], octets[3]);
 }
 
-uint32_t dns_resolve(const char *hostname) {
+int dns_lookup(const char *hostname, uint32_t *ip) {
     // First check if it's already an IP address
-    uint32_t ip = parse_ip_string(hostname);
-    if (ip != 0) {
-        return ip;  // It's an IP, no DNS needed
-    }
-
-    // Build DNS query
-    uint8_t query[512];
-    dns_header_t *dns = (dns_header_t *)query;
-
-    // Use a simple incrementing ID
-    static uint16_t next_id = 1;
-    dns_query_id = next_id++;
-
-    dns->id = htons(dns_query_id);
-    dns->flags = htons(0x0100);  // RD (recursion desired)
-    dns->qdcount = htons(1);
-    dns->ancount = 0;
-    dns->nscount = 0;
-    dns->arcount = 0;
-
-    // Build QNAME from hostname
-    uint8_t *ptr = query + sizeof(dns_header_t);
-    const char *src = hostname;
-
-    while (*src) {
-        // Find next dot or end
-        const char *dot = src;
-        while (*dot && *dot != '.') dot++;
-
-        uint8_t label_len = dot - src;
-        if (label_len > 63) return 0;  // Label too long
-
-        *ptr++ = label_len;
-        while (src < dot) {
-            *ptr++ = *src++;
-        }
-        if (*src == '.') src++;
+    uint32_t lit = parse_ip_string(hostname);
+    if (lit != 0) {
+        *ip = lit;
+        return 1;
     }
-    *ptr++ = 0;  // Null terminator
-
-    // QTYPE = A (1), QCLASS = IN (1)
-    *ptr++ = 0; *ptr++ = 1;  // QTYPE
-    *ptr++ = 0; *ptr++ = 1;  // QCLASS
-
-    uint32_t query_len = ptr - query;
-
-    // Bind to receive DNS responses on port 53 (we're the client, but use same port for simplicity)
-    // Actually, use ephemeral port
-    uint16_t local_port = 10053 + (dns_query_id % 100);
-    dns_response_received = 0;
-    dns_resolved_ip = 0;
 
-    udp_bind(local_port, dns_recv_handler);
-
-    // First, make sure we can reach DNS server (ARP)
-    uint32_t dns_server = NET_DNS;
-    uint32_t next_hop = dns_server;
-    if ((dns_server & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
+    // Lower case, and without the root's trailing dot
+    char name[DNS_NAME_MAX];
+    uint32_t n = 0;
+    while (hostname[n]) {
+        if (n >= DNS_NAME_MAX - 1) return -1;
+        name[n] = dns_lower(hostname[n]);
+        n++;
     }
-
-    if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-        if (!arp_lookup(next_hop)) {
-            udp_unbind(local_port);
-            return 0;
-        }
+    if (n > 0 && name[n - 1] == '.') n--;
+    name[n] = '\0';
+    uint8_t encoded[DNS_NAME_MAX + 1];
+    if (n == 0 || !dns_encode_name(name, encoded)) return -1;
+
+    uint32_t hash = dns_hashfn(name);
+    uint64_t now = hal_get_time_ns();
+    int ret;
+
+    net_lock();
+    dns_entry_t *e = dns_find(name, hash);
+    if (e && e->state != DNS_PENDING && now >= e->deadline) {
+        e->state = DNS_FAILED;      // Expired: ask again below
+    } else if (e) {
+        e->used = now;
+        if (e->state == DNS_VALID) *ip = e->ip;
+        ret = e->state == DNS_VALID ? 1 : (e->state == DNS_PENDING ? 0 : -1);
+        net_unlock();
+        return ret;
     }
 
-    // Send DNS query
-    if (udp_send(dns_server, local_port, 53, query, query_len) < 0) {
-        udp_unbind(local_port);
-        return 0;
+    if (!e) e = dns_new(name, hash);
+    if (!e) {
+        net_unlock();
+        return -1;  // Every entry has a query out
     }
 
-    // Wait for response (up to 5 seconds)
-    for (int i = 0; i < 500 && !dns_response_received; i++) {
-        net_poll();
-        for (volatile int j = 0; j < 100000; j++);
+    if (!dns_bound) {
+        udp_bind(DNS_CLIENT_PORT, dns_recv_handler);
+        dns_next_id = (uint16_t)prof_now();
+        dns_bound = 1;
     }
+    do {
+        dns_next_id += 0x9e37;          // Odd step: every ID before a repeat
+    } while (dns_find_id(dns_next_id));
+
+    e->state = DNS_PENDING;
+    e->id = dns_next_id;
+    e->tries = 0;
+    e->used = now;
+    dns_send_query(e, now);
+    net_unlock();
+    return 0;
+}
 
-    udp_unbind(local_port);
-
-    if (dns_response_received) {
-        printf("[DNS] Resolved %s -> %s\n", hostname, ip_to_str(dns_resolved_ip));
-        return dns_resolved_ip;
+uint32_t dns_resolve(const char *hostname) {
+    uint32_t ip = 0;
+    uint64_t give_up = hal_get_time_ns() +
+                       (DNS_MAX_TRIES + 1) * DNS_RETRY_MS * 1000000ULL;
+
+    // The entry settles one way or the other after DNS_MAX_TRIES
+    while (1) {
+        uint32_t seq = wait_queue_seq(&dns_wq);
+        int ret = dns_lookup(hostname, &ip);
+        if (ret != 0) return ret == 1 ? ip : 0;
+        if (hal_get_time_ns() >= give_up) return 0;
+        process_wait_on(&dns_wq, seq, give_up);
     }
-
-    printf("[DNS] Failed to resolve %s\n", hostname);
-    return 0;
 }
 
 // ============ TCP Implementation ============
-
-// TCP socket structure
-#define TCP_MAX_SOCKETS 8
-#define TCP_RX_BUF_SIZE 32768  // 32KB - TLS certs can be large
-#define TCP_TX_BUF_SIZE 4096
+//
+// Sockets buffer what they send until it is acknowledged, so lost
+// segments can go again: on a retransmission timeout (RFC 6298), or on
+// three duplicate ACKs (fast retransmit with NewReno recovery, RFC 6582).
+// Segments that arrive early are stored straight into the receive ring at
+// their own offset and handed over once the gap before them fills. The
+// timers run from CPU 0's housekeeping tick through net_tick().
+//
+// Sockets are allocated as needed and found by 4-tuple in a hash table;
+// handles index a slot table that grows on demand. A SYN to a listening
+// port makes a child socket that tcp_accept() hands out once the
+// handshake completes. tcp_close() gives the socket up to the stack,
+// which frees it when the connection is done (or the linger runs out).
+//
+// Callers that wait (connect, a full send buffer, the *_wait calls) sleep
+// on a wait queue per handle, which the receive path and the timers wake
+// whenever something happens on the socket. The queues live in a static
+// table by handle rather than in the socket, so a waiter never touches a
+// socket that was freed while it slept; it looks the handle up again.
+
+#define TCP_MAX_SOCKETS 1024            // Handles (slot table grows to this)
+#define TCP_MIN_SLOTS   16
+#define TCP_HASH_BITS   8               // Connection hash buckets
+#define TCP_HASH_SIZE   (1 << TCP_HASH_BITS)
+#define TCP_MAX_BACKLOG 128
+#define TCP_SYNACK_RETRIES 5            // Unanswered SYN+ACKs before a child is dropped
+#define TCP_LINGER_MS   10000           // Time a closed socket gets to finish
+#define TCP_CONNECT_MS  10000           // tcp_connect() gives up after this
+#define TCP_RX_BUF_SIZE (128 * 1024)    // Receive ring - what's free of it is our window
+#define TCP_TX_BUF_SIZE (64 * 1024)     // Unacknowledged plus not yet sent
+#define TCP_MSS         1460            // Largest segment on a 1500-byte MTU
+#define TCP_DEFAULT_MSS 536             // Peer's MSS if its SYN doesn't say
+#define TCP_TSO_MAX     (44 * TCP_MSS)  // Data in one segment the device cuts up
+#define TCP_WSCALE      2               // Our window scale, enough for the ring
+#define TCP_INIT_CWND   10              // Segments (RFC 6928)
+#define TCP_OOO_MAX     8               // Out-of-order ranges remembered
+#define TCP_RTO_INIT_MS 1000
+#define TCP_RTO_MIN_MS  200
+#define TCP_RTO_MAX_MS  60000
+#define TCP_MAX_BACKOFF 10              // Timeouts in a row before giving up
+#define TCP_DELACK_MS   40
+#define TCP_TICK_US     10000           // Timer granularity (housekeeping tick)
+
+// Sequence number comparisons, modulo 2^32
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
 
 typedef struct {
+    uint32_t start, end;    // Sequence range already stored in rx_buf
+} tcp_range_t;
+
+typedef struct tcp_sock {
+    int slot;               // Handle, -1 once closed or until accepted
     int state;
     uint32_t local_ip;
     uint32_t remote_ip;
     uint16_t local_port;
     uint16_t remote_port;
 
-    // Sequence numbers
-    uint32_t send_seq;      // Next byte we'll send
-    uint32_t send_ack;      // Last ACK we sent (next byte we expect)
-    uint32_t recv_seq;      // For tracking incoming data
+    // Send side. tx_buf is a ring holding the bytes from snd_una on: sent
+    // and unacknowledged first, then not yet sent.
+    uint32_t iss;
+    uint32_t snd_una;       // Oldest unacknowledged
+    uint32_t snd_nxt;       // Next to send (back to snd_una after a timeout)
+    uint32_t snd_max;       // Highest sent so far
+    uint32_t snd_wnd;       // Peer's window, scaled
+    uint32_t snd_wl1;       // Segment seq and ack that last set snd_wnd
+    uint32_t snd_wl2;
+    uint16_t mss;           // Largest segment the peer takes
+    uint8_t snd_wscale;     // Peer's window scale
+    uint8_t rcv_wscale;     // Ours, 0 if the peer doesn't do scaling
+    uint8_t *tx_buf;
+    uint32_t tx_head;       // Ring position of snd_una
+    uint32_t tx_len;        // Bytes buffered
+    uint8_t fin_queued;     // A FIN follows the buffered data
+    uint8_t fin_acked;
+
+    // Congestion control (NewReno)
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t bytes_acked;   // Toward the next cwnd step in congestion avoidance
+    uint32_t dupacks;
+    uint32_t recover;       // snd_max when fast recovery started
+    uint8_t in_recovery;
+
+    // Round-trip time and retransmission timer
+    uint32_t srtt_us;       // 0 until the first sample
+    uint32_t rttvar_us;
+    uint32_t rto_ms;
+    uint32_t backoff;       // Timeouts in a row; the timer doubles each time
+    uint64_t rto_deadline;  // 0 = not running
+    uint32_t rtt_seq;       // Timed segment ends here...
+    uint64_t rtt_start;     // ...and was sent then (0 = none timed)
+
+    // Receive side. rx_buf is a ring: [rx_tail, rx_head) is for the app
+    // and rx_head is where rcv_nxt goes. Out-of-order data sits further
+    // on, at its offset from rcv_nxt.
+    uint32_t rcv_nxt;
+    uint32_t rcv_adv;       // Right edge of the window we last advertised
+    uint8_t *rx_buf;
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    tcp_range_t ooo[TCP_OOO_MAX];   // Sorted, not touching
+    int nooo;
+    uint8_t fin_received;   // Remote sent FIN
+
+    // Delayed ACK
+    uint32_t unacked_segs;  // Data segments received since our last ACK
+    uint64_t delack_deadline;   // 0 = no ACK owed
 
-    // Receive buffer (ring buffer)
-    uint8_t rx_buf[TCP_RX_BUF_SIZE];
-    uint32_t rx_head;       // Write position
-    uint32_t rx_tail;       // Read position
+    struct tcp_sock *hnext;         // Hash chain (listeners: tcp_listeners)
 
-    // Flags
-    uint8_t fin_received;   // Remote sent FIN
-    uint8_t fin_sent;       // We sent FIN
+    // Passive open
+    struct tcp_sock *listener;      // Listener we came in on, until accepted
+    struct tcp_sock *qnext;         // Listener's accept queue
+    struct tcp_sock *accept_head;   // Listeners: established, not yet accepted
+    struct tcp_sock *accept_tail;
+    int backlog;
+    int pending;                    // Children not yet accepted, half-open too
+
+    // Closed by the app, finishing on its own
+    uint8_t orphan;
+    uint64_t close_deadline;
 } tcp_socket_internal_t;
 
-static tcp_socket_internal_t tcp_sockets[TCP_MAX_SOCKETS];
+static tcp_socket_internal_t **tcp_slots;          // By handle
+static int tcp_nslots;
+static wait_queue_t tcp_wq[TCP_MAX_SOCKETS];       // By handle
+static tcp_socket_internal_t *tcp_hash[TCP_HASH_SIZE];     // Connections by 4-tuple
+static tcp_socket_internal_t *tcp_listeners;
 static uint16_t tcp_next_port = 49152;  // Ephemeral port range
 
+// Some socket has a timer running (set under the lock, see net_tick())
+static volatile int tcp_timers_pending;
+
+static uint64_t tcp_stat_timeouts;
+static uint64_t tcp_stat_fast_retransmits;
+static uint64_t tcp_stat_ooo;
+
 // TCP pseudo-header for checksum
 typedef struct __attribute__((packed)) {
     uint32_t src_ip;
@@ -818,32 +1468,35 @@ typedef struct __attribute__((packed)) {
     uint16_t tcp_len;
 } tcp_pseudo_header_t;
 
-// Calculate TCP checksum (includes pseudo-header)
-static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
-                              const tcp_header_t *tcp, const void *data, uint32_t data_len) {
+// Pseudo-header sum, folded to 16 bits but not complemented - what the
+// device starts from when it finishes the checksum
+static uint16_t tcp_pseudo_sum(uint32_t src_ip, uint32_t dst_ip, uint32_t len) {
     uint32_t sum = 0;
-
-    // Pseudo-header
     sum += (src_ip >> 16) & 0xffff;
     sum += src_ip & 0xffff;
     sum += (dst_ip >> 16) & 0xffff;
     sum += dst_ip & 0xffff;
     sum += htons(IP_PROTO_TCP);
-    sum += htons(sizeof(tcp_header_t) + data_len);
+    sum += htons(len);
 
-    // TCP header
-    const uint16_t *ptr = (const uint16_t *)tcp;
-    for (int i = 0; i < (int)(sizeof(tcp_header_t) / 2); i++) {
-        sum += ptr[i];
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
     }
+    return sum;
+}
 
-    // Data
-    ptr = (const uint16_t *)data;
-    while (data_len > 1) {
+// Calculate TCP checksum over a whole segment (includes pseudo-header)
+static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
+                             const void *seg, uint32_t len) {
+    uint32_t sum = tcp_pseudo_sum(src_ip, dst_ip, len);
+
+    // Header, options and data
+    const uint16_t *ptr = (const uint16_t *)seg;
+    while (len > 1) {
         sum += *ptr++;
-        data_len -= 2;
+        len -= 2;
     }
-    if (data_len == 1) {
+    if (len == 1) {
         sum += *(const uint8_t *)ptr;
     }
 
@@ -855,39 +1508,507 @@ static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
     return ~sum;
 }
 
-// Send a TCP segment
-static int tcp_send_segment(tcp_socket_internal_t *sock, uint8_t flags,
-                            const void *data, uint32_t len) {
-    uint8_t pkt[1500];
-    tcp_header_t *tcp = (tcp_header_t *)pkt;
+// Offloads the device can do for this connection; loopback segments
+// never reach it
+static int tcp_offloads(tcp_socket_internal_t *sock) {
+    return sock->remote_ip == our_ip ? 0 : virtio_net_tx_offloads();
+}
+
+static uint32_t tcp_rx_free(tcp_socket_internal_t *sock) {
+    uint32_t used = (sock->rx_head - sock->rx_tail) % TCP_RX_BUF_SIZE;
+    return TCP_RX_BUF_SIZE - 1 - used;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+static uint64_t tcp_rto_ns(tcp_socket_internal_t *sock) {
+    uint64_t ms = (uint64_t)sock->rto_ms << sock->backoff;
+    if (ms > TCP_RTO_MAX_MS) ms = TCP_RTO_MAX_MS;
+    return ms * 1000000ULL;
+}
+
+// A timer was set: make sure CPU 0's housekeeping tick is running. The
+// barrier pairs with the re-check in the tick's stop path.
+static void tcp_timer_started(void) {
+    tcp_timers_pending = 1;
+    __sync_synchronize();
+    hal_timer_start_housekeeping();
+}
+
+// (Re)start the retransmission timer
+static void tcp_arm_rto(tcp_socket_internal_t *sock) {
+    sock->rto_deadline = hal_get_time_ns() + tcp_rto_ns(sock);
+    tcp_timer_started();
+}
+
+// Send one segment: len bytes of buffered data starting at seq, plus flags.
+// Carries our ACK and window unless it is the opening SYN.
+static int tcp_xmit(tcp_socket_internal_t *sock, uint32_t seq, uint8_t flags, uint32_t len) {
+    uint64_t start = prof_now();
+    uint32_t hdr_len = sizeof(tcp_header_t);
+    if (flags & TCP_SYN) hdr_len += sock->rcv_wscale ? 8 : 4;
+
+    // Built in place, with room in front for the IP and ethernet headers
+    pbuf_t *p = pbuf_alloc(hdr_len + len);
+    if (!p) {
+        if (!sock->rto_deadline) tcp_arm_rto(sock);     // Try again from the timer
+        return -1;
+    }
+    tcp_header_t *tcp = (tcp_header_t *)p->payload;
+
+    if (sock->state != TCP_STATE_SYN_SENT) {
+        flags |= TCP_ACK;
+    }
+
+    if (flags & TCP_SYN) {
+        // MSS, then NOP and window scale unless answering a SYN without it
+        uint8_t *opt = p->payload + sizeof(tcp_header_t);
+        opt[0] = 2; opt[1] = 4;
+        opt[2] = TCP_MSS >> 8; opt[3] = TCP_MSS & 0xff;
+        if (sock->rcv_wscale) {
+            opt[4] = 1;
+            opt[5] = 3; opt[6] = 3; opt[7] = sock->rcv_wscale;
+        }
+    }
+
+    // Window: SYNs are never scaled
+    uint32_t shift = (flags & TCP_SYN) ? 0 : sock->rcv_wscale;
+    uint32_t win = tcp_rx_free(sock) >> shift;
+    if (win > 0xffff) win = 0xffff;
 
     tcp->src_port = htons(sock->local_port);
     tcp->dst_port = htons(sock->remote_port);
-    tcp->seq = htonl(sock->send_seq);
-    tcp->ack = htonl(sock->send_ack);
-    tcp->data_off = (5 << 4);  // 20 bytes, no options
+    tcp->seq = htonl(seq);
+    tcp->ack = htonl((flags & TCP_ACK) ? sock->rcv_nxt : 0);
+    tcp->data_off = (hdr_len / 4) << 4;
     tcp->flags = flags;
-    tcp->window = htons(TCP_RX_BUF_SIZE);
+    tcp->window = htons(win);
     tcp->checksum = 0;
     tcp->urgent = 0;
 
-    // Copy data
-    if (data && len > 0) {
-        memcpy(pkt + sizeof(tcp_header_t), data, len);
+    // Copy data out of the send ring
+    if (len > 0) {
+        uint32_t pos = (sock->tx_head + (seq - sock->snd_una)) % TCP_TX_BUF_SIZE;
+        uint32_t first = min_u32(len, TCP_TX_BUF_SIZE - pos);
+        memcpy(p->payload + hdr_len, sock->tx_buf + pos, first);
+        memcpy(p->payload + hdr_len + first, sock->tx_buf, len - first);
     }
 
-    // Calculate checksum
-    tcp->checksum = tcp_checksum(htonl(sock->local_ip), htonl(sock->remote_ip),
-                                  tcp, data, len);
+    // Calculate checksum, or leave the device to sum from the pseudo-header
+    // on (and to cut a segment longer than the MSS)
+    if (tcp_offloads(sock) & VIRTIO_NET_TX_CSUM) {
+        tcp->checksum = tcp_pseudo_sum(htonl(sock->local_ip), htonl(sock->remote_ip), p->len);
+        p->flags |= PBUF_F_CSUM;
+        p->csum_start = (uint16_t)(p->payload - p->base);
+        p->csum_offset = offsetof(tcp_header_t, checksum);
+        if (len > sock->mss) p->gso_size = sock->mss;
+    } else {
+        tcp->checksum = tcp_checksum(htonl(sock->local_ip), htonl(sock->remote_ip),
+                                     p->payload, p->len);
+    }
+
+    // Time one new segment at a time; retransmissions can't be timed (Karn)
+    uint32_t seq_len = len + ((flags & TCP_SYN) ? 1 : 0) + ((flags & TCP_FIN) ? 1 : 0);
+    if (seq_len > 0) {
+        if (seq == sock->snd_max && !sock->rtt_start) {
+            sock->rtt_seq = seq + seq_len;
+            sock->rtt_start = hal_get_time_ns();
+        } else if (SEQ_LT(seq, sock->snd_max) && sock->rtt_start && SEQ_LT(seq, sock->rtt_seq)) {
+            sock->rtt_start = 0;
+        }
+        if (!sock->rto_deadline) tcp_arm_rto(sock);
+    }
+
+    // Every segment but the SYN acknowledges what we have
+    if (flags & TCP_ACK) {
+        sock->unacked_segs = 0;
+        sock->delack_deadline = 0;
+        sock->rcv_adv = sock->rcv_nxt + (win << shift);
+    }
+
+    int ret = ip_output(p, sock->remote_ip, IP_PROTO_TCP);
+    pbuf_free(p);
+    prof_add(NET_PROF_TX_TCP, start, 1);
+    return ret;
+}
+
+static void tcp_send_ack(tcp_socket_internal_t *sock) {
+    tcp_xmit(sock, sock->snd_nxt, TCP_ACK, 0);
+}
+
+// Send whatever the peer's window and our congestion window allow: new
+// data, then the FIN once the data is all out
+static void tcp_output(tcp_socket_internal_t *sock) {
+    switch (sock->state) {
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_CLOSING:
+        case TCP_STATE_LAST_ACK:
+            break;
+        default:
+            return;
+    }
+
+    uint32_t wnd = min_u32(sock->cwnd, sock->snd_wnd);
+    uint32_t fin_seq = sock->snd_una + sock->tx_len;
+
+    // With TSO, hand the device up to TCP_TSO_MAX at once, in whole MSS
+    // units unless it is the end of the data
+    uint32_t seg_max = (tcp_offloads(sock) & VIRTIO_NET_TX_TSO) ? TCP_TSO_MAX : sock->mss;
+
+    while (1) {
+        uint32_t in_flight = sock->snd_nxt - sock->snd_una;
+        uint32_t unsent = sock->tx_len > in_flight ? sock->tx_len - in_flight : 0;
+        uint32_t room = wnd > in_flight ? wnd - in_flight : 0;
+        uint32_t len = min_u32(min_u32(unsent, seg_max), room);
+        if (len > sock->mss && len < unsent) len -= len % sock->mss;
+
+        // The FIN goes with the last of the data, or on its own
+        int fin = sock->fin_queued && !sock->fin_acked && len == unsent &&
+                  sock->snd_nxt + len == fin_seq;
+        if (len == 0 && !fin) break;
+
+        uint8_t flags = 0;
+        if (len > 0 && len == unsent) flags |= TCP_PSH;
+        if (fin) flags |= TCP_FIN;
+        if (tcp_xmit(sock, sock->snd_nxt, flags, len) < 0) break;
+
+        sock->snd_nxt += len + (fin ? 1 : 0);
+        if (SEQ_GT(sock->snd_nxt, sock->snd_max)) sock->snd_max = sock->snd_nxt;
+        if (fin) break;
+    }
+
+    // Zero window with data waiting: the timer probes it
+    if (sock->snd_wnd == 0 && sock->tx_len > 0 && !sock->rto_deadline) {
+        tcp_arm_rto(sock);
+    }
+}
+
+// Resend the first unacknowledged segment
+static void tcp_retransmit(tcp_socket_internal_t *sock) {
+    if (sock->state == TCP_STATE_SYN_SENT || sock->state == TCP_STATE_SYN_RECEIVED) {
+        tcp_xmit(sock, sock->iss, TCP_SYN, 0);
+        return;
+    }
+
+    uint32_t len = min_u32(sock->tx_len, sock->mss);
+    uint8_t flags = 0;
+    if (len > 0) flags |= TCP_PSH;
+    if (sock->fin_queued && len == sock->tx_len &&
+        SEQ_GT(sock->snd_max, sock->snd_una + sock->tx_len)) {
+        flags |= TCP_FIN;
+    }
+    if (len == 0 && !(flags & TCP_FIN)) return;
+
+    tcp_xmit(sock, sock->snd_una, flags, len);
+    uint32_t end = sock->snd_una + len + ((flags & TCP_FIN) ? 1 : 0);
+    if (SEQ_GT(end, sock->snd_nxt)) sock->snd_nxt = end;
+}
+
+// Retransmission timer went off
+static void tcp_timeout(tcp_socket_internal_t *sock) {
+    uint32_t in_flight = sock->snd_max - sock->snd_una;
+
+    // Zero window probe: push one byte past the window until it opens.
+    // A peer that is just slow to read is never given up on.
+    if (sock->state != TCP_STATE_SYN_SENT && sock->state != TCP_STATE_SYN_RECEIVED &&
+        sock->snd_wnd == 0 && sock->tx_len > 0 && in_flight <= 1) {
+        tcp_xmit(sock, sock->snd_una, 0, 1);
+        sock->snd_nxt = sock->snd_max = sock->snd_una + 1;
+        if (sock->backoff < TCP_MAX_BACKOFF) sock->backoff++;
+        tcp_arm_rto(sock);
+        return;
+    }
+    if (in_flight == 0) return;
+
+    if (++sock->backoff > TCP_MAX_BACKOFF ||
+        (sock->state == TCP_STATE_SYN_RECEIVED && sock->backoff > TCP_SYNACK_RETRIES)) {
+        printf("[TCP] Connection to %s timed out\n", ip_to_str(sock->remote_ip));
+        sock->state = TCP_STATE_CLOSED;
+        return;
+    }
+    tcp_stat_timeouts++;
+
+    // Assume everything in flight is gone: back to one segment and slow start
+    sock->ssthresh = in_flight / 2 > 2u * sock->mss ? in_flight / 2 : 2u * sock->mss;
+    sock->cwnd = sock->mss;
+    sock->bytes_acked = 0;
+    sock->dupacks = 0;
+    sock->in_recovery = 0;
+    sock->recover = sock->snd_max;
+    sock->rtt_start = 0;
+    sock->snd_nxt = sock->snd_una;
+
+    tcp_arm_rto(sock);
+    tcp_retransmit(sock);
+}
+
+// Fold in a round-trip sample (RFC 6298)
+static void tcp_rtt_sample(tcp_socket_internal_t *sock, uint64_t rtt_ns) {
+    uint32_t r = rtt_ns / 1000;
+    if (r == 0) r = 1;
+
+    if (sock->srtt_us == 0) {
+        sock->srtt_us = r;
+        sock->rttvar_us = r / 2;
+    } else {
+        uint32_t err = sock->srtt_us > r ? sock->srtt_us - r : r - sock->srtt_us;
+        sock->rttvar_us = (3 * sock->rttvar_us + err) / 4;
+        sock->srtt_us = (7 * sock->srtt_us + r) / 8;
+    }
+
+    uint32_t var = 4 * sock->rttvar_us;
+    if (var < TCP_TICK_US) var = TCP_TICK_US;
+    uint32_t rto = (sock->srtt_us + var) / 1000;
+    if (rto < TCP_RTO_MIN_MS) rto = TCP_RTO_MIN_MS;
+    if (rto > TCP_RTO_MAX_MS) rto = TCP_RTO_MAX_MS;
+    sock->rto_ms = rto;
+}
+
+// Duplicate ACK: three in a row mean the segment after it was lost
+static void tcp_dupack(tcp_socket_internal_t *sock) {
+    sock->dupacks++;
+
+    if (sock->in_recovery) {
+        // Another segment left the network
+        sock->cwnd += sock->mss;
+        return;
+    }
+
+    if (sock->dupacks == 3 && SEQ_GT(sock->snd_una, sock->recover)) {
+        uint32_t in_flight = sock->snd_max - sock->snd_una;
+        sock->ssthresh = in_flight / 2 > 2u * sock->mss ? in_flight / 2 : 2u * sock->mss;
+        sock->recover = sock->snd_max;
+        sock->in_recovery = 1;
+        tcp_stat_fast_retransmits++;
+        tcp_retransmit(sock);
+        sock->cwnd = sock->ssthresh + 3 * sock->mss;
+    }
+}
+
+// Handle the ACK field (and window) of an incoming segment
+static void tcp_process_ack(tcp_socket_internal_t *sock, const tcp_header_t *tcp,
+                            uint32_t seq, uint32_t ack, uint32_t data_len) {
+    if (SEQ_GT(ack, sock->snd_max)) {
+        tcp_send_ack(sock);     // Acknowledges something we never sent
+        return;
+    }
+    if (SEQ_LT(ack, sock->snd_una)) return;    // Old
+
+    // Window update, from the newest segment only
+    int win_changed = 0;
+    if (SEQ_LT(sock->snd_wl1, seq) || (sock->snd_wl1 == seq && SEQ_LEQ(sock->snd_wl2, ack))) {
+        uint32_t win = (uint32_t)ntohs(tcp->window) << sock->snd_wscale;
+        win_changed = (win != sock->snd_wnd);
+        sock->snd_wnd = win;
+        sock->snd_wl1 = seq;
+        sock->snd_wl2 = ack;
+    }
+
+    if (ack == sock->snd_una) {
+        if (data_len == 0 && !win_changed && sock->snd_wnd > 0 &&
+            sock->snd_max != sock->snd_una) {
+            tcp_dupack(sock);
+        }
+        return;
+    }
+
+    // New data acknowledged - drop it from the send buffer
+    uint32_t acked = ack - sock->snd_una;
+    if (sock->fin_queued && acked > sock->tx_len) {
+        sock->fin_acked = 1;
+        acked = sock->tx_len;
+    }
+    sock->tx_head = (sock->tx_head + acked) % TCP_TX_BUF_SIZE;
+    sock->tx_len -= acked;
+    acked = ack - sock->snd_una;
+    sock->snd_una = ack;
+    if (SEQ_LT(sock->snd_nxt, ack)) sock->snd_nxt = ack;
+
+    if (sock->rtt_start && SEQ_GEQ(ack, sock->rtt_seq)) {
+        tcp_rtt_sample(sock, hal_get_time_ns() - sock->rtt_start);
+        sock->rtt_start = 0;
+    }
+    sock->backoff = 0;
+
+    // Congestion window
+    if (sock->in_recovery) {
+        if (SEQ_GEQ(ack, sock->recover)) {
+            // Everything up to the loss is in: deflate and carry on
+            sock->in_recovery = 0;
+            sock->cwnd = sock->ssthresh;
+            sock->dupacks = 0;
+        } else {
+            // Partial ACK: the next hole was lost too
+            tcp_retransmit(sock);
+            sock->cwnd = sock->cwnd > acked ? sock->cwnd - acked : 0;
+            sock->cwnd += sock->mss;
+        }
+    } else {
+        sock->dupacks = 0;
+        if (sock->cwnd < sock->ssthresh) {
+            sock->cwnd += min_u32(acked, sock->mss);    // Slow start
+        } else {
+            sock->bytes_acked += acked;                 // One MSS per window
+            if (sock->bytes_acked >= sock->cwnd) {
+                sock->bytes_acked -= sock->cwnd;
+                sock->cwnd += sock->mss;
+            }
+        }
+    }
+    if (sock->cwnd > 2 * TCP_TX_BUF_SIZE) sock->cwnd = 2 * TCP_TX_BUF_SIZE;
+
+    // Timer runs while something is outstanding
+    if (sock->snd_una == sock->snd_max) sock->rto_deadline = 0;
+    else tcp_arm_rto(sock);
+}
+
+static void tcp_rcv_advance(tcp_socket_internal_t *sock, uint32_t len) {
+    sock->rcv_nxt += len;
+    sock->rx_head = (sock->rx_head + len) % TCP_RX_BUF_SIZE;
+}
+
+// Remember that [start, end) is stored, merging with ranges it touches
+static void tcp_ooo_add(tcp_socket_internal_t *sock, uint32_t start, uint32_t end) {
+    tcp_range_t *r = sock->ooo;
+    int n = sock->nooo;
+    int i = 0;
+    while (i < n && SEQ_LT(r[i].end, start)) i++;
+
+    int j = i;
+    while (j < n && SEQ_LEQ(r[j].start, end)) {
+        if (SEQ_LT(r[j].start, start)) start = r[j].start;
+        if (SEQ_GT(r[j].end, end)) end = r[j].end;
+        j++;
+    }
+    if (j == i && n == TCP_OOO_MAX) return;    // No room - it will be resent
+
+    memmove(&r[i + 1], &r[j], (n - j) * sizeof(tcp_range_t));
+    r[i].start = start;
+    r[i].end = end;
+    sock->nooo = n - (j - i) + 1;
+}
+
+// Hand over stored ranges that rcv_nxt has caught up with
+static void tcp_ooo_collect(tcp_socket_internal_t *sock) {
+    while (sock->nooo > 0 && SEQ_LEQ(sock->ooo[0].start, sock->rcv_nxt)) {
+        if (SEQ_GT(sock->ooo[0].end, sock->rcv_nxt)) {
+            tcp_rcv_advance(sock, sock->ooo[0].end - sock->rcv_nxt);
+        }
+        sock->nooo--;
+        memmove(&sock->ooo[0], &sock->ooo[1], sock->nooo * sizeof(tcp_range_t));
+    }
+}
+
+// Take in the data (and FIN) of a segment
+static void tcp_receive(tcp_socket_internal_t *sock, uint32_t seq,
+                        const uint8_t *data, uint32_t len, int fin) {
+    // Trim off what we already have...
+    if (SEQ_LT(seq, sock->rcv_nxt)) {
+        uint32_t dup = sock->rcv_nxt - seq;
+        if (dup > len || (dup == len && !fin)) {
+            if (len > 0 || fin) tcp_send_ack(sock);    // Our ACK was lost
+            return;
+        }
+        seq += dup;
+        data += dup;
+        len -= dup;
+    }
+
+    // ...and what doesn't fit the window
+    uint32_t space = tcp_rx_free(sock);
+    uint32_t off = seq - sock->rcv_nxt;
+    if (off > space || (off == space && len > 0)) {
+        tcp_send_ack(sock);
+        return;
+    }
+    if (len > space - off) {
+        len = space - off;
+        fin = 0;
+    }
+    if (len == 0 && !fin) return;
+
+    // Store it at its place in the ring, next in line or not
+    if (len > 0) {
+        uint32_t pos = (sock->rx_head + off) % TCP_RX_BUF_SIZE;
+        uint32_t first = min_u32(len, TCP_RX_BUF_SIZE - pos);
+        memcpy(sock->rx_buf + pos, data, first);
+        memcpy(sock->rx_buf, data + first, len - first);
+    }
+
+    if (off > 0) {
+        // Early: keep it, and say at once what is missing so the sender
+        // can fast retransmit. A FIN out of order is left to be resent.
+        if (len > 0) {
+            tcp_ooo_add(sock, seq, seq + len);
+            tcp_stat_ooo++;
+        }
+        tcp_send_ack(sock);
+        return;
+    }
+
+    int filled_gap = sock->nooo > 0;
+    tcp_rcv_advance(sock, len);
+    tcp_ooo_collect(sock);
+
+    if (fin && sock->nooo == 0) {
+        sock->rcv_nxt++;
+        sock->fin_received = 1;
+        if (sock->state == TCP_STATE_ESTABLISHED) {
+            sock->state = TCP_STATE_CLOSE_WAIT;
+            printf("[TCP] Received FIN, connection closing\n");
+        } else if (sock->state == TCP_STATE_FIN_WAIT_1) {
+            sock->state = TCP_STATE_CLOSING;
+        } else if (sock->state == TCP_STATE_FIN_WAIT_2) {
+            sock->state = TCP_STATE_TIME_WAIT;
+        }
+        tcp_send_ack(sock);
+        return;
+    }
+
+    // Delayed ACK: every second segment, or within TCP_DELACK_MS
+    if (filled_gap || ++sock->unacked_segs >= 2) {
+        tcp_send_ack(sock);
+    } else if (!sock->delack_deadline) {
+        sock->delack_deadline = hal_get_time_ns() + TCP_DELACK_MS * 1000000ULL;
+        tcp_timer_started();
+    }
+}
+
+// MSS and window scale from a SYN's options (left alone if absent)
+static void tcp_parse_options(const uint8_t *opt, uint32_t len, uint16_t *mss, int *wscale) {
+    uint32_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == 0) break;           // End of options
+        if (kind == 1) {                // NOP
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len) break;
+        uint8_t olen = opt[i + 1];
+        if (kind == 2 && olen == 4) {
+            *mss = (opt[i + 2] << 8) | opt[i + 3];
+        } else if (kind == 3 && olen == 3) {
+            *wscale = opt[i + 2];
+        }
+        i += olen;
+    }
+}
 
-    return ip_send(sock->remote_ip, IP_PROTO_TCP, pkt, sizeof(tcp_header_t) + len);
+static uint32_t tcp_hashfn(uint32_t remote_ip, uint16_t remote_port, uint16_t local_port) {
+    uint32_t h = remote_ip ^ (((uint32_t)remote_port << 16) | local_port);
+    return (h * 0x9e3779b1u) >> (32 - TCP_HASH_BITS);
 }
 
 // Find socket by connection tuple
 static tcp_socket_internal_t *tcp_find_socket(uint32_t remote_ip, uint16_t remote_port,
                                                uint16_t local_port) {
-    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-        tcp_socket_internal_t *s = &tcp_sockets[i];
+    tcp_socket_internal_t *s = tcp_hash[tcp_hashfn(remote_ip, remote_port, local_port)];
+    for (; s; s = s->hnext) {
         if (s->state != TCP_STATE_CLOSED &&
             s->remote_ip == remote_ip &&
             s->remote_port == remote_port &&
@@ -898,9 +2019,376 @@ static tcp_socket_internal_t *tcp_find_socket(uint32_t remote_ip, uint16_t remot
     return NULL;
 }
 
-// Get socket index
-static int tcp_socket_index(tcp_socket_internal_t *sock) {
-    return sock - tcp_sockets;
+static tcp_socket_internal_t *tcp_find_listener(uint16_t port) {
+    for (tcp_socket_internal_t *s = tcp_listeners; s; s = s->hnext) {
+        if (s->local_port == port) return s;
+    }
+    return NULL;
+}
+
+static void tcp_hash_insert(tcp_socket_internal_t *sock) {
+    uint32_t b = tcp_hashfn(sock->remote_ip, sock->remote_port, sock->local_port);
+    sock->hnext = tcp_hash[b];
+    tcp_hash[b] = sock;
+}
+
+// Zeroed socket with default parameters; buffers only if with_buffers.
+// NULL if out of memory.
+static tcp_socket_internal_t *tcp_alloc(int with_buffers) {
+    tcp_socket_internal_t *sock = malloc(sizeof(tcp_socket_internal_t));
+    if (!sock) return NULL;
+    memset(sock, 0, sizeof(*sock));
+
+    if (with_buffers) {
+        sock->rx_buf = malloc(TCP_RX_BUF_SIZE);
+        sock->tx_buf = malloc(TCP_TX_BUF_SIZE);
+        if (!sock->rx_buf || !sock->tx_buf) {
+            free(sock->rx_buf);
+            free(sock->tx_buf);
+            free(sock);
+            return NULL;
+        }
+    }
+
+    sock->slot = -1;
+    sock->local_ip = our_ip;
+    sock->mss = TCP_DEFAULT_MSS;
+    sock->rcv_wscale = TCP_WSCALE;
+    sock->cwnd = TCP_INIT_CWND * TCP_DEFAULT_MSS;
+    sock->ssthresh = 0xffffffff;
+    sock->rto_ms = TCP_RTO_INIT_MS;
+    return sock;
+}
+
+static uint32_t tcp_new_iss(void) {
+    return 1000 + (uint32_t)hal_get_time_ns() + (tcp_next_port * 1234);
+}
+
+// Give a socket a handle, growing the slot table if it is full. -1 if
+// there are TCP_MAX_SOCKETS handles out already, or no memory.
+static int tcp_slot_assign(tcp_socket_internal_t *sock) {
+    for (int i = 0; i < tcp_nslots; i++) {
+        if (!tcp_slots[i]) {
+            tcp_slots[i] = sock;
+            sock->slot = i;
+            return i;
+        }
+    }
+
+    int n = tcp_nslots ? tcp_nslots * 2 : TCP_MIN_SLOTS;
+    if (n > TCP_MAX_SOCKETS) n = TCP_MAX_SOCKETS;
+    if (n == tcp_nslots) return -1;
+    tcp_socket_internal_t **slots = malloc(n * sizeof(tcp_socket_internal_t *));
+    if (!slots) return -1;
+    memset(slots, 0, n * sizeof(tcp_socket_internal_t *));
+    if (tcp_slots) {
+        memcpy(slots, tcp_slots, tcp_nslots * sizeof(tcp_socket_internal_t *));
+        free(tcp_slots);
+    }
+
+    int i = tcp_nslots;
+    tcp_slots = slots;
+    tcp_nslots = n;
+    tcp_slots[i] = sock;
+    sock->slot = i;
+    return i;
+}
+
+// Socket behind a handle, NULL if the handle is not open
+static tcp_socket_internal_t *tcp_get(tcp_socket_t sock_id) {
+    if (sock_id < 0 || sock_id >= tcp_nslots) return NULL;
+    return tcp_slots[sock_id];
+}
+
+// Something happened on sock that a waiter may want: data, room to send,
+// a state change. A connection not yet accepted wakes its listener.
+static void tcp_wake(tcp_socket_internal_t *sock) {
+    if (sock->slot < 0 && sock->listener) sock = sock->listener;
+    if (sock->slot >= 0) process_wake_all(&tcp_wq[sock->slot]);
+    process_wake_all(&poll_wq);
+}
+
+// Take a child off its listener: out of the accept queue, not counted
+static void tcp_detach(tcp_socket_internal_t *sock) {
+    tcp_socket_internal_t *lsn = sock->listener;
+    tcp_socket_internal_t *prev = NULL;
+    for (tcp_socket_internal_t *s = lsn->accept_head; s; prev = s, s = s->qnext) {
+        if (s != sock) continue;
+        if (prev) prev->qnext = s->qnext;
+        else lsn->accept_head = s->qnext;
+        if (lsn->accept_tail == s) lsn->accept_tail = prev;
+        break;
+    }
+    sock->qnext = NULL;
+    sock->listener = NULL;
+    lsn->pending--;
+}
+
+// Unlink a socket from everything and free it
+static void tcp_free(tcp_socket_internal_t *sock) {
+    tcp_socket_internal_t **pp;
+    if (sock->state == TCP_STATE_LISTEN) {
+        pp = &tcp_listeners;
+    } else {
+        pp = &tcp_hash[tcp_hashfn(sock->remote_ip, sock->remote_port, sock->local_port)];
+    }
+    while (*pp && *pp != sock) pp = &(*pp)->hnext;
+    if (*pp) *pp = sock->hnext;
+
+    if (sock->slot >= 0) tcp_slots[sock->slot] = NULL;
+    if (sock->listener) tcp_detach(sock);
+
+    free(sock->rx_buf);
+    free(sock->tx_buf);
+    free(sock);
+}
+
+// RST for a segment that belongs to no connection (RFC 793)
+static void tcp_send_reset(uint32_t dst_ip, const tcp_header_t *in, uint32_t data_len) {
+    if (in->flags & TCP_RST) return;
+
+    pbuf_t *p = pbuf_alloc(sizeof(tcp_header_t));
+    if (!p) return;
+    tcp_header_t *tcp = (tcp_header_t *)p->payload;
+    uint32_t seq = 0;
+    uint32_t ack = 0;
+    uint8_t flags = TCP_RST;
+    if (in->flags & TCP_ACK) {
+        seq = ntohl(in->ack);
+    } else {
+        ack = ntohl(in->seq) + data_len + ((in->flags & TCP_SYN) ? 1 : 0) +
+              ((in->flags & TCP_FIN) ? 1 : 0);
+        flags |= TCP_ACK;
+    }
+
+    tcp->src_port = in->dst_port;
+    tcp->dst_port = in->src_port;
+    tcp->seq = htonl(seq);
+    tcp->ack = htonl(ack);
+    tcp->data_off = (sizeof(tcp_header_t) / 4) << 4;
+    tcp->flags = flags;
+    tcp->window = 0;
+    tcp->checksum = 0;
+    tcp->urgent = 0;
+    tcp->checksum = tcp_checksum(htonl(our_ip), htonl(dst_ip), p->payload, p->len);
+
+    ip_output(p, dst_ip, IP_PROTO_TCP);
+    pbuf_free(p);
+}
+
+// Abort a connection: RST to the peer, nothing more sent
+static void tcp_abort(tcp_socket_internal_t *sock) {
+    if (sock->state != TCP_STATE_CLOSED && sock->state != TCP_STATE_SYN_SENT) {
+        tcp_xmit(sock, sock->snd_nxt, TCP_RST, 0);
+    }
+    sock->state = TCP_STATE_CLOSED;
+    sock->rto_deadline = 0;
+    sock->delack_deadline = 0;
+}
+
+// Free a socket nobody will ask about again: closed by the app and done
+// (or out of time), or dropped before it was accepted. 1 if freed.
+static int tcp_reap(tcp_socket_internal_t *sock, uint64_t now) {
+    if (sock->orphan) {
+        if (sock->state != TCP_STATE_CLOSED && sock->state != TCP_STATE_TIME_WAIT) {
+            if (now < sock->close_deadline) return 0;
+            tcp_abort(sock);
+        }
+    } else if (!sock->listener || sock->state != TCP_STATE_CLOSED) {
+        return 0;
+    }
+    tcp_free(sock);
+    return 1;
+}
+
+// SYN+ACK for our SYN
+static void tcp_handle_syn_sent(tcp_socket_internal_t *sock, const tcp_header_t *tcp,
+                                uint32_t hdr_len, uint32_t seq, uint32_t ack) {
+    if ((tcp->flags & (TCP_SYN | TCP_ACK)) != (TCP_SYN | TCP_ACK) || ack != sock->iss + 1) {
+        return;
+    }
+
+    uint16_t mss = TCP_DEFAULT_MSS;
+    int wscale = -1;
+    tcp_parse_options((const uint8_t *)tcp + sizeof(tcp_header_t),
+                      hdr_len - sizeof(tcp_header_t), &mss, &wscale);
+
+    sock->mss = mss < TCP_MSS ? mss : TCP_MSS;
+    if (sock->mss < 64) sock->mss = 64;
+    if (wscale >= 0) {
+        sock->snd_wscale = wscale > 14 ? 14 : wscale;
+    } else {
+        sock->snd_wscale = 0;       // Scaling needs both sides
+        sock->rcv_wscale = 0;
+    }
+
+    sock->snd_una = sock->snd_nxt = sock->snd_max = ack;
+    sock->snd_wnd = ntohs(tcp->window);     // Never scaled in a SYN
+    sock->snd_wl1 = seq;
+    sock->snd_wl2 = ack;
+    sock->rcv_nxt = seq + 1;
+    sock->cwnd = TCP_INIT_CWND * sock->mss;
+
+    if (sock->rtt_start) {
+        tcp_rtt_sample(sock, hal_get_time_ns() - sock->rtt_start);
+        sock->rtt_start = 0;
+    }
+    sock->backoff = 0;
+    sock->rto_deadline = 0;
+
+    sock->state = TCP_STATE_ESTABLISHED;
+    tcp_send_ack(sock);
+    printf("[TCP] Connection established\n");
+}
+
+// SYN to a listening port: a child socket in SYN_RECEIVED answers it.
+// Past the backlog the SYN is dropped and the peer tries again later.
+static void tcp_handle_listen(tcp_socket_internal_t *lsn, const tcp_header_t *tcp,
+                              uint32_t hdr_len, uint32_t src_ip, uint32_t seq) {
+    if (lsn->pending >= lsn->backlog) return;
+
+    tcp_socket_internal_t *sock = tcp_alloc(1);
+    if (!sock) return;
+
+    uint16_t mss = TCP_DEFAULT_MSS;
+    int wscale = -1;
+    tcp_parse_options((const uint8_t *)tcp + sizeof(tcp_header_t),
+                      hdr_len - sizeof(tcp_header_t), &mss, &wscale);
+
+    sock->mss = mss < TCP_MSS ? mss : TCP_MSS;
+    if (sock->mss < 64) sock->mss = 64;
+    if (wscale >= 0) {
+        sock->snd_wscale = wscale > 14 ? 14 : wscale;
+    } else {
+        sock->rcv_wscale = 0;       // Peer can't scale, so we don't either
+    }
+
+    sock->remote_ip = src_ip;
+    sock->remote_port = ntohs(tcp->src_port);
+    sock->local_port = lsn->local_port;
+    sock->iss = tcp_new_iss();
+    sock->snd_una = sock->iss;
+    sock->snd_nxt = sock->snd_max = sock->iss + 1;
+    sock->recover = sock->iss;
+    sock->snd_wnd = ntohs(tcp->window);
+    sock->snd_wl1 = seq;
+    sock->snd_wl2 = sock->iss;
+    sock->rcv_nxt = seq + 1;
+    sock->state = TCP_STATE_SYN_RECEIVED;
+
+    sock->listener = lsn;
+    lsn->pending++;
+    tcp_hash_insert(sock);
+
+    // SYN+ACK (the timer resends it)
+    tcp_xmit(sock, sock->iss, TCP_SYN, 0);
+}
+
+// ACK of our SYN+ACK: the connection is up and waits for tcp_accept()
+static void tcp_handle_syn_received(tcp_socket_internal_t *sock, const tcp_header_t *tcp,
+                                    uint32_t seq, uint32_t ack) {
+    sock->snd_una = sock->snd_nxt = ack;
+    sock->snd_wnd = (uint32_t)ntohs(tcp->window) << sock->snd_wscale;
+    sock->snd_wl1 = seq;
+    sock->snd_wl2 = ack;
+    sock->cwnd = TCP_INIT_CWND * sock->mss;
+
+    if (sock->rtt_start) {
+        tcp_rtt_sample(sock, hal_get_time_ns() - sock->rtt_start);
+        sock->rtt_start = 0;
+    }
+    sock->backoff = 0;
+    sock->rto_deadline = 0;
+    sock->state = TCP_STATE_ESTABLISHED;
+
+    tcp_socket_internal_t *lsn = sock->listener;
+    if (lsn->accept_tail) lsn->accept_tail->qnext = sock;
+    else lsn->accept_head = sock;
+    lsn->accept_tail = sock;
+}
+
+// One segment for an existing connection
+static void tcp_segment(tcp_socket_internal_t *sock, const tcp_header_t *tcp,
+                        uint32_t seq, uint32_t ack, const uint8_t *data, uint32_t data_len) {
+    uint8_t flags = tcp->flags;
+    uint32_t data_off = (tcp->data_off >> 4) * 4;
+
+    // Handle RST, if it's really for this connection
+    if (flags & TCP_RST) {
+        int valid;
+        if (sock->state == TCP_STATE_SYN_SENT) {
+            valid = (flags & TCP_ACK) && ack == sock->iss + 1;
+        } else {
+            valid = SEQ_GEQ(seq, sock->rcv_nxt) &&
+                    SEQ_LEQ(seq, sock->rcv_nxt + tcp_rx_free(sock));
+        }
+        if (valid) {
+            if (sock->state != TCP_STATE_SYN_RECEIVED) {
+                printf("[TCP] Connection reset by peer\n");
+            }
+            sock->state = TCP_STATE_CLOSED;
+        }
+        return;
+    }
+
+    if (sock->state == TCP_STATE_SYN_SENT) {
+        tcp_handle_syn_sent(sock, tcp, data_off, seq, ack);
+        return;
+    }
+
+    if (sock->state == TCP_STATE_SYN_RECEIVED) {
+        // The peer's SYN again: our SYN+ACK was lost
+        if (flags & TCP_SYN) {
+            if (seq + 1 == sock->rcv_nxt) tcp_retransmit(sock);
+            return;
+        }
+        if (!(flags & TCP_ACK)) return;
+        if (ack != sock->iss + 1) {
+            tcp_send_reset(sock->remote_ip, tcp, data_len);
+            return;
+        }
+        tcp_handle_syn_received(sock, tcp, seq, ack);
+        // Data may ride on the ACK - carry on
+    }
+
+    // From here on every segment carries an ACK. A repeated SYN+ACK means
+    // our ACK of it was lost.
+    if (!(flags & TCP_ACK)) return;
+    if (flags & TCP_SYN) {
+        tcp_send_ack(sock);
+        return;
+    }
+
+    tcp_process_ack(sock, tcp, seq, ack, data_len);
+    if (sock->state == TCP_STATE_CLOSED) return;
+
+    // Our FIN got through
+    if (sock->fin_acked) {
+        if (sock->state == TCP_STATE_FIN_WAIT_1) {
+            sock->state = TCP_STATE_FIN_WAIT_2;
+        } else if (sock->state == TCP_STATE_CLOSING) {
+            sock->state = TCP_STATE_TIME_WAIT;
+        } else if (sock->state == TCP_STATE_LAST_ACK) {
+            sock->state = TCP_STATE_CLOSED;
+            printf("[TCP] Connection closed\n");
+            return;
+        }
+    }
+
+    switch (sock->state) {
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_FIN_WAIT_1:
+        case TCP_STATE_FIN_WAIT_2:
+            tcp_receive(sock, seq, data, data_len, flags & TCP_FIN);
+            break;
+        default:
+            // Peer already sent its FIN - anything more is a resend
+            if (data_len > 0 || (flags & TCP_FIN)) tcp_send_ack(sock);
+            break;
+    }
+
+    // ACKs open the window; send what it now allows
+    tcp_output(sock);
 }
 
 // Handle incoming TCP packet
@@ -921,293 +2409,372 @@ static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
     const uint8_t *data = pkt + data_off;
     uint32_t data_len = len - data_off;
 
-    // Find matching socket
+    // Find matching socket, or a listener for a new connection
     tcp_socket_internal_t *sock = tcp_find_socket(src_ip, src_port, dst_port);
     if (!sock) {
-        // No socket - send RST if not a RST
-        if (!(flags & TCP_RST)) {
-            // TODO: send RST
+        tcp_socket_internal_t *lsn = tcp_find_listener(dst_port);
+        if (lsn && (flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+            tcp_handle_listen(lsn, tcp, data_off, src_ip, seq);
+        } else {
+            tcp_send_reset(src_ip, tcp, data_len);
         }
         return;
     }
 
-    // Handle RST
-    if (flags & TCP_RST) {
-        printf("[TCP] Connection reset by peer\n");
-        sock->state = TCP_STATE_CLOSED;
-        return;
-    }
-
-    // State machine
-    switch (sock->state) {
-        case TCP_STATE_SYN_SENT:
-            // Expecting SYN+ACK
-            if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
-                if (ack == sock->send_seq + 1) {
-                    sock->send_seq = ack;
-                    sock->send_ack = seq + 1;
-                    sock->recv_seq = seq + 1;
-
-                    // Send ACK
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                    sock->state = TCP_STATE_ESTABLISHED;
-                    printf("[TCP] Connection established\n");
-                }
-            }
-            break;
+    tcp_segment(sock, tcp, seq, ack, data, data_len);
+    tcp_wake(sock);
+    tcp_reap(sock, hal_get_time_ns());
+}
 
-        case TCP_STATE_ESTABLISHED:
-            // Check if ACK is valid
-            if (flags & TCP_ACK) {
-                // Update send_seq if this ACKs new data
-                if (ack > sock->send_seq - 1000 && ack <= sock->send_seq + 10000) {
-                    // Valid ACK range (rough check)
-                }
+// ARP gave up on next_hop: connections still opening through it fail now
+// rather than when their SYN runs out of retries
+static void tcp_unreachable(uint32_t next_hop) {
+    for (int b = 0; b < TCP_HASH_SIZE; b++) {
+        for (tcp_socket_internal_t *sock = tcp_hash[b]; sock; sock = sock->hnext) {
+            if (sock->state == TCP_STATE_SYN_SENT && ip_next_hop(sock->remote_ip) == next_hop) {
+                printf("[TCP] %s unreachable\n", ip_to_str(sock->remote_ip));
+                sock->state = TCP_STATE_CLOSED;
+                sock->rto_deadline = 0;
+                tcp_wake(sock);
             }
+        }
+    }
+}
 
-            // Handle incoming data
-            if (data_len > 0) {
-                // Check if this is the next expected segment
-                if (seq == sock->send_ack) {
-                    // Copy data to receive buffer, track how many bytes actually stored
-                    uint32_t bytes_stored = 0;
-                    for (uint32_t i = 0; i < data_len; i++) {
-                        uint32_t next_head = (sock->rx_head + 1) % TCP_RX_BUF_SIZE;
-                        if (next_head == sock->rx_tail) {
-                            // Buffer full - stop here
-                            break;
-                        }
-                        sock->rx_buf[sock->rx_head] = data[i];
-                        sock->rx_head = next_head;
-                        bytes_stored++;
-                    }
-
-                    // CRITICAL: Only ACK bytes we actually stored!
-                    // Otherwise we tell sender we got data that was dropped.
-                    sock->send_ack = seq + bytes_stored;
-
-                    // Send ACK
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
+void net_tick(void) {
+    // Like the RX IRQ: if someone holds the lock, try again next tick
+    int cpu = cpu_this()->id;
+    if (net_owner == cpu || !spin_trylock(&net_spin)) return;
+    net_owner = cpu;
+    net_depth = 1;
+
+    uint64_t now = hal_get_time_ns();
+    arp_timers_pending = arp_tick(now);
+    dns_timers_pending = dns_tick(now);
+
+    // Segments sent from here only queue, so the chains hold still apart
+    // from the socket being reaped
+    int active = 0;
+    for (int b = 0; b < TCP_HASH_SIZE; b++) {
+        tcp_socket_internal_t *next;
+        for (tcp_socket_internal_t *sock = tcp_hash[b]; sock; sock = next) {
+            next = sock->hnext;
+            if (sock->state != TCP_STATE_CLOSED) {
+                if (sock->delack_deadline && now >= sock->delack_deadline) {
+                    tcp_send_ack(sock);
                 }
-            }
-
-            // Handle FIN
-            if (flags & TCP_FIN) {
-                sock->fin_received = 1;
-                sock->send_ack = seq + data_len + 1;
-                tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                sock->state = TCP_STATE_CLOSE_WAIT;
-                printf("[TCP] Received FIN, connection closing\n");
-            }
-            break;
-
-        case TCP_STATE_FIN_WAIT_1:
-            if (flags & TCP_ACK) {
-                if (flags & TCP_FIN) {
-                    // Simultaneous close
-                    sock->send_ack = seq + 1;
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                    sock->state = TCP_STATE_TIME_WAIT;
-                } else {
-                    sock->state = TCP_STATE_FIN_WAIT_2;
+                if (sock->rto_deadline && now >= sock->rto_deadline) {
+                    sock->rto_deadline = 0;
+                    tcp_timeout(sock);
+                    if (sock->state == TCP_STATE_CLOSED) tcp_wake(sock);
                 }
             }
-            break;
-
-        case TCP_STATE_FIN_WAIT_2:
-            if (flags & TCP_FIN) {
-                sock->send_ack = seq + 1;
-                tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                sock->state = TCP_STATE_TIME_WAIT;
-            }
-            break;
+            if (tcp_reap(sock, now)) continue;
+            if (sock->rto_deadline || sock->delack_deadline || sock->orphan) active = 1;
+        }
+    }
+    tcp_timers_pending = active;
 
-        case TCP_STATE_CLOSE_WAIT:
-            // Waiting for application to close
-            break;
+    net_release();
+}
 
-        case TCP_STATE_LAST_ACK:
-            if (flags & TCP_ACK) {
-                sock->state = TCP_STATE_CLOSED;
-                printf("[TCP] Connection closed\n");
-            }
-            break;
+int net_timers_pending(void) {
+    return tcp_timers_pending || arp_timers_pending || dns_timers_pending;
+}
 
-        case TCP_STATE_TIME_WAIT:
-            // Should wait 2*MSL, but we just close immediately
-            sock->state = TCP_STATE_CLOSED;
-            break;
+void tcp_get_stats(uint64_t *timeouts, uint64_t *fast_retransmits, uint64_t *ooo_segments) {
+    if (timeouts) *timeouts = tcp_stat_timeouts;
+    if (fast_retransmits) *fast_retransmits = tcp_stat_fast_retransmits;
+    if (ooo_segments) *ooo_segments = tcp_stat_ooo;
+}
 
-        default:
-            break;
+// Next ephemeral port with no connection to ip:port and no listener on it
+static uint16_t tcp_pick_port(uint32_t ip, uint16_t port) {
+    while (1) {
+        uint16_t p = tcp_next_port++;
+        if (tcp_next_port == 0) tcp_next_port = 49152;
+        if (!tcp_find_socket(ip, port, p) && !tcp_find_listener(p)) return p;
     }
 }
 
 // Public API
 
 tcp_socket_t tcp_connect(uint32_t ip, uint16_t port) {
-    // Find free socket
-    int idx = -1;
-    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-        if (tcp_sockets[i].state == TCP_STATE_CLOSED) {
-            idx = i;
-            break;
-        }
+    if ((ip >> 24) == 127) ip = our_ip;
+
+    // The SYN waits in the ARP queue if the next hop isn't known yet
+    tcp_socket_internal_t *sock = tcp_alloc(1);
+    if (!sock) {
+        printf("[TCP] Out of memory\n");
+        return -1;
     }
+
+    net_lock();
+    int idx = tcp_slot_assign(sock);
     if (idx < 0) {
+        tcp_free(sock);
+        net_unlock();
         printf("[TCP] No free sockets\n");
         return -1;
     }
 
-    tcp_socket_internal_t *sock = &tcp_sockets[idx];
-    memset(sock, 0, sizeof(*sock));
-
-    sock->local_ip = our_ip;
     sock->remote_ip = ip;
-    sock->local_port = tcp_next_port++;
     sock->remote_port = port;
-    sock->send_seq = 1000 + (tcp_next_port * 1234);  // Simple ISN
-    sock->send_ack = 0;
+    sock->local_port = tcp_pick_port(ip, port);
+    sock->iss = tcp_new_iss();
+    sock->snd_una = sock->iss;
+    sock->snd_nxt = sock->snd_max = sock->iss + 1;
+    sock->recover = sock->iss;
     sock->state = TCP_STATE_SYN_SENT;
+    tcp_hash_insert(sock);
 
-    // ARP resolve first
-    uint32_t next_hop = ip;
-    if ((ip & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
+    // Send SYN (the timer resends it)
+    printf("[TCP] Connecting to %s:%d\n", ip_to_str(ip), port);
+    tcp_xmit(sock, sock->iss, TCP_SYN, 0);
+    net_unlock();
+
+    // Wait for SYN+ACK (up to 10 seconds). The socket has no owner but
+    // us until we return, so it can't go away meanwhile.
+    uint64_t deadline = net_deadline(TCP_CONNECT_MS);
+    while (hal_get_time_ns() < deadline) {
+        uint32_t seq = wait_queue_seq(&tcp_wq[idx]);
+        if (sock->state != TCP_STATE_SYN_SENT) break;
+        process_wait_on(&tcp_wq[idx], seq, deadline);
     }
 
-    if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-        if (!arp_lookup(next_hop)) {
-            printf("[TCP] ARP failed for %s\n", ip_to_str(next_hop));
-            sock->state = TCP_STATE_CLOSED;
-            return -1;
-        }
-    }
+    net_lock();
+    int ok = (sock->state == TCP_STATE_ESTABLISHED);
+    if (!ok) tcp_free(sock);
+    net_unlock();
 
-    // Send SYN
-    printf("[TCP] Connecting to %s:%d\n", ip_to_str(ip), port);
-    if (tcp_send_segment(sock, TCP_SYN, NULL, 0) < 0) {
-        sock->state = TCP_STATE_CLOSED;
+    if (!ok) {
+        printf("[TCP] Connection timeout\n");
         return -1;
     }
+    return idx;
+}
 
-    // Wait for SYN+ACK (up to 10 seconds)
-    for (int i = 0; i < 1000 && sock->state == TCP_STATE_SYN_SENT; i++) {
-        net_poll();
-        for (volatile int j = 0; j < 100000; j++);
+tcp_socket_t tcp_listen(uint16_t port, int backlog) {
+    if (port == 0) return -1;
+    if (backlog < 1) backlog = 1;
+    if (backlog > TCP_MAX_BACKLOG) backlog = TCP_MAX_BACKLOG;
+
+    tcp_socket_internal_t *sock = tcp_alloc(0);
+    if (!sock) return -1;
+
+    net_lock();
+    if (tcp_find_listener(port) || tcp_slot_assign(sock) < 0) {
+        net_unlock();
+        free(sock);
+        return -1;
     }
+    sock->state = TCP_STATE_LISTEN;
+    sock->local_port = port;
+    sock->backlog = backlog;
+    sock->hnext = tcp_listeners;
+    tcp_listeners = sock;
+    int idx = sock->slot;
+    net_unlock();
+
+    printf("[TCP] Listening on port %d\n", port);
+    return idx;
+}
 
-    if (sock->state != TCP_STATE_ESTABLISHED) {
-        printf("[TCP] Connection timeout\n");
-        sock->state = TCP_STATE_CLOSED;
+tcp_socket_t tcp_accept(tcp_socket_t listener) {
+    net_lock();
+    tcp_socket_internal_t *lsn = tcp_get(listener);
+    if (!lsn || lsn->state != TCP_STATE_LISTEN || !lsn->accept_head) {
+        net_unlock();
         return -1;
     }
 
+    tcp_socket_internal_t *sock = lsn->accept_head;
+    int idx = tcp_slot_assign(sock);
+    if (idx >= 0) tcp_detach(sock);
+    net_unlock();
     return idx;
 }
 
-int tcp_send(tcp_socket_t sock_id, const void *data, uint32_t len) {
-    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
+tcp_socket_t tcp_accept_wait(tcp_socket_t listener, uint32_t timeout_ms) {
+    if (listener < 0 || listener >= TCP_MAX_SOCKETS) return -1;
+    uint64_t deadline = net_deadline(timeout_ms);
+
+    while (1) {
+        uint32_t seq = wait_queue_seq(&tcp_wq[listener]);
+        int sock = tcp_accept(listener);
+        if (sock >= 0 || hal_get_time_ns() >= deadline) return sock;
 
-    tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
-    if (sock->state != TCP_STATE_ESTABLISHED) return -1;
+        // A closed listener has nothing more coming
+        net_lock();
+        tcp_socket_internal_t *lsn = tcp_get(listener);
+        int listening = lsn && lsn->state == TCP_STATE_LISTEN;
+        net_unlock();
+        if (!listening) return -1;
 
-    // Send data in chunks (MSS ~1460, use 1400 to be safe)
-    const uint8_t *ptr = (const uint8_t *)data;
+        process_wait_on(&tcp_wq[listener], seq, deadline);
+    }
+}
+
+int tcp_send(tcp_socket_t sock_id, const void *data, uint32_t len) {
+    const uint8_t *src = (const uint8_t *)data;
     uint32_t sent = 0;
+    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
 
+    // Queue it all, waiting for ACKs to make room as needed
     while (sent < len) {
-        uint32_t chunk = len - sent;
-        if (chunk > 1400) chunk = 1400;
-
-        if (tcp_send_segment(sock, TCP_ACK | TCP_PSH, ptr + sent, chunk) < 0) {
+        uint32_t seq = wait_queue_seq(&tcp_wq[sock_id]);
+        net_lock();
+        tcp_socket_internal_t *sock = tcp_get(sock_id);
+        if (!sock || (sock->state != TCP_STATE_ESTABLISHED &&
+                      sock->state != TCP_STATE_CLOSE_WAIT)) {
+            net_unlock();
             return sent > 0 ? (int)sent : -1;
         }
 
-        sock->send_seq += chunk;
-        sent += chunk;
+        uint32_t chunk = min_u32(len - sent, TCP_TX_BUF_SIZE - sock->tx_len);
+        if (chunk > 0) {
+            uint32_t pos = (sock->tx_head + sock->tx_len) % TCP_TX_BUF_SIZE;
+            uint32_t first = min_u32(chunk, TCP_TX_BUF_SIZE - pos);
+            memcpy(sock->tx_buf + pos, src + sent, first);
+            memcpy(sock->tx_buf, src + sent + first, chunk - first);
+            sock->tx_len += chunk;
+            sent += chunk;
+            tcp_output(sock);
+        }
+        net_unlock();
 
-        // Small delay between segments
-        for (volatile int j = 0; j < 10000; j++);
+        if (sent < len && chunk == 0) {
+            process_wait_on(&tcp_wq[sock_id], seq, HAL_TIMER_NEVER);
+        }
     }
 
     return (int)sent;
 }
 
 int tcp_recv(tcp_socket_t sock_id, void *buf, uint32_t maxlen) {
-    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
-
-    tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
-
-    // Poll for incoming data
-    net_poll();
-
-    // Check for data in receive buffer
-    uint8_t *dst = (uint8_t *)buf;
-    uint32_t received = 0;
+    // Check for data in receive buffer (the bottom half fills it)
+    net_lock();
+    tcp_socket_internal_t *sock = tcp_get(sock_id);
+    if (!sock || sock->state == TCP_STATE_LISTEN) {
+        net_unlock();
+        return -1;
+    }
 
-    while (received < maxlen && sock->rx_tail != sock->rx_head) {
-        dst[received++] = sock->rx_buf[sock->rx_tail];
-        sock->rx_tail = (sock->rx_tail + 1) % TCP_RX_BUF_SIZE;
+    uint32_t avail = (sock->rx_head - sock->rx_tail) % TCP_RX_BUF_SIZE;
+    uint32_t received = min_u32(avail, maxlen);
+    if (received > 0) {
+        uint32_t first = min_u32(received, TCP_RX_BUF_SIZE - sock->rx_tail);
+        memcpy(buf, sock->rx_buf + sock->rx_tail, first);
+        memcpy((uint8_t *)buf + first, sock->rx_buf, received - first);
+        sock->rx_tail = (sock->rx_tail + received) % TCP_RX_BUF_SIZE;
+
+        // Tell the sender once the window has opened by a useful amount,
+        // not for every few bytes read
+        uint32_t edge = sock->rcv_nxt + (tcp_rx_free(sock) & ~((1u << sock->rcv_wscale) - 1));
+        if (SEQ_GEQ(edge, sock->rcv_adv + 2 * TCP_MSS) && !sock->fin_received) {
+            tcp_send_ack(sock);
+        }
     }
+    int closed = sock->fin_received || sock->state == TCP_STATE_CLOSED;
+    net_unlock();
 
     // If no data and connection closed, return -1
     if (received == 0) {
-        if (sock->state == TCP_STATE_CLOSE_WAIT ||
-            sock->state == TCP_STATE_CLOSED) {
-            return -1;
-        }
-        return 0;  // No data yet
+        return closed ? -1 : 0;  // 0: no data yet
     }
 
     return (int)received;
 }
 
-void tcp_close(tcp_socket_t sock_id) {
-    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return;
-
-    tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
-
-    if (sock->state == TCP_STATE_ESTABLISHED) {
-        // Send FIN
-        tcp_send_segment(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->fin_sent = 1;
-        sock->state = TCP_STATE_FIN_WAIT_1;
-
-        // Wait for close to complete (up to 5 seconds)
-        for (int i = 0; i < 500 && sock->state != TCP_STATE_CLOSED &&
-                                   sock->state != TCP_STATE_TIME_WAIT; i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-    } else if (sock->state == TCP_STATE_CLOSE_WAIT) {
-        // Send FIN
-        tcp_send_segment(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->state = TCP_STATE_LAST_ACK;
-
-        // Wait for ACK
-        for (int i = 0; i < 500 && sock->state != TCP_STATE_CLOSED; i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
+int tcp_recv_wait(tcp_socket_t sock_id, void *buf, uint32_t maxlen, uint32_t timeout_ms) {
+    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
+    uint64_t deadline = net_deadline(timeout_ms);
+
+    while (1) {
+        uint32_t seq = wait_queue_seq(&tcp_wq[sock_id]);
+        int n = tcp_recv(sock_id, buf, maxlen);
+        if (n != 0 || hal_get_time_ns() >= deadline) return n;
+        process_wait_on(&tcp_wq[sock_id], seq, deadline);
+    }
+}
+
+// Closing a listener resets the connections it hasn't handed out
+static void tcp_close_listener(tcp_socket_internal_t *lsn) {
+    for (int b = 0; b < TCP_HASH_SIZE && lsn->pending > 0; b++) {
+        tcp_socket_internal_t *next;
+        for (tcp_socket_internal_t *sock = tcp_hash[b]; sock; sock = next) {
+            next = sock->hnext;
+            if (sock->listener != lsn) continue;
+            tcp_abort(sock);
+            tcp_free(sock);
         }
     }
+    tcp_free(lsn);
+}
 
-    sock->state = TCP_STATE_CLOSED;
+void tcp_close(tcp_socket_t sock_id) {
+    net_lock();
+    tcp_socket_internal_t *sock = tcp_get(sock_id);
+    if (!sock) {
+        net_unlock();
+        return;
+    }
+    tcp_slots[sock_id] = NULL;
+    sock->slot = -1;
+    process_wake_all(&tcp_wq[sock_id]);     // Anyone else waiting on it gives up
+
+    if (sock->state == TCP_STATE_LISTEN) {
+        tcp_close_listener(sock);
+        net_unlock();
+        return;
+    }
+
+    if (sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_CLOSE_WAIT) {
+        // FIN after whatever is still buffered
+        sock->fin_queued = 1;
+        sock->state = sock->state == TCP_STATE_ESTABLISHED ? TCP_STATE_FIN_WAIT_1
+                                                           : TCP_STATE_LAST_ACK;
+        tcp_output(sock);
+    }
+
+    // The stack finishes the close and frees the socket
+    sock->orphan = 1;
+    sock->close_deadline = hal_get_time_ns() + TCP_LINGER_MS * 1000000ULL;
+    if (!tcp_reap(sock, 0)) tcp_timer_started();
+    net_unlock();
 }
 
 int tcp_is_connected(tcp_socket_t sock_id) {
-    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return 0;
-    return tcp_sockets[sock_id].state == TCP_STATE_ESTABLISHED;
+    net_lock();
+    tcp_socket_internal_t *sock = tcp_get(sock_id);
+    int connected = sock && sock->state == TCP_STATE_ESTABLISHED;
+    net_unlock();
+    return connected;
 }
 
 int tcp_get_state(tcp_socket_t sock_id) {
-    if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return TCP_STATE_CLOSED;
-    return tcp_sockets[sock_id].state;
+    net_lock();
+    tcp_socket_internal_t *sock = tcp_get(sock_id);
+    int state = sock ? sock->state : TCP_STATE_CLOSED;
+    net_unlock();
+    return state;
+}
+
+int tcp_poll(tcp_socket_t sock_id) {
+    net_lock();
+    tcp_socket_internal_t *sock = tcp_get(sock_id);
+    int events = 0;
+    if (!sock || sock->state == TCP_STATE_CLOSED) {
+        events = TCP_POLL_HUP;
+    } else if (sock->state == TCP_STATE_LISTEN) {
+        if (sock->accept_head) events = TCP_POLL_IN;
+    } else {
+        if (sock->rx_head != sock->rx_tail || sock->fin_received) events |= TCP_POLL_IN;
+        if ((sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_CLOSE_WAIT) &&
+            sock->tx_len < TCP_TX_BUF_SIZE) {
+            events |= TCP_POLL_OUT;
+        }
+    }
+    net_unlock();
+    return events;
 }
@@ -77,14 +77,6 @@ typedef struct __attribute__((packed)) {
     uint16_t checksum;
 } udp_header_t;
 
-// ARP table entry
-typedef struct {
-    uint32_t ip;
-    uint8_t mac[6];
-    uint8_t valid;
-    uint32_t timestamp;  // For expiry (future)
-} arp_entry_t;
-
 // Network configuration (QEMU user-mode defaults)
 #define NET_IP          0x0a00020f  // 10.0.2.15
 #define NET_GATEWAY     0x0a000202  // 10.0.2.2
@@ -94,9 +86,36 @@ typedef struct {
 // Initialize network stack
 void net_init(void);
 
-// Process incoming packets (call from main loop or IRQ)
+// Process incoming packets now. Not normally needed: the RX IRQ runs the
+// stack over each batch of frames as it arrives.
 void net_poll(void);
 
+// RX interrupt handler (registered by kernel.c)
+void net_irq_handler(void);
+
+// TCP timers (retransmission, delayed ACK). CPU 0's housekeeping tick
+// calls net_tick() and keeps ticking while net_timers_pending().
+void net_tick(void);
+int net_timers_pending(void);
+
+// Where the time goes, per layer. Each counts the packets that went
+// through it and the time spent there, including the layers it calls:
+// RX from the driver up, TX from TCP down. ACKs sent while handling a
+// received segment count in both.
+#define NET_PROF_RX_DEV 0       // Driver's RX batches, whole stack included
+#define NET_PROF_RX_ETH 1
+#define NET_PROF_RX_IP  2
+#define NET_PROF_RX_TCP 3
+#define NET_PROF_TX_TCP 4       // Building and sending a segment
+#define NET_PROF_TX_IP  5
+#define NET_PROF_TX_ETH 6
+#define NET_PROF_TX_DEV 7       // Driver send, up to the device finishing it
+#define NET_PROF_COUNT  8
+
+// Copies up to max counters since boot (NULL to skip either array);
+// returns NET_PROF_COUNT
+int net_get_prof(uint64_t *packets, uint64_t *ns, int max);
+
 // Send raw ethernet frame
 int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len);
 
@@ -111,6 +130,9 @@ uint16_t ip_checksum(const void *data, uint32_t len);
 // ICMP functions
 int icmp_send_echo_request(uint32_t dst_ip, uint16_t id, uint16_t seq, const void *data, uint32_t len);
 
+// Timeouts of the calls that wait are in ms; this one means no timeout
+#define NET_WAIT_FOREVER 0xffffffffu
+
 // Ping interface (blocking, with timeout)
 // Returns round-trip time in ms, or -1 on timeout
 int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms);
@@ -137,8 +159,12 @@ void udp_bind(uint16_t port, udp_recv_callback_t callback);
 // Unregister a UDP listener
 void udp_unbind(uint16_t port);
 
-// DNS resolver (uses UDP)
-// Returns IP address, or 0 on failure
+// DNS resolver (uses UDP). Answers and failures are cached per their TTL.
+// Without waiting: 1 with *ip set, 0 while the query is out (call again),
+// -1 if the name doesn't resolve
+int dns_lookup(const char *hostname, uint32_t *ip);
+
+// Waits for dns_lookup(). Returns IP address, or 0 on failure
 uint32_t dns_resolve(const char *hostname);
 
 // ============ TCP ============
@@ -173,6 +199,9 @@ typedef struct __attribute__((packed)) {
 #define TCP_STATE_CLOSE_WAIT  5
 #define TCP_STATE_LAST_ACK    6
 #define TCP_STATE_TIME_WAIT   7
+#define TCP_STATE_CLOSING     8
+#define TCP_STATE_LISTEN      9
+#define TCP_STATE_SYN_RECEIVED 10
 
 // TCP socket handle (opaque)
 typedef int tcp_socket_t;
@@ -181,7 +210,8 @@ typedef int tcp_socket_t;
 // Returns socket handle (>=0) or -1 on error
 tcp_socket_t tcp_connect(uint32_t ip, uint16_t port);
 
-// Send data on connected socket
+// Send data on connected socket. Waits while the send buffer is full;
+// the data is then on its way, retransmitted as needed.
 // Returns bytes sent or -1 on error
 int tcp_send(tcp_socket_t sock, const void *data, uint32_t len);
 
@@ -189,7 +219,25 @@ int tcp_send(tcp_socket_t sock, const void *data, uint32_t len);
 // Returns bytes received, 0 if no data, -1 on error/closed
 int tcp_recv(tcp_socket_t sock, void *buf, uint32_t maxlen);
 
-// Close socket
+// Like tcp_recv, but sleeps until data arrives or timeout_ms runs out
+// (then returns 0)
+int tcp_recv_wait(tcp_socket_t sock, void *buf, uint32_t maxlen, uint32_t timeout_ms);
+
+// Accept connections on a port, with up to backlog of them waiting
+// (handshake under way or done) for tcp_accept.
+// Returns listening socket handle or -1 (port taken, no free sockets)
+tcp_socket_t tcp_listen(uint16_t port, int backlog);
+
+// Next established connection on a listening socket, or -1 if none is
+// waiting yet (doesn't block)
+tcp_socket_t tcp_accept(tcp_socket_t listener);
+
+// Like tcp_accept, but sleeps up to timeout_ms for a connection
+tcp_socket_t tcp_accept_wait(tcp_socket_t listener, uint32_t timeout_ms);
+
+// Close socket. Doesn't wait: buffered data and the FIN still go out
+// and the stack frees the socket once the peer is done. Closing a
+// listener resets the connections it hasn't handed out.
 void tcp_close(tcp_socket_t sock);
 
 // Check if socket is connected
@@ -198,4 +246,15 @@ int tcp_is_connected(tcp_socket_t sock);
 // Get socket state (for debugging)
 int tcp_get_state(tcp_socket_t sock);
 
+// What a socket is ready for, without waiting. Sleep on poll_wq (see
+// process.h) to hear about changes.
+#define TCP_POLL_IN  1      // Data or the peer's FIN to read; listeners: a connection
+#define TCP_POLL_OUT 2      // Room in the send buffer
+#define TCP_POLL_HUP 4      // Closed or reset (or not a socket)
+int tcp_poll(tcp_socket_t sock);
+
+// Counters since boot: retransmission timeouts, fast retransmits, and
+// segments that arrived out of order
+void tcp_get_stats(uint64_t *timeouts, uint64_t *fast_retransmits, uint64_t *ooo_segments);
+
 #endif
@@ -0,0 +1,89 @@
+/*
+ * VibeOS Packet Buffers
+ *
+ * Header and buffer are one allocation. Freed buffers go on a free list,
+ * up to PBUF_POOL_MAX, so steady traffic doesn't go through the heap for
+ * every packet. Large buffers for segmentation offload are allocated to
+ * size and not pooled.
+ */
+
+#include "pbuf.h"
+#include "memory.h"
+
+static pbuf_t *pool;
+static int pool_count;
+
+pbuf_t *pbuf_alloc(uint32_t len) {
+    if (len > PBUF_LARGE_MAX) return NULL;
+
+    pbuf_t *p = pool;
+    if (len > PBUF_DATA_SIZE) {
+        p = malloc(sizeof(pbuf_t) + PBUF_HEADROOM + len);
+        if (!p) return NULL;
+        p->base = (uint8_t *)(p + 1);
+        p->size = PBUF_HEADROOM + len;
+    } else if (p) {
+        pool = p->next;
+        pool_count--;
+    } else {
+        p = malloc(sizeof(pbuf_t) + PBUF_HEADROOM + PBUF_DATA_SIZE);
+        if (!p) return NULL;
+        p->base = (uint8_t *)(p + 1);
+        p->size = PBUF_HEADROOM + PBUF_DATA_SIZE;
+    }
+
+    p->payload = p->base + PBUF_HEADROOM;
+    p->len = len;
+    p->refs = 1;
+    p->flags = 0;
+    p->csum_start = p->csum_offset = 0;
+    p->gso_size = 0;
+    p->next = NULL;
+    return p;
+}
+
+void pbuf_borrow(pbuf_t *p, uint8_t *data, uint32_t len, uint32_t headroom) {
+    p->base = data - headroom;
+    p->size = headroom + len;
+    p->payload = data;
+    p->len = len;
+    p->refs = 1;
+    p->flags = PBUF_F_BORROWED;
+    p->csum_start = p->csum_offset = 0;
+    p->gso_size = 0;
+    p->next = NULL;
+}
+
+void *pbuf_push(pbuf_t *p, uint32_t n) {
+    if ((uint32_t)(p->payload - p->base) < n) return NULL;
+    p->payload -= n;
+    p->len += n;
+    return p->payload;
+}
+
+void *pbuf_pull(pbuf_t *p, uint32_t n) {
+    if (p->len < n) return NULL;
+    p->payload += n;
+    p->len -= n;
+    return p->payload;
+}
+
+void pbuf_trim(pbuf_t *p, uint32_t len) {
+    if (len < p->len) p->len = len;
+}
+
+void pbuf_ref(pbuf_t *p) {
+    p->refs++;
+}
+
+void pbuf_free(pbuf_t *p) {
+    if (--p->refs > 0 || (p->flags & PBUF_F_BORROWED)) return;
+
+    if (pool_count < PBUF_POOL_MAX && p->size == PBUF_HEADROOM + PBUF_DATA_SIZE) {
+        p->next = pool;
+        pool = p;
+        pool_count++;
+    } else {
+        free(p);
+    }
+}
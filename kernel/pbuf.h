@@ -0,0 +1,72 @@
+/*
+ * VibeOS Packet Buffers
+ *
+ * One packet in one contiguous buffer, with room in front so each layer
+ * on the way out can put its header there in place instead of copying
+ * the packet behind a new one. On the way in, the driver wraps its own
+ * receive buffer and each layer just steps past its header.
+ *
+ * Buffers are reference counted: whoever keeps a packet beyond the call
+ * that handed it over takes a reference, and the last pbuf_free() gives
+ * the memory back. Received packets borrow the driver's buffer and are
+ * only good until the handler returns.
+ *
+ * A packet the driver is to checksum or cut into segments itself (see
+ * virtio_net_tx_offloads()) says where, in csum_start/csum_offset and
+ * gso_size; only those can be bigger than PBUF_DATA_SIZE.
+ *
+ * Not locked itself - the network stack uses them under its lock.
+ */
+
+#ifndef PBUF_H
+#define PBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PBUF_HEADROOM   64      // Virtio, ethernet, IP and TCP headers fit
+#define PBUF_DATA_SIZE  1536    // Largest payload after the headroom
+#define PBUF_POOL_MAX   64      // Free buffers kept for reuse
+#define PBUF_LARGE_MAX  65536   // Largest payload of a segmentation offload
+
+#define PBUF_F_BORROWED 0x01    // Memory belongs to someone else
+#define PBUF_F_CSUM     0x02    // Checksum left to the device
+
+typedef struct pbuf {
+    uint8_t *payload;           // Current start of the packet
+    uint32_t len;
+    uint8_t *base;              // Start of the buffer; headroom is payload - base
+    uint32_t size;
+    int refs;
+    uint8_t flags;
+    uint16_t csum_start;        // PBUF_F_CSUM: sum from base + csum_start on,
+    uint16_t csum_offset;       //  and store it csum_offset bytes further
+    uint16_t gso_size;          // Device segments the payload at this, 0 = don't
+    struct pbuf *next;          // Free list / a queue holding a reference
+} pbuf_t;
+
+// New buffer with len bytes of payload after the headroom, refs 1. Up to
+// PBUF_DATA_SIZE comes from the pool; up to PBUF_LARGE_MAX is a one-off
+// allocation, for segmentation offload. NULL if too big or out of memory.
+pbuf_t *pbuf_alloc(uint32_t len);
+
+// Wrap memory the caller owns (a driver's RX buffer); headroom bytes in
+// front of data are usable too. p lives wherever the caller put it.
+void pbuf_borrow(pbuf_t *p, uint8_t *data, uint32_t len, uint32_t headroom);
+
+// Grow the packet by n bytes at the front, for a header. Returns the new
+// start, or NULL if the headroom is used up.
+void *pbuf_push(pbuf_t *p, uint32_t n);
+
+// Step past n bytes at the front (a header that has been read). Returns
+// the new start, or NULL if the packet is shorter than that.
+void *pbuf_pull(pbuf_t *p, uint32_t n);
+
+// Cut the packet to len bytes (drops link-layer padding)
+void pbuf_trim(pbuf_t *p, uint32_t len);
+
+// References
+void pbuf_ref(pbuf_t *p);
+void pbuf_free(pbuf_t *p);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "printf.h"
 #include "klog.h"
+#include "spinlock.h"
 #include <stdint.h>
 #include <stddef.h>
 
@@ -16,6 +17,10 @@
 extern void uart_putc(char c);
 extern void console_putc(char c);
 
+// Keeps lines from different cores from interleaving (and the console
+// cursor / klog ring consistent)
+static spinlock_t printf_lock = SPINLOCK_INIT;
+
 // Local strlen to avoid circular deps
 static int local_strlen(const char *s) {
     int len = 0;
@@ -223,6 +228,7 @@ int printf(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     int count = 0;
+    uint64_t flags = spin_lock_irqsave(&printf_lock);
 
     while (*fmt) {
         if (*fmt != '%') {
@@ -314,6 +320,7 @@ int printf(const char *fmt, ...) {
         fmt++;
     }
 
+    spin_unlock_irqrestore(&printf_lock, flags);
     va_end(args);
     return count;
 }
@@ -4,37 +4,88 @@
  * Preemptive multitasking - timer IRQ forces context switches.
  * Programs run in kernel space and call kernel functions directly.
  * No memory protection, but full preemption via timer interrupt.
+ *
+ * SMP: every core runs its own kernel thread (the shell on CPU 0, an idle
+ * loop on the others) and dispatches READY processes from the shared table.
+ * proc_lock protects the table; a context's on_cpu flag keeps two cores
+ * from running the same process while its registers are still in flight.
+ *
+ * READY processes sit on a per-priority run queue, so picking the next one
+ * never scans the table. Sleeping processes are BLOCKED on a timer wheel
+ * that CPU 0 turns, rather than spinning through the scheduler.
+ * Processes waiting for an event (data on a socket, say) are BLOCKED on
+ * a wait queue, and on the wheel as well if they gave a timeout; whichever
+ * comes first takes them off both.
+ *
+ * There is no periodic scheduler tick: after every scheduling decision a
+ * core programs its timer for the end of the running slice (and CPU 0 for
+ * the earliest sleeper too). Work made for another core is delivered with
+ * a reschedule IPI, so idle cores sit in wfi until they are needed.
  */
 
 #include "process.h"
+#include "asm_offsets.h"
 #include "elf.h"
+#include "execcache.h"
 #include "vfs.h"
+#include "bcache.h"
 #include "memory.h"
 #include "string.h"
 #include "printf.h"
 #include "kapi.h"
+#include "spinlock.h"
+#include "hal/hal.h"
 #include <stddef.h>
 
 // Process table
 static process_t proc_table[MAX_PROCESSES];
-static int current_pid = -1;  // -1 means kernel/shell is running
 static int next_pid = 1;
-
-// Current process pointer - used by IRQ handler for preemption
-// NULL means kernel is running (no process to save to)
-process_t *current_process = NULL;
-
-// Kernel context - saved when switching from kernel to a process
-// This allows us to return to kernel (e.g., desktop running via process_exec)
-// Global (not static) so vectors.S can access it for kernel->process IRQ switches
-cpu_context_t kernel_context;
-
-// Program load address - grows upward as we load programs
-// Set dynamically based on heap_end
-static uint64_t program_base = 0;
-static uint64_t next_load_addr = 0;
-
-// Align to 64KB boundary for cleaner loading
+static spinlock_t proc_lock = SPINLOCK_INIT;
+
+// Run queue: a FIFO of READY processes per priority level, and a bitmap
+// of the non-empty levels so finding the best one is a single ctz
+static process_t *rq_head[SCHED_PRIO_LEVELS];
+static process_t *rq_tail[SCHED_PRIO_LEVELS];
+static uint64_t rq_bitmap;
+static int rq_count;
+
+// Timer wheel: sleeping processes hashed by wake time into 1ms buckets,
+// with a bitmap of the non-empty ones. Deadlines more than a lap away just
+// stay put until their lap comes round. Owned by CPU 0.
+#define WHEEL_SLOTS 64
+#define WHEEL_SLOT_NS 1000000ULL
+
+// Idle core retry while a queued process's registers are still in flight
+#define SCHED_RETRY_NS 100000ULL
+static process_t *wheel[WHEEL_SLOTS];
+static uint64_t wheel_bits;
+static uint64_t wheel_slot;     // Absolute slot (ns / WHEEL_SLOT_NS) reached
+static uint64_t wheel_armed;    // Deadline CPU 0's timer is set for
+
+wait_queue_t poll_wq = WAIT_QUEUE_INIT;
+
+// Exited or killed processes whose core may still be on their stack,
+// waiting for reap_zombies()
+static int zombie_count;
+
+// Wakeup-to-run latency of timer wheel wakeups, in counter ticks
+static uint64_t lat_wakeups;
+static uint64_t lat_total;
+static uint64_t lat_max;
+
+// Per-CPU state: current process (NULL means the kernel thread is running)
+// and the kernel context saved when switching from kernel to a process.
+// The kernel context lets us return to kernel (e.g., desktop running via
+// process_exec). vectors.S reaches both through TPIDR_EL1.
+cpu_t cpus[MAX_CPUS];
+
+// vectors.S uses these offsets directly
+_Static_assert(offsetof(process_t, context) == CONTEXT_OFFSET, "CONTEXT_OFFSET out of date");
+_Static_assert(offsetof(cpu_context_t, on_cpu) == CONTEXT_ON_CPU, "CONTEXT_ON_CPU out of date");
+_Static_assert(offsetof(cpu_t, current) == CPU_CURRENT, "CPU_CURRENT out of date");
+_Static_assert(offsetof(cpu_t, kernel_context) == CPU_KERNEL_CTX, "CPU_KERNEL_CTX out of date");
+
+// Align to 64KB boundary (the program area granule)
 #define ALIGN_64K(x) (((x) + 0xFFFF) & ~0xFFFFULL)
 
 // Program entry point signature
@@ -43,6 +94,27 @@ typedef int (*program_entry_t)(kapi_t *api, int argc, char **argv);
 // Forward declarations
 static void process_entry_wrapper(void);
 static void kill_children(int parent_pid);
+static void reap_zombies(void);
+
+void process_cpu_init(int id) {
+    cpu_t *cpu = &cpus[id];
+    cpu->id = id;
+    cpu->current = NULL;
+    cpu->kernel_context = &cpu->kernel_ctx;
+    cpu->preempt_count = 0;
+    cpu->slice_end = 0;
+    cpu->wait_until = 0;
+    if (id == 0) {
+        cpu->online = 1;  // Boot CPU runs the kernel from the start
+    }
+    asm volatile("msr tpidr_el1, %0" :: "r"(cpu) : "memory");
+}
+
+// Slot index of the process running on this core, -1 for the kernel thread
+static int current_slot(void) {
+    process_t *proc = current_process;
+    return proc ? (int)(proc - proc_table) : -1;
+}
 
 void process_init(void) {
     // Clear process table
@@ -52,17 +124,26 @@ void process_init(void) {
         // Also clear context to prevent garbage
         memset(&proc_table[i].context, 0, sizeof(cpu_context_t));
     }
-    current_pid = -1;
     current_process = NULL;
     next_pid = 1;
 
-    // Programs load right after the heap
-    program_base = ALIGN_64K(heap_end);
-    next_load_addr = program_base;
+    for (int i = 0; i < SCHED_PRIO_LEVELS; i++) {
+        rq_head[i] = rq_tail[i] = NULL;
+    }
+    rq_bitmap = 0;
+    rq_count = 0;
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        wheel[i] = NULL;
+    }
+    wheel_bits = 0;
+    wheel_slot = hal_get_time_ns() / WHEEL_SLOT_NS;
+    wheel_armed = HAL_TIMER_NEVER;
 
     printf("[PROC] Process subsystem initialized (max %d processes)\n", MAX_PROCESSES);
-    printf("[PROC] Program load area: 0x%lx+\n", program_base);
-    printf("[PROC] kernel_context at: 0x%lx\n", (uint64_t)&kernel_context);
+    printf("[PROC] Program load area: 0x%lx - 0x%lx (%lu MB)\n",
+           prog_area_start(), prog_area_start() + prog_area_size(),
+           prog_area_size() / (1024 * 1024));
+    printf("[PROC] kernel_context at: 0x%lx\n", (uint64_t)cpu_this()->kernel_context);
 }
 
 // Find a free slot in the process table
@@ -76,8 +157,7 @@ static int find_free_slot(void) {
 }
 
 process_t *process_current(void) {
-    if (current_pid < 0) return NULL;
-    return &proc_table[current_pid];
+    return current_process;
 }
 
 process_t *process_get(int pid) {
@@ -94,17 +174,274 @@ process_t **process_get_current_ptr(void) {
     return &current_process;
 }
 
+// Queued plus running - no table scan
 int process_count_ready(void) {
+    int count = rq_count;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].current) count++;
+    }
+    return count;
+}
+
+int process_count_active(void) {
     int count = 0;
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state == PROC_STATE_READY ||
-            proc_table[i].state == PROC_STATE_RUNNING) {
+        if (proc_table[i].state != PROC_STATE_FREE &&
+            proc_table[i].state != PROC_STATE_ZOMBIE) {
             count++;
         }
     }
     return count;
 }
 
+static inline uint64_t read_counter(void) {
+    uint64_t val;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(val) :: "memory");
+    return val;
+}
+
+// ============================================================================
+// Run queue and timer wheel - all callers hold proc_lock
+// ============================================================================
+
+static void kick_cpu_for(process_t *p);
+
+static void rq_push(process_t *p) {
+    int prio = p->prio;
+    p->next = NULL;
+    p->prev = rq_tail[prio];
+    if (rq_tail[prio]) {
+        rq_tail[prio]->next = p;
+    } else {
+        rq_head[prio] = p;
+    }
+    rq_tail[prio] = p;
+    rq_bitmap |= 1ULL << prio;
+    rq_count++;
+    kick_cpu_for(p);
+}
+
+static void rq_remove(process_t *p) {
+    int prio = p->prio;
+    if (p->prev) p->prev->next = p->next;
+    else rq_head[prio] = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else rq_tail[prio] = p->prev;
+    p->next = p->prev = NULL;
+    if (!rq_head[prio]) {
+        rq_bitmap &= ~(1ULL << prio);
+    }
+    rq_count--;
+}
+
+// Best READY process at level worst_prio or better. A process whose
+// context is still live on another core (just preempted, registers not
+// saved yet) is passed over.
+static process_t *rq_pick(int worst_prio) {
+    uint64_t bits = rq_bitmap;
+    if (worst_prio < SCHED_PRIO_LEVELS - 1) {
+        bits &= (2ULL << worst_prio) - 1;
+    }
+    while (bits) {
+        int prio = __builtin_ctzll(bits);
+        for (process_t *p = rq_head[prio]; p; p = p->next) {
+            if (!p->context.on_cpu) return p;
+        }
+        bits &= bits - 1;
+    }
+    return NULL;
+}
+
+static void wheel_insert(process_t *p) {
+    int slot = (p->wake_ns / WHEEL_SLOT_NS) % WHEEL_SLOTS;
+    p->prev = NULL;
+    p->next = wheel[slot];
+    if (wheel[slot]) wheel[slot]->prev = p;
+    wheel[slot] = p;
+    wheel_bits |= 1ULL << slot;
+    p->sleeping = 1;
+}
+
+static void wheel_remove(process_t *p) {
+    int slot = (p->wake_ns / WHEEL_SLOT_NS) % WHEEL_SLOTS;
+    if (p->prev) p->prev->next = p->next;
+    else wheel[slot] = p->next;
+    if (p->next) p->next->prev = p->prev;
+    p->next = p->prev = NULL;
+    if (!wheel[slot]) {
+        wheel_bits &= ~(1ULL << slot);
+    }
+    p->sleeping = 0;
+}
+
+// Take p off the wait queue it is BLOCKED on
+static void wq_remove(process_t *p) {
+    process_t **pp = &p->wq->head;
+    while (*pp && *pp != p) pp = &(*pp)->wq_next;
+    if (*pp) *pp = p->wq_next;
+    p->wq = NULL;
+    p->wq_next = NULL;
+}
+
+static void wheel_wake_bucket(int slot, uint64_t now) {
+    process_t *p = wheel[slot];
+    while (p) {
+        process_t *next = p->next;
+        if (p->wake_ns <= now) {
+            wheel_remove(p);
+            if (p->wq) wq_remove(p);    // Timed out waiting
+            p->state = PROC_STATE_READY;
+            p->woke_at = read_counter();
+            rq_push(p);
+        }
+        p = next;
+    }
+}
+
+// Wake everything due by now (CPU 0). Visits the buckets between the last
+// slot reached and now - all of them at most once after a long idle.
+static void wheel_advance(uint64_t now) {
+    uint64_t now_slot = now / WHEEL_SLOT_NS;
+    if (now_slot - wheel_slot >= WHEEL_SLOTS) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            if (wheel_bits & (1ULL << i)) wheel_wake_bucket(i, now);
+        }
+    } else {
+        for (uint64_t s = wheel_slot; s <= now_slot; s++) {
+            int slot = s % WHEEL_SLOTS;
+            if (wheel_bits & (1ULL << slot)) wheel_wake_bucket(slot, now);
+        }
+    }
+    wheel_slot = now_slot;
+}
+
+// Earliest deadline on the wheel. The first non-empty bucket from the
+// current slot on usually has it; entries a lap or more out fall back to
+// the minimum over all sleepers.
+static uint64_t wheel_next(void) {
+    uint64_t cur = wheel_slot % WHEEL_SLOTS;
+    uint64_t bits = cur ? (wheel_bits >> cur) | (wheel_bits << (WHEEL_SLOTS - cur))
+                        : wheel_bits;
+    uint64_t best = HAL_TIMER_NEVER;
+
+    while (bits) {
+        int d = __builtin_ctzll(bits);
+        uint64_t slot_end = (wheel_slot + d + 1) * WHEEL_SLOT_NS;
+        uint64_t bucket_min = HAL_TIMER_NEVER;
+        for (process_t *p = wheel[(cur + d) % WHEEL_SLOTS]; p; p = p->next) {
+            if (p->wake_ns < bucket_min) bucket_min = p->wake_ns;
+        }
+        if (bucket_min < slot_end) return bucket_min;
+        if (bucket_min < best) best = bucket_min;
+        bits &= bits - 1;
+    }
+    return best;
+}
+
+// Program this core's next timer event: the end of the running slice,
+// a kernel poll deadline, and on CPU 0 the earliest sleeper. Caller holds
+// proc_lock with IRQs masked.
+static void rearm(cpu_t *cpu, uint64_t now) {
+    uint64_t deadline = HAL_TIMER_NEVER;
+
+    if (cpu->current && cpu->slice_end < deadline) {
+        deadline = cpu->slice_end;
+    }
+    if (cpu->wait_until > now && cpu->wait_until < deadline) {
+        deadline = cpu->wait_until;
+    }
+    if (cpu->preempt_count > 0 && now + SCHED_TICK_NS < deadline) {
+        // Can't switch now - look again shortly
+        deadline = now + SCHED_TICK_NS;
+    }
+    if (!cpu->current && rq_count > 0 && now + SCHED_RETRY_NS < deadline) {
+        // Idle, but what's queued is still being saved on another core
+        deadline = now + SCHED_RETRY_NS;
+    }
+    if (cpu->id == 0) {
+        uint64_t next = wheel_next();
+        if (next < deadline) deadline = next;
+        wheel_armed = next;
+    }
+
+    hal_timer_set_deadline(deadline);
+}
+
+// A process just became READY - get a core to look at it. An idle core
+// takes it (highest numbered first, CPU 0's kernel thread is the shell),
+// otherwise the core running the lowest priority below it is preempted.
+// Equal priorities wait for a slice to end. Caller holds proc_lock.
+static void kick_cpu_for(process_t *p) {
+    if (!smp_active) return;
+
+    cpu_t *self = cpu_this();
+    int target = -1;
+    int worst = p->prio;
+    for (int i = MAX_CPUS - 1; i >= 0; i--) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu == self || !cpu->online) continue;
+        if (!cpu->current) {
+            target = i;
+            break;
+        }
+        if (cpu->current->prio > worst) {
+            worst = cpu->current->prio;
+            target = i;
+        }
+    }
+    if (target >= 0) {
+        hal_cpu_kick(target);
+    }
+}
+
+// Let idle kernel threads re-check what they are waiting on (a process
+// exiting ends process_exec_args()' wait). Caller holds proc_lock.
+static void kick_idle(void) {
+    if (!smp_active) return;
+
+    cpu_t *self = cpu_this();
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (&cpus[i] != self && cpus[i].online && !cpus[i].current) {
+            hal_cpu_kick(i);
+        }
+    }
+}
+
+// The core still running p (killed from elsewhere) should drop it now
+static void kick_running(process_t *p) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].current == p && &cpus[i] != cpu_this()) {
+            hal_cpu_kick(i);
+        }
+    }
+}
+
+// Take a process off whichever queue it is on, before killing it
+static void sched_unlink(process_t *p) {
+    if (p->state == PROC_STATE_READY) {
+        rq_remove(p);
+    } else {
+        if (p->sleeping) wheel_remove(p);
+        if (p->wq) wq_remove(p);
+    }
+}
+
+// Make p the running process on this core
+static void dispatch(cpu_t *cpu, process_t *p) {
+    rq_remove(p);
+    if (p->woke_at) {
+        uint64_t lat = read_counter() - p->woke_at;
+        lat_wakeups++;
+        lat_total += lat;
+        if (lat > lat_max) lat_max = lat;
+        p->woke_at = 0;
+    }
+    p->state = PROC_STATE_RUNNING;
+    p->context.on_cpu = 1;
+    cpu->current = p;
+    cpu->slice_end = hal_get_time_ns() + SCHED_SLICE_NS;
+}
+
 int process_get_info(int index, char *name, int name_size, int *state) {
     if (index < 0 || index >= MAX_PROCESSES) return 0;
     process_t *p = &proc_table[index];
@@ -124,33 +461,84 @@ int process_get_info(int index, char *name, int name_size, int *state) {
     return 1;
 }
 
+// Hand a process's image and stack back to the program area. Caller
+// makes sure no core is still running on the stack.
+static void release_memory(process_t *p) {
+    if (p->region_base) {
+        prog_free(p->region_base, p->region_size);
+        p->region_base = 0;
+        p->region_size = 0;
+    }
+    p->stack_base = NULL;
+}
+
+// Release a slot reserved by process_create that never became runnable
+static void release_slot(int slot) {
+    release_memory(&proc_table[slot]);
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    proc_table[slot].state = PROC_STATE_FREE;
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+static int create_from_image(int slot, const char *path, exec_image_t *img,
+                             int argc, char **argv);
+static uint64_t alloc_region(int slot, const char *path, uint64_t prog_size,
+                             uint64_t note_stack);
+static int publish_process(int slot, const char *path, const elf_load_info_t *info,
+                           int argc, char **argv);
+
 // Create a new process (load the binary but don't start it)
 int process_create(const char *path, int argc, char **argv) {
     (void)argc;
     (void)argv;
 
-    // Find free slot
+    // Find free slot and reserve it (BLOCKED is never scheduled) so another
+    // core creating a process at the same time can't take it
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    reap_zombies();
     int slot = find_free_slot();
+    if (slot >= 0) {
+        proc_table[slot].state = PROC_STATE_BLOCKED;
+        proc_table[slot].region_base = 0;
+        proc_table[slot].region_size = 0;
+        proc_table[slot].stack_base = NULL;
+    }
+    spin_unlock_irqrestore(&proc_lock, flags);
     if (slot < 0) {
         printf("[PROC] No free process slots\n");
         return -1;
     }
 
-    // Look up file
-    vfs_node_t *file = vfs_lookup(path);
+    // A program started recently and unchanged since is still in memory
+    char abspath[VFS_MAX_PATH];
+    fat32_version_t ver;
+    int cacheable = (vfs_file_version(path, abspath, &ver) == 0);
+    exec_image_t *img = cacheable ? exec_cache_get(abspath, &ver) : NULL;
+    if (img) {
+        return create_from_image(slot, path, img, argc, argv);
+    }
+
+    // Open the file - a private handle, since the node vfs_lookup()
+    // returns is shared scratch space
+    vfs_node_t *file = vfs_open_handle(path);
     if (!file) {
         printf("[PROC] File not found: %s\n", path);
+        release_slot(slot);
         return -1;
     }
 
     if (vfs_is_dir(file)) {
         printf("[PROC] Cannot exec directory: %s\n", path);
+        vfs_close_handle(file);
+        release_slot(slot);
         return -1;
     }
 
     size_t size = file->size;
     if (size == 0) {
         printf("[PROC] File is empty: %s\n", path);
+        vfs_close_handle(file);
+        release_slot(slot);
         return -1;
     }
 
@@ -158,13 +546,17 @@ int process_create(const char *path, int argc, char **argv) {
     char *data = malloc(size);
     if (!data) {
         printf("[PROC] Out of memory reading %s\n", path);
+        vfs_close_handle(file);
+        release_slot(slot);
         return -1;
     }
 
     int bytes = vfs_read(file, data, size, 0);
+    vfs_close_handle(file);
     if (bytes != (int)size) {
         printf("[PROC] Failed to read %s\n", path);
         free(data);
+        release_slot(slot);
         return -1;
     }
 
@@ -177,45 +569,109 @@ int process_create(const char *path, int argc, char **argv) {
         printf("[PROC] Header: %02x %02x %02x %02x %02x %02x %02x %02x\n",
                b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
         free(data);
+        release_slot(slot);
         return -1;
     }
 
-    // Align load address
-    uint64_t load_addr = ALIGN_64K(next_load_addr);
+    uint64_t note_stack = elf_stack_size(data, size);
+    uint64_t load_addr = alloc_region(slot, path, prog_size, note_stack);
+    if (!load_addr) {
+        free(data);
+        release_slot(slot);
+        return -1;
+    }
 
     // Load the ELF at this address
     elf_load_info_t info;
     if (elf_load_at(data, size, load_addr, &info) != 0) {
         printf("[PROC] Failed to load ELF: %s\n", path);
         free(data);
+        release_slot(slot);
         return -1;
     }
 
+    // Keep a copy for next time, before the program touches it
+    if (cacheable) {
+        exec_cache_add(abspath, &ver, data, size, load_addr, &info, prog_size, note_stack);
+    }
     free(data);
 
-    // Update next load address for future programs
-    next_load_addr = ALIGN_64K(load_addr + info.load_size + 0x10000);
+    return publish_process(slot, path, &info, argc, argv);
+}
 
-    // Set up process structure
+// Start a process from a cached image (see execcache.h)
+static int create_from_image(int slot, const char *path, exec_image_t *img,
+                             int argc, char **argv) {
+    uint64_t load_addr = alloc_region(slot, path, img->prog_size, img->stack_size);
+    if (!load_addr) {
+        exec_cache_put(img);
+        release_slot(slot);
+        return -1;
+    }
+
+    elf_load_info_t info;
+    exec_cache_load(img, load_addr, &info);
+    exec_cache_put(img);
+
+    return publish_process(slot, path, &info, argc, argv);
+}
+
+// Image and stack share one region: the image at the bottom, the stack on
+// top of it, growing down towards the image. note_stack is what the
+// program asked for, 0 for the default. Returns the base, 0 if no room.
+static uint64_t alloc_region(int slot, const char *path, uint64_t prog_size,
+                             uint64_t note_stack) {
+    uint64_t stack_size = note_stack;
+    if (stack_size == 0) stack_size = PROCESS_STACK_SIZE;
+    if (stack_size > PROCESS_STACK_MAX) stack_size = PROCESS_STACK_MAX;
+    stack_size = ALIGN_64K(stack_size);
+
+    uint64_t image_size = ALIGN_64K(prog_size);
+    uint64_t load_addr = prog_alloc(image_size + stack_size);
+    if (!load_addr) {
+        printf("[PROC] No room to load %s (%lu KB, %lu KB free)\n", path,
+               (image_size + stack_size) / 1024, prog_area_free() / 1024);
+        return 0;
+    }
+
+    process_t *proc = &proc_table[slot];
+    proc->region_base = load_addr;
+    proc->region_size = image_size + stack_size;
+    proc->stack_base = (void *)(load_addr + image_size);
+    proc->stack_size = stack_size;
+    return load_addr;
+}
+
+// Fill in a loaded process's slot and make it runnable. Returns the pid.
+static int publish_process(int slot, const char *path, const elf_load_info_t *info,
+                           int argc, char **argv) {
     process_t *proc = &proc_table[slot];
-    proc->pid = next_pid++;
+
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    int pid = next_pid++;
+    spin_unlock_irqrestore(&proc_lock, flags);
+
+    // Set up process structure
+    proc->pid = pid;
     strncpy(proc->name, path, PROCESS_NAME_MAX - 1);
     proc->name[PROCESS_NAME_MAX - 1] = '\0';
-    proc->state = PROC_STATE_READY;
-    proc->load_base = info.load_base;
-    proc->load_size = info.load_size;
-    proc->entry = info.entry;
-    proc->parent_pid = current_pid;
+    proc->load_base = info->load_base;
+    proc->load_size = info->load_size;
+    proc->entry = info->entry;
+    proc->parent_pid = current_slot();
     proc->exit_status = 0;
 
-    // Allocate stack
-    proc->stack_size = PROCESS_STACK_SIZE;
-    proc->stack_base = malloc(proc->stack_size);
-    if (!proc->stack_base) {
-        printf("[PROC] Failed to allocate stack\n");
-        proc->state = PROC_STATE_FREE;
-        return -1;
-    }
+    // A niced-down parent passes that on to its children (so a build's
+    // compiler runs stay batch work), a raised priority does not - or
+    // everything launched from the desktop would outrank batch jobs
+    process_t *parent = current_process;
+    proc->nice = (parent && parent->nice > NICE_DEFAULT) ? parent->nice : NICE_DEFAULT;
+    proc->prio = proc->nice - NICE_MIN;
+    proc->sleeping = 0;
+    proc->woke_at = 0;
+    proc->wq = NULL;
+    proc->wq_next = NULL;
+    proc->next = proc->prev = NULL;
 
     // Initialize context
     // Stack grows down, SP starts at top (aligned to 16 bytes)
@@ -232,6 +688,12 @@ int process_create(const char *path, int argc, char **argv) {
     proc->context.x[21] = (uint64_t)argc;     // x21 = argc
     proc->context.x[22] = (uint64_t)argv;     // x22 = argv
 
+    // Publish - from here any core's scheduler may pick it up
+    flags = spin_lock_irqsave(&proc_lock);
+    proc->state = PROC_STATE_READY;
+    rq_push(proc);
+    spin_unlock_irqrestore(&proc_lock, flags);
+
     // printf("[PROC] Created process '%s' pid=%d at 0x%lx-0x%lx (slot %d)\n",
     //        proc->name, proc->pid, proc->load_base, proc->load_base + proc->load_size, slot);
     // printf("[PROC] Stack at 0x%lx-0x%lx\n",
@@ -285,156 +747,335 @@ void process_exit(int status) {
     // Disable IRQs during exit to prevent race with preemption
     asm volatile("msr daifset, #2" ::: "memory");
 
-    if (current_pid < 0) {
+    cpu_t *cpu = cpu_this();
+    process_t *proc = cpu->current;
+    if (!proc) {
         printf("[PROC] Exit called with no current process!\n");
         asm volatile("msr daifclr, #2" ::: "memory");
         return;
     }
 
-    int slot = current_pid;
-    process_t *proc = &proc_table[slot];
     printf("[PROC] Process '%s' (pid %d) exited with status %d\n",
            proc->name, proc->pid, status);
 
+    spin_lock(&proc_lock);
+
     // Kill all children of this process before exiting
     kill_children(proc->pid);
 
     proc->exit_status = status;
-    proc->state = PROC_STATE_ZOMBIE;
 
-    // Free stack - but we're still on it! Don't free yet.
-    // The stack will be freed when the slot is reused.
-
-    // Mark slot as free (simple cleanup for now)
-    proc->state = PROC_STATE_FREE;
+    // We're still on the stack, so leave the slot to reap_zombies(). It
+    // frees the region once context_switch() below has left the stack
+    // and cleared on_cpu.
+    proc->state = PROC_STATE_ZOMBIE;
+    zombie_count++;
 
     // We're done with this process - switch back to kernel context
     // This MUST not return - we context switch away
-    current_pid = -1;
-    current_process = NULL;
+    cpu->current = NULL;
+    rearm(cpu, hal_get_time_ns());
+
+    // Whoever waits for us in process_exec_args() may be parked in wfi
+    kick_idle();
+    spin_unlock(&proc_lock);
+
+    cpu_context_t *kctx = cpu->kernel_context;
 
     // Debug: verify kernel_context before switching
     printf("[PROC] Switching to kernel_context: pc=0x%lx sp=0x%lx pstate=0x%lx\n",
-           kernel_context.pc, kernel_context.sp, kernel_context.pstate);
+           kctx->pc, kctx->sp, kctx->pstate);
 
     // Sanity check kernel_context
     // Note: kernel code is in flash at 0x0, stack is near 0x5f000000
-    if (kernel_context.pc == 0 || kernel_context.sp == 0) {
+    if (kctx->pc == 0 || kctx->sp == 0) {
         printf("[PROC] ERROR: kernel_context appears corrupted!\n");
         printf("[PROC] This indicates memory corruption during process execution\n");
         while(1);  // Hang instead of crashing
     }
 
-    // Switch directly back to kernel context
+    // Switch directly back to this core's kernel context
     // This will resume in process_exec_args() or process_schedule()
     // wherever the kernel was waiting
     // IRQs will be re-enabled when kernel re-enables them
-    context_switch(&proc->context, &kernel_context);
+    // The save is only there to clear on_cpu - a zombie never resumes
+    context_switch(&proc->context, kctx);
 
     // Should never reach here
     printf("[PROC] ERROR: process_exit returned!\n");
     while(1);
 }
 
-// Yield - voluntarily give up CPU
-void process_yield(void) {
-    if (current_pid >= 0) {
-        // Mark current process as ready
-        process_t *proc = &proc_table[current_pid];
-        proc->state = PROC_STATE_READY;
+// Free processes that exited, or were killed while running on another
+// core, once their core has switched away from them. Caller holds proc_lock.
+static void reap_zombies(void) {
+    if (zombie_count == 0) return;
+
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        process_t *p = &proc_table[i];
+        if (p->state == PROC_STATE_ZOMBIE && !p->context.on_cpu) {
+            release_memory(p);
+            p->state = PROC_STATE_FREE;
+            p->pid = 0;
+            zombie_count--;
+        }
     }
-    // Always try to schedule - even from kernel context
-    // This lets programs started via process_exec() yield to spawned children
-    process_schedule();
 }
 
-// Simple round-robin scheduler (for voluntary transitions like process_exec)
-void process_schedule(void) {
+// Voluntary reschedule. A yielding process steps aside for anything READY,
+// whatever its priority - if it outranks whoever gets the core, the next
+// timer tick hands the core back. With nothing else to run it sleeps
+// until the next interrupt instead of spinning.
+static void schedule(int yielding) {
     // Disable IRQs during scheduling to prevent race with preemption
     asm volatile("msr daifset, #2" ::: "memory");
 
-    int old_pid = current_pid;
-    process_t *old_proc = (old_pid >= 0) ? &proc_table[old_pid] : NULL;
+    cpu_t *cpu = cpu_this();
+    spin_lock(&proc_lock);
+    reap_zombies();
 
-    // Find next runnable process (round-robin)
-    int start = (old_pid >= 0) ? old_pid + 1 : 0;
-    int next = -1;
+    process_t *old_proc = cpu->current;
+    process_t *next = rq_pick(SCHED_PRIO_LEVELS - 1);
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        int idx = (start + i) % MAX_PROCESSES;
-        if (proc_table[idx].state == PROC_STATE_READY) {
-            next = idx;
-            break;
-        }
-    }
-
-    if (next < 0) {
+    if (!next) {
         // No runnable processes
-        if (old_pid >= 0 && old_proc->state == PROC_STATE_RUNNING) {
+        if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
             // Current process still running, keep it
+            if (!yielding) {
+                spin_unlock(&proc_lock);
+                asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+                return;
+            }
+            // Yielding with nothing else to run - sleep up to a tick, like
+            // the periodic timer used to pace yield loops
+            uint64_t now = hal_get_time_ns();
+            cpu->wait_until = now + SCHED_TICK_NS;
+            rearm(cpu, now);
+            spin_unlock(&proc_lock);
+            asm volatile("wfi");    // IRQs still masked: a pending one ends it
+            cpu->wait_until = 0;
             asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
             return;
         }
         // Return to kernel (if we were in a process, switch back to kernel)
-        if (old_pid >= 0) {
-            current_pid = -1;
-            current_process = NULL;
-            context_switch(&old_proc->context, &kernel_context);
+        if (old_proc) {
+            cpu->current = NULL;
+            rearm(cpu, hal_get_time_ns());
+            spin_unlock(&proc_lock);
+            context_switch(&old_proc->context, cpu->kernel_context);
             // When we return here, IRQs will be re-enabled below
+        } else {
+            spin_unlock(&proc_lock);
         }
-        // Already in kernel with nothing to run - sleep until next interrupt
-        asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
-        asm volatile("wfi");
-        return;
-    }
-
-    if (next == old_pid && old_proc && old_proc->state == PROC_STATE_RUNNING) {
-        // Same process and it's running - nothing to switch
+        // Already in kernel with nothing to run - sleep until next interrupt.
+        // CPU 0's kernel thread also wakes up for delayed disk write-back.
         asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+        if (cpu->id == 0) {
+            process_wait_event(bcache_writeback_due());
+            vfs_writeback();
+        } else {
+            asm volatile("wfi");
+        }
         return;
     }
 
-    if (next == old_pid && old_proc && old_proc->state == PROC_STATE_READY) {
-        // Process yielded but it's the only one - sleep until interrupt
-        old_proc->state = PROC_STATE_RUNNING;
-        asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
-        asm volatile("wfi");
-        return;
-    }
-
-    // Switch to new process
-    process_t *new_proc = &proc_table[next];
-
+    // Back of the line for our own level
     if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
         old_proc->state = PROC_STATE_READY;
+        rq_push(old_proc);
     }
 
-    new_proc->state = PROC_STATE_RUNNING;
-    current_pid = next;
-    current_process = new_proc;
+    dispatch(cpu, next);
+    rearm(cpu, hal_get_time_ns());
+    spin_unlock(&proc_lock);
 
     // Context switch!
-    // If old_pid == -1, we're switching FROM kernel context
+    // If old_proc is NULL, we're switching FROM kernel context
     // IRQs stay disabled - new process will enable them (entry_wrapper or return path)
-    cpu_context_t *old_ctx = (old_pid >= 0) ? &old_proc->context : &kernel_context;
+    // context_switch clears old_proc's on_cpu once its registers are saved
+    cpu_context_t *old_ctx = old_proc ? &old_proc->context : cpu->kernel_context;
 
     // Debug: if switching from kernel, verify kernel_context after we return
-    int was_kernel = (old_pid < 0);
+    // (the kernel thread never migrates, so cpu is still ours then)
+    int was_kernel = (old_proc == NULL);
 
-    context_switch(old_ctx, &new_proc->context);
+    context_switch(old_ctx, &next->context);
 
-    // We return here when someone switches back to us
+    // We return here when someone switches back to us - possibly on a
+    // different core if we are a process
     // Verify kernel_context wasn't corrupted during process execution
     if (was_kernel) {
-        if (kernel_context.pc < 0x40000000 || kernel_context.sp < 0x40000000) {
+        cpu_context_t *kctx = cpu->kernel_context;
+        if (kctx->pc < 0x40000000 || kctx->sp < 0x40000000) {
             printf("[PROC] WARNING: kernel_context corrupted after process ran!\n");
-            printf("[PROC] pc=0x%lx sp=0x%lx\n", kernel_context.pc, kernel_context.sp);
+            printf("[PROC] pc=0x%lx sp=0x%lx\n", kctx->pc, kctx->sp);
         }
     }
 
     asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
 }
 
+// Yield - voluntarily give up CPU
+// Always schedules - even from kernel context. This lets programs started
+// via process_exec() yield to spawned children
+void process_yield(void) {
+    schedule(1);
+}
+
+// Scheduler entry for voluntary transitions like process_exec
+void process_schedule(void) {
+    schedule(0);
+}
+
+// Put the current process on the wheel until wake_ns. Caller holds
+// proc_lock with IRQs masked.
+static void wheel_sleep(cpu_t *cpu, process_t *proc, uint64_t wake_ns) {
+    proc->wake_ns = wake_ns;
+    wheel_insert(proc);
+
+    // CPU 0 owns the wheel - make sure its timer fires in time
+    if (cpu->id != 0 && wake_ns < wheel_armed && smp_active) {
+        wheel_armed = wake_ns;
+        hal_cpu_kick(0);
+    }
+}
+
+// Hand the core of the just BLOCKED proc to the best READY process, or
+// back to the kernel thread. Drops proc_lock; returns once proc runs again.
+static void switch_away(cpu_t *cpu, process_t *proc, uint64_t now) {
+    process_t *next = rq_pick(SCHED_PRIO_LEVELS - 1);
+    cpu_context_t *new_ctx;
+    if (next) {
+        dispatch(cpu, next);
+        new_ctx = &next->context;
+    } else {
+        cpu->current = NULL;
+        new_ctx = cpu->kernel_context;
+    }
+    rearm(cpu, now);
+    spin_unlock(&proc_lock);
+
+    context_switch(&proc->context, new_ctx);
+}
+
+int process_sleep_until(uint64_t wake_ns) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    if (flags & 0x80) {
+        return -1;  // IRQs masked - nothing would wake us
+    }
+    asm volatile("msr daifset, #2" ::: "memory");
+
+    cpu_t *cpu = cpu_this();
+    process_t *proc = cpu->current;
+    if (!proc || cpu->preempt_count > 0) {
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+        return -1;
+    }
+
+    spin_lock(&proc_lock);
+
+    // Already due, or killed from another core (about to be dropped)
+    uint64_t now = hal_get_time_ns();
+    if (wake_ns <= now || proc->state != PROC_STATE_RUNNING) {
+        spin_unlock(&proc_lock);
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+        return 0;
+    }
+
+    proc->state = PROC_STATE_BLOCKED;
+    wheel_sleep(cpu, proc, wake_ns);
+    switch_away(cpu, proc, now);
+
+    // Woken by the wheel and picked again, maybe on another core
+    asm volatile("msr daifclr, #2" ::: "memory");
+    return 0;
+}
+
+void process_wait_on(wait_queue_t *wq, uint32_t seq, uint64_t deadline_ns) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+
+    cpu_t *cpu = cpu_this();
+    process_t *proc = cpu->current;
+    if ((flags & 0x80) || !proc || cpu->preempt_count > 0) {
+        // Can't block: kernel thread, a kernel lock held, or IRQs masked
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+        uint64_t tick = hal_get_time_ns() + SCHED_TICK_NS;
+        process_wait_event(tick < deadline_ns ? tick : deadline_ns);
+        return;
+    }
+
+    spin_lock(&proc_lock);
+
+    // On the queue before looking at seq: a waker bumps seq before it
+    // looks at the queue, so one of us sees the other
+    proc->wq = wq;
+    proc->wq_next = wq->head;
+    __atomic_store_n(&wq->head, proc, __ATOMIC_SEQ_CST);
+
+    // Woken already, due, or killed from another core
+    uint64_t now = hal_get_time_ns();
+    if (__atomic_load_n(&wq->seq, __ATOMIC_SEQ_CST) != seq || deadline_ns <= now ||
+        proc->state != PROC_STATE_RUNNING) {
+        wq_remove(proc);
+        spin_unlock(&proc_lock);
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+        return;
+    }
+
+    proc->state = PROC_STATE_BLOCKED;
+    if (deadline_ns != HAL_TIMER_NEVER) wheel_sleep(cpu, proc, deadline_ns);
+    switch_away(cpu, proc, now);
+
+    // Woken (or timed out) and picked again, maybe on another core
+    asm volatile("msr daifclr, #2" ::: "memory");
+}
+
+void process_wake_all(wait_queue_t *wq) {
+    __atomic_add_fetch(&wq->seq, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&wq->head, __ATOMIC_SEQ_CST)) return;
+
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    process_t *p = wq->head;
+    wq->head = NULL;
+    while (p) {
+        process_t *next = p->wq_next;
+        p->wq = NULL;
+        p->wq_next = NULL;
+        if (p->sleeping) wheel_remove(p);
+        p->state = PROC_STATE_READY;
+        p->woke_at = read_counter();
+        rq_push(p);
+        p = next;
+    }
+    spin_unlock_irqrestore(&proc_lock, flags);
+}
+
+void process_wait_event(uint64_t deadline_ns) {
+    cpu_t *cpu = cpu_this();
+
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+
+    // Arm and wfi with IRQs masked, so the timer can't fire in between and
+    // leave us waiting for an event that already happened
+    uint64_t now = hal_get_time_ns();
+    if (now < deadline_ns) {
+        spin_lock(&proc_lock);
+        cpu->wait_until = deadline_ns;
+        rearm(cpu, now);
+        spin_unlock(&proc_lock);
+
+        asm volatile("wfi");
+        cpu->wait_until = 0;
+    }
+
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
 // Execute and wait - creates a real process and waits for it to finish
 int process_exec_args(const char *path, int argc, char **argv) {
     // Create the process
@@ -477,70 +1118,92 @@ int process_exec(const char *path) {
     return process_exec_args(path, 1, argv);
 }
 
-// Called from IRQ handler for preemptive scheduling
-// Just updates current_process - IRQ handler does the actual context switch
+// Called from every core's timer tick (IRQ handler) for preemptive scheduling
+// Just updates this core's current process - IRQ handler does the actual
+// context switch, and clears the old context's on_cpu once it has left
+// the old stack
 void process_schedule_from_irq(void) {
-    // Check how many processes are ready to run
-    int ready_count = process_count_ready();
+    cpu_t *cpu = cpu_this();
+    uint64_t now = hal_get_time_ns();
 
-    // If kernel is running (current_pid == -1), we should switch to ANY ready process
-    // If a process is running, we only switch if there's another ready process
-    if (current_pid >= 0 && ready_count <= 1) {
-        return;  // Only one process, no point switching
+    spin_lock(&proc_lock);
+
+    // CPU 0 turns the wheel for everyone
+    if (cpu->id == 0) {
+        wheel_advance(now);
     }
-    if (current_pid < 0 && ready_count == 0) {
-        return;  // Kernel running, no processes to switch to
+
+    // Running thread holds a sleeping-style kernel lock (VFS) - let it finish
+    if (cpu->preempt_count > 0) {
+        rearm(cpu, now);
+        spin_unlock(&proc_lock);
+        return;
     }
 
-    // Find next runnable process (round-robin)
-    int old_slot = current_pid;
-    int start = (old_slot >= 0) ? old_slot + 1 : 0;
+    reap_zombies();
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        int idx = (start + i) % MAX_PROCESSES;
-        if (proc_table[idx].state == PROC_STATE_READY) {
-            // Found a different process to switch to
-            if (idx != old_slot) {
-                // Safety check: verify process has valid context
-                process_t *new_proc = &proc_table[idx];
-                if (new_proc->context.sp == 0 || new_proc->context.pc == 0) {
-                    continue;  // Skip invalid process
-                }
-
-                // Mark old process as ready (it was running)
-                if (old_slot >= 0 && proc_table[old_slot].state == PROC_STATE_RUNNING) {
-                    proc_table[old_slot].state = PROC_STATE_READY;
-                }
+    process_t *old_proc = cpu->current;
+    process_t *next;
 
-                // Switch to new process
-                proc_table[idx].state = PROC_STATE_RUNNING;
-                current_pid = idx;
-                current_process = new_proc;
+    if (!old_proc || old_proc->state != PROC_STATE_RUNNING) {
+        // Kernel thread gives way to any process. A process killed from
+        // another core can't keep running either - if nothing else is
+        // ready, park it and resume this core's kernel thread
+        next = rq_pick(SCHED_PRIO_LEVELS - 1);
+        if (!next && old_proc) {
+            cpu->current = NULL;
+        }
+    } else if (now >= cpu->slice_end) {
+        // Slice used up - rotate with the same level (or better)
+        next = rq_pick(old_proc->prio);
+        if (!next) {
+            cpu->slice_end = now + SCHED_SLICE_NS;
+        }
+    } else {
+        // Mid-slice, only a higher priority process preempts
+        next = (old_proc->prio > 0) ? rq_pick(old_proc->prio - 1) : NULL;
+    }
 
-                // Memory barrier to ensure current_process is visible to IRQ handler
-                asm volatile("dsb sy" ::: "memory");
-            }
-            return;
+    if (next) {
+        // Mark old process as ready (it was running)
+        if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
+            old_proc->state = PROC_STATE_READY;
+            rq_push(old_proc);
         }
+        dispatch(cpu, next);
     }
+    rearm(cpu, now);
+    spin_unlock(&proc_lock);
+
+    // Memory barrier to ensure current_process is visible to IRQ handler
+    asm volatile("dsb sy" ::: "memory");
 }
 
-// Kill all children of a process (recursive)
+// Kill all children of a process (recursive). Caller holds proc_lock.
 static void kill_children(int parent_pid) {
+    int self = current_slot();
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (proc_table[i].state != PROC_STATE_FREE &&
+            proc_table[i].state != PROC_STATE_ZOMBIE &&
             proc_table[i].parent_pid == parent_pid) {
             int child_pid = proc_table[i].pid;
             // First kill grandchildren recursively
             kill_children(child_pid);
             // Then kill this child (skip if it's current process)
-            if (i != current_pid) {
+            if (i != self) {
                 printf("[PROC] Killing child '%s' (pid %d, parent %d)\n",
                        proc_table[i].name, child_pid, parent_pid);
-                if (proc_table[i].stack_base) {
-                    free(proc_table[i].stack_base);
-                    proc_table[i].stack_base = NULL;
+                proc_table[i].exit_status = -1;
+                sched_unlink(&proc_table[i]);
+                if (proc_table[i].context.on_cpu) {
+                    // Running on another core - it switches away at its next
+                    // tick and reap_zombies() frees it afterwards
+                    proc_table[i].state = PROC_STATE_ZOMBIE;
+                    zombie_count++;
+                    kick_running(&proc_table[i]);
+                    continue;
                 }
+                release_memory(&proc_table[i]);
                 proc_table[i].state = PROC_STATE_FREE;
                 proc_table[i].pid = 0;
             }
@@ -556,16 +1219,20 @@ int process_kill(int pid) {
         return -1;
     }
 
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+
     // Find the process
     int slot = -1;
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE) {
+        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE &&
+            proc_table[i].state != PROC_STATE_ZOMBIE) {
             slot = i;
             break;
         }
     }
 
     if (slot < 0) {
+        spin_unlock_irqrestore(&proc_lock, flags);
         printf("[PROC] Process %d not found\n", pid);
         return -1;
     }
@@ -573,7 +1240,8 @@ int process_kill(int pid) {
     process_t *proc = &proc_table[slot];
 
     // Don't allow killing the current process this way - use exit() instead
-    if (slot == current_pid) {
+    if (slot == current_slot()) {
+        spin_unlock_irqrestore(&proc_lock, flags);
         printf("[PROC] Cannot kill current process (use exit)\n");
         return -1;
     }
@@ -583,15 +1251,96 @@ int process_kill(int pid) {
     // First kill all children of this process
     kill_children(pid);
 
-    // Free the process memory
-    if (proc->stack_base) {
-        free(proc->stack_base);
-        proc->stack_base = NULL;
+    proc->exit_status = -1;
+    sched_unlink(proc);
+
+    if (proc->context.on_cpu) {
+        // Still running on another core - can't free its stack under it.
+        // That core drops it at its next tick, then it gets reaped.
+        proc->state = PROC_STATE_ZOMBIE;
+        zombie_count++;
+        kick_running(proc);
+        kick_idle();
+        spin_unlock_irqrestore(&proc_lock, flags);
+        return 0;
     }
 
+    // Free the process memory
+    release_memory(proc);
+
     // Mark slot as free
     proc->state = PROC_STATE_FREE;
     proc->pid = 0;
 
+    // A kernel thread waiting on it in process_exec_args() may be in wfi
+    kick_idle();
+
+    spin_unlock_irqrestore(&proc_lock, flags);
+    return 0;
+}
+
+// ============================================================================
+// Priorities
+// ============================================================================
+
+// Live process by pid (0 = the caller). Caller holds proc_lock.
+static process_t *find_live(int pid) {
+    if (pid == 0) return current_process;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE &&
+            proc_table[i].state != PROC_STATE_ZOMBIE) {
+            return &proc_table[i];
+        }
+    }
+    return NULL;
+}
+
+int process_set_nice(int pid, int nice) {
+    if (nice < NICE_MIN) nice = NICE_MIN;
+    if (nice > NICE_MAX) nice = NICE_MAX;
+
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    process_t *p = find_live(pid);
+    if (!p) {
+        spin_unlock_irqrestore(&proc_lock, flags);
+        return -1;
+    }
+
+    // A queued process has to move to its new level
+    int queued = (p->state == PROC_STATE_READY);
+    if (queued) rq_remove(p);
+    p->nice = nice;
+    p->prio = nice - NICE_MIN;
+    if (queued) rq_push(p);
+
+    spin_unlock_irqrestore(&proc_lock, flags);
     return 0;
 }
+
+int process_get_nice(int pid, int *nice) {
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    process_t *p = find_live(pid);
+    if (p && nice) *nice = p->nice;
+    spin_unlock_irqrestore(&proc_lock, flags);
+    return p ? 0 : -1;
+}
+
+void process_sched_latency(uint64_t *wakeups, uint64_t *total_us,
+                           uint64_t *max_us, int reset) {
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+
+    uint64_t flags = spin_lock_irqsave(&proc_lock);
+    uint64_t count = lat_wakeups;
+    uint64_t total = lat_total;
+    uint64_t max = lat_max;
+    if (reset) {
+        lat_wakeups = lat_total = lat_max = 0;
+    }
+    spin_unlock_irqrestore(&proc_lock, flags);
+
+    // Counter ticks to us without overflowing the multiply
+    if (wakeups) *wakeups = count;
+    if (total_us) *total_us = (total / freq) * 1000000 + (total % freq) * 1000000 / freq;
+    if (max_us) *max_us = max * 1000000 / freq;
+}
@@ -2,7 +2,10 @@
  * VibeOS Process Management
  *
  * Preemptive multitasking - timer IRQ forces context switches.
- * Processes get 200ms time slices (100Hz timer, preempt every 20 ticks).
+ * Processes get 200ms time slices among equal priorities; a higher priority
+ * process preempts as soon as it wakes. The timer is tickless: each core
+ * programs its next interrupt from the slice end or the earliest sleeper.
+ * Every online core runs the same scheduler over one shared process table.
  */
 
 #ifndef PROCESS_H
@@ -12,8 +15,18 @@
 #include <stddef.h>
 
 #define PROCESS_NAME_MAX 32
-#define PROCESS_STACK_SIZE 0x100000  // 1MB per process (TLS crypto needs lots of stack)
+#define PROCESS_STACK_SIZE 0x40000   // 256KB default stack
+#define PROCESS_STACK_MAX  0x800000  // Cap on VIBE_STACK_SIZE() requests (TLS needs ~1MB)
 #define MAX_PROCESSES 16
+#define MAX_CPUS 4
+
+// Nice values, lower runs first. Each one is its own run queue level.
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_DEFAULT 0
+#define SCHED_PRIO_LEVELS (NICE_MAX - NICE_MIN + 1)
+#define SCHED_SLICE_NS 200000000ULL  // 200ms round-robin slice within a level
+#define SCHED_TICK_NS  10000000ULL   // Retry / yield pacing interval (10ms)
 
 // Process states
 typedef enum {
@@ -36,6 +49,10 @@ typedef struct {
     uint64_t fpcr;
     uint64_t fpsr;
     uint64_t fp_regs[64];  // q0-q31 (each 128-bit = 2 x 64-bit)
+    // Non-zero while some core is still executing on (or saving) this
+    // context. Cleared with a store-release once the registers are saved
+    // and that core has left the stack, so no other core can resume it early.
+    uint64_t on_cpu;
 } __attribute__((aligned(16))) cpu_context_t;
 
 typedef struct process {
@@ -46,18 +63,91 @@ typedef struct process {
     // Memory
     uint64_t load_base;       // Where program code is loaded
     uint64_t load_size;       // Size of loaded code
-    void *stack_base;         // Stack allocation base
+    void *stack_base;         // Stack base, top of the load region
     uint64_t stack_size;      // Stack size
 
-    // Execution
+    // Execution - vectors.S reaches context at CONTEXT_OFFSET (asm_offsets.h),
+    // so fields before it must not change
     uint64_t entry;           // Entry point
     cpu_context_t context;    // Saved registers for context switch
 
+    // Scheduling
+    int nice;                 // NICE_MIN..NICE_MAX
+    int prio;                 // Run queue level, nice - NICE_MIN
+    int sleeping;             // On the timer wheel (BLOCKED until wake_ns)
+    uint64_t wake_ns;         // hal_get_time_ns() deadline
+    uint64_t woke_at;         // Counter value at wakeup, 0 once it has run
+    struct process *next;     // Run queue (READY) or timer wheel bucket
+    struct process *prev;     // (sleeping) links - never both at once
+    struct wait_queue *wq;    // Wait queue BLOCKED on (may be sleeping too)
+    struct process *wq_next;
+
     // Exit
     int exit_status;
     int parent_pid;           // Who spawned us
+
+    // Program area region (image + stack), 0 if none
+    uint64_t region_base;
+    uint64_t region_size;
 } process_t;
 
+// Processes BLOCKED until some event. seq counts the wakeups: a waiter
+// reads it before checking its condition, and process_wait_on() doesn't
+// sleep if a wakeup came in between.
+typedef struct wait_queue {
+    struct process *head;
+    uint32_t seq;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { NULL, 0 }
+
+static inline uint32_t wait_queue_seq(wait_queue_t *wq) {
+    return __atomic_load_n(&wq->seq, __ATOMIC_ACQUIRE);
+}
+
+// Per-CPU scheduler state - TPIDR_EL1 on each core points at its own entry.
+// vectors.S reads the first two fields directly, keep them in place.
+typedef struct cpu {
+    process_t *current;             // 0x00: process running here (NULL = kernel)
+    cpu_context_t *kernel_context;  // 0x08: this core's parked kernel thread
+    int id;
+    volatile int online;
+    int preempt_count;              // >0: timer IRQ must not switch away
+    uint64_t slice_end;             // When the running process's slice ends
+    uint64_t wait_until;            // Kernel-side poll deadline, 0 = none
+    cpu_context_t kernel_ctx;       // Storage behind kernel_context
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+
+static inline cpu_t *cpu_this(void) {
+    cpu_t *cpu;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(cpu));
+    return cpu;
+}
+
+// Point TPIDR_EL1 at cpus[id] - first thing each core does in C
+void process_cpu_init(int id);
+
+// Keep the timer IRQ from switching this core away from the running
+// thread (kernel or process). Used around the VFS lock, which is held
+// across slow disk I/O with IRQs still enabled.
+static inline void preempt_disable(void) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    cpu_this()->preempt_count++;
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+static inline void preempt_enable(void) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    cpu_this()->preempt_count--;
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
 // Initialize process subsystem
 void process_init(void);
 
@@ -78,8 +168,8 @@ void process_exit(int status);
 process_t *process_current(void);
 process_t *process_get(int pid);
 
-// Current running process (NULL if kernel)
-extern process_t *current_process;
+// Current running process on this core (NULL if kernel)
+#define current_process (cpu_this()->current)
 
 // Get pointer to current_process pointer (for assembly IRQ handler)
 process_t **process_get_current_ptr(void);
@@ -87,8 +177,37 @@ process_t **process_get_current_ptr(void);
 // Scheduling
 void process_yield(void);              // Give up CPU voluntarily
 void process_schedule(void);           // Pick next process to run
-void process_schedule_from_irq(void);  // Called from timer IRQ for preemption
-int process_count_ready(void);         // Count runnable processes
+void process_schedule_from_irq(void);  // Timer event or reschedule IPI, any core
+int process_count_ready(void);         // Count runnable processes (O(1))
+int process_count_active(void);        // Count live processes, sleeping included
+
+// Block the current process until hal_get_time_ns() reaches wake_ns.
+// Returns -1 without sleeping if this thread can't be switched away
+// (kernel thread, VFS lock held, IRQs masked) - caller must poll instead.
+int process_sleep_until(uint64_t wake_ns);
+
+// One wfi on this core, with its timer armed to fire by deadline_ns
+void process_wait_event(uint64_t deadline_ns);
+
+// Block on wq until it is woken or deadline_ns passes (HAL_TIMER_NEVER:
+// no timeout), unless wq's seq has moved on from the caller's. A thread
+// that can't be switched away waits in wfi instead, for at most
+// SCHED_TICK_NS. Callers re-check their condition when it returns.
+void process_wait_on(wait_queue_t *wq, uint32_t seq, uint64_t deadline_ns);
+
+// Wake everything on wq. Any context, IRQ handlers included.
+void process_wake_all(wait_queue_t *wq);
+
+// Woken by everything poll() watches: socket activity and window events
+extern wait_queue_t poll_wq;
+
+// Nice value of a process (pid 0 = current). Returns 0 or -1.
+int process_set_nice(int pid, int nice);
+int process_get_nice(int pid, int *nice);
+
+// Wakeup-to-run latency of timer wheel wakeups, for benchmarks
+void process_sched_latency(uint64_t *wakeups, uint64_t *total_us,
+                           uint64_t *max_us, int reset);
 
 // Context switch (implemented in assembly)
 void context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
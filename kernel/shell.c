@@ -165,7 +165,8 @@ void shell_run(void) {
         } else if (strcmp(cmd, "vibesh") == 0) {
             process_exec("/bin/vibesh");
         } else if (strcmp(cmd, "reboot") == 0) {
-            console_puts("Rebooting not implemented. Please close QEMU.\n");
+            vfs_sync();
+            console_puts("Rebooting not implemented. Disk synced, please close QEMU.\n");
         } else if (strcmp(cmd, "dmesg") == 0) {
             // Interactive kernel log viewer
             size_t log_size = klog_size();
@@ -270,6 +271,8 @@ void shell_run(void) {
                     free(log_buf);
                 }
             }
+        } else if (strcmp(cmd, "membench") == 0) {
+            memory_bandwidth_bench();
 #ifdef TARGET_PI
         } else if (strcmp(cmd, "usbstats") == 0) {
             usb_hid_print_stats();
@@ -0,0 +1,98 @@
+/*
+ * VibeOS SMP Bring-up
+ *
+ * Each secondary core gets a 64KB kernel stack and enters the boot stub's
+ * smp_secondary_entry, which drops to EL1, turns on the MMU and caches with
+ * CPU 0's page tables and calls smp_secondary_main(). From there the core
+ * sets up its own banked interrupt/timer state and sits in the scheduler,
+ * picking up READY processes like CPU 0 does.
+ */
+
+#include "smp.h"
+#include "process.h"
+#include "memory.h"
+#include "printf.h"
+#include "hal/hal.h"
+
+volatile int smp_active = 0;
+
+// Stack tops for the boot stub, indexed by core number
+uint64_t smp_boot_stack[MAX_CPUS];
+
+// Entry point in boot.S / boot-pi.S
+extern void smp_secondary_entry(void);
+
+// How long to wait for a core to check in before giving up on it
+#define SMP_START_TIMEOUT_US 100000
+
+static uint64_t read_counter_us(void) {
+    uint64_t cnt, freq;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(cnt));
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return (cnt * 1000000ULL) / freq;
+}
+
+int smp_cpu_count(void) {
+    int count = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].online) count++;
+    }
+    return count;
+}
+
+void smp_init(void) {
+    // From here on spinlocks really lock. Nothing holds one right now:
+    // heap/process locks are IRQ-save and the VFS lock disables preemption.
+    smp_active = 1;
+    asm volatile("dsb ish" ::: "memory");
+
+    for (int cpu = 1; cpu < MAX_CPUS; cpu++) {
+        void *stack = malloc(SMP_STACK_SIZE);
+        if (!stack) {
+            printf("[SMP] Out of memory for CPU %d stack\n", cpu);
+            break;
+        }
+        smp_boot_stack[cpu] = ((uint64_t)stack + SMP_STACK_SIZE) & ~0xFULL;
+
+        // The core reads this before its D-cache is on
+        asm volatile("dc civac, %0" :: "r"(&smp_boot_stack[cpu]) : "memory");
+        asm volatile("dsb sy" ::: "memory");
+
+        if (hal_cpu_start(cpu, (uint64_t)smp_secondary_entry) < 0) {
+            free(stack);
+            continue;
+        }
+
+        uint64_t start = read_counter_us();
+        while (!cpus[cpu].online) {
+            if (read_counter_us() - start > SMP_START_TIMEOUT_US) {
+                break;
+            }
+        }
+        if (!cpus[cpu].online) {
+            // Not present (e.g. QEMU without -smp). Leave the stack alone in
+            // case it shows up late.
+            printf("[SMP] CPU %d did not respond\n", cpu);
+        }
+    }
+
+    printf("[SMP] %d of %d CPUs online\n", smp_cpu_count(), MAX_CPUS);
+}
+
+void smp_secondary_main(int cpu) {
+    process_cpu_init(cpu);
+
+    hal_irq_init_secondary();
+    hal_timer_init_secondary();
+
+    printf("[SMP] CPU %d online\n", cpu);
+    cpus[cpu].online = 1;
+
+    hal_irq_enable();
+
+    // This core's kernel thread: the idle loop. process_schedule() runs
+    // whatever is READY and sleeps in wfi when there is nothing to do.
+    while (1) {
+        process_schedule();
+    }
+}
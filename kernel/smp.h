@@ -0,0 +1,33 @@
+/*
+ * VibeOS SMP Bring-up
+ *
+ * CPU 0 boots the kernel; the other cores stay parked (firmware spin table
+ * on the Pi, a hold pen in boot.S on QEMU) until smp_init() releases them
+ * into the scheduler.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+// Kernel-thread stack for each secondary core (IRQs taken while idle too)
+#define SMP_STACK_SIZE 0x10000  // 64KB
+
+// Hardware core number from MPIDR_EL1 (Aff0)
+static inline int smp_cpu_id(void) {
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return (int)(mpidr & 0xFF);
+}
+
+// Start every secondary core and wait for it to check in
+void smp_init(void);
+
+// Number of cores currently running the scheduler
+int smp_cpu_count(void);
+
+// C entry point for secondary cores (called from the boot stub)
+void smp_secondary_main(int cpu);
+
+#endif
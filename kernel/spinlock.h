@@ -0,0 +1,80 @@
+/*
+ * VibeOS Spinlocks
+ *
+ * Test-and-set locks built on ldaxr/stxr, waiting in wfe between attempts.
+ * The _irqsave variants also mask IRQs on the local core, which is all the
+ * protection shared state had before the secondary cores were started.
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+// Set by smp_init() just before the first secondary core is released.
+// Until then there is only one core, and on the Pi the D-cache may still
+// be off - exclusives on non-cacheable memory are not reliable there.
+extern volatile int smp_active;
+
+static inline void spin_lock(spinlock_t *lock) {
+    if (!smp_active) return;
+
+    uint32_t tmp;
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, [%1]\n"
+        "   cbnz    %w0, 1b\n"
+        "   stxr    %w0, %w2, [%1]\n"
+        "   cbnz    %w0, 2b\n"
+        : "=&r"(tmp)
+        : "r"(&lock->locked), "r"(1)
+        : "memory");
+}
+
+// Single attempt, returns 1 if the lock was taken
+static inline int spin_trylock(spinlock_t *lock) {
+    if (!smp_active) return 1;
+
+    uint32_t tmp, fail;
+    asm volatile(
+        "   ldaxr   %w0, [%2]\n"
+        "   mov     %w1, #1\n"
+        "   cbnz    %w0, 1f\n"
+        "   stxr    %w1, %w3, [%2]\n"
+        "1:\n"
+        : "=&r"(tmp), "=&r"(fail)
+        : "r"(&lock->locked), "r"(1)
+        : "memory");
+    if (tmp) asm volatile("clrex" ::: "memory");
+    return fail == 0;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    if (!smp_active) return;
+
+    // The store-release clears the waiters' exclusive monitors, which
+    // generates the event that wakes them from wfe
+    asm volatile("stlr wzr, [%0]" :: "r"(&lock->locked) : "memory");
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif" : "=r"(flags));
+    asm volatile("msr daifset, #2" ::: "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+#endif
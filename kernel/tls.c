@@ -79,6 +79,7 @@ extern void sleep_ms(uint32_t ms);
 // Forward declarations for kernel functions
 extern void uart_puts(const char *s);
 extern unsigned long timer_get_ticks(void);
+extern uint64_t hal_get_time_ns(void);
 
 // errno global (declared in errno.h)
 int errno = 0;
@@ -151,6 +152,7 @@ void vibe_random(unsigned char *key, int len) {
 // ============ VibeOS TLS API ============
 
 #define MAX_TLS_SOCKETS 4
+#define TLS_HANDSHAKE_MS 10000      // Whole handshake, all rounds
 
 typedef struct {
     int tcp_sock;
@@ -232,16 +234,18 @@ int tls_connect(uint32_t ip, uint16_t port, const char *hostname) {
         uart_puts("[TLS] No ClientHello generated!\r\n");
     }
 
-    // Handshake loop
+    // Handshake loop - each round sleeps until the server's next bytes
     unsigned char recv_buf[4096];
-    int max_rounds = 50;
+    uint64_t give_up = hal_get_time_ns() + TLS_HANDSHAKE_MS * 1000000ULL;
 
     uart_puts("[TLS] Starting handshake...\r\n");
 
-    while (!tls_established(ctx) && max_rounds-- > 0) {
-        net_poll();
+    while (!tls_established(ctx)) {
+        uint64_t now = hal_get_time_ns();
+        if (now >= give_up) break;
 
-        int recv_len = tcp_recv(tcp, recv_buf, sizeof(recv_buf));
+        int recv_len = tcp_recv_wait(tcp, recv_buf, sizeof(recv_buf),
+                                     (uint32_t)((give_up - now) / 1000000) + 1);
         if (recv_len > 0) {
             // Print received length
             uart_puts("[TLS] Got ");
@@ -323,9 +327,6 @@ int tls_connect(uint32_t ip, uint16_t port, const char *hostname) {
             tls_sockets[slot].ctx = NULL;
             return -1;
         }
-
-        // Small delay
-        sleep_ms(10);
     }
 
     if (!tls_established(ctx)) {
@@ -360,20 +361,10 @@ int tls_send(int sock, const void *data, uint32_t len) {
     return len;
 }
 
-int tls_recv(int sock, void *buf, uint32_t maxlen) {
-    if (sock < 0 || sock >= MAX_TLS_SOCKETS) return -1;
-    tls_socket_internal_t *s = &tls_sockets[sock];
-    if (!s->ctx || s->closed) return -1;
-
-    // Check for buffered data
-    int decrypted = tls_read(s->ctx, buf, maxlen);
-    if (decrypted > 0) return decrypted;
-
-    net_poll();
-
-    unsigned char recv_buf[4096];
-    int recv_len = tcp_recv(s->tcp_sock, recv_buf, sizeof(recv_buf));
-
+// Decrypt recv_len bytes from TCP (or note the close, recv_len < 0) and
+// return what is now readable: bytes, 0 for a partial record, -1 closed
+static int tls_feed(tls_socket_internal_t *s, const unsigned char *recv_buf, int recv_len,
+                    void *buf, uint32_t maxlen) {
     if (recv_len > 0) {
         int consumed = tls_consume_stream(s->ctx, recv_buf, recv_len, NULL);
         if (consumed < 0) { s->closed = 1; return -1; }
@@ -385,7 +376,7 @@ int tls_recv(int sock, void *buf, uint32_t maxlen) {
             tls_buffer_clear(s->ctx);
         }
 
-        decrypted = tls_read(s->ctx, buf, maxlen);
+        int decrypted = tls_read(s->ctx, buf, maxlen);
         if (decrypted > 0) return decrypted;
     } else if (recv_len < 0) {
         s->closed = 1;
@@ -395,6 +386,57 @@ int tls_recv(int sock, void *buf, uint32_t maxlen) {
     return 0;
 }
 
+int tls_recv(int sock, void *buf, uint32_t maxlen) {
+    if (sock < 0 || sock >= MAX_TLS_SOCKETS) return -1;
+    tls_socket_internal_t *s = &tls_sockets[sock];
+    if (!s->ctx || s->closed) return -1;
+
+    // Check for buffered data
+    int decrypted = tls_read(s->ctx, buf, maxlen);
+    if (decrypted > 0) return decrypted;
+
+    unsigned char recv_buf[4096];
+    int recv_len = tcp_recv(s->tcp_sock, recv_buf, sizeof(recv_buf));
+    return tls_feed(s, recv_buf, recv_len, buf, maxlen);
+}
+
+int tls_recv_wait(int sock, void *buf, uint32_t maxlen, uint32_t timeout_ms) {
+    if (sock < 0 || sock >= MAX_TLS_SOCKETS) return -1;
+    tls_socket_internal_t *s = &tls_sockets[sock];
+    if (!s->ctx || s->closed) return -1;
+
+    int decrypted = tls_read(s->ctx, buf, maxlen);
+    if (decrypted > 0) return decrypted;
+
+    // A record can come in several segments - keep going until it's whole
+    uint64_t give_up = timeout_ms == NET_WAIT_FOREVER ? ~0ULL
+                       : hal_get_time_ns() + timeout_ms * 1000000ULL;
+    unsigned char recv_buf[4096];
+    while (1) {
+        uint64_t now = hal_get_time_ns();
+        if (now >= give_up) return 0;
+        uint32_t left = timeout_ms == NET_WAIT_FOREVER ? NET_WAIT_FOREVER
+                        : (uint32_t)((give_up - now) / 1000000) + 1;
+
+        int recv_len = tcp_recv_wait(s->tcp_sock, recv_buf, sizeof(recv_buf), left);
+        int n = tls_feed(s, recv_buf, recv_len, buf, maxlen);
+        if (n != 0) return n;
+    }
+}
+
+int tls_poll(int sock) {
+    if (sock < 0 || sock >= MAX_TLS_SOCKETS) return TCP_POLL_HUP;
+    tls_socket_internal_t *s = &tls_sockets[sock];
+    if (!s->ctx) return TCP_POLL_HUP;
+    if (s->closed) return TCP_POLL_IN | TCP_POLL_HUP;
+
+    // Readable TCP bytes may be only part of a record: tls_recv can still
+    // return 0 then
+    int events = tcp_poll(s->tcp_sock);
+    if (s->ctx->application_buffer_len > 0) events |= TCP_POLL_IN;
+    return events;
+}
+
 void tls_close(int sock) {
     if (sock < 0 || sock >= MAX_TLS_SOCKETS) return;
     tls_socket_internal_t *s = &tls_sockets[sock];
@@ -28,6 +28,13 @@ int tls_send(int sock, const void *data, uint32_t len);
 // Returns: bytes received, 0 if no data yet, -1 on error/closed
 int tls_recv(int sock, void *buf, uint32_t maxlen);
 
+// Like tls_recv, but sleeps until data arrives or timeout_ms
+// (NET_WAIT_FOREVER: none) runs out, then returns 0
+int tls_recv_wait(int sock, void *buf, uint32_t maxlen, uint32_t timeout_ms);
+
+// What the socket is ready for: TCP_POLL_* bits (see net.h)
+int tls_poll(int sock);
+
 // Close TLS connection
 void tls_close(int sock);
 
@@ -0,0 +1,475 @@
+/*
+ * VibeOS RAM Filesystem
+ *
+ * Each directory keeps its children twice: in a hash table for lookups
+ * and in a list in creation order for readdir, so a cursor can carry on
+ * after entries are added or removed. Deleted nodes that are still open
+ * are taken out of the tree at once and freed on the last put.
+ *
+ * Allocated extents are all zeros past the end of the file, which is
+ * what lets a write or truncate past the end leave a gap of zeros.
+ */
+
+#include "tmpfs.h"
+#include "memory.h"
+#include "string.h"
+
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int valid_name(const char *name, size_t len) {
+    if (len == 0 || len > TMPFS_NAME_MAX) return 0;
+    if (len == 1 && name[0] == '.') return 0;
+    if (len == 2 && name[0] == '.' && name[1] == '.') return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '/') return 0;
+    }
+    return 1;
+}
+
+static tmpfs_node_t *new_node(tmpfs_t *fs, const char *name, size_t len, uint8_t type) {
+    tmpfs_node_t *node = malloc(sizeof(tmpfs_node_t));
+    if (!node) return NULL;
+    memset(node, 0, sizeof(tmpfs_node_t));
+
+    node->name = malloc(len + 1);
+    if (!node->name) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+    node->hash = name_hash(name, len);
+    node->type = type;
+    node->next_seq = 1;     // 0 means "nothing returned yet" to a cursor
+
+    fs->nodes++;
+    return node;
+}
+
+static uint32_t extent_cap(tmpfs_node_t *file, uint32_t idx) {
+    return idx == 0 ? file->first_cap : TMPFS_EXTENT;
+}
+
+static void free_node(tmpfs_t *fs, tmpfs_node_t *node) {
+    for (uint32_t i = 0; i < node->nextents; i++) {
+        if (node->extents[i]) {
+            fs->bytes -= extent_cap(node, i);
+            free(node->extents[i]);
+        }
+    }
+    free(node->extents);
+    free(node->buckets);
+    free(node->name);
+    free(node);
+    fs->nodes--;
+}
+
+// ============================================================================
+// Directories
+// ============================================================================
+
+static tmpfs_node_t *find_child(tmpfs_node_t *dir, const char *name, size_t len,
+                                uint32_t hash) {
+    if (dir->nbuckets == 0) return NULL;
+    for (tmpfs_node_t *n = dir->buckets[hash & (dir->nbuckets - 1)]; n; n = n->hnext) {
+        if (n->hash == hash && strncmp(n->name, name, len) == 0 && n->name[len] == '\0') {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+static void hash_insert(tmpfs_node_t *dir, tmpfs_node_t *node) {
+    tmpfs_node_t **bucket = &dir->buckets[node->hash & (dir->nbuckets - 1)];
+    node->hnext = *bucket;
+    *bucket = node;
+}
+
+static void hash_remove(tmpfs_node_t *dir, tmpfs_node_t *node) {
+    tmpfs_node_t **link = &dir->buckets[node->hash & (dir->nbuckets - 1)];
+    while (*link && *link != node) link = &(*link)->hnext;
+    if (*link) *link = node->hnext;
+    node->hnext = NULL;
+}
+
+// Double the bucket count (power of two) and rehash
+static int hash_grow(tmpfs_node_t *dir) {
+    uint32_t nb = dir->nbuckets ? dir->nbuckets * 2 : 8;
+    tmpfs_node_t **buckets = malloc(nb * sizeof(tmpfs_node_t *));
+    if (!buckets) return -1;
+    memset(buckets, 0, nb * sizeof(tmpfs_node_t *));
+
+    free(dir->buckets);
+    dir->buckets = buckets;
+    dir->nbuckets = nb;
+    for (tmpfs_node_t *n = dir->first; n; n = n->next) {
+        hash_insert(dir, n);
+    }
+    return 0;
+}
+
+static int add_child(tmpfs_node_t *dir, tmpfs_node_t *node) {
+    // Keep chains short; a failed grow just makes them longer
+    if (dir->count >= dir->nbuckets && hash_grow(dir) < 0 && dir->nbuckets == 0) {
+        return -1;
+    }
+    hash_insert(dir, node);
+
+    node->parent = dir;
+    node->seq = dir->next_seq++;
+    node->prev = dir->last;
+    node->next = NULL;
+    if (dir->last) dir->last->next = node;
+    else dir->first = node;
+    dir->last = node;
+    dir->count++;
+    return 0;
+}
+
+static void remove_child(tmpfs_node_t *node) {
+    tmpfs_node_t *dir = node->parent;
+    hash_remove(dir, node);
+
+    if (node->prev) node->prev->next = node->next;
+    else dir->first = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else dir->last = node->prev;
+    node->prev = node->next = NULL;
+
+    dir->count--;
+    dir->removals++;
+    node->parent = NULL;
+}
+
+static void release(tmpfs_t *fs, tmpfs_node_t *node) {
+    if (node->unlinked && node->refs == 0) free_node(fs, node);
+}
+
+static void unlink_node(tmpfs_t *fs, tmpfs_node_t *node) {
+    remove_child(node);
+    node->unlinked = 1;
+    release(fs, node);
+}
+
+static void unlink_tree(tmpfs_t *fs, tmpfs_node_t *node) {
+    while (node->first) unlink_tree(fs, node->first);
+    unlink_node(fs, node);
+}
+
+// Walk path from the root. With last set, stops at the parent of the
+// final component and points *last at that component's name.
+static tmpfs_node_t *walk(tmpfs_t *fs, const char *path, const char **last, size_t *last_len) {
+    tmpfs_node_t *cur = fs->root;
+    const char *p = path;
+
+    while (1) {
+        while (*p == '/') p++;
+        if (!*p) return last ? NULL : cur;
+
+        const char *name = p;
+        while (*p && *p != '/') p++;
+        size_t len = p - name;
+
+        if (cur->type != TMPFS_DIR) return NULL;
+
+        if (last) {
+            const char *rest = p;
+            while (*rest == '/') rest++;
+            if (!*rest) {
+                *last = name;
+                *last_len = len;
+                return cur;
+            }
+        }
+
+        if (len == 1 && name[0] == '.') continue;
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            if (cur->parent) cur = cur->parent;
+            continue;
+        }
+        cur = find_child(cur, name, len, name_hash(name, len));
+        if (!cur) return NULL;
+    }
+}
+
+tmpfs_t *tmpfs_create(void) {
+    tmpfs_t *fs = malloc(sizeof(tmpfs_t));
+    if (!fs) return NULL;
+    fs->bytes = 0;
+    fs->nodes = 0;
+    fs->root = new_node(fs, "/", 1, TMPFS_DIR);
+    if (!fs->root) {
+        free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+tmpfs_node_t *tmpfs_lookup(tmpfs_t *fs, const char *path) {
+    return walk(fs, path, NULL, NULL);
+}
+
+static tmpfs_node_t *create_node(tmpfs_t *fs, const char *path, uint8_t type) {
+    const char *name;
+    size_t len;
+    tmpfs_node_t *parent = walk(fs, path, &name, &len);
+    if (!parent || !valid_name(name, len)) return NULL;
+
+    tmpfs_node_t *existing = find_child(parent, name, len, name_hash(name, len));
+    if (existing) {
+        return (type == TMPFS_FILE && existing->type == TMPFS_FILE) ? existing : NULL;
+    }
+
+    tmpfs_node_t *node = new_node(fs, name, len, type);
+    if (!node) return NULL;
+    if (add_child(parent, node) < 0) {
+        free_node(fs, node);
+        return NULL;
+    }
+    return node;
+}
+
+tmpfs_node_t *tmpfs_create_file(tmpfs_t *fs, const char *path) {
+    return create_node(fs, path, TMPFS_FILE);
+}
+
+tmpfs_node_t *tmpfs_mkdir(tmpfs_t *fs, const char *path) {
+    return create_node(fs, path, TMPFS_DIR);
+}
+
+int tmpfs_delete(tmpfs_t *fs, const char *path) {
+    tmpfs_node_t *node = tmpfs_lookup(fs, path);
+    if (!node || node->type != TMPFS_FILE) return -1;
+    unlink_node(fs, node);
+    return 0;
+}
+
+int tmpfs_delete_dir(tmpfs_t *fs, const char *path) {
+    tmpfs_node_t *node = tmpfs_lookup(fs, path);
+    if (!node || node == fs->root || node->type != TMPFS_DIR || node->count > 0) {
+        return -1;
+    }
+    unlink_node(fs, node);
+    return 0;
+}
+
+int tmpfs_delete_recursive(tmpfs_t *fs, const char *path) {
+    tmpfs_node_t *node = tmpfs_lookup(fs, path);
+    if (!node || node == fs->root) return -1;
+    unlink_tree(fs, node);
+    return 0;
+}
+
+int tmpfs_rename(tmpfs_t *fs, const char *path, const char *newname) {
+    tmpfs_node_t *node = tmpfs_lookup(fs, path);
+    if (!node || node == fs->root) return -1;
+
+    size_t len = strlen(newname);
+    if (!valid_name(newname, len)) return -1;
+
+    tmpfs_node_t *dir = node->parent;
+    tmpfs_node_t *existing = find_child(dir, newname, len, name_hash(newname, len));
+    if (existing) return existing == node ? 0 : -1;
+
+    char *name = malloc(len + 1);
+    if (!name) return -1;
+    strcpy(name, newname);
+
+    // Same place in readdir order, new hash chain
+    hash_remove(dir, node);
+    free(node->name);
+    node->name = name;
+    node->hash = name_hash(newname, len);
+    hash_insert(dir, node);
+    return 0;
+}
+
+void tmpfs_get(tmpfs_node_t *node) {
+    node->refs++;
+}
+
+void tmpfs_put(tmpfs_t *fs, tmpfs_node_t *node) {
+    node->refs--;
+    release(fs, node);
+}
+
+void tmpfs_opendir(tmpfs_node_t *dir, tmpfs_dir_t *d) {
+    tmpfs_get(dir);
+    d->dir = dir;
+    tmpfs_rewinddir(d);
+}
+
+int tmpfs_readdir(tmpfs_dir_t *d, tmpfs_node_t **out) {
+    tmpfs_node_t *dir = d->dir;
+    if (dir->unlinked) return -1;
+
+    tmpfs_node_t *n = d->pos;
+    if (!n || d->removals != dir->removals) {
+        // pos may have been freed, or children added after the end:
+        // find the first child after the last one returned
+        n = (dir->last && dir->last->seq > d->last_seq) ? dir->first : NULL;
+        while (n && n->seq <= d->last_seq) n = n->next;
+        d->removals = dir->removals;
+    }
+    if (!n) {
+        d->pos = NULL;
+        return 0;
+    }
+
+    *out = n;
+    d->last_seq = n->seq;
+    d->pos = n->next;
+    return 1;
+}
+
+void tmpfs_rewinddir(tmpfs_dir_t *d) {
+    d->pos = d->dir->first;
+    d->last_seq = 0;
+    d->removals = d->dir->removals;
+}
+
+void tmpfs_closedir(tmpfs_t *fs, tmpfs_dir_t *d) {
+    tmpfs_put(fs, d->dir);
+    d->dir = NULL;
+}
+
+// ============================================================================
+// File data
+// ============================================================================
+
+// Make the extent table at least n slots long
+static int reserve_extents(tmpfs_node_t *file, uint32_t n) {
+    if (n <= file->nextents) return 0;
+
+    uint32_t cap = file->nextents ? file->nextents : 4;
+    while (cap < n) cap *= 2;
+    uint8_t **table = malloc(cap * sizeof(uint8_t *));
+    if (!table) return -1;
+
+    if (file->extents) memcpy(table, file->extents, file->nextents * sizeof(uint8_t *));
+    memset(table + file->nextents, 0, (cap - file->nextents) * sizeof(uint8_t *));
+    free(file->extents);
+    file->extents = table;
+    file->nextents = cap;
+    return 0;
+}
+
+// Extent idx, allocated and zeroed as needed so that it holds at least
+// need bytes. The first extent starts small so tiny files stay tiny.
+static uint8_t *writable_extent(tmpfs_t *fs, tmpfs_node_t *file, uint32_t idx, size_t need) {
+    if (idx > 0) {
+        if (!file->extents[idx]) {
+            uint8_t *ext = malloc(TMPFS_EXTENT);
+            if (!ext) return NULL;
+            memset(ext, 0, TMPFS_EXTENT);
+            file->extents[idx] = ext;
+            fs->bytes += TMPFS_EXTENT;
+        }
+        return file->extents[idx];
+    }
+
+    if (need > file->first_cap) {
+        uint32_t cap = 64;
+        while (cap < need) cap *= 2;
+        if (cap > TMPFS_EXTENT) cap = TMPFS_EXTENT;
+
+        uint8_t *ext = realloc(file->extents[0], cap);
+        if (!ext) return NULL;
+        memset(ext + file->first_cap, 0, cap - file->first_cap);
+        fs->bytes += cap - file->first_cap;
+        file->extents[0] = ext;
+        file->first_cap = cap;
+    }
+    return file->extents[0];
+}
+
+int tmpfs_read(tmpfs_node_t *file, void *buf, size_t size, size_t offset) {
+    if (!file || file->type != TMPFS_FILE || !buf) return -1;
+    if (offset >= file->size) return 0;
+
+    size_t to_read = file->size - offset;
+    if (to_read > size) to_read = size;
+
+    uint8_t *out = (uint8_t *)buf;
+    size_t done = 0;
+    while (done < to_read) {
+        size_t pos = offset + done;
+        uint32_t idx = pos / TMPFS_EXTENT;
+        size_t in = pos % TMPFS_EXTENT;
+        size_t chunk = TMPFS_EXTENT - in;
+        if (chunk > to_read - done) chunk = to_read - done;
+
+        // Missing extents, and the unallocated end of the first, are zeros
+        uint8_t *ext = idx < file->nextents ? file->extents[idx] : NULL;
+        uint32_t cap = extent_cap(file, idx);
+        size_t avail = (ext && in < cap) ? cap - in : 0;
+        if (avail > chunk) avail = chunk;
+
+        if (avail) memcpy(out + done, ext + in, avail);
+        if (avail < chunk) memset(out + done + avail, 0, chunk - avail);
+        done += chunk;
+    }
+    return (int)done;
+}
+
+int tmpfs_write(tmpfs_t *fs, tmpfs_node_t *file, const void *buf, size_t size, size_t offset) {
+    if (!file || file->type != TMPFS_FILE || (!buf && size)) return -1;
+    if (size == 0) return 0;
+
+    size_t end = offset + size;
+    if (end < offset || end > 0x7FFFFFFF) return -1;   // Sizes are ints at the API
+    if (reserve_extents(file, (end + TMPFS_EXTENT - 1) / TMPFS_EXTENT) < 0) return -1;
+
+    const uint8_t *in_buf = (const uint8_t *)buf;
+    size_t done = 0;
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t idx = pos / TMPFS_EXTENT;
+        size_t in = pos % TMPFS_EXTENT;
+        size_t chunk = TMPFS_EXTENT - in;
+        if (chunk > size - done) chunk = size - done;
+
+        uint8_t *ext = writable_extent(fs, file, idx, in + chunk);
+        if (!ext) break;
+        memcpy(ext + in, in_buf + done, chunk);
+        done += chunk;
+    }
+
+    if (offset + done > file->size) file->size = offset + done;
+    return done ? (int)done : -1;
+}
+
+int tmpfs_truncate(tmpfs_t *fs, tmpfs_node_t *file, size_t size) {
+    if (!file || file->type != TMPFS_FILE || size > 0x7FFFFFFF) return -1;
+
+    if (size < file->size) {
+        // Free the extents past the new end...
+        uint32_t keep = (size + TMPFS_EXTENT - 1) / TMPFS_EXTENT;
+        for (uint32_t i = keep; i < file->nextents; i++) {
+            if (!file->extents[i]) continue;
+            fs->bytes -= extent_cap(file, i);
+            free(file->extents[i]);
+            file->extents[i] = NULL;
+            if (i == 0) file->first_cap = 0;
+        }
+
+        // ...and zero the cut-off part of the last one
+        size_t in = size % TMPFS_EXTENT;
+        if (keep > 0 && in > 0 && keep - 1 < file->nextents) {
+            uint8_t *ext = file->extents[keep - 1];
+            uint32_t cap = extent_cap(file, keep - 1);
+            if (ext && in < cap) memset(ext + in, 0, cap - in);
+        }
+    }
+
+    // Growing needs nothing: past the end is already zeros
+    file->size = size;
+    return 0;
+}
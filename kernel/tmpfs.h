@@ -0,0 +1,103 @@
+/*
+ * VibeOS RAM Filesystem
+ *
+ * Files and directories that live only in memory, for scratch files that
+ * have no business on the SD card. Directories hash their children by
+ * name; file data is a table of fixed-size extents, so growing a file
+ * never copies what is already there. Both grow until the heap runs out.
+ *
+ * Paths are relative to the filesystem's root and start with '/'. Names
+ * are case-sensitive. Not locked itself - every caller holds vfs_lock().
+ */
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TMPFS_FILE      1
+#define TMPFS_DIR       2
+#define TMPFS_EXTENT    4096    // Bytes per extent (the first one grows up to this)
+#define TMPFS_NAME_MAX  255
+
+typedef struct tmpfs_node {
+    char *name;
+    uint32_t hash;
+    uint8_t type;                   // TMPFS_FILE or TMPFS_DIR
+    struct tmpfs_node *parent;      // NULL once unlinked
+    struct tmpfs_node *hnext;       // Parent's hash chain
+    struct tmpfs_node *prev, *next; // Parent's children in creation order
+    uint32_t seq;                   // Position in that order
+    int refs;                       // Open handles and cursors
+    int unlinked;                   // Deleted - freed on the last put
+
+    // Directories
+    struct tmpfs_node **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+    struct tmpfs_node *first, *last;
+    uint32_t next_seq;
+    uint32_t removals;              // Lets cursors notice a child went away
+
+    // Files
+    size_t size;
+    uint8_t **extents;              // NULL slots read as zeros
+    uint32_t nextents;              // Slots in the table
+    uint32_t first_cap;             // Bytes allocated for extents[0]
+} tmpfs_node_t;
+
+typedef struct tmpfs {
+    tmpfs_node_t *root;
+    uint64_t bytes;                 // File data allocated
+    uint32_t nodes;
+} tmpfs_t;
+
+// Directory cursor: creation order, entries added behind it are returned
+typedef struct {
+    tmpfs_node_t *dir;
+    tmpfs_node_t *pos;              // Next child to return, NULL at the end
+    uint32_t last_seq;              // Last child returned
+    uint32_t removals;              // dir->removals when pos was taken
+} tmpfs_dir_t;
+
+// New empty filesystem, NULL if out of memory
+tmpfs_t *tmpfs_create(void);
+
+// NULL if not found
+tmpfs_node_t *tmpfs_lookup(tmpfs_t *fs, const char *path);
+
+// tmpfs_create_file returns an existing file as is. Both NULL if the
+// parent is missing, the name is taken (by a directory, for files) or
+// out of memory.
+tmpfs_node_t *tmpfs_create_file(tmpfs_t *fs, const char *path);
+tmpfs_node_t *tmpfs_mkdir(tmpfs_t *fs, const char *path);
+
+// Bytes read/written, or -1. Writing past the end leaves a gap that
+// reads as zeros. tmpfs_truncate cuts or zero-extends; 0 or -1.
+int tmpfs_read(tmpfs_node_t *file, void *buf, size_t size, size_t offset);
+int tmpfs_write(tmpfs_t *fs, tmpfs_node_t *file, const void *buf, size_t size, size_t offset);
+int tmpfs_truncate(tmpfs_t *fs, tmpfs_node_t *file, size_t size);
+
+// 0 or -1. tmpfs_delete only takes files, tmpfs_delete_dir only empty
+// directories; the root can't be deleted. Open nodes stay readable until
+// their last tmpfs_put().
+int tmpfs_delete(tmpfs_t *fs, const char *path);
+int tmpfs_delete_dir(tmpfs_t *fs, const char *path);
+int tmpfs_delete_recursive(tmpfs_t *fs, const char *path);
+
+// Rename within the same directory; newname is just the name
+int tmpfs_rename(tmpfs_t *fs, const char *path, const char *newname);
+
+// References held by open handles
+void tmpfs_get(tmpfs_node_t *node);
+void tmpfs_put(tmpfs_t *fs, tmpfs_node_t *node);
+
+// tmpfs_readdir: 1 with the next child in *out, 0 at the end, -1 if the
+// directory was deleted. *out is only good until the next tmpfs call.
+void tmpfs_opendir(tmpfs_node_t *dir, tmpfs_dir_t *d);
+int tmpfs_readdir(tmpfs_dir_t *d, tmpfs_node_t **out);
+void tmpfs_rewinddir(tmpfs_dir_t *d);
+void tmpfs_closedir(tmpfs_t *fs, tmpfs_dir_t *d);
+
+#endif
@@ -1,15 +1,22 @@
 /*
  * VibeOS Virtual File System
  *
- * Now backed by FAT32 on persistent storage with read/write support.
- * Falls back to in-memory if no disk is available.
+ * Paths go through a mount table: FAT32 on persistent storage at /, and
+ * tmpfs (RAM only) at /tmp. With no disk available, / is a tmpfs too.
+ *
+ * All entry points run under one recursive lock (see vfs_lock()).
  */
 
 #include "vfs.h"
 #include "fat32.h"
+#include "tmpfs.h"
+#include "bcache.h"
+#include "hal/hal.h"
 #include "string.h"
 #include "memory.h"
 #include "printf.h"
+#include "process.h"
+#include "spinlock.h"
 
 // Current working directory path
 static char cwd_path[VFS_MAX_PATH] = "/";
@@ -17,182 +24,118 @@ static char cwd_path[VFS_MAX_PATH] = "/";
 // Is FAT32 available?
 static int use_fat32 = 0;
 
-// For in-memory fallback (minimal, just /tmp)
-static vfs_node_t inodes[VFS_MAX_INODES];
-static int inode_count = 0;
-static vfs_node_t *mem_root = NULL;
-
-// Allocate a new in-memory inode
-static vfs_node_t *alloc_inode(void) {
-    if (inode_count >= VFS_MAX_INODES) {
-        return NULL;
-    }
-    vfs_node_t *node = &inodes[inode_count++];
-    memset(node, 0, sizeof(vfs_node_t));
-    return node;
+// Mount table, in mount order; / is always first. Mounts are never
+// removed, so pointers into the table stay good.
+typedef struct {
+    char path[VFS_MAX_PATH];
+    size_t len;
+    uint8_t fs;                 // VFS_FS_*
+    tmpfs_t *tmpfs;
+} vfs_mount_t;
+
+static vfs_mount_t mounts[VFS_MAX_MOUNTS];
+static int mount_count = 0;
+
+// Big filesystem lock. FAT32 keeps shared sector buffers and the cwd is
+// global, so one core at a time. It's held across disk I/O with IRQs on,
+// so instead of masking IRQs the holder just can't be preempted - which
+// also means no other thread can run on the owning core, so recursion is
+// tracked per core.
+static spinlock_t vfs_spin = SPINLOCK_INIT;
+static volatile int vfs_owner = -1;
+static int vfs_depth = 0;
+
+// Write back everything cached, filesystem metadata included
+static int flush_disk(void) {
+    return use_fat32 ? fat32_sync() : bcache_sync();
 }
 
-// Create an in-memory directory node
-static vfs_node_t *create_mem_dir(const char *name, vfs_node_t *parent) {
-    vfs_node_t *dir = alloc_inode();
-    if (!dir) return NULL;
-
-    int i;
-    for (i = 0; name[i] && i < VFS_MAX_NAME - 1; i++) {
-        dir->name[i] = name[i];
-    }
-    dir->name[i] = '\0';
-
-    dir->type = VFS_DIRECTORY;
-    dir->parent = parent;
-    dir->child_count = 0;
-
-    if (parent) {
-        if (parent->child_count >= VFS_MAX_CHILDREN) {
-            return NULL;
-        }
-        parent->children[parent->child_count++] = dir;
+void vfs_lock(void) {
+    preempt_disable();
+    int cpu = cpu_this()->id;
+    if (vfs_owner == cpu) {
+        vfs_depth++;
+        return;
     }
-
-    return dir;
+    spin_lock(&vfs_spin);
+    vfs_owner = cpu;
+    vfs_depth = 1;
 }
 
-// Create an in-memory file node
-static vfs_node_t *create_mem_file(const char *name, vfs_node_t *parent) {
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return NULL;
-    }
-
-    vfs_node_t *file = alloc_inode();
-    if (!file) return NULL;
-
-    int i;
-    for (i = 0; name[i] && i < VFS_MAX_NAME - 1; i++) {
-        file->name[i] = name[i];
+// Like vfs_lock(), but gives up instead of waiting for another core
+static int vfs_trylock(void) {
+    preempt_disable();
+    int cpu = cpu_this()->id;
+    if (vfs_owner == cpu) {
+        vfs_depth++;
+        return 1;
     }
-    file->name[i] = '\0';
-
-    file->type = VFS_FILE;
-    file->parent = parent;
-    file->data = NULL;
-    file->size = 0;
-    file->capacity = 0;
-
-    if (parent->child_count >= VFS_MAX_CHILDREN) {
-        return NULL;
+    if (!spin_trylock(&vfs_spin)) {
+        preempt_enable();
+        return 0;
     }
-    parent->children[parent->child_count++] = file;
-
-    return file;
+    vfs_owner = cpu;
+    vfs_depth = 1;
+    return 1;
 }
 
-// Find child by name in an in-memory directory
-static vfs_node_t *find_mem_child(vfs_node_t *dir, const char *name) {
-    if (!dir || dir->type != VFS_DIRECTORY) {
-        return NULL;
+void vfs_unlock(void) {
+    // Delayed write-back rides on the outermost unlock once it is due
+    if (vfs_depth == 1 && hal_get_time_ns() >= bcache_writeback_due()) {
+        flush_disk();
     }
-
-    for (int i = 0; i < dir->child_count; i++) {
-        if (strcmp(dir->children[i]->name, name) == 0) {
-            return dir->children[i];
-        }
+    if (--vfs_depth == 0) {
+        vfs_owner = -1;
+        spin_unlock(&vfs_spin);
     }
-    return NULL;
+    preempt_enable();
 }
 
-// Lookup in-memory filesystem
-static vfs_node_t *mem_lookup(const char *path) {
-    if (!path || !path[0]) {
-        return mem_root;
-    }
-
-    vfs_node_t *current;
-    char pathbuf[VFS_MAX_PATH];
-    char *token;
-    char *rest;
-
-    if (path[0] == '/') {
-        current = mem_root;
-        path++;
-    } else {
-        // Relative path - not supported for in-memory, just use root
-        current = mem_root;
-    }
-
-    if (!path[0]) {
-        return current;
-    }
-
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
-
-    rest = pathbuf;
-    while ((token = strtok_r(rest, "/", &rest)) != NULL) {
-        if (token[0] == '\0') continue;
-
-        if (strcmp(token, ".") == 0) continue;
-
-        if (strcmp(token, "..") == 0) {
-            if (current->parent) {
-                current = current->parent;
-            }
+// The mount abspath is on (the longest mount path that is a prefix of it)
+// and, in *sub, the path within that filesystem
+static vfs_mount_t *find_mount(const char *abspath, const char **sub) {
+    vfs_mount_t *best = NULL;
+    for (int i = 0; i < mount_count; i++) {
+        vfs_mount_t *m = &mounts[i];
+        if (best && m->len <= best->len) continue;
+        if (m->len > 1 && (strncmp(abspath, m->path, m->len) != 0 ||
+                           (abspath[m->len] != '\0' && abspath[m->len] != '/'))) {
             continue;
         }
-
-        vfs_node_t *child = find_mem_child(current, token);
-        if (!child) {
-            return NULL;
-        }
-        current = child;
+        best = m;
     }
 
-    return current;
+    if (best && sub) {
+        const char *s = best->len > 1 ? abspath + best->len : abspath;
+        *sub = *s ? s : "/";
+    }
+    return best;
 }
 
-// Initialize the filesystem
-void vfs_init(void) {
-    // Try to use FAT32
-    if (fat32_init() == 0) {
-        use_fat32 = 1;
+// Is abspath the root of a mount? Mount points can't be deleted or renamed.
+static int is_mount_root(const char *abspath) {
+    const char *sub;
+    vfs_mount_t *m = find_mount(abspath, &sub);
+    return m && strcmp(sub, "/") == 0;
+}
 
-        // Set initial cwd to /home/user if it exists, else /
-        if (fat32_is_dir("/home/user") == 1) {
-            strcpy(cwd_path, "/home/user");
-        } else if (fat32_is_dir("/home") == 1) {
-            strcpy(cwd_path, "/home");
-        } else {
-            strcpy(cwd_path, "/");
+// Is there a mount somewhere under abspath?
+static int has_mount_below(const char *abspath) {
+    size_t len = strlen(abspath);
+    for (int i = 0; i < mount_count; i++) {
+        if (mounts[i].len > len && strncmp(mounts[i].path, abspath, len) == 0 &&
+            (len == 1 || mounts[i].path[len] == '/')) {
+            return 1;
         }
-    } else {
-        use_fat32 = 0;
-
-        // Create minimal in-memory filesystem
-        inode_count = 0;
-        mem_root = alloc_inode();
-        mem_root->name[0] = '/';
-        mem_root->name[1] = '\0';
-        mem_root->type = VFS_DIRECTORY;
-        mem_root->parent = mem_root;
-        mem_root->child_count = 0;
-
-        // Create /tmp for temporary files
-        create_mem_dir("tmp", mem_root);
-
-        strcpy(cwd_path, "/");
     }
-
-    printf("[VFS] %s, cwd=%s\n", use_fat32 ? "FAT32" : "in-memory", cwd_path);
+    return 0;
 }
 
-// Resolve a path to a node (returns static/cached node - do NOT free)
-// For FAT32, returns a static temp node
-// For in-memory, returns the actual node
-vfs_node_t *vfs_lookup(const char *path) {
-    static vfs_node_t temp_node;
-    static char stored_path[VFS_MAX_PATH];
+// Make path absolute (relative to the cwd) and resolve . and ..
+// Returns 0, or -1 if it has too many components.
+static int normalize_path(const char *path, char *normalized) {
     char fullpath[VFS_MAX_PATH];
 
-    // Build full path
     if (!path || !path[0]) {
         strcpy(fullpath, cwd_path);
     } else if (path[0] == '/') {
@@ -207,8 +150,6 @@ vfs_node_t *vfs_lookup(const char *path) {
         }
     }
 
-    // Normalize . and ..
-    char normalized[VFS_MAX_PATH];
     char *parts[32];
     int depth = 0;
 
@@ -224,6 +165,7 @@ vfs_node_t *vfs_lookup(const char *path) {
             if (depth > 0) depth--;
             continue;
         }
+        if (depth == 32) return -1;
         parts[depth++] = token;
     }
 
@@ -236,47 +178,247 @@ vfs_node_t *vfs_lookup(const char *path) {
     if (normalized[0] == '\0') {
         strcpy(normalized, "/");
     }
+    return 0;
+}
 
-    if (use_fat32) {
-        int is_dir = fat32_is_dir(normalized);
-        if (is_dir < 0) {
-            return NULL;  // Not found
-        }
+// 1 if abspath is a directory, 0 if a file (its size in *size), -1 if
+// not found
+static int path_type(const char *abspath, size_t *size) {
+    const char *sub;
+    vfs_mount_t *m = find_mount(abspath, &sub);
+    if (!m) return -1;
 
-        // Use static node for lookup (not for file handles!)
-        memset(&temp_node, 0, sizeof(temp_node));
+    if (m->fs == VFS_FS_FAT32) {
+        int is_dir = fat32_is_dir(sub);
+        if (is_dir == 0 && size) *size = fat32_file_size(sub);
+        return is_dir;
+    }
 
-        // Extract name from path
-        char *last_slash = NULL;
-        for (char *p = normalized; *p; p++) {
-            if (*p == '/') last_slash = p;
+    tmpfs_node_t *node = tmpfs_lookup(m->tmpfs, sub);
+    if (!node) return -1;
+    if (node->type == TMPFS_FILE && size) *size = node->size;
+    return node->type == TMPFS_DIR;
+}
+
+// The tmpfs node behind a vfs node: held by handles, looked up by path
+// for lookup nodes. Also hands back its filesystem.
+static tmpfs_node_t *tmpfs_node_of(vfs_node_t *node, tmpfs_t **fs) {
+    if (!node->data) return NULL;
+
+    const char *sub;
+    vfs_mount_t *m = find_mount(node->data, &sub);
+    if (!m || m->fs != VFS_FS_TMPFS) return NULL;
+
+    *fs = m->tmpfs;
+    if (node->fs_file) return (tmpfs_node_t *)node->fs_file;
+    return tmpfs_lookup(m->tmpfs, sub);
+}
+
+// Make an empty tmpfs and mount it on abspath
+static int do_mount_tmpfs(const char *path) {
+    char abspath[VFS_MAX_PATH];
+    if (mount_count >= VFS_MAX_MOUNTS || normalize_path(path, abspath) < 0) {
+        return -1;
+    }
+
+    if (mount_count > 0) {
+        for (int i = 0; i < mount_count; i++) {
+            if (strcmp(mounts[i].path, abspath) == 0) return -1;
+        }
+
+        // Needs a directory to sit on. Making it on FAT32 is a one-off
+        // write; nothing under the mount ever reaches the disk.
+        int type = path_type(abspath, NULL);
+        if (type == 0) return -1;
+        if (type < 0) {
+            const char *sub;
+            vfs_mount_t *m = find_mount(abspath, &sub);
+            int made = (m->fs == VFS_FS_FAT32) ? fat32_mkdir(sub) == 0
+                                               : tmpfs_mkdir(m->tmpfs, sub) != NULL;
+            if (!made) return -1;
         }
-        if (last_slash && last_slash[1]) {
-            strncpy(temp_node.name, last_slash + 1, VFS_MAX_NAME - 1);
+    } else if (strcmp(abspath, "/") != 0) {
+        return -1;  // The first mount is the root
+    }
+
+    tmpfs_t *fs = tmpfs_create();
+    if (!fs) return -1;
+
+    vfs_mount_t *m = &mounts[mount_count++];
+    strcpy(m->path, abspath);
+    m->len = strlen(abspath);
+    m->fs = VFS_FS_TMPFS;
+    m->tmpfs = fs;
+
+    printf("[VFS] tmpfs mounted on %s\n", abspath);
+    return 0;
+}
+
+// Initialize the filesystem
+void vfs_init(void) {
+    // Try to use FAT32
+    if (fat32_init() == 0) {
+        use_fat32 = 1;
+
+        // FAT32 is only ever the root mount, so its paths are absolute paths
+        vfs_mount_t *m = &mounts[mount_count++];
+        strcpy(m->path, "/");
+        m->len = 1;
+        m->fs = VFS_FS_FAT32;
+        m->tmpfs = NULL;
+
+        // Set initial cwd to /home/user if it exists, else /
+        if (fat32_is_dir("/home/user") == 1) {
+            strcpy(cwd_path, "/home/user");
+        } else if (fat32_is_dir("/home") == 1) {
+            strcpy(cwd_path, "/home");
         } else {
-            strcpy(temp_node.name, "/");
+            strcpy(cwd_path, "/");
         }
+    } else {
+        use_fat32 = 0;
+
+        // Everything in memory
+        do_mount_tmpfs("/");
+        strcpy(cwd_path, "/");
+    }
+
+    // Scratch files - compiler temporaries and the like - stay in RAM
+    do_mount_tmpfs("/tmp");
 
-        temp_node.type = is_dir ? VFS_DIRECTORY : VFS_FILE;
-        if (!is_dir) {
-            temp_node.size = fat32_file_size(normalized);
+    printf("[VFS] %s, cwd=%s\n", use_fat32 ? "FAT32" : "in-memory", cwd_path);
+}
+
+// Resolve a path to a node (returns a static temp node, one per core -
+// do NOT free)
+static vfs_node_t *do_lookup(const char *path) {
+    static vfs_node_t temp_nodes[MAX_CPUS];
+    static char stored_paths[MAX_CPUS][VFS_MAX_PATH];
+    vfs_node_t *temp = &temp_nodes[cpu_this()->id];
+    char *stored_path = stored_paths[cpu_this()->id];
+
+    char normalized[VFS_MAX_PATH];
+    if (normalize_path(path, normalized) < 0) {
+        return NULL;
+    }
+
+    size_t size = 0;
+    int is_dir = path_type(normalized, &size);
+    if (is_dir < 0) {
+        return NULL;  // Not found
+    }
+
+    // Use static node for lookup (not for file handles!)
+    memset(temp, 0, sizeof(*temp));
+
+    // Extract name from path
+    char *last_slash = NULL;
+    for (char *p = normalized; *p; p++) {
+        if (*p == '/') last_slash = p;
+    }
+    if (last_slash && last_slash[1]) {
+        strncpy(temp->name, last_slash + 1, VFS_MAX_NAME - 1);
+    } else {
+        strcpy(temp->name, "/");
+    }
+
+    temp->type = is_dir ? VFS_DIRECTORY : VFS_FILE;
+    temp->fs = find_mount(normalized, NULL)->fs;
+    if (!is_dir) {
+        temp->size = size;
+    }
+
+    // Store path in static buffer
+    strcpy(stored_path, normalized);
+    temp->data = stored_path;
+
+    return temp;
+}
+
+// Directory cursor, on whichever filesystem the directory is on. Also
+// what vfs_opendir hands out.
+struct vfs_dir {
+    uint8_t fs;
+    tmpfs_t *tmpfs;
+    void *cursor;       // fat32_dir_t or tmpfs_dir_t
+};
+
+static vfs_dir_t *open_cursor(const char *abspath) {
+    const char *sub;
+    vfs_mount_t *m = find_mount(abspath, &sub);
+    if (!m) return NULL;
+
+    vfs_dir_t *dir = malloc(sizeof(vfs_dir_t));
+    if (!dir) return NULL;
+    dir->fs = m->fs;
+    dir->tmpfs = m->tmpfs;
+    dir->cursor = NULL;
+
+    if (m->fs == VFS_FS_FAT32) {
+        dir->cursor = fat32_opendir(sub);
+    } else {
+        tmpfs_node_t *node = tmpfs_lookup(m->tmpfs, sub);
+        if (node && node->type == TMPFS_DIR) {
+            dir->cursor = malloc(sizeof(tmpfs_dir_t));
+            if (dir->cursor) tmpfs_opendir(node, (tmpfs_dir_t *)dir->cursor);
         }
+    }
+
+    if (!dir->cursor) {
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
 
-        // Store path in static buffer
-        strcpy(stored_path, normalized);
-        temp_node.data = stored_path;
+static void close_cursor(vfs_dir_t *dir) {
+    if (dir->fs == VFS_FS_FAT32) {
+        fat32_closedir((fat32_dir_t *)dir->cursor);
+    } else {
+        tmpfs_closedir(dir->tmpfs, (tmpfs_dir_t *)dir->cursor);
+        free(dir->cursor);
+    }
+    free(dir);
+}
 
-        return &temp_node;
+static void rewind_cursor(vfs_dir_t *dir) {
+    if (dir->fs == VFS_FS_FAT32) {
+        fat32_rewinddir((fat32_dir_t *)dir->cursor);
     } else {
-        return mem_lookup(normalized);
+        tmpfs_rewinddir((tmpfs_dir_t *)dir->cursor);
     }
 }
 
+// 1 with the next entry in *ent, 0 at the end, -1 on error
+static int next_entry(vfs_dir_t *dir, vfs_dirent_t *ent) {
+    if (dir->fs == VFS_FS_FAT32) {
+        fat32_dirinfo_t info;
+        int ret = fat32_readdir((fat32_dir_t *)dir->cursor, &info);
+        if (ret <= 0) return ret;
+
+        strcpy(ent->name, info.name);
+        ent->type = (info.attr & FAT_ATTR_DIRECTORY) ? VFS_DIRECTORY : VFS_FILE;
+        ent->attr = info.attr;
+        ent->size = ent->type == VFS_FILE ? info.size : 0;
+        return 1;
+    }
+
+    tmpfs_node_t *node;
+    int ret = tmpfs_readdir((tmpfs_dir_t *)dir->cursor, &node);
+    if (ret <= 0) return ret;
+
+    strcpy(ent->name, node->name);
+    ent->type = node->type == TMPFS_DIR ? VFS_DIRECTORY : VFS_FILE;
+    ent->attr = 0;
+    ent->size = ent->type == VFS_FILE ? node->size : 0;
+    return 1;
+}
+
 // Open a file handle (allocates - caller must free with vfs_close_handle)
 // This is for kapi->open, NOT for internal kernel lookups
-vfs_node_t *vfs_open_handle(const char *path) {
+static vfs_node_t *do_open_handle(const char *path) {
     // First do a lookup to check if file exists and get info
-    vfs_node_t *temp = vfs_lookup(path);
+    vfs_node_t *temp = do_lookup(path);
     if (!temp) return NULL;
 
     // Allocate a new node for this handle
@@ -287,11 +429,32 @@ vfs_node_t *vfs_open_handle(const char *path) {
     memcpy(node, temp, sizeof(vfs_node_t));
 
     // Allocate and copy the path
-    if (temp->data) {
-        char *path_copy = malloc(VFS_MAX_PATH);
-        if (!path_copy) { free(node); return NULL; }
-        strcpy(path_copy, (char*)temp->data);
-        node->data = path_copy;
+    char *path_copy = malloc(VFS_MAX_PATH);
+    if (!path_copy) { free(node); return NULL; }
+    strcpy(path_copy, (char*)temp->data);
+    node->data = path_copy;
+
+    // Files keep an open file, so reads skip the path walk (and on FAT32
+    // the FAT chain walk). A tmpfs file stays readable through the handle
+    // even if it is deleted.
+    node->fs_file = NULL;
+    if (node->type == VFS_FILE && node->fs == VFS_FS_FAT32) {
+        node->fs_file = fat32_open(node->data);
+    } else if (node->type == VFS_FILE) {
+        tmpfs_t *fs;
+        tmpfs_node_t *file = tmpfs_node_of(node, &fs);
+        if (file) {
+            tmpfs_get(file);
+            node->fs_file = file;
+        }
+    }
+
+    // Directories keep a cursor, so readdir with increasing indexes walks
+    // the directory once
+    node->fs_dir = NULL;
+    node->dir_pos = 0;
+    if (node->type == VFS_DIRECTORY) {
+        node->fs_dir = open_cursor(node->data);
     }
 
     return node;
@@ -300,6 +463,17 @@ vfs_node_t *vfs_open_handle(const char *path) {
 // Close/free a handle returned by vfs_open_handle
 void vfs_close_handle(vfs_node_t *node) {
     if (!node) return;
+    if (node->fs_file || node->fs_dir) {
+        vfs_lock();
+        if (node->fs_file && node->fs == VFS_FS_FAT32) {
+            fat32_close((fat32_file_t *)node->fs_file);
+        } else if (node->fs_file) {
+            tmpfs_t *fs;
+            if (tmpfs_node_of(node, &fs)) tmpfs_put(fs, (tmpfs_node_t *)node->fs_file);
+        }
+        if (node->fs_dir) close_cursor((vfs_dir_t *)node->fs_dir);
+        vfs_unlock();
+    }
     if (node->data) free(node->data);
     free(node);
 }
@@ -312,617 +486,497 @@ vfs_node_t *vfs_get_cwd(void) {
     return vfs_lookup(cwd_path);
 }
 
-int vfs_set_cwd(const char *path) {
-    char fullpath[VFS_MAX_PATH];
-
+static int do_set_cwd(const char *path) {
     if (!path || !path[0]) {
         return -1;
     }
 
-    // Build full path
-    if (path[0] == '/') {
-        strncpy(fullpath, path, VFS_MAX_PATH - 1);
-        fullpath[VFS_MAX_PATH - 1] = '\0';
-    } else {
-        if (strcmp(cwd_path, "/") == 0) {
-            snprintf(fullpath, VFS_MAX_PATH, "/%s", path);
-        } else {
-            snprintf(fullpath, VFS_MAX_PATH, "%s/%s", cwd_path, path);
-        }
-    }
-
-    // Normalize the path
     char normalized[VFS_MAX_PATH];
-    char *parts[32];
-    int depth = 0;
-
-    char pathcopy[VFS_MAX_PATH];
-    strcpy(pathcopy, fullpath);
-
-    char *rest = pathcopy;
-    char *token;
-    if (*rest == '/') rest++;
-
-    while ((token = strtok_r(rest, "/", &rest)) != NULL) {
-        if (token[0] == '\0' || strcmp(token, ".") == 0) {
-            continue;
-        }
-        if (strcmp(token, "..") == 0) {
-            if (depth > 0) depth--;
-            continue;
-        }
-        parts[depth++] = token;
-    }
-
-    normalized[0] = '\0';
-    for (int i = 0; i < depth; i++) {
-        strcat(normalized, "/");
-        strcat(normalized, parts[i]);
-    }
-    if (normalized[0] == '\0') {
-        strcpy(normalized, "/");
+    if (normalize_path(path, normalized) < 0) {
+        return -1;
     }
 
     // Check if it exists and is a directory
-    if (use_fat32) {
-        if (fat32_is_dir(normalized) != 1) {
-            return -1;
-        }
-    } else {
-        vfs_node_t *node = mem_lookup(normalized);
-        if (!node || node->type != VFS_DIRECTORY) {
-            return -1;
-        }
+    if (path_type(normalized, NULL) != 1) {
+        return -1;
     }
 
     strcpy(cwd_path, normalized);
     return 0;
 }
 
-int vfs_get_cwd_path(char *buf, size_t size) {
+static int do_get_cwd_path(char *buf, size_t size) {
     if (!buf || size == 0) return -1;
     strncpy(buf, cwd_path, size - 1);
     buf[size - 1] = '\0';
     return 0;
 }
 
-// Directory listing callback context
-typedef struct {
-    int index;
-    int target_index;
-    char *name;
-    size_t name_size;
-    uint8_t *type;
-    int found;
-} readdir_ctx_t;
-
-static void readdir_callback(const char *name, int is_dir, uint32_t size, void *user_data) {
-    (void)size;
-    readdir_ctx_t *ctx = (readdir_ctx_t *)user_data;
-
-    if (ctx->index == ctx->target_index) {
-        strncpy(ctx->name, name, ctx->name_size - 1);
-        ctx->name[ctx->name_size - 1] = '\0';
-        if (ctx->type) {
-            *ctx->type = is_dir ? VFS_DIRECTORY : VFS_FILE;
-        }
-        ctx->found = 1;
-    }
-    ctx->index++;
-}
-
-int vfs_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_t *type) {
-    if (!dir || dir->type != VFS_DIRECTORY || !name) {
+static int do_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_t *type) {
+    if (!dir || dir->type != VFS_DIRECTORY || !name || index < 0) {
         return -1;
     }
 
-    if (use_fat32) {
-        // Get the path from the node
-        const char *dirpath = (const char *)dir->data;
-        if (!dirpath) dirpath = "/";
-
-        readdir_ctx_t ctx = {
-            .index = 0,
-            .target_index = index,
-            .name = name,
-            .name_size = name_size,
-            .type = type,
-            .found = 0
-        };
-
-        fat32_list_dir(dirpath, readdir_callback, &ctx);
-
-        return ctx.found ? 0 : -1;
-    } else {
-        if (index < 0 || index >= dir->child_count) {
-            return -1;
+    vfs_dirent_t ent;
+    if (dir->fs_dir) {
+        // Carry on from the cursor; going backwards starts over
+        vfs_dir_t *d = (vfs_dir_t *)dir->fs_dir;
+        if (index < dir->dir_pos) {
+            rewind_cursor(d);
+            dir->dir_pos = 0;
         }
 
-        vfs_node_t *child = dir->children[index];
-        strncpy(name, child->name, name_size - 1);
-        name[name_size - 1] = '\0';
-        if (type) *type = child->type;
-
-        return 0;
-    }
-}
-
-vfs_node_t *vfs_mkdir(const char *path) {
-    if (use_fat32) {
-        // Build full path
-        char fullpath[VFS_MAX_PATH];
-        if (path[0] == '/') {
-            strncpy(fullpath, path, VFS_MAX_PATH - 1);
-            fullpath[VFS_MAX_PATH - 1] = '\0';
-        } else {
-            if (strcmp(cwd_path, "/") == 0) {
-                snprintf(fullpath, VFS_MAX_PATH, "/%s", path);
-            } else {
-                snprintf(fullpath, VFS_MAX_PATH, "%s/%s", cwd_path, path);
-            }
+        while (dir->dir_pos <= index) {
+            if (next_entry(d, &ent) <= 0) return -1;
+            dir->dir_pos++;
         }
+    } else {
+        // Lookup nodes have no cursor - list from the start
+        vfs_dir_t *d = dir->data ? open_cursor(dir->data) : NULL;
+        if (!d) return -1;
 
-        if (fat32_mkdir(fullpath) < 0) {
-            return NULL;
+        int ret = 1;
+        for (int i = 0; i <= index && ret > 0; i++) {
+            ret = next_entry(d, &ent);
         }
-        return vfs_lookup(path);
+        close_cursor(d);
+        if (ret <= 0) return -1;
     }
 
-    // In-memory mkdir
-    if (!path || !path[0]) return NULL;
+    strncpy(name, ent.name, name_size - 1);
+    name[name_size - 1] = '\0';
+    if (type) *type = ent.type;
+    return 0;
+}
 
-    char pathbuf[VFS_MAX_PATH];
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
+static vfs_dir_t *do_opendir(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    if (normalize_path(path, normalized) < 0) return NULL;
+    return open_cursor(normalized);
+}
 
-    char *last_slash = NULL;
-    for (char *p = pathbuf; *p; p++) {
-        if (*p == '/') last_slash = p;
+static int do_readdir_batch(vfs_dir_t *dir, vfs_dirent_t *ents, int max) {
+    if (!dir || !ents || max <= 0) return -1;
+
+    int n = 0;
+    while (n < max) {
+        int ret = next_entry(dir, &ents[n]);
+        if (ret < 0) return n ? n : -1;   // Report it on the next call
+        if (ret == 0) break;
+        n++;
     }
+    return n;
+}
+
+static vfs_node_t *do_mkdir(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    if (!path || !path[0] || normalize_path(path, normalized) < 0) return NULL;
 
-    vfs_node_t *parent;
-    char *dirname;
+    const char *sub;
+    vfs_mount_t *m = find_mount(normalized, &sub);
+    if (!m) return NULL;
 
-    if (last_slash == NULL) {
-        parent = mem_lookup(cwd_path);
-        dirname = pathbuf;
-    } else if (last_slash == pathbuf) {
-        parent = mem_root;
-        dirname = last_slash + 1;
+    if (m->fs == VFS_FS_FAT32) {
+        if (fat32_mkdir(sub) < 0) return NULL;
     } else {
-        *last_slash = '\0';
-        parent = mem_lookup(pathbuf);
-        dirname = last_slash + 1;
+        if (!tmpfs_mkdir(m->tmpfs, sub)) return NULL;
     }
+    return do_lookup(normalized);
+}
 
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return NULL;
-    }
+static vfs_node_t *do_create(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    if (!path || !path[0] || normalize_path(path, normalized) < 0) return NULL;
 
-    if (find_mem_child(parent, dirname)) {
-        return NULL;  // Already exists
-    }
+    const char *sub;
+    vfs_mount_t *m = find_mount(normalized, &sub);
+    if (!m) return NULL;
 
-    return create_mem_dir(dirname, parent);
+    if (m->fs == VFS_FS_FAT32) {
+        if (fat32_create_file(sub) < 0) return NULL;
+    } else {
+        if (!tmpfs_create_file(m->tmpfs, sub)) return NULL;
+    }
+    return do_lookup(normalized);
 }
 
-vfs_node_t *vfs_create(const char *path) {
-    if (use_fat32) {
-        // Build full path
-        char fullpath[VFS_MAX_PATH];
-        if (path[0] == '/') {
-            strncpy(fullpath, path, VFS_MAX_PATH - 1);
-            fullpath[VFS_MAX_PATH - 1] = '\0';
-        } else {
-            if (strcmp(cwd_path, "/") == 0) {
-                snprintf(fullpath, VFS_MAX_PATH, "/%s", path);
-            } else {
-                snprintf(fullpath, VFS_MAX_PATH, "%s/%s", cwd_path, path);
-            }
-        }
-
-        if (fat32_create_file(fullpath) < 0) {
-            return NULL;
-        }
-        return vfs_lookup(path);
+static int do_read(vfs_node_t *file, char *buf, size_t size, size_t offset) {
+    if (!file || file->type != VFS_FILE || !buf) {
+        return -1;
     }
 
-    if (!path || !path[0]) return NULL;
+    // Get path from node
+    const char *filepath = (const char *)file->data;
+    if (!filepath) return -1;
 
-    char pathbuf[VFS_MAX_PATH];
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
-
-    char *last_slash = NULL;
-    for (char *p = pathbuf; *p; p++) {
-        if (*p == '/') last_slash = p;
+    if (file->fs == VFS_FS_TMPFS) {
+        tmpfs_t *fs;
+        return tmpfs_read(tmpfs_node_of(file, &fs), buf, size, offset);
     }
 
-    vfs_node_t *parent;
-    char *filename;
-
-    if (last_slash == NULL) {
-        parent = mem_lookup(cwd_path);
-        filename = pathbuf;
-    } else if (last_slash == pathbuf) {
-        parent = mem_root;
-        filename = last_slash + 1;
-    } else {
-        *last_slash = '\0';
-        parent = mem_lookup(pathbuf);
-        filename = last_slash + 1;
+    if (file->fs_file) {
+        return fat32_file_read((fat32_file_t *)file->fs_file, buf, size, offset);
     }
 
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return NULL;
-    }
+    // Lookup nodes have no open-file object - resolve the path each time
+    return fat32_read_file_offset(filepath, buf, size, offset);
+}
 
-    vfs_node_t *existing = find_mem_child(parent, filename);
-    if (existing) {
-        return existing;
-    }
+// A node's FAT32 open-file object. Lookup nodes don't keep one, so open
+// one just for the call - release it with put_fat_file().
+static fat32_file_t *get_fat_file(vfs_node_t *file) {
+    if (file->fs_file) return (fat32_file_t *)file->fs_file;
+    if (!file->data) return NULL;
+    return fat32_open((const char *)file->data);
+}
 
-    return create_mem_file(filename, parent);
+static void put_fat_file(vfs_node_t *file, fat32_file_t *f) {
+    if (f && f != file->fs_file) fat32_close(f);
 }
 
-int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset) {
-    if (!file || file->type != VFS_FILE || !buf) {
+static int do_write(vfs_node_t *file, const char *buf, size_t size) {
+    if (!file || file->type != VFS_FILE) {
         return -1;
     }
 
-    if (use_fat32) {
-        // Get path from node
-        const char *filepath = (const char *)file->data;
-        if (!filepath) return -1;
+    if (file->fs == VFS_FS_TMPFS) {
+        tmpfs_t *fs;
+        tmpfs_node_t *n = tmpfs_node_of(file, &fs);
+        if (!n) return -1;
 
-        // Use offset-aware read - only reads what's needed
-        return fat32_read_file_offset(filepath, buf, size, offset);
-    } else {
-        if (offset >= file->size) {
-            return 0;
-        }
+        int ret = tmpfs_write(fs, n, buf, size, 0);
+        if (ret >= 0 && tmpfs_truncate(fs, n, size) < 0) ret = -1;
+        if (ret >= 0) file->size = size;
+        return ret;
+    }
 
-        size_t to_read = file->size - offset;
-        if (to_read > size) to_read = size;
+    // Overwrite in place and cut off whatever is left of the old
+    // contents - the cluster chain is reused, not reallocated
+    fat32_file_t *f = get_fat_file(file);
+    if (!f) return -1;
 
-        memcpy(buf, file->data + offset, to_read);
-        return (int)to_read;
-    }
+    int ret = fat32_file_write(f, buf, size, 0);
+    if (ret >= 0 && fat32_file_truncate(f, size) < 0) ret = -1;
+    if (ret >= 0) file->size = size;
+    put_fat_file(file, f);
+    return ret;
 }
 
-int vfs_write(vfs_node_t *file, const char *buf, size_t size) {
+static int do_append(vfs_node_t *file, const char *buf, size_t size) {
     if (!file || file->type != VFS_FILE) {
         return -1;
     }
 
-    if (use_fat32) {
-        // Get path from node
-        const char *filepath = (const char *)file->data;
-        if (!filepath) return -1;
+    if (file->fs == VFS_FS_TMPFS) {
+        tmpfs_t *fs;
+        tmpfs_node_t *n = tmpfs_node_of(file, &fs);
+        if (!n) return -1;
 
-        return fat32_write_file(filepath, buf, size);
+        int ret = tmpfs_write(fs, n, buf, size, n->size);
+        if (ret >= 0) file->size = n->size;
+        return ret;
     }
 
-    // In-memory write
-    if (size > file->capacity) {
-        size_t new_cap = size + 64;
-        char *new_data = malloc(new_cap);
-        if (!new_data) return -1;
+    // Extends the chain in place - only the last clusters are touched
+    fat32_file_t *f = get_fat_file(file);
+    if (!f) return -1;
 
-        if (file->data) {
-            free(file->data);
-        }
-        file->data = new_data;
-        file->capacity = new_cap;
+    int ret = -1;
+    int file_size = fat32_file_length(f);
+    if (file_size >= 0) {
+        ret = fat32_file_write(f, buf, size, file_size);
+        if (ret >= 0) file->size = file_size + size;
     }
-
-    memcpy(file->data, buf, size);
-    file->size = size;
-    return (int)size;
+    put_fat_file(file, f);
+    return ret;
 }
 
-int vfs_append(vfs_node_t *file, const char *buf, size_t size) {
-    if (!file || file->type != VFS_FILE) {
+static int do_write_at(vfs_node_t *file, const char *buf, size_t size, size_t offset) {
+    if (!file || file->type != VFS_FILE || (!buf && size)) {
         return -1;
     }
 
-    if (use_fat32) {
-        // Get path from node
-        const char *filepath = (const char *)file->data;
-        if (!filepath) return -1;
-
-        // For append, we need to read existing content, add new data, and write back
-        int file_size = fat32_file_size(filepath);
-        if (file_size < 0) file_size = 0;
+    if (file->fs == VFS_FS_TMPFS) {
+        tmpfs_t *fs;
+        tmpfs_node_t *n = tmpfs_node_of(file, &fs);
+        if (!n) return -1;
 
-        char *new_buf = malloc(file_size + size);
-        if (!new_buf) return -1;
+        int ret = tmpfs_write(fs, n, buf, size, offset);
+        if (ret > 0) file->size = n->size;
+        return ret;
+    }
 
-        // Read existing content
-        if (file_size > 0) {
-            if (fat32_read_file(filepath, new_buf, file_size) < 0) {
-                free(new_buf);
-                return -1;
-            }
-        }
+    fat32_file_t *f = get_fat_file(file);
+    if (!f) return -1;
 
-        // Append new data
-        memcpy(new_buf + file_size, buf, size);
+    int ret = fat32_file_write(f, buf, size, offset);
+    if (ret > 0 && offset + size > file->size) file->size = offset + size;
+    put_fat_file(file, f);
+    return ret;
+}
 
-        // Write back
-        int result = fat32_write_file(filepath, new_buf, file_size + size);
-        free(new_buf);
-        return result >= 0 ? (int)size : -1;
+static int do_truncate(vfs_node_t *file, size_t size) {
+    if (!file || file->type != VFS_FILE) {
+        return -1;
     }
 
-    size_t new_size = file->size + size;
-
-    if (new_size > file->capacity) {
-        size_t new_cap = new_size + 64;
-        char *new_data = malloc(new_cap);
-        if (!new_data) return -1;
+    if (file->fs == VFS_FS_TMPFS) {
+        tmpfs_t *fs;
+        tmpfs_node_t *n = tmpfs_node_of(file, &fs);
+        if (!n) return -1;
 
-        if (file->data) {
-            memcpy(new_data, file->data, file->size);
-            free(file->data);
-        }
-        file->data = new_data;
-        file->capacity = new_cap;
+        int ret = tmpfs_truncate(fs, n, size);
+        if (ret >= 0) file->size = size;
+        return ret;
     }
 
-    memcpy(file->data + file->size, buf, size);
-    file->size = new_size;
-    return (int)size;
-}
+    fat32_file_t *f = get_fat_file(file);
+    if (!f) return -1;
 
-// Helper to build full path from possibly relative path
-static void build_fullpath(const char *path, char *fullpath) {
-    if (path[0] == '/') {
-        strncpy(fullpath, path, VFS_MAX_PATH - 1);
-        fullpath[VFS_MAX_PATH - 1] = '\0';
-    } else {
-        if (strcmp(cwd_path, "/") == 0) {
-            snprintf(fullpath, VFS_MAX_PATH, "/%s", path);
-        } else {
-            snprintf(fullpath, VFS_MAX_PATH, "%s/%s", cwd_path, path);
-        }
-    }
+    int ret = fat32_file_truncate(f, size);
+    if (ret >= 0) file->size = size;
+    put_fat_file(file, f);
+    return ret;
 }
 
-int vfs_delete(const char *path) {
-    if (use_fat32) {
-        char fullpath[VFS_MAX_PATH];
-        build_fullpath(path, fullpath);
-        return fat32_delete(fullpath);
-    }
-
-    // In-memory delete
-    if (!path || !path[0]) return -1;
+// Resolve path for a delete or rename: its mount and the path within it.
+// Mount points themselves are off limits.
+static vfs_mount_t *target_mount(const char *path, char *normalized, const char **sub) {
+    if (!path || !path[0] || normalize_path(path, normalized) < 0) return NULL;
+    if (is_mount_root(normalized)) return NULL;
+    return find_mount(normalized, sub);
+}
 
-    char pathbuf[VFS_MAX_PATH];
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
+static int do_delete(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *m = target_mount(path, normalized, &sub);
+    if (!m) return -1;
 
-    char *last_slash = NULL;
-    for (char *p = pathbuf; *p; p++) {
-        if (*p == '/') last_slash = p;
+    if (m->fs == VFS_FS_FAT32) {
+        return fat32_delete(sub);
     }
+    return tmpfs_delete(m->tmpfs, sub);
+}
 
-    vfs_node_t *parent;
-    char *filename;
+static int do_delete_dir(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *m = target_mount(path, normalized, &sub);
+    if (!m) return -1;
 
-    if (last_slash == NULL) {
-        parent = mem_lookup(cwd_path);
-        filename = pathbuf;
-    } else if (last_slash == pathbuf) {
-        parent = mem_root;
-        filename = last_slash + 1;
-    } else {
-        *last_slash = '\0';
-        parent = mem_lookup(pathbuf);
-        filename = last_slash + 1;
+    if (m->fs == VFS_FS_FAT32) {
+        return fat32_delete_dir(sub);
     }
+    return tmpfs_delete_dir(m->tmpfs, sub);
+}
 
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return -1;
-    }
+static int do_delete_recursive(const char *path) {
+    char normalized[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *m = target_mount(path, normalized, &sub);
+    if (!m || has_mount_below(normalized)) return -1;
 
-    // Find the child
-    int found_idx = -1;
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, filename) == 0) {
-            found_idx = i;
-            break;
-        }
+    if (m->fs == VFS_FS_FAT32) {
+        return fat32_delete_recursive(sub);
     }
+    return tmpfs_delete_recursive(m->tmpfs, sub);
+}
 
-    if (found_idx < 0) return -1;
-
-    vfs_node_t *node = parent->children[found_idx];
+static int do_rename(const char *path, const char *newname) {
+    if (!newname || !newname[0]) return -1;
 
-    // Don't delete directories with this function
-    if (node->type == VFS_DIRECTORY) {
-        return -1;
-    }
+    char normalized[VFS_MAX_PATH];
+    const char *sub;
+    vfs_mount_t *m = target_mount(path, normalized, &sub);
+    if (!m) return -1;
 
-    // Free file data if any
-    if (node->data && node->type == VFS_FILE) {
-        free(node->data);
+    // Extract just the filename from newname (renames stay in the directory)
+    const char *basename = newname;
+    for (const char *p = newname; *p; p++) {
+        if (*p == '/') basename = p + 1;
     }
 
-    // Remove from parent's children array
-    for (int i = found_idx; i < parent->child_count - 1; i++) {
-        parent->children[i] = parent->children[i + 1];
+    if (m->fs == VFS_FS_FAT32) {
+        return fat32_rename(sub, basename);
     }
-    parent->child_count--;
-
-    return 0;
+    return tmpfs_rename(m->tmpfs, sub, basename);
 }
 
-int vfs_delete_dir(const char *path) {
-    if (use_fat32) {
-        char fullpath[VFS_MAX_PATH];
-        build_fullpath(path, fullpath);
-        return fat32_delete_dir(fullpath);
-    }
-
-    // In-memory delete directory
-    if (!path || !path[0]) return -1;
-
-    char pathbuf[VFS_MAX_PATH];
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
-
-    char *last_slash = NULL;
-    for (char *p = pathbuf; *p; p++) {
-        if (*p == '/') last_slash = p;
-    }
+int vfs_is_dir(vfs_node_t *node) {
+    return node && node->type == VFS_DIRECTORY;
+}
 
-    vfs_node_t *parent;
-    char *dirname;
+int vfs_is_file(vfs_node_t *node) {
+    return node && node->type == VFS_FILE;
+}
 
-    if (last_slash == NULL) {
-        parent = mem_lookup(cwd_path);
-        dirname = pathbuf;
-    } else if (last_slash == pathbuf) {
-        parent = mem_root;
-        dirname = last_slash + 1;
-    } else {
-        *last_slash = '\0';
-        parent = mem_lookup(pathbuf);
-        dirname = last_slash + 1;
-    }
+// ============================================================================
+// Locked entry points
+// ============================================================================
 
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return -1;
-    }
+int vfs_mount_tmpfs(const char *path) {
+    vfs_lock();
+    int ret = do_mount_tmpfs(path);
+    vfs_unlock();
+    return ret;
+}
 
-    // Find the child
-    int found_idx = -1;
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, dirname) == 0) {
-            found_idx = i;
-            break;
-        }
-    }
+vfs_node_t *vfs_lookup(const char *path) {
+    vfs_lock();
+    vfs_node_t *node = do_lookup(path);
+    vfs_unlock();
+    return node;
+}
 
-    if (found_idx < 0) return -1;
+vfs_node_t *vfs_open_handle(const char *path) {
+    vfs_lock();
+    vfs_node_t *node = do_open_handle(path);
+    vfs_unlock();
+    return node;
+}
 
-    vfs_node_t *node = parent->children[found_idx];
+int vfs_set_cwd(const char *path) {
+    vfs_lock();
+    int ret = do_set_cwd(path);
+    vfs_unlock();
+    return ret;
+}
 
-    // Must be a directory
-    if (node->type != VFS_DIRECTORY) {
-        return -1;
-    }
+int vfs_get_cwd_path(char *buf, size_t size) {
+    vfs_lock();
+    int ret = do_get_cwd_path(buf, size);
+    vfs_unlock();
+    return ret;
+}
 
-    // Must be empty
-    if (node->child_count > 0) {
-        return -1;
-    }
+int vfs_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_t *type) {
+    vfs_lock();
+    int ret = do_readdir(dir, index, name, name_size, type);
+    vfs_unlock();
+    return ret;
+}
 
-    // Remove from parent's children array
-    for (int i = found_idx; i < parent->child_count - 1; i++) {
-        parent->children[i] = parent->children[i + 1];
-    }
-    parent->child_count--;
+vfs_dir_t *vfs_opendir(const char *path) {
+    vfs_lock();
+    vfs_dir_t *dir = do_opendir(path);
+    vfs_unlock();
+    return dir;
+}
 
-    return 0;
+int vfs_readdir_batch(vfs_dir_t *dir, vfs_dirent_t *ents, int max) {
+    vfs_lock();
+    int ret = do_readdir_batch(dir, ents, max);
+    vfs_unlock();
+    return ret;
 }
 
-int vfs_delete_recursive(const char *path) {
-    if (use_fat32) {
-        char fullpath[VFS_MAX_PATH];
-        build_fullpath(path, fullpath);
-        return fat32_delete_recursive(fullpath);
-    }
+void vfs_closedir(vfs_dir_t *dir) {
+    if (!dir) return;
+    vfs_lock();
+    close_cursor(dir);
+    vfs_unlock();
+}
 
-    // In-memory recursive delete - for now just try delete_dir (doesn't recurse)
-    // This is fine since in-memory fs is rarely used
-    vfs_node_t *node = vfs_lookup(path);
-    if (!node) return -1;
+vfs_node_t *vfs_mkdir(const char *path) {
+    vfs_lock();
+    vfs_node_t *node = do_mkdir(path);
+    vfs_unlock();
+    return node;
+}
 
-    if (node->type == VFS_DIRECTORY) {
-        return vfs_delete_dir(path);
-    } else {
-        return vfs_delete(path);
-    }
+vfs_node_t *vfs_create(const char *path) {
+    vfs_lock();
+    vfs_node_t *node = do_create(path);
+    vfs_unlock();
+    return node;
 }
 
-int vfs_rename(const char *path, const char *newname) {
-    if (use_fat32) {
-        // Build full path for old file
-        char fullpath[VFS_MAX_PATH];
-        if (path[0] == '/') {
-            strncpy(fullpath, path, VFS_MAX_PATH - 1);
-            fullpath[VFS_MAX_PATH - 1] = '\0';
-        } else {
-            if (strcmp(cwd_path, "/") == 0) {
-                snprintf(fullpath, VFS_MAX_PATH, "/%s", path);
-            } else {
-                snprintf(fullpath, VFS_MAX_PATH, "%s/%s", cwd_path, path);
-            }
-        }
+int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset) {
+    vfs_lock();
+    int ret = do_read(file, buf, size, offset);
+    vfs_unlock();
+    return ret;
+}
 
-        // Extract just the filename from newname (fat32_rename expects basename only)
-        const char *basename = newname;
-        for (const char *p = newname; *p; p++) {
-            if (*p == '/') basename = p + 1;
-        }
+int vfs_write(vfs_node_t *file, const char *buf, size_t size) {
+    vfs_lock();
+    int ret = do_write(file, buf, size);
+    vfs_unlock();
+    return ret;
+}
 
-        return fat32_rename(fullpath, basename);
-    }
+int vfs_append(vfs_node_t *file, const char *buf, size_t size) {
+    vfs_lock();
+    int ret = do_append(file, buf, size);
+    vfs_unlock();
+    return ret;
+}
 
-    // In-memory rename
-    if (!path || !path[0] || !newname || !newname[0]) return -1;
+int vfs_write_at(vfs_node_t *file, const char *buf, size_t size, size_t offset) {
+    vfs_lock();
+    int ret = do_write_at(file, buf, size, offset);
+    vfs_unlock();
+    return ret;
+}
 
-    char pathbuf[VFS_MAX_PATH];
-    strncpy(pathbuf, path, VFS_MAX_PATH - 1);
-    pathbuf[VFS_MAX_PATH - 1] = '\0';
+int vfs_truncate(vfs_node_t *file, size_t size) {
+    vfs_lock();
+    int ret = do_truncate(file, size);
+    vfs_unlock();
+    return ret;
+}
 
-    char *last_slash = NULL;
-    for (char *p = pathbuf; *p; p++) {
-        if (*p == '/') last_slash = p;
-    }
+int vfs_delete(const char *path) {
+    vfs_lock();
+    int ret = do_delete(path);
+    vfs_unlock();
+    return ret;
+}
 
-    vfs_node_t *parent;
-    char *filename;
+int vfs_delete_dir(const char *path) {
+    vfs_lock();
+    int ret = do_delete_dir(path);
+    vfs_unlock();
+    return ret;
+}
 
-    if (last_slash == NULL) {
-        parent = mem_lookup(cwd_path);
-        filename = pathbuf;
-    } else if (last_slash == pathbuf) {
-        parent = mem_root;
-        filename = last_slash + 1;
-    } else {
-        *last_slash = '\0';
-        parent = mem_lookup(pathbuf);
-        filename = last_slash + 1;
-    }
+int vfs_delete_recursive(const char *path) {
+    vfs_lock();
+    int ret = do_delete_recursive(path);
+    vfs_unlock();
+    return ret;
+}
 
-    if (!parent || parent->type != VFS_DIRECTORY) {
-        return -1;
-    }
+int vfs_rename(const char *path, const char *newname) {
+    vfs_lock();
+    int ret = do_rename(path, newname);
+    vfs_unlock();
+    return ret;
+}
 
-    // Find the child
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, filename) == 0) {
-            // Rename it
-            int j;
-            for (j = 0; newname[j] && j < VFS_MAX_NAME - 1; j++) {
-                parent->children[i]->name[j] = newname[j];
-            }
-            parent->children[i]->name[j] = '\0';
-            return 0;
-        }
+int vfs_file_version(const char *path, char *abspath, fat32_version_t *ver) {
+    vfs_lock();
+    int ret = -1;
+    vfs_node_t *node = do_lookup(path);
+    if (node && node->type == VFS_FILE && node->fs == VFS_FS_FAT32) {
+        strcpy(abspath, (const char *)node->data);
+        ret = fat32_file_version(abspath, ver);
     }
-
-    return -1;
+    vfs_unlock();
+    return ret;
 }
 
-int vfs_is_dir(vfs_node_t *node) {
-    return node && node->type == VFS_DIRECTORY;
+int vfs_sync(void) {
+    vfs_lock();
+    int ret = flush_disk();
+    vfs_unlock();
+    return ret;
 }
 
-int vfs_is_file(vfs_node_t *node) {
-    return node && node->type == VFS_FILE;
+void vfs_writeback(void) {
+    if (hal_get_time_ns() < bcache_writeback_due()) return;
+    if (vfs_trylock()) {
+        vfs_unlock();  // Does the write-back
+    }
 }
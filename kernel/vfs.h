@@ -1,7 +1,8 @@
 /*
  * VibeOS Virtual File System
  *
- * Simple in-memory filesystem with hierarchical directories
+ * One directory tree over a small mount table: FAT32 on / (a tmpfs when
+ * there is no disk) and a tmpfs on /tmp
  */
 
 #ifndef VFS_H
@@ -14,36 +15,55 @@
 #define VFS_FILE      1
 #define VFS_DIRECTORY 2
 
+// Filesystem types
+#define VFS_FS_FAT32  1
+#define VFS_FS_TMPFS  2
+
 // Max limits
 #define VFS_MAX_NAME     64
-#define VFS_MAX_CHILDREN 32
 #define VFS_MAX_PATH     256
-#define VFS_MAX_INODES   256
-
-// Forward declaration
-struct vfs_node;
+#define VFS_MAX_MOUNTS   8
 
 // Directory entry
 typedef struct vfs_node {
     char name[VFS_MAX_NAME];
     uint8_t type;                           // VFS_FILE or VFS_DIRECTORY
-
-    // For files
-    char *data;                             // File contents
+    uint8_t fs;                             // VFS_FS_* it lives on
+    char *data;                             // Absolute path
     size_t size;                            // File size
-    size_t capacity;                        // Allocated capacity
-
-    // For directories
-    struct vfs_node *children[VFS_MAX_CHILDREN];
-    int child_count;
 
-    // Tree structure
-    struct vfs_node *parent;
+    // Open handles: the filesystem's open file (fat32_file_t, or a held
+    // tmpfs node), or for a directory its cursor and the readdir index
+    // the cursor is at
+    void *fs_file;
+    void *fs_dir;
+    int dir_pos;
 } vfs_node_t;
 
+// Directory entry filled in by vfs_readdir_batch
+typedef struct vfs_dirent {
+    char name[VFS_MAX_PATH];
+    uint8_t type;                           // VFS_FILE or VFS_DIRECTORY
+    uint8_t attr;                           // FAT attribute bits, 0 in memory
+    uint32_t size;                          // File size in bytes
+} vfs_dirent_t;
+
+// Directory stream (see vfs_opendir)
+typedef struct vfs_dir vfs_dir_t;
+
 // Initialize the filesystem
 void vfs_init(void);
 
+// Mount an empty tmpfs at path, hiding whatever was there. Like mount(8)
+// it needs a directory to mount on, and makes one if the path is free.
+// Mounts stay until reboot. Returns 0, or -1.
+int vfs_mount_tmpfs(const char *path);
+
+// Filesystem lock - every vfs_* call takes it. Recursive; disables
+// preemption while held. Take it directly around raw fat32_* calls.
+void vfs_lock(void);
+void vfs_unlock(void);
+
 // Path operations
 vfs_node_t *vfs_lookup(const char *path);           // Returns static node - do NOT free
 vfs_node_t *vfs_open_handle(const char *path);      // Allocates - must call vfs_close_handle
@@ -57,11 +77,20 @@ int vfs_get_cwd_path(char *buf, size_t size);
 vfs_node_t *vfs_mkdir(const char *path);
 int vfs_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_t *type);
 
+// Directory streams: walk a directory in one pass, up to max entries per
+// call. vfs_readdir_batch returns the number filled in, 0 at the end, or
+// -1 on error. Allocates - must call vfs_closedir.
+vfs_dir_t *vfs_opendir(const char *path);
+int vfs_readdir_batch(vfs_dir_t *dir, vfs_dirent_t *ents, int max);
+void vfs_closedir(vfs_dir_t *dir);
+
 // File operations
 vfs_node_t *vfs_create(const char *path);
 int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset);
-int vfs_write(vfs_node_t *file, const char *buf, size_t size);
+int vfs_write(vfs_node_t *file, const char *buf, size_t size);    // Replace contents
 int vfs_append(vfs_node_t *file, const char *buf, size_t size);
+int vfs_write_at(vfs_node_t *file, const char *buf, size_t size, size_t offset);  // Extends, gap reads as zeros
+int vfs_truncate(vfs_node_t *file, size_t size);                  // Cut or zero-extend
 
 // Delete file
 int vfs_delete(const char *path);
@@ -75,6 +104,19 @@ int vfs_delete_recursive(const char *path);
 // Rename (same directory only)
 int vfs_rename(const char *path, const char *newname);
 
+// Write all cached disk changes out now. Returns 0, or -1 on a disk error.
+int vfs_sync(void);
+
+// Idle kernel threads call this: writes back cached changes once they are
+// due, unless another core has the filesystem busy
+void vfs_writeback(void);
+
+// Which version of a file's contents is on disk now (see fat32_version_t)
+// and its absolute path, for caches keyed by file. abspath holds
+// VFS_MAX_PATH bytes. -1 if not found, a directory, or not on FAT32.
+struct fat32_version;
+int vfs_file_version(const char *path, char *abspath, struct fat32_version *ver);
+
 // Utility
 int vfs_is_dir(vfs_node_t *node);
 int vfs_is_file(vfs_node_t *node);
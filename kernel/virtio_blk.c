@@ -3,15 +3,24 @@
  *
  * Implements virtio-blk for block device access on QEMU virt machine.
  * Based on virtio 1.0 spec (modern mode).
+ *
+ * Requests are queued: up to NUM_SLOTS virtio requests are in flight at
+ * once, and queued requests for adjacent sectors are merged into one
+ * virtio request with a data descriptor each. Completions arrive through
+ * the block IRQ; the synchronous read/write calls wait in wfi for them.
  */
 
 #include "virtio_blk.h"
+#include "hal/hal.h"
+#include "process.h"
+#include "spinlock.h"
 #include "printf.h"
 #include "string.h"
 
 // Virtio MMIO registers
 #define VIRTIO_MMIO_BASE        0x0a000000
 #define VIRTIO_MMIO_STRIDE      0x200
+#define VIRTIO_IRQ_BASE         48
 
 // Virtio MMIO register offsets
 #define VIRTIO_MMIO_MAGIC           0x000
@@ -86,7 +95,7 @@ typedef struct __attribute__((packed)) {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-} virtio_blk_req_t;
+} virtio_blk_hdr_t;
 
 // Virtio block config (from device)
 typedef struct __attribute__((packed)) {
@@ -96,23 +105,59 @@ typedef struct __attribute__((packed)) {
     // ... more fields we don't need
 } virtio_blk_config_t;
 
+#define QUEUE_MAX    128    // Descriptors we ask for (device may offer more)
+#define QUEUE_MIN    16
+#define NUM_SLOTS    32     // Virtio requests in flight
+#define MERGE_SEGS   16     // Caller requests merged into one virtio request
+#define MERGE_SECTORS 2048  // ... up to 1MB
+#define DESC_F_NEXT  1
+#define DESC_F_WRITE 2
+
+#define WAIT_POLL_NS    10000000ULL     // Re-check even without an IRQ
+#define WAIT_TIMEOUT_NS 10000000000ULL  // Give up on the device
+
+// One virtio request: header, one data descriptor per merged caller
+// request, status byte
+typedef struct {
+    virtio_blk_hdr_t hdr __attribute__((aligned(16)));
+    volatile uint8_t status;
+    int in_use;
+    uint16_t head;              // First descriptor of the chain
+    hal_blk_req_t *reqs;        // Merged caller requests, in sector order
+} blk_slot_t;
+
 // Driver state
 static volatile uint32_t *blk_base = NULL;
+static int blk_device_index = -1;
 static virtq_desc_t *desc = NULL;
 static virtq_avail_t *avail = NULL;
 static virtq_used_t *used = NULL;
 static uint64_t device_capacity = 0;
+static uint32_t queue_size = 0;
 
-#define QUEUE_SIZE 16
-#define DESC_F_NEXT  1
-#define DESC_F_WRITE 2
+// Statically allocated memory for the virtqueue: descriptors, then the
+// available ring, then the used ring on its own page
+static uint8_t queue_mem[8192] __attribute__((aligned(4096)));
+
+static blk_slot_t slots[NUM_SLOTS];
+static int16_t desc_slot[QUEUE_MAX];    // Head descriptor -> slot
+static uint16_t free_desc;              // Free descriptor list, via .next
+static uint32_t num_free_desc;
+static uint16_t last_used;
 
-// Statically allocated memory for virtqueue (4KB aligned)
-static uint8_t queue_mem[4096] __attribute__((aligned(4096)));
+// Submitted but not yet sent to the device, sorted by sector so that
+// neighbours end up next to each other and merge
+static hal_blk_req_t *pending;
 
-// Request header and status buffers
-static virtio_blk_req_t req_header __attribute__((aligned(16)));
-static uint8_t req_status __attribute__((aligned(16)));
+// Everything above is shared with the IRQ handler on CPU 0
+static spinlock_t blk_lock = SPINLOCK_INIT;
+
+// Cores sleeping in virtio_blk_wait(), kicked when something completes
+static volatile uint32_t waiters;
+
+// Counters for blkbench
+static uint64_t stat_requests;  // Virtio requests issued
+static uint64_t stat_merged;    // Caller requests folded into another
 
 // Memory barriers for device communication
 static inline void mb(void) {
@@ -139,6 +184,7 @@ static volatile uint32_t *find_virtio_blk(void) {
         uint32_t device_id = read32(base + VIRTIO_MMIO_DEVICE_ID/4);
 
         if (magic == 0x74726976 && device_id == VIRTIO_DEV_BLK) {
+            blk_device_index = i;
             return base;
         }
     }
@@ -146,13 +192,9 @@ static volatile uint32_t *find_virtio_blk(void) {
     return NULL;
 }
 
-int virtio_blk_init(void) {
-    blk_base = find_virtio_blk();
-    if (!blk_base) {
-        printf("[BLK] No device found\n");
-        return -1;
-    }
-
+// Reset the device and bring it up with an empty virtqueue. Used at init
+// and to take back buffers from a request the device never finished.
+static int device_setup(void) {
     // Reset device (with timeout to prevent hang)
     write32(blk_base + VIRTIO_MMIO_STATUS/4, 0);
     int timeout = 100000;
@@ -185,20 +227,22 @@ int virtio_blk_init(void) {
     volatile uint8_t *config = (volatile uint8_t *)blk_base + VIRTIO_MMIO_CONFIG;
     device_capacity = *(volatile uint64_t *)config;
 
-    // Setup virtqueue 0
+    // Setup virtqueue 0, as big as the device and our memory allow
     write32(blk_base + VIRTIO_MMIO_QUEUE_SEL/4, 0);
     uint32_t max_queue = read32(blk_base + VIRTIO_MMIO_QUEUE_NUM_MAX/4);
-    if (max_queue < QUEUE_SIZE) {
+    if (max_queue < QUEUE_MIN) {
         printf("[BLK] Queue too small\n");
         return -1;
     }
+    queue_size = QUEUE_MAX;
+    while (queue_size > max_queue) queue_size /= 2;
 
-    write32(blk_base + VIRTIO_MMIO_QUEUE_NUM/4, QUEUE_SIZE);
+    write32(blk_base + VIRTIO_MMIO_QUEUE_NUM/4, queue_size);
 
     // Setup queue memory
     desc = (virtq_desc_t *)queue_mem;
-    avail = (virtq_avail_t *)(queue_mem + QUEUE_SIZE * sizeof(virtq_desc_t));
-    used = (virtq_used_t *)(queue_mem + 2048);
+    avail = (virtq_avail_t *)(queue_mem + queue_size * sizeof(virtq_desc_t));
+    used = (virtq_used_t *)(queue_mem + 4096);
 
     uint64_t desc_addr = (uint64_t)desc;
     uint64_t avail_addr = (uint64_t)avail;
@@ -213,6 +257,19 @@ int virtio_blk_init(void) {
 
     avail->flags = 0;
     avail->idx = 0;
+    last_used = 0;
+
+    // All descriptors on the free list
+    for (uint32_t i = 0; i < queue_size; i++) {
+        desc[i].next = (i + 1 < queue_size) ? i + 1 : 0;
+        desc_slot[i] = -1;
+    }
+    free_desc = 0;
+    num_free_desc = queue_size;
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        slots[i].in_use = 0;
+    }
+    pending = NULL;
 
     write32(blk_base + VIRTIO_MMIO_QUEUE_READY/4, 1);
     write32(blk_base + VIRTIO_MMIO_STATUS/4,
@@ -224,87 +281,332 @@ int virtio_blk_init(void) {
         return -1;
     }
 
-    printf("[BLK] Ready (%d MB)\n", (uint32_t)(device_capacity / 2048));
     return 0;
 }
 
-// Perform a block request (read or write)
-static int do_request(uint32_t type, uint64_t sector, uint32_t count, void *buf) {
-    if (!blk_base) return -1;
-    if (sector + count > device_capacity) return -1;
+int virtio_blk_init(void) {
+    blk_base = find_virtio_blk();
+    if (!blk_base) {
+        printf("[BLK] No device found\n");
+        return -1;
+    }
 
-    // Setup request header
-    req_header.type = type;
-    req_header.reserved = 0;
-    req_header.sector = sector;
+    if (device_setup() < 0) return -1;
 
-    // Clear status
-    req_status = 0xff;
+    printf("[BLK] Ready (%d MB, queue %u)\n", (uint32_t)(device_capacity / 2048), queue_size);
+    return 0;
+}
 
-    // Setup descriptor chain:
-    // desc[0]: request header (device reads)
-    // desc[1]: data buffer (device reads or writes depending on request type)
-    // desc[2]: status byte (device writes)
+// ============================================================================
+// Request queue
+// ============================================================================
 
-    desc[0].addr = (uint64_t)&req_header;
-    desc[0].len = sizeof(virtio_blk_req_t);
-    desc[0].flags = DESC_F_NEXT;
-    desc[0].next = 1;
+static uint16_t alloc_desc(void) {
+    uint16_t d = free_desc;
+    free_desc = desc[d].next;
+    num_free_desc--;
+    return d;
+}
 
-    desc[1].addr = (uint64_t)buf;
-    desc[1].len = count * 512;
-    desc[1].flags = DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? DESC_F_WRITE : 0);
-    desc[1].next = 2;
+static void free_chain(uint16_t head) {
+    uint16_t d = head;
+    for (;;) {
+        uint16_t flags = desc[d].flags;
+        uint16_t next = desc[d].next;
+        desc[d].next = free_desc;
+        free_desc = d;
+        num_free_desc++;
+        if (!(flags & DESC_F_NEXT)) break;
+        d = next;
+    }
+}
 
-    desc[2].addr = (uint64_t)&req_status;
-    desc[2].len = 1;
-    desc[2].flags = DESC_F_WRITE;
-    desc[2].next = 0;
+// Send as much of the pending list as slots and descriptors allow.
+// Runs of adjacent requests in the same direction go out as one virtio
+// request with a data descriptor each. Caller holds blk_lock.
+static void issue_pending(void) {
+    int issued = 0;
+
+    while (pending) {
+        int s;
+        for (s = 0; s < NUM_SLOTS && slots[s].in_use; s++);
+        if (s == NUM_SLOTS || num_free_desc < 3) break;
+        blk_slot_t *slot = &slots[s];
+
+        // Take the head of the list plus whatever directly follows it
+        hal_blk_req_t *first = pending;
+        hal_blk_req_t *last = first;
+        uint32_t segs = 1;
+        uint32_t sectors = first->count;
+        while (last->next && segs < MERGE_SEGS && segs + 2 < num_free_desc &&
+               last->next->write == first->write &&
+               last->next->sector == last->sector + last->count &&
+               sectors + last->next->count <= MERGE_SECTORS) {
+            last = last->next;
+            sectors += last->count;
+            segs++;
+        }
+        pending = last->next;
+        last->next = NULL;
+
+        slot->in_use = 1;
+        slot->reqs = first;
+        slot->hdr.type = first->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        slot->hdr.reserved = 0;
+        slot->hdr.sector = first->sector;
+        slot->status = 0xff;
+
+        uint16_t head = alloc_desc();
+        desc[head].addr = (uint64_t)&slot->hdr;
+        desc[head].len = sizeof(virtio_blk_hdr_t);
+        desc[head].flags = DESC_F_NEXT;
+
+        uint16_t prev = head;
+        for (hal_blk_req_t *r = first; r; r = r->next) {
+            uint16_t d = alloc_desc();
+            desc[d].addr = (uint64_t)r->buf;
+            desc[d].len = r->count * 512;
+            desc[d].flags = DESC_F_NEXT | (r->write ? 0 : DESC_F_WRITE);
+            desc[prev].next = d;
+            prev = d;
+        }
 
-    // Add to available ring
-    mb();
-    uint16_t old_used_idx = used->idx;
-    uint16_t avail_slot = avail->idx % QUEUE_SIZE;
-    avail->ring[avail_slot] = 0;  // First descriptor in chain
-    mb();
-    avail->idx++;
-    mb();
+        uint16_t st = alloc_desc();
+        desc[st].addr = (uint64_t)&slot->status;
+        desc[st].len = 1;
+        desc[st].flags = DESC_F_WRITE;
+        desc[st].next = 0;
+        desc[prev].next = st;
 
-    // Notify device
-    write32(blk_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
+        slot->head = head;
+        desc_slot[head] = s;
 
-    // Poll for completion - wait for used->idx to change
-    int timeout = 10000000;
-    while (used->idx == old_used_idx && timeout > 0) {
+        avail->ring[avail->idx % queue_size] = head;
         mb();
-        timeout--;
+        avail->idx++;
+
+        stat_requests++;
+        stat_merged += segs - 1;
+        issued++;
     }
 
-    if (timeout == 0) {
-        printf("[BLK] Request timed out!\n");
-        return -1;
+    if (issued) {
+        mb();
+        write32(blk_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
     }
+}
 
-    // Ack interrupt
-    write32(blk_base + VIRTIO_MMIO_INTERRUPT_ACK/4, read32(blk_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+// Collect finished requests off the used ring, refill the queue from the
+// pending list, then run completion callbacks (without the lock held)
+static void reap(void) {
+    hal_blk_req_t *done = NULL;
+    hal_blk_req_t **done_tail = &done;
 
-    // Check status
-    if (req_status != VIRTIO_BLK_S_OK) {
-        printf("[BLK] Request failed with status %d\n", req_status);
-        return -1;
+    uint64_t flags = spin_lock_irqsave(&blk_lock);
+
+    write32(blk_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
+            read32(blk_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+
+    while (last_used != used->idx) {
+        mb();
+        uint16_t head = used->ring[last_used % queue_size].id;
+        last_used++;
+
+        int s = desc_slot[head];
+        if (s < 0) continue;  // Not ours - shouldn't happen
+        blk_slot_t *slot = &slots[s];
+        int ok = (slot->status == VIRTIO_BLK_S_OK);
+        if (!ok) {
+            printf("[BLK] Request at sector %u failed with status %d\n",
+                   (uint32_t)slot->hdr.sector, slot->status);
+        }
+
+        for (hal_blk_req_t *r = slot->reqs; r; r = r->next) {
+            r->status = ok ? 0 : -1;
+        }
+        *done_tail = slot->reqs;
+        while (*done_tail) done_tail = &(*done_tail)->next;
+
+        desc_slot[head] = -1;
+        free_chain(head);
+        slot->in_use = 0;
+        slot->reqs = NULL;
     }
 
-    return 0;
+    issue_pending();
+    uint32_t wake = waiters;
+    spin_unlock_irqrestore(&blk_lock, flags);
+
+    // Callbacks may resubmit, so walk a snapshot of the list
+    while (done) {
+        hal_blk_req_t *r = done;
+        done = r->next;
+        r->next = NULL;
+        if (r->done) r->done(r);
+    }
+
+    if (wake) {
+        int me = cpu_this()->id;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if ((wake & (1u << cpu)) && cpu != me) hal_cpu_kick(cpu);
+        }
+    }
+}
+
+void virtio_blk_submit(hal_blk_req_t *req) {
+    req->status = HAL_BLK_PENDING;
+    req->next = NULL;
+    if (!blk_base || req->count == 0 ||
+        (uint64_t)req->sector + req->count > device_capacity) {
+        req->status = -1;
+        if (req->done) req->done(req);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&blk_lock);
+    hal_blk_req_t **pp = &pending;
+    while (*pp && (*pp)->sector <= req->sector) pp = &(*pp)->next;
+    req->next = *pp;
+    *pp = req;
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
+
+void virtio_blk_kick(void) {
+    if (!blk_base) return;
+    uint64_t flags = spin_lock_irqsave(&blk_lock);
+    issue_pending();
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
+
+// Take back a request that timed out, so its caller can reuse the memory.
+// Still on the pending list: just unlink it. Already sent: the device may
+// yet write its buffer, so reset the device, fail everything it had in
+// flight and set the queue up again. Pending requests are kept and go
+// out on the new queue.
+static void abandon(hal_blk_req_t *req) {
+    hal_blk_req_t *failed = NULL;
+    hal_blk_req_t **failed_tail = &failed;
+
+    uint64_t flags = spin_lock_irqsave(&blk_lock);
+    if (req->status != HAL_BLK_PENDING) {
+        // Finished after all
+        spin_unlock_irqrestore(&blk_lock, flags);
+        return;
+    }
+
+    for (hal_blk_req_t **pp = &pending; *pp; pp = &(*pp)->next) {
+        if (*pp == req) {
+            *pp = req->next;
+            req->next = NULL;
+            req->status = -1;
+            spin_unlock_irqrestore(&blk_lock, flags);
+            if (req->done) req->done(req);
+            return;
+        }
+    }
+
+    printf("[BLK] Resetting device\n");
+    for (int s = 0; s < NUM_SLOTS; s++) {
+        if (!slots[s].in_use) continue;
+        *failed_tail = slots[s].reqs;
+        while (*failed_tail) {
+            (*failed_tail)->status = -1;
+            failed_tail = &(*failed_tail)->next;
+        }
+    }
+
+    hal_blk_req_t *keep = pending;
+    if (device_setup() < 0) {
+        // Device is gone: fail what's left and refuse new requests
+        *failed_tail = keep;
+        for (hal_blk_req_t *r = keep; r; r = r->next) r->status = -1;
+        device_capacity = 0;
+    } else {
+        pending = keep;
+        issue_pending();
+    }
+    spin_unlock_irqrestore(&blk_lock, flags);
+
+    while (failed) {
+        hal_blk_req_t *r = failed;
+        failed = r->next;
+        r->next = NULL;
+        if (r->done) r->done(r);
+    }
+}
+
+// Sleep in wfi until req completes. The block IRQ (or, on other cores,
+// the kick that CPU 0 sends after handling it) ends the wfi; the request
+// is then reaped here as well, which also covers IRQs being masked.
+int virtio_blk_wait(hal_blk_req_t *req) {
+    if (!blk_base) return -1;
+    virtio_blk_kick();
+
+    uint32_t bit = 1u << cpu_this()->id;
+    uint64_t give_up = hal_get_time_ns() + WAIT_TIMEOUT_NS;
+
+    while (req->status == HAL_BLK_PENDING) {
+        uint64_t flags;
+        asm volatile("mrs %0, daif" : "=r"(flags));
+        asm volatile("msr daifset, #2" ::: "memory");
+
+        __atomic_or_fetch(&waiters, bit, __ATOMIC_SEQ_CST);
+        reap();
+        if (req->status == HAL_BLK_PENDING) {
+            uint64_t now = hal_get_time_ns();
+            if (now >= give_up) {
+                __atomic_and_fetch(&waiters, ~bit, __ATOMIC_SEQ_CST);
+                asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+                printf("[BLK] Request timed out!\n");
+                abandon(req);
+                return req->status;
+            }
+            process_wait_event(now + WAIT_POLL_NS);
+        }
+        __atomic_and_fetch(&waiters, ~bit, __ATOMIC_SEQ_CST);
+
+        asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+    }
+    return req->status;
+}
+
+static int do_request(int write, uint64_t sector, uint32_t count, void *buf) {
+    hal_blk_req_t req;
+    req.sector = (uint32_t)sector;
+    req.count = count;
+    req.buf = buf;
+    req.write = write;
+    req.done = NULL;
+    req.priv = NULL;
+    if (sector > 0xFFFFFFFFULL) return -1;
+
+    virtio_blk_submit(&req);
+    return virtio_blk_wait(&req);
 }
 
 int virtio_blk_read(uint64_t sector, uint32_t count, void *buf) {
-    return do_request(VIRTIO_BLK_T_IN, sector, count, buf);
+    return do_request(0, sector, count, buf);
 }
 
 int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf) {
-    return do_request(VIRTIO_BLK_T_OUT, sector, count, (void *)buf);
+    return do_request(1, sector, count, (void *)buf);
 }
 
 uint64_t virtio_blk_get_capacity(void) {
     return device_capacity;
 }
+
+uint32_t virtio_blk_get_irq(void) {
+    if (blk_device_index < 0) return 0;
+    return VIRTIO_IRQ_BASE + blk_device_index;
+}
+
+void virtio_blk_irq_handler(void) {
+    if (!blk_base) return;
+    reap();
+}
+
+void virtio_blk_get_stats(uint64_t *requests, uint64_t *merged) {
+    if (requests) *requests = stat_requests;
+    if (merged) *merged = stat_merged;
+}
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "hal/hal.h"
 
 // Initialize the virtio-blk device
 int virtio_blk_init(void);
@@ -30,4 +31,17 @@ int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf);
 // Get the total number of sectors on the device
 uint64_t virtio_blk_get_capacity(void);
 
+// Queued requests (see hal_blk_submit). Up to the queue size is kept in
+// flight; adjacent requests in the same direction go out as one.
+void virtio_blk_submit(hal_blk_req_t *req);
+void virtio_blk_kick(void);
+int virtio_blk_wait(hal_blk_req_t *req);
+
+// IRQ handling - completions are reaped here
+uint32_t virtio_blk_get_irq(void);
+void virtio_blk_irq_handler(void);
+
+// Virtio requests issued, and caller requests merged into another one
+void virtio_blk_get_stats(uint64_t *requests, uint64_t *merged);
+
 #endif
@@ -3,6 +3,20 @@
  *
  * Implements virtio-net for network access on QEMU virt machine.
  * Based on virtio 1.0 spec (modern mode).
+ *
+ * Received frames are handed to the network stack straight from the RX
+ * buffers, and the buffers go back to the device a batch at a time with
+ * one notify. Frames to send come in a pbuf and the device reads them
+ * where they are, virtio header and all.
+ *
+ * Sending doesn't wait for the device: each frame takes a TX descriptor
+ * and a reference to its pbuf, and the device is notified once per batch
+ * (virtio_net_tx_flush(), when the network stack lets go of its lock).
+ * Finished descriptors are reclaimed on later sends, so TX never raises
+ * the IRQ. With VIRTIO_RING_F_EVENT_IDX both sides say which index they
+ * want to hear about, which drops the notifies and interrupts in between.
+ * Checksums and TCP segmentation are left to the device when it offers
+ * them (it does when QEMU's backend takes virtio headers, e.g. tap).
  */
 
 #include "virtio_net.h"
@@ -48,7 +62,14 @@
 #define VIRTIO_DEV_NET  1
 
 // Virtio net feature bits
+#define VIRTIO_NET_F_CSUM       (1 << 0)   // Device checksums what we send
 #define VIRTIO_NET_F_MAC        (1 << 5)   // Device has given MAC address
+#define VIRTIO_NET_F_HOST_TSO4  (1 << 11)  // Device segments TCP over IPv4
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)  // used_event / avail_event
+
+// Virtio net header flags and GSO types
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
 
 // Virtio net header (prepended to every packet)
 typedef struct __attribute__((packed)) {
@@ -98,22 +119,41 @@ static virtq_desc_t *rx_desc = NULL;
 static virtq_avail_t *rx_avail = NULL;
 static virtq_used_t *rx_used = NULL;
 static uint16_t rx_last_used_idx = 0;
+static uint16_t rx_size = 0;        // Power of two, up to RX_QUEUE_SIZE
 
 // Transmit queue (queue 1)
 static virtq_desc_t *tx_desc = NULL;
 static virtq_avail_t *tx_avail = NULL;
 static virtq_used_t *tx_used = NULL;
+static uint16_t tx_size = 0;
 
-#define QUEUE_SIZE 16
+#define RX_QUEUE_SIZE 256   // Frames the device can hold for us
+#define TX_QUEUE_SIZE 256   // Frames in flight to the device
+#define MIN_QUEUE_SIZE 16
+#define TX_KICK_BATCH 64    // Notify early if a burst gets this long
 #define DESC_F_NEXT  1
 #define DESC_F_WRITE 2
+#define AVAIL_F_NO_INTERRUPT 1
+#define USED_F_NO_NOTIFY     1
+
+// TX descriptors in flight hold a reference to their pbuf until the
+// device is done with it
+static pbuf_t *tx_pbufs[TX_QUEUE_SIZE];
+static uint16_t tx_free[TX_QUEUE_SIZE];
+static uint16_t tx_num_free = 0;
+static uint16_t tx_last_used = 0;   // Completions reclaimed up to here
+static uint16_t tx_kicked_idx = 0;  // Avail index the device was last told of
+
+// Negotiated features
+static int event_idx = 0;
+static int tx_offloads = 0;         // VIRTIO_NET_TX_*
 
 // Virtio IRQ base (same as other virtio devices)
 #define VIRTIO_IRQ_BASE 48
 
 // Queue memory (4KB aligned)
-static uint8_t rx_queue_mem[4096] __attribute__((aligned(4096)));
-static uint8_t tx_queue_mem[4096] __attribute__((aligned(4096)));
+static uint8_t rx_queue_mem[8192] __attribute__((aligned(4096)));
+static uint8_t tx_queue_mem[8192] __attribute__((aligned(4096)));
 
 // Receive buffers: virtio header + ethernet frame
 typedef struct __attribute__((aligned(16))) {
@@ -121,15 +161,7 @@ typedef struct __attribute__((aligned(16))) {
     uint8_t data[NET_MTU];
 } rx_buffer_t;
 
-static rx_buffer_t rx_buffers[QUEUE_SIZE] __attribute__((aligned(16)));
-
-// Transmit buffer (single, reused)
-typedef struct __attribute__((aligned(16))) {
-    virtio_net_hdr_t hdr;
-    uint8_t data[NET_MTU];
-} tx_buffer_t;
-
-static tx_buffer_t tx_buffer __attribute__((aligned(16)));
+static rx_buffer_t rx_buffers[RX_QUEUE_SIZE] __attribute__((aligned(16)));
 
 // Memory barriers for device communication
 static inline void mb(void) {
@@ -148,6 +180,35 @@ static inline void write32(volatile uint32_t *addr, uint32_t val) {
     mb();
 }
 
+// Event index slots, just past the end of each ring: in the available
+// ring the used index we want an interrupt at, in the used ring the
+// available index the device wants a notify at
+static inline volatile uint16_t *used_event(virtq_avail_t *avail, uint16_t size) {
+    return (volatile uint16_t *)((uint8_t *)avail + 4 + 2 * size);
+}
+
+static inline volatile uint16_t *avail_event(virtq_used_t *used, uint16_t size) {
+    return (volatile uint16_t *)((uint8_t *)used + 4 + sizeof(virtq_used_elem_t) * size);
+}
+
+// Did moving an index from old_idx to new_idx pass event? (virtio spec)
+static inline int need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Tell the device about a queue's new buffers, unless it has said it
+// doesn't need to hear about them
+static void notify_queue(int queue_idx, virtq_used_t *used, uint16_t size,
+                         uint16_t new_idx, uint16_t old_idx) {
+    mb();
+    int kick = event_idx ? need_event(*avail_event(used, size), new_idx, old_idx)
+                         : !(used->flags & USED_F_NO_NOTIFY);
+    if (kick) {
+        write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, queue_idx);
+        write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, queue_idx);
+    }
+}
+
 // Find virtio-net device
 static volatile uint32_t *find_virtio_net(void) {
     for (int i = 0; i < 32; i++) {
@@ -164,23 +225,27 @@ static volatile uint32_t *find_virtio_net(void) {
     return NULL;
 }
 
-// Setup a virtqueue
-static int setup_queue(int queue_idx, uint8_t *queue_mem,
+// Setup a virtqueue of up to size entries (a power of two). Returns the
+// size used, which may be smaller if the device offers less, or -1.
+static int setup_queue(int queue_idx, uint8_t *queue_mem, uint32_t size,
                        virtq_desc_t **desc_out, virtq_avail_t **avail_out, virtq_used_t **used_out) {
     write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, queue_idx);
 
     uint32_t max_queue = read32(net_base + VIRTIO_MMIO_QUEUE_NUM_MAX/4);
-    if (max_queue < QUEUE_SIZE) {
+    while (size > max_queue && size > MIN_QUEUE_SIZE) size /= 2;
+    if (max_queue < size) {
         printf("[NET] Queue %d too small (max=%d)\n", queue_idx, max_queue);
         return -1;
     }
 
-    write32(net_base + VIRTIO_MMIO_QUEUE_NUM/4, QUEUE_SIZE);
+    write32(net_base + VIRTIO_MMIO_QUEUE_NUM/4, size);
 
-    // Setup queue memory layout
+    // Setup queue memory layout: descriptors, available ring, used ring
+    uint32_t avail_off = size * sizeof(virtq_desc_t);
+    uint32_t used_off = (avail_off + 6 + 2 * size + 3) & ~3u;
     *desc_out = (virtq_desc_t *)queue_mem;
-    *avail_out = (virtq_avail_t *)(queue_mem + QUEUE_SIZE * sizeof(virtq_desc_t));
-    *used_out = (virtq_used_t *)(queue_mem + 2048);
+    *avail_out = (virtq_avail_t *)(queue_mem + avail_off);
+    *used_out = (virtq_used_t *)(queue_mem + used_off);
 
     uint64_t desc_addr = (uint64_t)*desc_out;
     uint64_t avail_addr = (uint64_t)*avail_out;
@@ -198,7 +263,7 @@ static int setup_queue(int queue_idx, uint8_t *queue_mem,
 
     write32(net_base + VIRTIO_MMIO_QUEUE_READY/4, 1);
 
-    return 0;
+    return (int)size;
 }
 
 int virtio_net_init(void) {
@@ -230,9 +295,14 @@ int virtio_net_init(void) {
     uint32_t features = read32(net_base + VIRTIO_MMIO_DEVICE_FEATURES/4);
     printf("[NET] Device features: 0x%x\n", features);
 
-    // Accept MAC feature only (don't need checksums, GSO, etc)
+    // MAC, plus event indexes and TX offloads when offered. Nothing for
+    // RX: received checksums aren't checked, and frames stay MTU-sized.
+    uint32_t accept = VIRTIO_NET_F_MAC | (features & (VIRTIO_NET_F_CSUM | VIRTIO_RING_F_EVENT_IDX));
+    if ((features & VIRTIO_NET_F_CSUM) && (features & VIRTIO_NET_F_HOST_TSO4)) {
+        accept |= VIRTIO_NET_F_HOST_TSO4;
+    }
     write32(net_base + VIRTIO_MMIO_DRIVER_FEATURES_SEL/4, 0);
-    write32(net_base + VIRTIO_MMIO_DRIVER_FEATURES/4, VIRTIO_NET_F_MAC);
+    write32(net_base + VIRTIO_MMIO_DRIVER_FEATURES/4, accept);
 
     write32(net_base + VIRTIO_MMIO_STATUS/4,
             VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
@@ -242,6 +312,9 @@ int virtio_net_init(void) {
         printf("[NET] Feature negotiation failed\n");
         return -1;
     }
+    event_idx = (accept & VIRTIO_RING_F_EVENT_IDX) != 0;
+    if (accept & VIRTIO_NET_F_CSUM) tx_offloads |= VIRTIO_NET_TX_CSUM;
+    if (accept & VIRTIO_NET_F_HOST_TSO4) tx_offloads |= VIRTIO_NET_TX_TSO;
 
     // Read MAC address from config space
     volatile uint8_t *config = (volatile uint8_t *)net_base + VIRTIO_MMIO_CONFIG;
@@ -253,17 +326,29 @@ int virtio_net_init(void) {
            mac_addr[3], mac_addr[4], mac_addr[5]);
 
     // Setup receive queue (queue 0)
-    if (setup_queue(0, rx_queue_mem, &rx_desc, &rx_avail, &rx_used) < 0) {
+    int size = setup_queue(0, rx_queue_mem, RX_QUEUE_SIZE, &rx_desc, &rx_avail, &rx_used);
+    if (size < 0) {
         return -1;
     }
+    rx_size = size;
 
-    // Setup transmit queue (queue 1)
-    if (setup_queue(1, tx_queue_mem, &tx_desc, &tx_avail, &tx_used) < 0) {
+    // Setup transmit queue (queue 1). Completions are picked up on later
+    // sends, so they don't need an interrupt: with event indexes, ask for
+    // one at an index that is never reached (kept behind in tx_reclaim()).
+    size = setup_queue(1, tx_queue_mem, TX_QUEUE_SIZE, &tx_desc, &tx_avail, &tx_used);
+    if (size < 0) {
         return -1;
     }
+    tx_size = size;
+    tx_avail->flags = AVAIL_F_NO_INTERRUPT;
+    *used_event(tx_avail, tx_size) = (uint16_t)(tx_last_used - 1);
+    for (int i = 0; i < tx_size; i++) {
+        tx_free[i] = tx_size - 1 - i;
+    }
+    tx_num_free = tx_size;
 
     // Pre-populate receive queue with buffers
-    for (int i = 0; i < QUEUE_SIZE; i++) {
+    for (int i = 0; i < rx_size; i++) {
         rx_desc[i].addr = (uint64_t)&rx_buffers[i];
         rx_desc[i].len = sizeof(rx_buffer_t);
         rx_desc[i].flags = DESC_F_WRITE;  // Device writes to this buffer
@@ -271,7 +356,7 @@ int virtio_net_init(void) {
 
         rx_avail->ring[i] = i;
     }
-    rx_avail->idx = QUEUE_SIZE;
+    rx_avail->idx = rx_size;
     mb();
 
     // Set driver OK
@@ -289,7 +374,10 @@ int virtio_net_init(void) {
     write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 0);
     write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
 
-    printf("[NET] Ready\n");
+    printf("[NET] Ready, %d RX buffers, %d TX descriptors%s%s%s\n", rx_size, tx_size,
+           event_idx ? ", event index" : "",
+           (tx_offloads & VIRTIO_NET_TX_CSUM) ? ", checksum offload" : "",
+           (tx_offloads & VIRTIO_NET_TX_TSO) ? ", TSO" : "");
     return 0;
 }
 
@@ -299,53 +387,92 @@ void virtio_net_get_mac(uint8_t *mac) {
     }
 }
 
-int virtio_net_send(const void *data, uint32_t len) {
-    if (!net_base) return -1;
-    if (len > NET_MTU) return -1;
-
-    // Prepare virtio header (all zeros - no offloads)
-    memset(&tx_buffer.hdr, 0, sizeof(virtio_net_hdr_t));
-
-    // Copy data
-    memcpy(tx_buffer.data, data, len);
-
-    // Setup descriptor chain: header + data in one buffer
-    tx_desc[0].addr = (uint64_t)&tx_buffer;
-    tx_desc[0].len = sizeof(virtio_net_hdr_t) + len;
-    tx_desc[0].flags = 0;  // Device reads from this buffer
-    tx_desc[0].next = 0;
-
-    // Add to available ring
-    mb();
-    uint16_t avail_idx = tx_avail->idx % QUEUE_SIZE;
-    tx_avail->ring[avail_idx] = 0;
-    mb();
-    tx_avail->idx++;
+// Give back the pbufs of frames the device has finished with
+static void tx_reclaim(void) {
     mb();
+    uint16_t used_idx = tx_used->idx;
+    while (tx_last_used != used_idx) {
+        uint32_t id = tx_used->ring[tx_last_used % tx_size].id;
+        tx_last_used++;
+        if (id < tx_size && tx_pbufs[id]) {
+            pbuf_free(tx_pbufs[id]);
+            tx_pbufs[id] = NULL;
+            tx_free[tx_num_free++] = id;
+        }
+    }
 
-    // Save used index for polling
-    uint16_t old_used = tx_used->idx;
+    // Keep the interrupt index just behind, where it won't be passed
+    *used_event(tx_avail, tx_size) = (uint16_t)(tx_last_used - 1);
+}
 
-    // Notify device (select queue 1 first)
-    write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 1);
-    write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 1);
+void virtio_net_tx_flush(void) {
+    if (!net_base) return;
+    tx_reclaim();
+    if (tx_avail->idx == tx_kicked_idx) return;
+    uint16_t old_idx = tx_kicked_idx;
+    tx_kicked_idx = tx_avail->idx;
+    notify_queue(1, tx_used, tx_size, tx_kicked_idx, old_idx);
+}
 
-    // Poll for completion
-    int timeout = 1000000;
-    while (tx_used->idx == old_used && timeout > 0) {
-        mb();
-        timeout--;
+int virtio_net_tx_offloads(void) {
+    return tx_offloads;
+}
+
+int virtio_net_send(pbuf_t *p) {
+    if (!net_base) return -1;
+    int tso = p->gso_size && (p->flags & PBUF_F_CSUM) && (tx_offloads & VIRTIO_NET_TX_TSO);
+    if (p->len > NET_MTU && !tso) return -1;
+
+    tx_reclaim();
+    if (tx_num_free == 0) {
+        // Ring full: let the device at what is queued and wait for a slot
+        virtio_net_tx_flush();
+        int timeout = 1000000;
+        while (tx_num_free == 0 && --timeout > 0) {
+            tx_reclaim();
+        }
+        if (tx_num_free == 0) {
+            printf("[NET] TX timeout\n");
+            return -1;
+        }
     }
 
-    if (timeout == 0) {
-        printf("[NET] TX timeout\n");
-        return -1;
+    // Virtio header goes in the headroom
+    virtio_net_hdr_t *hdr = pbuf_push(p, sizeof(virtio_net_hdr_t));
+    if (!hdr) return -1;
+    memset(hdr, 0, sizeof(virtio_net_hdr_t));
+    uint8_t *frame = p->payload + sizeof(virtio_net_hdr_t);
+    if ((p->flags & PBUF_F_CSUM) && (tx_offloads & VIRTIO_NET_TX_CSUM)) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = (uint16_t)(p->base + p->csum_start - frame);
+        hdr->csum_offset = p->csum_offset;
+        if (tso) {
+            // csum_start is the TCP header; its data offset ends the headers
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = p->gso_size;
+            hdr->hdr_len = hdr->csum_start + (frame[hdr->csum_start + 12] >> 4) * 4;
+        }
     }
 
-    // Ack interrupt
-    write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
-            read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+    // One descriptor: header + frame, read straight from the pbuf, which
+    // stays ours until the device hands the descriptor back
+    uint16_t id = tx_free[--tx_num_free];
+    tx_desc[id].addr = (uint64_t)p->payload;
+    tx_desc[id].len = p->len;
+    tx_desc[id].flags = 0;  // Device reads from this buffer
+    tx_desc[id].next = 0;
+    pbuf_ref(p);
+    tx_pbufs[id] = p;
+    pbuf_pull(p, sizeof(virtio_net_hdr_t));
+
+    // Add to available ring; the notify waits for the end of the batch
+    tx_avail->ring[tx_avail->idx % tx_size] = id;
+    mb();
+    tx_avail->idx++;
 
+    if ((uint16_t)(tx_avail->idx - tx_kicked_idx) >= TX_KICK_BATCH) {
+        virtio_net_tx_flush();
+    }
     return 0;
 }
 
@@ -355,47 +482,47 @@ int virtio_net_has_packet(void) {
     return rx_used->idx != rx_last_used_idx;
 }
 
-int virtio_net_recv(void *buf, uint32_t maxlen) {
-    if (!net_base) return -1;
+int virtio_net_rx_batch(virtio_net_rx_fn fn, int max) {
+    if (!net_base) return 0;
 
     mb();
-    if (rx_used->idx == rx_last_used_idx) {
-        return 0;  // No packet
-    }
+    uint16_t used_idx = rx_used->idx;
+    int n = 0;
+
+    while (rx_last_used_idx != used_idx && n < max) {
+        virtq_used_elem_t *elem = &rx_used->ring[rx_last_used_idx % rx_size];
+        uint32_t desc_idx = elem->id;
+        uint32_t total_len = elem->len;
+        rx_last_used_idx++;
+
+        // Skip virtio header, hand over the ethernet frame in place
+        if (desc_idx < rx_size && total_len > sizeof(virtio_net_hdr_t)) {
+            uint32_t frame_len = total_len - sizeof(virtio_net_hdr_t);
+            if (frame_len > NET_MTU) frame_len = NET_MTU;
+            pbuf_t p;
+            pbuf_borrow(&p, rx_buffers[desc_idx].data, frame_len, sizeof(virtio_net_hdr_t));
+            fn(&p);
+        }
 
-    // Get the completed descriptor
-    uint16_t used_idx = rx_last_used_idx % QUEUE_SIZE;
-    uint32_t desc_idx = rx_used->ring[used_idx].id;
-    uint32_t total_len = rx_used->ring[used_idx].len;
+        // Queue the buffer up again; the device sees the whole batch at once
+        rx_avail->ring[(uint16_t)(rx_avail->idx + n) % rx_size] = desc_idx;
+        n++;
+    }
 
-    rx_last_used_idx++;
+    // Interrupt for the next frame after these. A frame that beat this
+    // write is caught by the caller's virtio_net_has_packet() check.
+    *used_event(rx_avail, rx_size) = rx_last_used_idx;
 
-    // Skip virtio header, copy ethernet frame
-    rx_buffer_t *rxbuf = &rx_buffers[desc_idx];
-    uint32_t frame_len = total_len - sizeof(virtio_net_hdr_t);
+    if (n > 0) {
+        uint16_t old_idx = rx_avail->idx;
+        mb();
+        rx_avail->idx += n;
 
-    if (frame_len > maxlen) {
-        frame_len = maxlen;
+        // Notify device, unless it says it is polling anyway
+        notify_queue(0, rx_used, rx_size, rx_avail->idx, old_idx);
     }
-
-    memcpy(buf, rxbuf->data, frame_len);
-
-    // Re-add buffer to available ring
-    uint16_t avail_idx = rx_avail->idx % QUEUE_SIZE;
-    rx_avail->ring[avail_idx] = desc_idx;
-    mb();
-    rx_avail->idx++;
     mb();
-
-    // Notify device
-    write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 0);
-    write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
-
-    // Ack interrupt
-    write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
-            read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
-
-    return frame_len;
+    return n;
 }
 
 uint32_t virtio_net_get_irq(void) {
@@ -403,11 +530,8 @@ uint32_t virtio_net_get_irq(void) {
     return VIRTIO_IRQ_BASE + net_device_index;
 }
 
-void virtio_net_irq_handler(void) {
+void virtio_net_irq_ack(void) {
     if (!net_base) return;
-
-    // Just ack the interrupt - don't consume packets here!
-    // Packets will be processed by net_poll() in the network stack.
     write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
             read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
 }
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "pbuf.h"
 
 // Maximum ethernet frame size (without virtio header)
 #define NET_MTU 1514
@@ -20,23 +21,37 @@ int virtio_net_init(void);
 // Get MAC address (6 bytes)
 void virtio_net_get_mac(uint8_t *mac);
 
-// Send a raw ethernet frame
-// data: pointer to ethernet frame (dst mac, src mac, ethertype, payload)
-// len: length of frame in bytes
-// Returns 0 on success, -1 on error
-int virtio_net_send(const void *data, uint32_t len);
+// Offloads the device takes for frames we send (virtio_net_tx_offloads())
+#define VIRTIO_NET_TX_CSUM  0x01    // PBUF_F_CSUM: device fills in the checksum
+#define VIRTIO_NET_TX_TSO   0x02    // gso_size: device cuts TCP into segments
+
+// Queue a raw ethernet frame (dst mac, src mac, ethertype, payload) to
+// send. The virtio header goes in p's headroom, and p is the same again
+// on return; the driver keeps a reference until the device has read it,
+// so p must not be borrowed or written to afterwards. The device hears
+// about it on the next virtio_net_tx_flush(). Returns 0 on success, -1
+// on error
+int virtio_net_send(pbuf_t *p);
+
+// Notify the device of the frames queued since the last flush
+void virtio_net_tx_flush(void);
+
+// VIRTIO_NET_TX_* the device accepted
+int virtio_net_tx_offloads(void);
 
-// Receive a raw ethernet frame (polling)
-// buf: buffer to receive into
-// maxlen: maximum bytes to receive
-// Returns number of bytes received, 0 if no packet, -1 on error
-int virtio_net_recv(void *buf, uint32_t maxlen);
+// Receive up to max frames: fn gets each one as a pbuf borrowing the
+// driver's own buffer, which goes back to the device when the batch is
+// done. Returns the number of frames handled, 0 if none were waiting.
+// Not reentrant - the network stack calls it under its lock.
+typedef void (*virtio_net_rx_fn)(pbuf_t *p);
+int virtio_net_rx_batch(virtio_net_rx_fn fn, int max);
 
 // Check if a packet is available
 int virtio_net_has_packet(void);
 
-// IRQ handler (called from irq.c)
-void virtio_net_irq_handler(void);
+// Acknowledge the device interrupt (the network stack's IRQ handler
+// calls this before draining the RX ring)
+void virtio_net_irq_ack(void);
 
 // Get the network device's IRQ number
 uint32_t virtio_net_get_irq(void);
@@ -15,6 +15,8 @@
 #include "virtio_sound.h"
 #include "printf.h"
 #include "string.h"
+#include "hal/hal.h"
+#include "spinlock.h"
 
 // Virtio MMIO registers
 #define VIRTIO_MMIO_BASE        0x0a000000
@@ -234,6 +236,10 @@ static uint16_t tx_last_used = 0;
 static virtio_snd_hdr_t ctrl_response __attribute__((aligned(16)));
 static virtio_snd_pcm_status_t tx_status __attribute__((aligned(16)));
 
+// Virtqueues and playback state are touched both by callers on any core
+// and by the housekeeping pump in CPU 0's timer IRQ
+static spinlock_t snd_lock = SPINLOCK_INIT;
+
 // Audio playback state
 static int playing = 0;
 static uint32_t playback_position = 0;
@@ -648,6 +654,15 @@ static int hz_to_rate_index(uint32_t hz) {
     }
 }
 
+// Configure, prepare and start the stream. Caller holds snd_lock.
+static int begin_stream(uint8_t channels, uint8_t format, uint8_t rate) {
+    if (configure_stream(channels, format, rate) < 0) return -1;
+    if (prepare_stream() < 0) return -1;
+    return start_stream();
+}
+
+static void pump_locked(void);
+
 int virtio_sound_play_pcm(const int16_t *data, uint32_t samples, uint8_t channels, uint32_t sample_rate) {
     if (!snd_base) return -1;
 
@@ -657,22 +672,18 @@ int virtio_sound_play_pcm(const int16_t *data, uint32_t samples, uint8_t channel
         return -1;
     }
 
-    if (configure_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
-        return -1;
-    }
-
-    if (prepare_stream() < 0) {
-        return -1;
-    }
-
-    if (start_stream() < 0) {
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    if (begin_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
     playing = 1;
     playback_position = 0;
+    spin_unlock_irqrestore(&snd_lock, flags);
 
-    // Submit audio in chunks
+    // Submit audio in chunks, dropping the lock between them so
+    // virtio_sound_stop() on another core can end playback
     uint32_t bytes = samples * channels * sizeof(int16_t);
     uint32_t chunk_size = 4096;  // Match period_bytes
     const uint8_t *ptr = (const uint8_t *)data;
@@ -680,7 +691,10 @@ int virtio_sound_play_pcm(const int16_t *data, uint32_t samples, uint8_t channel
     while (bytes > 0 && playing) {
         uint32_t to_send = (bytes < chunk_size) ? bytes : chunk_size;
 
-        if (submit_audio(ptr, to_send) < 0) {
+        flags = spin_lock_irqsave(&snd_lock);
+        int ret = submit_audio(ptr, to_send);
+        spin_unlock_irqrestore(&snd_lock, flags);
+        if (ret < 0) {
             break;
         }
 
@@ -689,8 +703,10 @@ int virtio_sound_play_pcm(const int16_t *data, uint32_t samples, uint8_t channel
         playback_position += to_send / (channels * sizeof(int16_t));
     }
 
+    flags = spin_lock_irqsave(&snd_lock);
     stop_stream();
     playing = 0;
+    spin_unlock_irqrestore(&snd_lock, flags);
 
     return 0;
 }
@@ -797,20 +813,15 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
             printf("[SND] Playing %d bytes of audio...\n", data_size);
 
             // Configure and play
-            if (configure_stream(hdr->channels, format, rate) < 0) {
-                return -1;
-            }
-
-            if (prepare_stream() < 0) {
-                return -1;
-            }
-
-            if (start_stream() < 0) {
+            uint64_t flags = spin_lock_irqsave(&snd_lock);
+            if (begin_stream(hdr->channels, format, rate) < 0) {
+                spin_unlock_irqrestore(&snd_lock, flags);
                 return -1;
             }
 
             playing = 1;
             playback_position = 0;
+            spin_unlock_irqrestore(&snd_lock, flags);
 
             // Submit audio in chunks
             uint32_t chunk_size = 4096;
@@ -820,7 +831,10 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
             while (bytes_left > 0 && playing) {
                 uint32_t to_send = (bytes_left < chunk_size) ? bytes_left : chunk_size;
 
-                if (submit_audio(audio_ptr, to_send) < 0) {
+                flags = spin_lock_irqsave(&snd_lock);
+                int ret = submit_audio(audio_ptr, to_send);
+                spin_unlock_irqrestore(&snd_lock, flags);
+                if (ret < 0) {
                     break;
                 }
 
@@ -829,8 +843,10 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
                 playback_position += to_send / hdr->block_align;
             }
 
+            flags = spin_lock_irqsave(&snd_lock);
             stop_stream();
             playing = 0;
+            spin_unlock_irqrestore(&snd_lock, flags);
 
             printf("[SND] Playback complete\n");
             return 0;
@@ -847,8 +863,8 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
     return -1;
 }
 
-void virtio_sound_stop(void) {
-    if (!snd_base) return;
+// Caller holds snd_lock
+static void stop_locked(void) {
     playing = 0;
     async_playing = 0;
     async_paused = 0;
@@ -856,36 +872,43 @@ void virtio_sound_stop(void) {
     stop_stream();
 }
 
+void virtio_sound_stop(void) {
+    if (!snd_base) return;
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    stop_locked();
+    spin_unlock_irqrestore(&snd_lock, flags);
+}
+
 // Pause async playback - can be resumed later
 void virtio_sound_pause(void) {
     if (!snd_base) return;
-    if (!async_playing) return;  // Nothing to pause
 
-    // Stop the stream but keep state
-    stop_stream();
-    async_playing = 0;
-    async_paused = 1;
-    playing = 0;
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    if (async_playing) {
+        // Stop the stream but keep state
+        stop_stream();
+        async_playing = 0;
+        async_paused = 1;
+        playing = 0;
+    }
+    spin_unlock_irqrestore(&snd_lock, flags);
 }
 
 // Resume paused playback
 int virtio_sound_resume(void) {
     if (!snd_base) return -1;
-    if (!async_paused || !async_pcm_data) return -1;  // Nothing to resume
 
-    int rate_idx = hz_to_rate_index(async_sample_rate);
-    if (rate_idx < 0) return -1;
-
-    // Reconfigure and restart stream
-    if (configure_stream(async_channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    if (!async_paused || !async_pcm_data) {  // Nothing to resume
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
-    if (prepare_stream() < 0) {
-        return -1;
-    }
-
-    if (start_stream() < 0) {
+    // Reconfigure and restart stream
+    int rate_idx = hz_to_rate_index(async_sample_rate);
+    if (rate_idx < 0 ||
+        begin_stream(async_channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
@@ -894,8 +917,10 @@ int virtio_sound_resume(void) {
     async_paused = 0;
     playing = 1;
 
-    // Submit next chunk
-    virtio_sound_pump();
+    // Submit next chunk, the housekeeping tick pumps the rest
+    pump_locked();
+    spin_unlock_irqrestore(&snd_lock, flags);
+    hal_timer_start_housekeeping();
 
     return 0;
 }
@@ -968,26 +993,21 @@ static int async_submit_ready(void) {
 int virtio_sound_play_pcm_async(const int16_t *data, uint32_t samples, uint8_t channels, uint32_t sample_rate) {
     if (!snd_base) return -1;
 
-    // Stop any current playback
-    if (async_playing || async_paused) {
-        virtio_sound_stop();
-    }
-
     int rate_idx = hz_to_rate_index(sample_rate);
     if (rate_idx < 0) {
         printf("[SND] Unsupported sample rate: %d\n", sample_rate);
         return -1;
     }
 
-    if (configure_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
-        return -1;
-    }
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
 
-    if (prepare_stream() < 0) {
-        return -1;
+    // Stop any current playback
+    if (async_playing || async_paused) {
+        stop_locked();
     }
 
-    if (start_stream() < 0) {
+    if (begin_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
@@ -1002,14 +1022,27 @@ int virtio_sound_play_pcm_async(const int16_t *data, uint32_t samples, uint8_t c
     playing = 1;
     playback_position = 0;
 
-    // Submit first chunk
-    virtio_sound_pump();
+    // Submit first chunk, the housekeeping tick pumps the rest
+    pump_locked();
+    spin_unlock_irqrestore(&snd_lock, flags);
+    hal_timer_start_housekeeping();
 
     return 0;
 }
 
 // Called periodically (e.g., from timer) to feed more audio data
 void virtio_sound_pump(void) {
+    if (!async_playing) return;
+
+    // Runs in the timer IRQ. If another core holds the lock (possibly for
+    // a whole synchronous chunk) catch up on the next tick instead of spinning
+    if (!spin_trylock(&snd_lock)) return;
+    pump_locked();
+    spin_unlock(&snd_lock);
+}
+
+// Caller holds snd_lock
+static void pump_locked(void) {
     if (!async_playing || !async_pcm_data) return;
 
     // Check if device is ready for more data
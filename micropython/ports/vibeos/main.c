@@ -14,6 +14,9 @@
 #include "py/nlr.h"
 #include "shared/runtime/pyexec.h"
 
+// https requests from modvibe run the kernel's TLS handshake on our stack
+VIBE_STACK_SIZE(1024 * 1024);
+
 // Global kernel API pointer (used by mphalport.c)
 kapi_t *mp_vibeos_api;
 
@@ -839,12 +839,16 @@ static mp_obj_t mod_vibe_tcp_send(mp_obj_t sock_obj, mp_obj_t data_obj) {
 }
 static MP_DEFINE_CONST_FUN_OBJ_2(mod_vibe_tcp_send_obj, mod_vibe_tcp_send);
 
-// vibe.tcp_recv(sock, maxlen) -> bytes or None
-static mp_obj_t mod_vibe_tcp_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
-    int sock = mp_obj_get_int(sock_obj);
-    int maxlen = mp_obj_get_int(maxlen_obj);
+// vibe.tcp_recv(sock, maxlen, timeout_ms=0) -> bytes or None
+// With a timeout, sleeps until data arrives; None if it runs out or the
+// connection is closed
+static mp_obj_t mod_vibe_tcp_recv(size_t n_args, const mp_obj_t *args) {
+    int sock = mp_obj_get_int(args[0]);
+    int maxlen = mp_obj_get_int(args[1]);
+    uint32_t timeout = n_args > 2 ? mp_obj_get_int(args[2]) : 0;
     char *buf = m_new(char, maxlen);
-    int received = mp_vibeos_api->tcp_recv(sock, buf, maxlen);
+    int received = timeout ? mp_vibeos_api->tcp_recv_wait(sock, buf, maxlen, timeout)
+                           : mp_vibeos_api->tcp_recv(sock, buf, maxlen);
     if (received <= 0) {
         m_del(char, buf, maxlen);
         return mp_const_none;
@@ -853,7 +857,7 @@ static mp_obj_t mod_vibe_tcp_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
     m_del(char, buf, maxlen);
     return result;
 }
-static MP_DEFINE_CONST_FUN_OBJ_2(mod_vibe_tcp_recv_obj, mod_vibe_tcp_recv);
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_vibe_tcp_recv_obj, 2, 3, mod_vibe_tcp_recv);
 
 // vibe.tcp_close(sock)
 static mp_obj_t mod_vibe_tcp_close(mp_obj_t sock_obj) {
@@ -881,12 +885,16 @@ static mp_obj_t mod_vibe_tls_send(mp_obj_t sock_obj, mp_obj_t data_obj) {
 }
 static MP_DEFINE_CONST_FUN_OBJ_2(mod_vibe_tls_send_obj, mod_vibe_tls_send);
 
-// vibe.tls_recv(sock, maxlen) -> bytes or None
-static mp_obj_t mod_vibe_tls_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
-    int sock = mp_obj_get_int(sock_obj);
-    int maxlen = mp_obj_get_int(maxlen_obj);
+// vibe.tls_recv(sock, maxlen, timeout_ms=0) -> bytes or None
+// With a timeout, sleeps until data arrives; None if it runs out or the
+// connection is closed
+static mp_obj_t mod_vibe_tls_recv(size_t n_args, const mp_obj_t *args) {
+    int sock = mp_obj_get_int(args[0]);
+    int maxlen = mp_obj_get_int(args[1]);
+    uint32_t timeout = n_args > 2 ? mp_obj_get_int(args[2]) : 0;
     char *buf = m_new(char, maxlen);
-    int received = mp_vibeos_api->tls_recv(sock, buf, maxlen);
+    int received = timeout ? mp_vibeos_api->tls_recv_wait(sock, buf, maxlen, timeout)
+                           : mp_vibeos_api->tls_recv(sock, buf, maxlen);
     if (received <= 0) {
         m_del(char, buf, maxlen);
         return mp_const_none;
@@ -895,7 +903,7 @@ static mp_obj_t mod_vibe_tls_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
     m_del(char, buf, maxlen);
     return result;
 }
-static MP_DEFINE_CONST_FUN_OBJ_2(mod_vibe_tls_recv_obj, mod_vibe_tls_recv);
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_vibe_tls_recv_obj, 2, 3, mod_vibe_tls_recv);
 
 // vibe.tls_close(sock)
 static mp_obj_t mod_vibe_tls_close(mp_obj_t sock_obj) {
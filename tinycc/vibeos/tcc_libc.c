@@ -457,7 +457,7 @@ FILE *fopen(const char *path, const char *mode) {
 
     /* Truncate for write mode */
     if (m == 1) {
-        /* kapi doesn't have truncate, so we'll handle this via write */
+        tcc_kapi->truncate(handle, 0);
         f->size = 0;
     }
 
@@ -930,6 +930,7 @@ int open(const char *path, int flags, ...) {
     tcc_kapi->uart_puts("\n");
 
     if (flags & O_TRUNC) {
+        tcc_kapi->truncate(handle, 0);
         fd_table[fd].size = 0;
     }
     if (flags & O_APPEND) {
@@ -998,7 +999,8 @@ ssize_t write(int fd, const void *buf, size_t count) {
 
     if (fd < 0 || fd >= MAX_FDS || !fd_table[fd].in_use) return -1;
 
-    int n = tcc_kapi->write(fd_table[fd].handle, buf, count);
+    /* Write in place at the current position, no whole-file rewrite */
+    int n = tcc_kapi->write_at(fd_table[fd].handle, buf, count, fd_table[fd].pos);
     if (n > 0) {
         fd_table[fd].pos += n;
         if (fd_table[fd].pos > fd_table[fd].size)
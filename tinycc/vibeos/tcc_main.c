@@ -8,6 +8,9 @@
 #include "../../user/lib/vibe.h"
 #include "tcc_libc.h"
 
+/* The parser recurses deeply on big expressions */
+VIBE_STACK_SIZE(1024 * 1024);
+
 /* kapi pointer used by tcc_libc.c */
 kapi_t *tcc_kapi = 0;
 
@@ -0,0 +1,187 @@
+/*
+ * appendbench - log append benchmark
+ *
+ * Usage: appendbench [-n records] [file]
+ *   Appends 1KB records to a log file (default /appendbench.log - on the
+ *   disk, unlike /tmp - and 10000 records) with write_at, timing every
+ *   tenth of the run. Appends extend the file in place, so each tenth
+ *   should take about as long as the first no matter how big the file has
+ *   grown. The file is checked and deleted afterwards unless one was given.
+ */
+
+#include "../lib/vibe.h"
+
+#define RECORD_SIZE      1024
+#define DEFAULT_RECORDS  10000
+#define SEGMENTS         10
+#define TEST_FILE        "/appendbench.log"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+// Fill a record with its number, so the check below can tell them apart
+static void make_record(char *rec, int n) {
+    for (int i = 0; i < RECORD_SIZE - 1; i++) {
+        rec[i] = 'a' + (n + i) % 26;
+    }
+    rec[RECORD_SIZE - 1] = '\n';
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    int records = DEFAULT_RECORDS;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            records = parse_int(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (records < SEGMENTS) records = SEGMENTS;
+
+    int own_file = (path == NULL);
+    if (own_file) {
+        path = TEST_FILE;
+    }
+
+    if (!k->create(path)) {
+        out_puts("appendbench: cannot create ");
+        out_puts(path);
+        out_putc('\n');
+        return 1;
+    }
+    void *file = k->open(path);
+    if (!file || k->truncate(file, 0) < 0) {
+        out_puts("appendbench: cannot open ");
+        out_puts(path);
+        out_putc('\n');
+        if (file) k->close(file);
+        return 1;
+    }
+
+    char *rec = k->malloc(RECORD_SIZE);
+    if (!rec) {
+        out_puts("appendbench: out of memory\n");
+        k->close(file);
+        return 1;
+    }
+
+    out_puts("appendbench: ");
+    print_num(records);
+    out_puts(" x 1 KB appends to ");
+    out_puts(path);
+    out_putc('\n');
+
+    int per_seg = records / SEGMENTS;
+    unsigned long offset = 0;
+    uint64_t start = k->get_time_ns();
+    uint64_t seg_start = start;
+    uint64_t first_ns = 0, last_ns = 0;
+    int n = 0;
+
+    for (int seg = 0; seg < SEGMENTS; seg++) {
+        int end = (seg == SEGMENTS - 1) ? records : n + per_seg;
+        for (; n < end; n++) {
+            make_record(rec, n);
+            if (k->write_at(file, rec, RECORD_SIZE, offset) != RECORD_SIZE) {
+                out_puts("appendbench: write failed at record ");
+                print_num(n);
+                out_putc('\n');
+                k->free(rec);
+                k->close(file);
+                return 1;
+            }
+            offset += RECORD_SIZE;
+        }
+
+        uint64_t now = k->get_time_ns();
+        uint64_t ns = now - seg_start;
+        if (seg == 0) first_ns = ns;
+        last_ns = ns;
+
+        out_puts("  ");
+        print_num(n);
+        out_puts(" records (");
+        print_num(offset / 1024);
+        out_puts(" KB): ");
+        print_num((unsigned long)(ns / 1000));
+        out_puts(" us for this tenth\n");
+        seg_start = now;
+    }
+
+    // Include getting it all to disk
+    k->sync();
+    uint64_t total_ns = k->get_time_ns() - start;
+
+    out_puts("total: ");
+    print_num((unsigned long)(total_ns / 1000000));
+    out_puts(" ms, ");
+    print_num((unsigned long)(total_ns / 1000 / records));
+    out_puts(" us per append, last/first tenth ");
+    print_num((unsigned long)(first_ns ? last_ns * 100 / first_ns : 0));
+    out_puts("%\n");
+
+    // Spot-check a few records
+    int bad = 0;
+    char *check = k->malloc(RECORD_SIZE);
+    if (check && (unsigned long)k->file_size(file) != offset) {
+        bad = 1;
+    }
+    for (int i = 0; check && !bad && i < records; i += records / 7 + 1) {
+        make_record(rec, i);
+        if (k->read(file, check, RECORD_SIZE, (size_t)i * RECORD_SIZE) != RECORD_SIZE) {
+            bad = 1;
+        }
+        for (int j = 0; !bad && j < RECORD_SIZE; j++) {
+            if (check[j] != rec[j]) bad = 1;
+        }
+    }
+    out_puts(bad ? "check: FAILED\n" : "check: ok\n");
+
+    if (check) k->free(check);
+    k->free(rec);
+    k->close(file);
+    if (own_file) {
+        k->delete(TEST_FILE);
+    }
+    return bad;
+}
@@ -0,0 +1,154 @@
+/*
+ * blkbench - raw disk read benchmark
+ *
+ * Usage: blkbench [-n reads]
+ *   Reads 4KB blocks straight from the disk, below the filesystem and the
+ *   block cache, sequentially and at random offsets. Each pattern runs at
+ *   queue depths 1, 4, 16 and 32: that many reads are handed to the driver
+ *   together before waiting for them. Prints IOPS and KB/s for each.
+ *   Default is 2048 reads per run.
+ */
+
+#include "../lib/vibe.h"
+
+#define BLOCK_SECTORS  8        // 4KB
+#define DEFAULT_READS  2048
+#define MAX_DEPTH      32
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+// Right-align n in width columns
+static void print_num_w(unsigned long n, int width) {
+    int digits = 1;
+    for (unsigned long t = n; t >= 10; t /= 10) digits++;
+    while (digits++ < width) out_putc(' ');
+    print_num(n);
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng_next(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+// One run: reads blocks in batches of depth. Returns elapsed ns, 0 on error.
+static uint64_t run(int random, int depth, int reads, uint32_t blocks, char *buf) {
+    uint32_t sectors[MAX_DEPTH];
+    uint32_t next = 0;
+
+    uint64_t start = api->get_time_ns();
+    for (int done = 0; done < reads; done += depth) {
+        int n = reads - done < depth ? reads - done : depth;
+        for (int i = 0; i < n; i++) {
+            uint32_t block;
+            if (random) {
+                block = rng_next() % blocks;
+            } else {
+                block = next++;
+                if (next == blocks) next = 0;
+            }
+            sectors[i] = block * BLOCK_SECTORS;
+        }
+        if (api->blk_read_batch(sectors, n, BLOCK_SECTORS, buf) < 0) {
+            return 0;
+        }
+    }
+    uint64_t ns = api->get_time_ns() - start;
+    return ns ? ns : 1;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    int reads = DEFAULT_READS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            reads = parse_int(argv[++i]);
+        }
+    }
+    if (reads < MAX_DEPTH) reads = MAX_DEPTH;
+
+    uint32_t blocks = (uint32_t)k->get_disk_total() / 4;
+    if (blocks < MAX_DEPTH) {
+        out_puts("blkbench: no disk\n");
+        return 1;
+    }
+
+    char *buf = k->malloc(MAX_DEPTH * BLOCK_SECTORS * 512);
+    if (!buf) {
+        out_puts("blkbench: out of memory\n");
+        return 1;
+    }
+
+    out_puts("blkbench: ");
+    print_num(reads);
+    out_puts(" x 4 KB raw reads per run, ");
+    print_num(blocks / 256);
+    out_puts(" MB disk\n");
+    out_puts("pattern     depth    IOPS    KB/s\n");
+
+    static const int depths[] = { 1, 4, 16, 32 };
+    for (int random = 0; random < 2; random++) {
+        for (int d = 0; d < 4; d++) {
+            uint64_t ns = run(random, depths[d], reads, blocks, buf);
+            if (ns == 0) {
+                out_puts("blkbench: read error\n");
+                k->free(buf);
+                return 1;
+            }
+            unsigned long iops = (unsigned long)((uint64_t)reads * 1000000000ULL / ns);
+
+            out_puts(random ? "random    " : "sequential");
+            print_num_w(depths[d], 7);
+            print_num_w(iops, 8);
+            print_num_w(iops * 4, 8);
+            out_putc('\n');
+        }
+    }
+
+    k->free(buf);
+    return 0;
+}
@@ -168,19 +168,14 @@ def fetch_url(url):
     request += "\r\n"
     send_fn(sock, request)
 
+    # Sleeps in the kernel until data comes; None once the server closes
+    # (or goes quiet for 5s)
     response = b''
-    timeout = 0
-    while timeout < 100:
-        chunk = recv_fn(sock, 4096)
-        if chunk is None or len(chunk) == 0:
-            if len(response) > 0:
-                break
-            timeout += 1
-            vibe.sleep_ms(50)
-        else:
-            response += chunk
-            timeout = 0
-        vibe.sched_yield()
+    while True:
+        chunk = recv_fn(sock, 4096, 5000)
+        if chunk is None:
+            break
+        response += chunk
 
     close_fn(sock)
 
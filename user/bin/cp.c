@@ -70,16 +70,15 @@ static int copy_file(const char *src, const char *dst) {
     size_t offset = 0;
     int bytes;
 
+    // create() keeps an existing file, so drop its old contents first
+    api->truncate(dst_file, 0);
+
     while ((bytes = api->read(src_file, buf, sizeof(buf), offset)) > 0) {
-        // Write to destination (write appends, so no offset needed)
-        // But our write() always appends, so we need to truncate first
-        // Actually, create() makes empty file, so this should work
-        if (offset == 0) {
-            // First write - file is empty from create()
-            api->write(dst_file, buf, bytes);
-        } else {
-            // Subsequent writes - append
-            api->write(dst_file, buf, bytes);
+        if (api->write_at(dst_file, buf, bytes, offset) < 0) {
+            out_puts("cp: write error on '");
+            out_puts(dst);
+            out_puts("'\n");
+            return -1;
         }
         offset += bytes;
     }
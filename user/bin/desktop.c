@@ -329,6 +329,9 @@ static void push_event(int wid, int event_type, int data1, int data2, int data3)
     w->events[w->event_tail].data2 = data2;
     w->events[w->event_tail].data3 = data3;
     w->event_tail = next;
+
+    // Apps sleeping in poll() on this window look again
+    api->poll_wake();
 }
 
 // ============ Window API (registered in kapi) ============
@@ -446,6 +449,11 @@ static int wm_window_poll_event(int wid, int *event_type, int *data1, int *data2
     return 1;
 }
 
+static int wm_window_has_event(int wid) {
+    if (wid < 0 || wid >= MAX_WINDOWS || !windows[wid].active) return 0;
+    return windows[wid].event_head != windows[wid].event_tail;
+}
+
 static void wm_window_invalidate(int wid) {
     if (wid < 0 || wid >= MAX_WINDOWS || !windows[wid].active) return;
     windows[wid].dirty = 1;
@@ -1783,6 +1791,7 @@ static void register_window_api(void) {
     api->window_destroy = wm_window_destroy;
     api->window_get_buffer = wm_window_get_buffer;
     api->window_poll_event = wm_window_poll_event;
+    api->window_has_event = wm_window_has_event;
     api->window_invalidate = wm_window_invalidate;
     api->window_set_title = wm_window_set_title;
 }
@@ -1793,6 +1802,10 @@ int main(kapi_t *kapi, int argc, char **argv) {
 
     api = kapi;
 
+    // The compositor runs ahead of normal programs, so a busy compile
+    // doesn't stall the mouse and window redraws
+    if (api->set_priority) api->set_priority(0, -5);
+
     // Get screen dimensions from kapi
     SCREEN_WIDTH = api->fb_width;
     SCREEN_HEIGHT = api->fb_height;
@@ -1113,13 +1113,14 @@ time_t time(time_t *t) {
 }
 
 clock_t clock(void) {
-    return doom_kapi ? (clock_t)(doom_kapi->get_uptime_ticks() * 10) : 0;
+    return doom_kapi ? (clock_t)(doom_kapi->get_time_ns() / 1000000) : 0;
 }
 
 int gettimeofday(struct timeval *tv, struct timezone *tz) {
     if (tv) {
-        tv->tv_sec = time(0);
-        tv->tv_usec = 0;
+        uint64_t us = doom_kapi ? doom_kapi->get_time_ns() / 1000 : 0;
+        tv->tv_sec = us / 1000000;
+        tv->tv_usec = us % 1000000;
     }
     if (tz) {
         tz->tz_minuteswest = 0;
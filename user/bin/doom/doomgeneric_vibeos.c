@@ -14,6 +14,9 @@
 #include "doomkeys.h"
 #include "d_event.h"
 
+/* Renderer and savegame code keep large arrays on the stack */
+VIBE_STACK_SIZE(512 * 1024);
+
 /* External function to post events to DOOM */
 extern void D_PostEvent(event_t *ev);
 
@@ -21,7 +24,7 @@ extern void D_PostEvent(event_t *ev);
 kapi_t *doom_kapi = 0;
 
 /* Start time for DG_GetTicksMs */
-static uint64_t start_ticks = 0;
+static uint64_t start_ns = 0;
 
 /* Screen positioning - calculated at runtime to center on any resolution */
 static int screen_offset_x = 0;
@@ -170,7 +173,7 @@ static void poll_mouse(void) {
 
 void DG_Init(void) {
     /* Record start time */
-    start_ticks = doom_kapi->get_uptime_ticks();
+    start_ns = doom_kapi->get_time_ns();
 
     /* Calculate scale factor - largest integer scale that fits */
     int fb_w = doom_kapi->fb_width;
@@ -244,9 +247,9 @@ void DG_SleepMs(uint32_t ms) {
 }
 
 uint32_t DG_GetTicksMs(void) {
-    /* VibeOS ticks are 10ms each (100Hz timer) */
-    uint64_t now = doom_kapi->get_uptime_ticks();
-    return (uint32_t)((now - start_ticks) * 10);
+    /* Nanosecond clock - the 100Hz uptime ticks made 35fps tics jittery */
+    uint64_t now = doom_kapi->get_time_ns();
+    return (uint32_t)((now - start_ns) / 1000000);
 }
 
 int DG_GetKey(int *pressed, unsigned char *doomKey) {
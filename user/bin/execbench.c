@@ -0,0 +1,118 @@
+/*
+ * execbench - program start-up benchmark
+ *
+ * Usage: execbench [-n runs] [program [args...]]
+ *   Runs the program runs times in a row (default 50) and prints how long
+ *   the first start took and the average of the rest. Without a program
+ *   it runs itself with -child, which exits straight away, so the time is
+ *   all loading and process set-up. Also prints the kernel's program
+ *   image cache counters.
+ */
+
+#include "../lib/vibe.h"
+
+#define DEFAULT_RUNS 50
+#define SELF         "/bin/execbench"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    if (argc > 1 && strcmp(argv[1], "-child") == 0) {
+        return 0;
+    }
+
+    int runs = DEFAULT_RUNS;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        runs = parse_int(argv[2]);
+        first = 3;
+    }
+    if (runs < 2) runs = 2;
+
+    char *self_args[] = { "execbench", "-child" };
+    const char *path = SELF;
+    int child_argc = 2;
+    char **child_argv = self_args;
+    if (first < argc) {
+        path = argv[first];
+        child_argc = argc - first;
+        child_argv = &argv[first];
+    }
+
+    uint64_t hits0 = 0, misses0 = 0;
+    k->exec_cache_stats(&hits0, &misses0, NULL);
+
+    uint64_t first_ns = 0, rest_ns = 0;
+    for (int i = 0; i < runs; i++) {
+        uint64_t start = k->get_time_ns();
+        if (k->exec_args(path, child_argc, child_argv) < 0) {
+            out_puts("execbench: cannot run ");
+            out_puts(path);
+            out_putc('\n');
+            return 1;
+        }
+        uint64_t ns = k->get_time_ns() - start;
+        if (i == 0) first_ns = ns;
+        else rest_ns += ns;
+    }
+
+    uint64_t hits = 0, misses = 0, bytes = 0;
+    k->exec_cache_stats(&hits, &misses, &bytes);
+
+    out_puts("execbench: ");
+    out_puts(path);
+    out_puts(", ");
+    print_num(runs);
+    out_puts(" runs\n  first: ");
+    print_num((unsigned long)(first_ns / 1000));
+    out_puts(" us\n  after: ");
+    print_num((unsigned long)(rest_ns / (runs - 1) / 1000));
+    out_puts(" us average\n  image cache: ");
+    print_num((unsigned long)(hits - hits0));
+    out_puts(" hits, ");
+    print_num((unsigned long)(misses - misses0));
+    out_puts(" misses, ");
+    print_num((unsigned long)(bytes / 1024));
+    out_puts(" KB held\n");
+    return 0;
+}
@@ -14,6 +14,11 @@
 
 #include "../lib/vibe.h"
 
+// The kernel's TLS handshake runs on our stack
+VIBE_STACK_SIZE(1024 * 1024);
+
+#define RECV_TIMEOUT_MS 5000    // Silence before giving up on a response
+
 static kapi_t *k;
 
 // Output helpers
@@ -272,25 +277,18 @@ static int http_get(url_t *url, char *response, int max_response, http_response_
 
     // Receive response
     int total = 0;
-    int timeout = 0;
 
-    while (total < max_response - 1 && timeout < 500) {
+    while (total < max_response - 1) {
+        // Sleeps in the kernel until data arrives
         int n;
         if (url->use_tls) {
-            n = k->tls_recv(sock, response + total, max_response - 1 - total);
+            n = k->tls_recv_wait(sock, response + total, max_response - 1 - total, RECV_TIMEOUT_MS);
         } else {
-            n = k->tcp_recv(sock, response + total, max_response - 1 - total);
+            n = k->tcp_recv_wait(sock, response + total, max_response - 1 - total, RECV_TIMEOUT_MS);
         }
 
-        if (n < 0) break;  // Connection closed
-        if (n == 0) {
-            k->net_poll();
-            k->sleep_ms(10);
-            timeout++;
-            continue;
-        }
+        if (n <= 0) break;  // Connection closed, or nothing for too long
         total += n;
-        timeout = 0;
 
         // Check if we got headers yet
         if (resp->header_len == 0) {
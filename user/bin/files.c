@@ -17,7 +17,8 @@
 #define PATH_BAR_HEIGHT 24
 #define ITEM_HEIGHT     18
 #define SCROLL_WIDTH    16
-#define MAX_ITEMS       64
+#define MAX_ITEMS       2048
+#define READ_BATCH      32
 #define MAX_VISIBLE     ((WIN_HEIGHT - PATH_BAR_HEIGHT - 4) / ITEM_HEIGHT)
 
 // Modern colors
@@ -335,11 +336,8 @@ static void refresh_directory(void) {
     item_count = 0;
     selected_idx = -1;
 
-    void *dir = api->open(current_path);
-    if (!dir || !api->is_dir(dir)) {
-        if (dir) {
-            api->close(dir);
-        }
+    void *dir = api->opendir(current_path);
+    if (!dir) {
         return;
     }
 
@@ -350,25 +348,20 @@ static void refresh_directory(void) {
         item_count++;
     }
 
-    // Read directory entries
-    char name[64];
-    uint8_t type;
-    int idx = 0;
-
-    while (item_count < MAX_ITEMS && api->readdir(dir, idx, name, sizeof(name), &type) == 0) {
-        // Skip . and ..
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-            idx++;
-            continue;
+    // Read directory entries, a batch per call
+    vfs_dirent_t *ents = api->malloc(READ_BATCH * sizeof(vfs_dirent_t));
+    int n = 0;
+    while (ents && item_count < MAX_ITEMS &&
+           (n = api->readdir_batch(dir, ents, READ_BATCH)) > 0) {
+        for (int i = 0; i < n && item_count < MAX_ITEMS; i++) {
+            strncpy_safe(items[item_count].name, ents[i].name, sizeof(items[item_count].name));
+            items[item_count].is_dir = (ents[i].type == DIRENT_DIR);
+            item_count++;
         }
-
-        strcpy(items[item_count].name, name);
-        items[item_count].is_dir = (type == 2);  // VFS_DIRECTORY = 2
-        item_count++;
-        idx++;
     }
 
-    api->close(dir);
+    if (ents) api->free(ents);
+    api->closedir(dir);
     scroll_offset = 0;
 }
 
@@ -0,0 +1,512 @@
+/*
+ * httpd - small HTTP server, with a load generator to test it
+ *
+ * Usage: httpd [-p port] [root]
+ *   Serves the files under root (default /) over HTTP/1.0 on port (default
+ *   8080) until q is pressed. Directories get a listing, and /status shows
+ *   uptime, memory and request counts.
+ *
+ * Usage: httpd -load [-n requests] [-c connections] [host[:port]] [path]
+ *   Fetches path (default /status) requests times (default 200), keeping
+ *   that many connections going at once (default 4), and prints requests
+ *   per second. The default host is 127.0.0.1:8080 - this machine, with
+ *   the server running in another terminal.
+ */
+
+#include "../lib/vibe.h"
+
+#define DEFAULT_PORT    8080
+#define BACKLOG         16
+#define REQ_MAX         2048
+#define CHUNK_SIZE      16384
+#define IDLE_MS         5000    // Silence before giving up
+#define KEY_CHECK_MS    100     // How often the server looks for 'q'
+#define PATH_MAX_LEN    512
+
+#define LOAD_REQUESTS   200
+#define LOAD_CONNS      4
+#define LOAD_MAX_CONNS  32
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+static char *append(char *p, const char *s) {
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *append_num(char *p, unsigned long n) {
+    char buf[24];
+    int i = 0;
+    do {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (i > 0) *p++ = buf[--i];
+    return p;
+}
+
+// ============ Server ============
+
+static const char *root = "/";
+static unsigned long served;
+
+static int send_all(int sock, const char *data, int len) {
+    return api->tcp_send(sock, data, len) == len ? 0 : -1;
+}
+
+static void send_header(int sock, const char *status, const char *type, long length) {
+    char hdr[256];
+    char *p = append(hdr, "HTTP/1.0 ");
+    p = append(p, status);
+    p = append(p, "\r\nServer: VibeOS httpd\r\nContent-Type: ");
+    p = append(p, type);
+    if (length >= 0) {
+        p = append(p, "\r\nContent-Length: ");
+        p = append_num(p, length);
+    }
+    p = append(p, "\r\nConnection: close\r\n\r\n");
+    send_all(sock, hdr, p - hdr);
+}
+
+static void send_error(int sock, const char *status) {
+    char body[128];
+    char *p = append(body, status);
+    p = append(p, "\n");
+    send_header(sock, status, "text/plain", p - body);
+    send_all(sock, body, p - body);
+}
+
+static const char *content_type(const char *path) {
+    const char *dot = NULL;
+    for (const char *s = path; *s; s++) {
+        if (*s == '.') dot = s;
+        else if (*s == '/') dot = NULL;
+    }
+    if (!dot) return "application/octet-stream";
+    if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0) return "text/html";
+    if (strcmp(dot, ".txt") == 0 || strcmp(dot, ".md") == 0 ||
+        strcmp(dot, ".c") == 0 || strcmp(dot, ".h") == 0) return "text/plain";
+    if (strcmp(dot, ".css") == 0) return "text/css";
+    if (strcmp(dot, ".js") == 0) return "application/javascript";
+    if (strcmp(dot, ".png") == 0) return "image/png";
+    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0) return "image/jpeg";
+    if (strcmp(dot, ".gif") == 0) return "image/gif";
+    return "application/octet-stream";
+}
+
+static void serve_status(int sock, int head) {
+    char body[512];
+    unsigned long secs = api->get_uptime_ticks() / 100;
+    uint64_t timeouts = 0, fast = 0, ooo = 0;
+    api->tcp_stats(&timeouts, &fast, &ooo);
+
+    char *p = append(body, "uptime: ");
+    p = append_num(p, secs);
+    p = append(p, " s\nmemory used: ");
+    p = append_num(p, api->get_mem_used() / 1024);
+    p = append(p, " KB\nmemory free: ");
+    p = append_num(p, api->get_mem_free() / 1024);
+    p = append(p, " KB\nrequests: ");
+    p = append_num(p, served);
+    p = append(p, "\ntcp timeouts: ");
+    p = append_num(p, timeouts);
+    p = append(p, "\ntcp fast retransmits: ");
+    p = append_num(p, fast);
+    p = append(p, "\n");
+
+    send_header(sock, "200 OK", "text/plain", p - body);
+    if (!head) send_all(sock, body, p - body);
+}
+
+static void serve_dir(int sock, const char *path, const char *url, int head, char *buf) {
+    void *dir = api->opendir(path);
+    if (!dir) {
+        send_error(sock, "404 Not Found");
+        return;
+    }
+
+    // No length up front - the end of the connection marks the end
+    send_header(sock, "200 OK", "text/html", -1);
+    if (head) {
+        api->closedir(dir);
+        return;
+    }
+
+    char *p = append(buf, "<html><body><h1>");
+    p = append(p, url);
+    p = append(p, "</h1><ul>\n");
+    send_all(sock, buf, p - buf);
+
+    int slash = url[strlen(url) - 1] == '/';
+    vfs_dirent_t ents[8];
+    int n;
+    while ((n = api->readdir_batch(dir, ents, 8)) > 0) {
+        for (int i = 0; i < n; i++) {
+            p = append(buf, "<li><a href=\"");
+            p = append(p, url);
+            if (!slash) p = append(p, "/");
+            p = append(p, ents[i].name);
+            p = append(p, "\">");
+            p = append(p, ents[i].name);
+            if (ents[i].type == DIRENT_DIR) p = append(p, "/");
+            p = append(p, "</a></li>\n");
+            if (send_all(sock, buf, p - buf) < 0) {
+                api->closedir(dir);
+                return;
+            }
+        }
+    }
+    api->closedir(dir);
+
+    p = append(buf, "</ul></body></html>\n");
+    send_all(sock, buf, p - buf);
+}
+
+static void serve_file(int sock, const char *path, int head, char *buf) {
+    void *file = api->open(path);
+    if (!file) {
+        send_error(sock, "404 Not Found");
+        return;
+    }
+
+    int size = api->file_size(file);
+    send_header(sock, "200 OK", content_type(path), size);
+    for (int off = 0; !head && off < size; ) {
+        int n = api->read(file, buf, CHUNK_SIZE, off);
+        if (n <= 0 || send_all(sock, buf, n) < 0) break;
+        off += n;
+    }
+    api->close(file);
+}
+
+// Read one request and answer it
+static void serve(int sock, char *buf) {
+    char req[REQ_MAX + 1];
+    int len = 0;
+    while (len < REQ_MAX) {
+        int n = api->tcp_recv_wait(sock, req + len, REQ_MAX - len, IDLE_MS);
+        if (n <= 0) break;
+        len += n;
+        req[len] = '\0';
+
+        // Only the request line and the headers' end matter
+        int done = 0;
+        for (int i = 3; i < len && !done; i++) {
+            done = req[i - 3] == '\r' && req[i - 2] == '\n' && req[i - 1] == '\r' && req[i] == '\n';
+        }
+        if (done) break;
+    }
+    req[len] = '\0';
+
+    int head = 0;
+    char *url;
+    if (strncmp(req, "GET ", 4) == 0) {
+        url = req + 4;
+    } else if (strncmp(req, "HEAD ", 5) == 0) {
+        url = req + 5;
+        head = 1;
+    } else {
+        send_error(sock, len > 0 ? "501 Not Implemented" : "400 Bad Request");
+        return;
+    }
+
+    // The path ends at a space or the query string
+    char *end = url;
+    while (*end && *end != ' ' && *end != '?' && *end != '\r') end++;
+    *end = '\0';
+    if (url[0] != '/' || strlen(url) > PATH_MAX_LEN - 64) {
+        send_error(sock, "400 Bad Request");
+        return;
+    }
+    for (char *s = url; *s; s++) {
+        if (s[0] == '.' && s[1] == '.') {
+            send_error(sock, "403 Forbidden");
+            return;
+        }
+    }
+    served++;
+
+    if (strcmp(url, "/status") == 0) {
+        serve_status(sock, head);
+        return;
+    }
+
+    char path[PATH_MAX_LEN];
+    strcpy(path, root);
+    int rlen = strlen(path);
+    if (rlen > 0 && path[rlen - 1] == '/') path[rlen - 1] = '\0';
+    strcat(path, url);
+    if (path[0] == '\0') strcpy(path, "/");
+
+    void *node = api->open(path);
+    int dir = node && api->is_dir(node);
+    if (node) api->close(node);
+    if (dir) serve_dir(sock, path, url, head, buf);
+    else serve_file(sock, path, head, buf);
+}
+
+static int run_server(int port) {
+    int listener = api->tcp_listen(port, BACKLOG);
+    if (listener < 0) {
+        out_puts("httpd: cannot listen on port ");
+        print_num(port);
+        out_putc('\n');
+        return 1;
+    }
+
+    char *buf = api->malloc(CHUNK_SIZE);
+    if (!buf) {
+        api->tcp_close(listener);
+        out_puts("httpd: out of memory\n");
+        return 1;
+    }
+
+    out_puts("httpd: serving ");
+    out_puts(root);
+    out_puts(" on port ");
+    print_num(port);
+    out_puts(" (q to quit)\n");
+
+    while (1) {
+        if (vibe_has_key(api) && vibe_getc(api) == 'q') break;
+
+        int sock = api->tcp_accept_wait(listener, KEY_CHECK_MS);
+        if (sock < 0) continue;
+        serve(sock, buf);
+        api->tcp_close(sock);
+    }
+
+    api->tcp_close(listener);
+    api->free(buf);
+    out_puts("httpd: ");
+    print_num(served);
+    out_puts(" requests served\n");
+    return 0;
+}
+
+// ============ Load generator ============
+
+typedef struct {
+    int sock;               // -1 = free
+    uint64_t start;
+    long bytes;
+    char status[13];        // "HTTP/1.x NNN"
+} load_conn_t;
+
+static int load_start(load_conn_t *c, uint32_t ip, int port, const char *request, int len) {
+    c->start = api->get_time_ns();
+    c->bytes = 0;
+    c->status[0] = '\0';
+    c->sock = api->tcp_connect(ip, port);
+    if (c->sock < 0) return -1;
+    if (api->tcp_send(c->sock, request, len) != len) {
+        api->tcp_close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int run_load(int argc, char **argv, int arg) {
+    int requests = LOAD_REQUESTS;
+    int conns = LOAD_CONNS;
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-n") == 0) requests = parse_int(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-c") == 0) conns = parse_int(argv[arg + 1]);
+        else break;
+        arg += 2;
+    }
+    if (requests < 1) requests = 1;
+    if (conns < 1) conns = 1;
+    if (conns > LOAD_MAX_CONNS) conns = LOAD_MAX_CONNS;
+    if (conns > requests) conns = requests;
+
+    // [host[:port]] [path] - a lone argument starting with / is the path
+    char host[128];
+    strcpy(host, "127.0.0.1");
+    int port = DEFAULT_PORT;
+    const char *path = "/status";
+    if (arg < argc && argv[arg][0] != '/') {
+        int i = 0;
+        const char *h = argv[arg++];
+        while (h[i] && h[i] != ':' && i < (int)sizeof(host) - 1) {
+            host[i] = h[i];
+            i++;
+        }
+        host[i] = '\0';
+        if (h[i] == ':') port = parse_int(&h[i + 1]);
+    }
+    if (arg < argc) path = argv[arg];
+
+    uint32_t ip = api->dns_resolve(host);
+    if (ip == 0) {
+        out_puts("httpd: cannot resolve ");
+        out_puts(host);
+        out_putc('\n');
+        return 1;
+    }
+
+    char request[512];
+    char *p = append(request, "GET ");
+    p = append(p, path);
+    p = append(p, " HTTP/1.0\r\nHost: ");
+    p = append(p, host);
+    p = append(p, "\r\nConnection: close\r\n\r\n");
+    int req_len = p - request;
+
+    char *buf = api->malloc(CHUNK_SIZE);
+    if (!buf) {
+        out_puts("httpd: out of memory\n");
+        return 1;
+    }
+
+    out_puts("httpd: ");
+    print_num(requests);
+    out_puts(" requests to http://");
+    out_puts(host);
+    out_putc(':');
+    print_num(port);
+    out_puts(path);
+    out_puts(", ");
+    print_num(conns);
+    out_puts(" at a time\n");
+
+    load_conn_t conn[LOAD_MAX_CONNS];
+    for (int i = 0; i < conns; i++) conn[i].sock = -1;
+
+    int started = 0, ok = 0, failed = 0;
+    unsigned long total_bytes = 0;
+    uint64_t latency = 0;
+    uint64_t start = api->get_time_ns();
+    int stalled = 0;
+
+    while (ok + failed < requests && !stalled) {
+        int progress = 0;
+        for (int i = 0; i < conns; i++) {
+            load_conn_t *c = &conn[i];
+            if (c->sock < 0) {
+                if (started >= requests) continue;
+                started++;
+                progress = 1;
+                if (load_start(c, ip, port, request, req_len) < 0) failed++;
+                continue;
+            }
+
+            int n = api->tcp_recv(c->sock, buf, CHUNK_SIZE);
+            if (n == 0) continue;
+            progress = 1;
+            if (n > 0) {
+                for (int j = 0; j < n && c->bytes + j < 12; j++) {
+                    c->status[c->bytes + j] = buf[j];
+                    c->status[c->bytes + j + 1] = '\0';
+                }
+                c->bytes += n;
+                continue;
+            }
+
+            // Server closed: the response is complete
+            api->tcp_close(c->sock);
+            c->sock = -1;
+            if (c->bytes >= 12 && strncmp(c->status + 8, " 200", 4) == 0) {
+                ok++;
+                total_bytes += c->bytes;
+                latency += api->get_time_ns() - c->start;
+            } else {
+                failed++;
+            }
+        }
+
+        if (progress) continue;
+
+        // Sleep until one of the connections has something
+        poll_item_t items[LOAD_MAX_CONNS];
+        int n = 0;
+        for (int i = 0; i < conns; i++) {
+            if (conn[i].sock < 0) continue;
+            items[n].type = POLL_TCP;
+            items[n].handle = conn[i].sock;
+            items[n].events = POLL_IN;
+            n++;
+        }
+        if (n > 0 && api->poll(items, n, IDLE_MS) == 0) stalled = 1;
+    }
+    uint64_t ns = api->get_time_ns() - start;
+    if (ns == 0) ns = 1;
+
+    for (int i = 0; i < conns; i++) {
+        if (conn[i].sock >= 0) api->tcp_close(conn[i].sock);
+    }
+    api->free(buf);
+
+    if (stalled) out_puts("httpd: server stopped answering\n");
+    out_puts("  ");
+    print_num(ok);
+    out_puts(" ok, ");
+    print_num(failed);
+    out_puts(" failed in ");
+    print_num((unsigned long)(ns / 1000000));
+    out_puts(" ms\n  ");
+    print_num((unsigned long)((uint64_t)ok * 1000000000ULL / ns));
+    out_puts(" requests/s, ");
+    print_num((unsigned long)((uint64_t)total_bytes * 1000000000ULL / 1024 / ns));
+    out_puts(" KB/s, ");
+    print_num(ok ? (unsigned long)(latency / ok / 1000) : 0);
+    out_puts(" us average per request\n");
+    return failed ? 1 : 0;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    if (argc > 1 && strcmp(argv[1], "-load") == 0) {
+        return run_load(argc, argv, 2);
+    }
+
+    int port = DEFAULT_PORT;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+        port = parse_int(argv[2]);
+        arg = 3;
+    }
+    if (arg < argc) root = argv[arg];
+
+    return run_server(port);
+}
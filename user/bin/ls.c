@@ -1,11 +1,14 @@
 /*
  * ls - list directory contents
  *
- * Uses the proper readdir API instead of accessing VFS internals.
+ * Reads the directory in batches through opendir/readdir_batch, so a big
+ * directory is walked once rather than from the start for every entry.
  */
 
 #include "../lib/vibe.h"
 
+#define BATCH 32
+
 int main(kapi_t *k, int argc, char **argv) {
     const char *path = ".";
 
@@ -23,25 +26,36 @@ int main(kapi_t *k, int argc, char **argv) {
 
     if (!k->is_dir(dir)) {
         // It's a file, just print the name
+        k->close(dir);
         vibe_puts(k, path);
         vibe_putc(k, '\n');
         return 0;
     }
+    k->close(dir);
 
-    // List directory contents using readdir
-    char name[256];
-    uint8_t type;
-    int index = 0;
+    void *stream = k->opendir(path);
+    vfs_dirent_t *ents = k->malloc(BATCH * sizeof(vfs_dirent_t));
+    if (!stream || !ents) {
+        vibe_puts(k, "ls: cannot read ");
+        vibe_puts(k, path);
+        vibe_putc(k, '\n');
+        if (stream) k->closedir(stream);
+        if (ents) k->free(ents);
+        return 1;
+    }
 
-    while (k->readdir(dir, index, name, sizeof(name), &type) >= 0) {
-        vibe_puts(k, name);
-        if (type == 2) {
-            // Directory
-            vibe_putc(k, '/');
+    int n;
+    while ((n = k->readdir_batch(stream, ents, BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            vibe_puts(k, ents[i].name);
+            if (ents[i].type == DIRENT_DIR) {
+                vibe_putc(k, '/');
+            }
+            vibe_putc(k, '\n');
         }
-        vibe_putc(k, '\n');
-        index++;
     }
 
-    return 0;
+    k->free(ents);
+    k->closedir(stream);
+    return n < 0 ? 1 : 0;
 }
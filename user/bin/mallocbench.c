@@ -0,0 +1,233 @@
+/*
+ * mallocbench - heap allocator benchmark
+ *
+ * Usage: mallocbench [-n ops]
+ *   Runs a mixed-size malloc/free churn (default 20000 operations) against
+ *   the kernel heap and against a copy of the old first-fit allocator
+ *   running in a private arena, first on an empty heap and then on one
+ *   fragmented by freeing every other block of a run of mixed sizes.
+ *   Prints operations per second for each.
+ */
+
+#include "../lib/vibe.h"
+
+#define DEFAULT_OPS  20000
+#define CHURN_SLOTS  512
+#define FRAG_BLOCKS  2048
+#define ARENA_SIZE   (24 * 1024 * 1024)
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+// ============================================================================
+// Reference: the first-fit allocator the kernel used before the slab and
+// segregated-fit heap. One list of every block, first fit on malloc, and
+// free walks the whole list to coalesce.
+// ============================================================================
+
+typedef struct ff_block {
+    size_t size;
+    uint8_t is_free;
+    struct ff_block *next;
+} ff_block_t;
+
+#define FF_HEADER sizeof(ff_block_t)
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+static ff_block_t *ff_list;
+
+static void ff_init(void *arena, size_t size) {
+    ff_list = (ff_block_t *)arena;
+    ff_list->size = size - FF_HEADER;
+    ff_list->is_free = 1;
+    ff_list->next = NULL;
+}
+
+static void *ff_malloc(size_t size) {
+    size = ALIGN_UP(size, 16);
+    for (ff_block_t *b = ff_list; b; b = b->next) {
+        if (!b->is_free || b->size < size) continue;
+        if (b->size >= size + FF_HEADER + 16) {
+            ff_block_t *rest = (ff_block_t *)((uint8_t *)b + FF_HEADER + size);
+            rest->size = b->size - size - FF_HEADER;
+            rest->is_free = 1;
+            rest->next = b->next;
+            b->size = size;
+            b->next = rest;
+        }
+        b->is_free = 0;
+        return (uint8_t *)b + FF_HEADER;
+    }
+    return NULL;
+}
+
+static void ff_free(void *ptr) {
+    if (!ptr) return;
+    ff_block_t *block = (ff_block_t *)((uint8_t *)ptr - FF_HEADER);
+    block->is_free = 1;
+
+    ff_block_t *b = ff_list;
+    while (b) {
+        if (b->is_free && b->next && b->next->is_free) {
+            b->size += FF_HEADER + b->next->size;
+            b->next = b->next->next;
+        } else {
+            b = b->next;
+        }
+    }
+}
+
+// ============================================================================
+// Workload
+// ============================================================================
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*release)(void *ptr);
+} heap_ops_t;
+
+static void *kernel_malloc(size_t size) { return api->malloc(size); }
+static void kernel_free(void *ptr) { if (ptr) api->free(ptr); }
+
+// Programs run at EL1, so the generic timer can be read directly
+static uint64_t now_ns(void) {
+    uint64_t t, freq;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(t));
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return t / freq * 1000000000ULL + t % freq * 1000000000ULL / freq;
+}
+
+// Tiny LCG so every run sees the same sequence
+static uint32_t bench_rand(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// Size mix modelled on what the TLS handshake and the browser generate:
+// mostly small strings/nodes, some record-sized buffers, a few big ones
+static size_t bench_size(uint32_t *seed) {
+    uint32_t r = bench_rand(seed) % 100;
+    if (r < 70) return 8 + bench_rand(seed) % 248;          // 8B - 256B
+    if (r < 92) return 256 + bench_rand(seed) % 3840;       // 256B - 4KB
+    return 4096 + bench_rand(seed) % (60 * 1024);           // 4KB - 64KB
+}
+
+// ops random malloc/free operations over a pool of live slots, ops/sec
+static unsigned long churn(const heap_ops_t *h, void **slots, int ops, uint32_t seed) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < ops; i++) {
+        int idx = bench_rand(&seed) % CHURN_SLOTS;
+        if (slots[idx]) {
+            h->release(slots[idx]);
+            slots[idx] = NULL;
+        } else {
+            slots[idx] = h->alloc(bench_size(&seed));
+        }
+    }
+    uint64_t ns = now_ns() - start;
+    if (ns == 0) ns = 1;
+
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        h->release(slots[i]);
+        slots[i] = NULL;
+    }
+    return (unsigned long)((uint64_t)ops * 1000000000ULL / ns);
+}
+
+static void run(const heap_ops_t *h, void **slots, void **frag, int ops) {
+    unsigned long fresh = churn(h, slots, ops, 0x5eed);
+
+    // Fill with mixed sizes, then free every other block: the survivors
+    // pin holes of all sizes across the heap
+    uint32_t seed = 0xf7a6;
+    for (int i = 0; i < FRAG_BLOCKS; i++) frag[i] = h->alloc(bench_size(&seed));
+    for (int i = 0; i < FRAG_BLOCKS; i += 2) {
+        h->release(frag[i]);
+        frag[i] = NULL;
+    }
+    unsigned long aged = churn(h, slots, ops, 0x5eed);
+    for (int i = 1; i < FRAG_BLOCKS; i += 2) h->release(frag[i]);
+
+    out_puts("  ");
+    out_puts(h->name);
+    out_puts(": ");
+    print_num(fresh);
+    out_puts(" ops/sec fresh, ");
+    print_num(aged);
+    out_puts(" ops/sec fragmented\n");
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    int ops = DEFAULT_OPS;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        ops = parse_int(argv[2]);
+    }
+    if (ops < 1) ops = 1;
+
+    void **slots = k->malloc(CHURN_SLOTS * sizeof(void *));
+    void **frag = k->malloc(FRAG_BLOCKS * sizeof(void *));
+    void *arena = k->malloc(ARENA_SIZE);
+    if (!slots || !frag || !arena) {
+        out_puts("mallocbench: out of memory\n");
+        if (slots) k->free(slots);
+        if (frag) k->free(frag);
+        if (arena) k->free(arena);
+        return 1;
+    }
+    memset(slots, 0, CHURN_SLOTS * sizeof(void *));
+
+    out_puts("mallocbench: ");
+    print_num(ops);
+    out_puts(" ops per run\n");
+
+    heap_ops_t kernel_heap = { "kernel heap", kernel_malloc, kernel_free };
+    heap_ops_t first_fit = { "old first-fit", ff_malloc, ff_free };
+    run(&kernel_heap, slots, frag, ops);
+    ff_init(arena, ARENA_SIZE);
+    run(&first_fit, slots, frag, ops);
+
+    k->free(arena);
+    k->free(frag);
+    k->free(slots);
+    return 0;
+}
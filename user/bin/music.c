@@ -1254,6 +1254,9 @@ static void extract_filename(const char *path, char *name, int max_len) {
 int main(kapi_t *k, int argc, char **argv) {
     api = k;
 
+    // Keep decoding ahead of the audio pump when other programs are busy
+    if (api->set_priority) api->set_priority(0, -5);
+
     // Check for file argument
     if (argc > 1 && argv[1]) {
         single_file_mode = 1;
@@ -1398,7 +1401,10 @@ int main(kapi_t *k, int argc, char **argv) {
 
         // Only redraw what's dirty
         draw_dirty();
-        api->yield();
+
+        // The kernel pumps the audio - just poll the UI at ~200Hz
+        if (api->sleep_us) api->sleep_us(5000);
+        else api->yield();
     }
 
     if (is_playing) {
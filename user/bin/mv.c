@@ -80,8 +80,9 @@ static int copy_file(const char *src, const char *dst) {
     size_t offset = 0;
     int bytes;
 
+    api->truncate(dst_file, 0);
     while ((bytes = api->read(src_file, buf, sizeof(buf), offset)) > 0) {
-        api->write(dst_file, buf, bytes);
+        if (api->write_at(dst_file, buf, bytes, offset) < 0) return -1;
         offset += bytes;
     }
 
@@ -0,0 +1,245 @@
+/*
+ * netbench - TCP download throughput benchmark
+ *
+ * Usage: netbench [-n runs] [host[:port]] [path]
+ *   Fetches path (default /) over plain HTTP runs times (default 3) and
+ *   prints how fast each body came in, then the kernel's retransmission
+ *   counters. The default host is 10.0.2.2:8000 - under QEMU user
+ *   networking that is the host machine, so something like
+ *       head -c 50M /dev/urandom > big.bin && python3 -m http.server 8000
+ *   on the host and "netbench /big.bin" in VibeOS times a local transfer.
+ *   Ends with the time per packet in each layer of the network stack.
+ */
+
+#include "../lib/vibe.h"
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_HOST "10.0.2.2"
+#define DEFAULT_PORT 8000
+#define RECV_SIZE    16384
+#define IDLE_MS      10000      // Silence before giving up
+#define PROF_MAX     8
+
+// Kernel's layer order (NET_PROF_* in kernel/net.h)
+static const char *prof_names[PROF_MAX] = {
+    "rx driver", "rx eth", "rx ip", "rx tcp",
+    "tx tcp", "tx ip", "tx eth", "tx driver"
+};
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+// KB/s for a byte count over a ns interval
+static unsigned long rate_kbs(unsigned long bytes, uint64_t ns) {
+    if (ns == 0) ns = 1;
+    return (unsigned long)((uint64_t)bytes * 1000000000ULL / 1024 / ns);
+}
+
+static char *append(char *p, const char *s) {
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+// One GET. Returns body bytes, or -1; *ns is the time from sending the
+// request to the connection closing.
+static long fetch_once(uint32_t ip, int port, const char *host, const char *path,
+                       char *buf, uint64_t *ns) {
+    int sock = api->tcp_connect(ip, port);
+    if (sock < 0) {
+        out_puts("netbench: connection failed\n");
+        return -1;
+    }
+
+    char request[512];
+    char *p = append(request, "GET ");
+    p = append(p, path);
+    p = append(p, " HTTP/1.0\r\nHost: ");
+    p = append(p, host);
+    p = append(p, "\r\nConnection: close\r\n\r\n");
+
+    uint64_t start = api->get_time_ns();
+    if (api->tcp_send(sock, request, p - request) < 0) {
+        out_puts("netbench: send failed\n");
+        api->tcp_close(sock);
+        return -1;
+    }
+
+    // Count everything after the blank line that ends the headers
+    long total = 0;
+    long body = -1;
+    int matched = 0;
+    int stalled = 0;
+    while (1) {
+        int n = api->tcp_recv_wait(sock, buf, RECV_SIZE, IDLE_MS);
+        if (n < 0) break;
+        if (n == 0) {
+            stalled = 1;
+            break;
+        }
+        total += n;
+
+        if (body >= 0) {
+            body += n;
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            char want = (matched & 1) ? '\n' : '\r';
+            matched = (buf[i] == want) ? matched + 1 : (buf[i] == '\r');
+            if (matched == 4) {
+                body = n - i - 1;
+                break;
+            }
+        }
+    }
+    *ns = api->get_time_ns() - start;
+    api->tcp_close(sock);
+
+    if (stalled) out_puts("netbench: transfer stalled\n");
+    return body >= 0 ? body : total;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    int runs = DEFAULT_RUNS;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        runs = parse_int(argv[2]);
+        arg = 3;
+    }
+    if (runs < 1) runs = 1;
+
+    // [host[:port]] [path] - a lone argument starting with / is the path
+    char host[128];
+    strcpy(host, DEFAULT_HOST);
+    int port = DEFAULT_PORT;
+    const char *path = "/";
+    if (arg < argc && argv[arg][0] != '/') {
+        int i = 0;
+        const char *h = argv[arg++];
+        while (h[i] && h[i] != ':' && i < (int)sizeof(host) - 1) {
+            host[i] = h[i];
+            i++;
+        }
+        host[i] = '\0';
+        if (h[i] == ':') port = parse_int(&h[i + 1]);
+    }
+    if (arg < argc) path = argv[arg];
+
+    uint32_t ip = k->dns_resolve(host);
+    if (ip == 0) {
+        out_puts("netbench: cannot resolve ");
+        out_puts(host);
+        out_putc('\n');
+        return 1;
+    }
+
+    char *buf = k->malloc(RECV_SIZE);
+    if (!buf) {
+        out_puts("netbench: out of memory\n");
+        return 1;
+    }
+
+    uint64_t to0 = 0, fr0 = 0, ooo0 = 0;
+    k->tcp_stats(&to0, &fr0, &ooo0);
+    uint64_t pk0[PROF_MAX], ns0[PROF_MAX];
+    int layers = k->net_prof(pk0, ns0, PROF_MAX);
+    if (layers > PROF_MAX) layers = PROF_MAX;
+
+    out_puts("netbench: http://");
+    out_puts(host);
+    out_putc(':');
+    print_num(port);
+    out_puts(path);
+    out_putc('\n');
+
+    unsigned long all_bytes = 0;
+    uint64_t all_ns = 0;
+    for (int r = 0; r < runs; r++) {
+        uint64_t ns = 0;
+        long bytes = fetch_once(ip, port, host, path, buf, &ns);
+        if (bytes < 0) {
+            k->free(buf);
+            return 1;
+        }
+        all_bytes += bytes;
+        all_ns += ns;
+
+        out_puts("  run ");
+        print_num(r + 1);
+        out_puts(": ");
+        print_num((unsigned long)bytes / 1024);
+        out_puts(" KB in ");
+        print_num((unsigned long)(ns / 1000000));
+        out_puts(" ms, ");
+        print_num(rate_kbs(bytes, ns));
+        out_puts(" KB/s\n");
+    }
+    k->free(buf);
+
+    uint64_t to = 0, fr = 0, ooo = 0;
+    k->tcp_stats(&to, &fr, &ooo);
+
+    out_puts("  average: ");
+    print_num(rate_kbs(all_bytes, all_ns));
+    out_puts(" KB/s\n  tcp: ");
+    print_num((unsigned long)(to - to0));
+    out_puts(" timeouts, ");
+    print_num((unsigned long)(fr - fr0));
+    out_puts(" fast retransmits, ");
+    print_num((unsigned long)(ooo - ooo0));
+    out_puts(" out-of-order segments\n");
+
+    // Per layer, including the layers below it (TX) or above it (RX)
+    uint64_t pk[PROF_MAX], ns[PROF_MAX];
+    k->net_prof(pk, ns, PROF_MAX);
+    out_puts("  per packet, with the layers it calls:\n");
+    for (int i = 0; i < layers; i++) {
+        uint64_t n = pk[i] - pk0[i];
+        out_puts("    ");
+        out_puts(prof_names[i]);
+        out_puts(": ");
+        print_num((unsigned long)n);
+        out_puts(" packets, ");
+        print_num(n ? (unsigned long)((ns[i] - ns0[i]) / n) : 0);
+        out_puts(" ns each\n");
+    }
+    return 0;
+}
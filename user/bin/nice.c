@@ -0,0 +1,102 @@
+/*
+ * nice - run a command at a different scheduling priority
+ *
+ * Usage: nice [-n N] <command> [args...]
+ *        nice            (print current nice value)
+ *
+ * N is added to the current nice value (default 10, capped at 19).
+ * Only lowering priority is supported - a raised priority isn't
+ * inherited by the command, so a program has to raise its own.
+ */
+
+#include "../lib/vibe.h"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void print_int(int n) {
+    char buf[12];
+    int i = 0;
+
+    if (n < 0) {
+        out_puts("-");
+        n = -n;
+    }
+    do {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    char s[2] = { 0, 0 };
+    while (i > 0) {
+        s[0] = buf[--i];
+        out_puts(s);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    int neg = 0;
+
+    if (*s == '-') { neg = 1; s++; }
+    else if (*s == '+') s++;
+
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+
+    return neg ? -n : n;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    if (argc < 2) {
+        int nice = 0;
+        k->get_priority(0, &nice);
+        print_int(nice);
+        out_puts("\n");
+        return 0;
+    }
+
+    int adjust = 10;
+    int first = 1;
+    if (argv[1][0] == '-' && argv[1][1] == 'n' && argv[1][2] == '\0') {
+        if (argc < 4) {
+            out_puts("Usage: nice [-n N] <command> [args...]\n");
+            return 1;
+        }
+        adjust = parse_int(argv[2]);
+        first = 3;
+    }
+    if (adjust < 0) {
+        out_puts("nice: only lowering priority is supported\n");
+        return 1;
+    }
+
+    // Our own nice value is what the command inherits
+    int nice = 0;
+    k->get_priority(0, &nice);
+    if (k->set_priority(0, nice + adjust) < 0) {
+        out_puts("nice: cannot set priority\n");
+        return 1;
+    }
+
+    // Resolve bare command names in /bin like the shell does
+    char path[256];
+    const char *cmd = argv[first];
+    int i = 0;
+    if (cmd[0] != '/') {
+        const char *bin = "/bin/";
+        while (*bin) path[i++] = *bin++;
+    }
+    while (*cmd && i < (int)sizeof(path) - 1) path[i++] = *cmd++;
+    path[i] = '\0';
+
+    return k->exec_args(path, argc - first, &argv[first]);
+}
@@ -0,0 +1,193 @@
+/*
+ * readbench - sequential read benchmark in small chunks
+ *
+ * Usage: readbench [-s MB] [file]
+ *   Reads the file in 4KB chunks and times each tenth of it. With O(1)
+ *   seeks every tenth takes about as long as the first; if each read had
+ *   to walk the cluster chain from the start, later tenths would take
+ *   longer and longer. Without a file argument a test file of MB megabytes
+ *   (default 50) is written to / and deleted afterwards - not /tmp, which
+ *   is in RAM.
+ */
+
+#include "../lib/vibe.h"
+
+#define CHUNK_SIZE   4096
+#define SEGMENTS     10
+#define DEFAULT_MB   50
+#define TEST_FILE    "/readbench.dat"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+// KB/s for a byte count over a ns interval
+static unsigned long rate_kbs(unsigned long bytes, uint64_t ns) {
+    if (ns == 0) ns = 1;
+    return (unsigned long)((uint64_t)bytes * 1000000000ULL / 1024 / ns);
+}
+
+static int make_test_file(unsigned long size) {
+    out_puts("readbench: writing ");
+    print_num(size / (1024 * 1024));
+    out_puts(" MB test file...\n");
+
+    char *data = api->malloc(size);
+    if (!data) {
+        out_puts("readbench: out of memory for test file\n");
+        return -1;
+    }
+    // Something other than zeros, so nothing gets to skip work
+    for (unsigned long i = 0; i < size; i++) {
+        data[i] = (char)(i * 131 + (i >> 12));
+    }
+
+    void *file = api->create(TEST_FILE);
+    int ret = file ? api->write(file, data, size) : -1;
+    if (file) api->close(file);
+    api->free(data);
+    if (ret < 0) {
+        out_puts("readbench: cannot write " TEST_FILE "\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    unsigned long mb = DEFAULT_MB;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            mb = parse_int(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (mb == 0) mb = 1;
+
+    int own_file = (path == NULL);
+    if (own_file) {
+        if (make_test_file(mb * 1024 * 1024) < 0) return 1;
+        path = TEST_FILE;
+    }
+
+    void *file = k->open(path);
+    if (!file || k->is_dir(file)) {
+        out_puts("readbench: cannot open ");
+        out_puts(path);
+        out_putc('\n');
+        if (file) k->close(file);
+        return 1;
+    }
+
+    unsigned long size = k->file_size(file);
+    unsigned long segment = size / SEGMENTS;
+    if (segment < CHUNK_SIZE) {
+        out_puts("readbench: file too small\n");
+        k->close(file);
+        return 1;
+    }
+
+    char *buf = k->malloc(CHUNK_SIZE);
+    if (!buf) {
+        out_puts("readbench: out of memory\n");
+        k->close(file);
+        return 1;
+    }
+
+    out_puts("readbench: ");
+    out_puts(path);
+    out_puts(", ");
+    print_num(size / 1024);
+    out_puts(" KB in 4 KB reads\n");
+
+    unsigned long offset = 0;
+    uint64_t start = k->get_time_ns();
+    uint64_t seg_start = start;
+    uint64_t first_ns = 0, last_ns = 0;
+
+    for (int seg = 0; seg < SEGMENTS; seg++) {
+        unsigned long begin = offset;
+        unsigned long end = (seg == SEGMENTS - 1) ? size : offset + segment;
+        while (offset < end) {
+            unsigned long chunk = end - offset;
+            if (chunk > CHUNK_SIZE) chunk = CHUNK_SIZE;
+            int rd = k->read(file, buf, chunk, offset);
+            if (rd <= 0) {
+                out_puts("readbench: read error\n");
+                k->free(buf);
+                k->close(file);
+                return 1;
+            }
+            offset += rd;
+        }
+
+        uint64_t now = k->get_time_ns();
+        uint64_t ns = now - seg_start;
+        if (seg == 0) first_ns = ns;
+        last_ns = ns;
+
+        out_puts("  ");
+        print_num((seg + 1) * 10);
+        out_puts("%: ");
+        print_num((unsigned long)(ns / 1000000));
+        out_puts(" ms, ");
+        print_num(rate_kbs(end - begin, ns));
+        out_puts(" KB/s\n");
+        seg_start = now;
+    }
+
+    uint64_t total_ns = k->get_time_ns() - start;
+    out_puts("total: ");
+    print_num((unsigned long)(total_ns / 1000000));
+    out_puts(" ms, ");
+    print_num(rate_kbs(size, total_ns));
+    out_puts(" KB/s, last/first tenth ");
+    print_num((unsigned long)(first_ns ? last_ns * 100 / first_ns : 0));
+    out_puts("%\n");
+
+    k->free(buf);
+    k->close(file);
+    if (own_file) {
+        k->delete(TEST_FILE);
+    }
+    return 0;
+}
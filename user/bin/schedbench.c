@@ -0,0 +1,118 @@
+/*
+ * schedbench - scheduler wakeup latency benchmark
+ *
+ * Usage: schedbench [hogs]
+ *   Starts <hogs> CPU-bound processes (default 8), then sleeps 10ms at a
+ *   time and reports how long the kernel took from waking us to running
+ *   us - first at the hogs' priority, then at a raised one.
+ */
+
+#include "../lib/vibe.h"
+
+#define DEFAULT_HOGS 8
+#define MAX_HOGS     12
+#define ITERATIONS   100
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static int parse_int(const char *s) {
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        s++;
+    }
+    return n;
+}
+
+static void run_round(kapi_t *k, int nice) {
+    uint64_t wakeups, total_us, max_us;
+
+    k->set_priority(0, nice);
+    k->sched_latency(0, 0, 0, 1);
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        k->sleep_ms(10);
+    }
+
+    k->sched_latency(&wakeups, &total_us, &max_us, 1);
+
+    out_puts(nice < 0 ? "  nice -" : "  nice ");
+    print_num(nice < 0 ? -nice : nice);
+    out_puts(": ");
+    print_num(wakeups);
+    out_puts(" wakeups, avg ");
+    print_num(wakeups ? total_us / wakeups : 0);
+    out_puts(" us, max ");
+    print_num(max_us);
+    out_puts(" us\n");
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    // Child mode: burn CPU until killed
+    if (argc > 1 && argv[1][0] == 'h') {
+        volatile unsigned long spin = 0;
+        while (1) spin++;
+    }
+
+    int hogs = DEFAULT_HOGS;
+    if (argc > 1) {
+        hogs = parse_int(argv[1]);
+        if (hogs > MAX_HOGS) hogs = MAX_HOGS;
+    }
+
+    char *hog_argv[2] = { "/bin/schedbench", "hog" };
+    int pids[MAX_HOGS];
+    int started = 0;
+    for (int i = 0; i < hogs; i++) {
+        int pid = k->spawn_args("/bin/schedbench", 2, hog_argv);
+        if (pid < 0) break;
+        pids[started++] = pid;
+    }
+
+    out_puts("schedbench: ");
+    print_num(started);
+    out_puts(" hogs, ");
+    print_num(k->get_cpu_cores());
+    out_puts(" cores, ");
+    print_num(ITERATIONS);
+    out_puts(" x 10ms sleeps\n");
+
+    run_round(k, 0);
+    run_round(k, -5);
+
+    for (int i = 0; i < started; i++) {
+        k->kill_process(pids[i]);
+    }
+    return 0;
+}
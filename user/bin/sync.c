@@ -0,0 +1,17 @@
+/*
+ * sync - write cached disk changes out now
+ */
+
+#include "../lib/vibe.h"
+
+int main(kapi_t *k, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    if (k->sync() < 0) {
+        if (k->stdio_puts) k->stdio_puts("sync: write error\n");
+        else k->puts("sync: write error\n");
+        return 1;
+    }
+    return 0;
+}
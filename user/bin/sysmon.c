@@ -16,7 +16,7 @@ static gfx_ctx_t gfx;
 
 // Window content dimensions
 #define CONTENT_W 320
-#define CONTENT_H 520
+#define CONTENT_H 616
 
 // Process states (must match kernel)
 #define PROC_STATE_FREE    0
@@ -130,6 +130,14 @@ static void format_size_kb(char *buf, int kb) {
     }
 }
 
+// Block cache hit rate as "93% of 1234"
+static void format_cache_hits(char *buf, uint64_t hits, uint64_t misses) {
+    uint64_t total = hits + misses;
+    format_num(buf, total ? (unsigned long)(hits * 100 / total) : 0);
+    strcat(buf, "% of ");
+    format_num(buf + strlen(buf), (unsigned long)total);
+}
+
 static void format_uptime(char *buf, unsigned long ticks) {
     unsigned long total_seconds = ticks / 100;
     unsigned long hours = total_seconds / 3600;
@@ -316,6 +324,39 @@ static void draw_all(void) {
     int disk_total = api->get_disk_total();
     format_size_kb(buf, disk_total);
     draw_label_value(y, "Size:", buf);
+    y += 18;
+
+    // Free space is a running count in the kernel, cheap to ask every frame
+    int disk_free = api->get_disk_free();
+    format_size_kb(buf, disk_free);
+    draw_label_value(y, "Free:", buf);
+    y += 18;
+
+    int disk_percent = disk_total ? (int)(((uint64_t)(disk_total - disk_free) * 100) / disk_total) : 0;
+    draw_progress_bar(16, y, CONTENT_W - 80, 14, disk_percent);
+    format_num(buf, disk_percent);
+    blen = strlen(buf);
+    buf[blen] = '%';
+    buf[blen+1] = '\0';
+    buf_draw_string(CONTENT_W - 48, y, buf, COLOR_VALUE, COLOR_BG);
+    y += 24;
+
+    uint64_t hits = 0, misses = 0;
+    uint32_t cached = 0, dirty = 0;
+    api->blk_cache_stats(&hits, &misses, NULL, &cached, &dirty);
+    format_cache_hits(buf, hits, misses);
+    draw_label_value(y, "Cache Hits:", buf);
+    y += 18;
+
+    format_size_kb(buf, (int)(dirty / 2));
+    strcat(buf, " dirty");
+    draw_label_value(y, "Cache:", buf);
+    y += 18;
+
+    uint64_t dhits = 0, dmisses = 0;
+    api->dcache_stats(&dhits, &dmisses, NULL);
+    format_cache_hits(buf, dhits, dmisses);
+    draw_label_value(y, "Name Hits:", buf);
     y += 24;
 
     // ============ Processes Section ============
@@ -463,7 +504,38 @@ static void print_cli(void) {
     format_size_kb(buf, disk_total);
     out("Disk Size:  ");
     out(buf);
-    out("\n\n");
+    out("\n");
+
+    int disk_free = api->get_disk_free();
+    format_size_kb(buf, disk_free);
+    out("Disk Free:  ");
+    out(buf);
+    out("\n");
+
+    uint64_t hits = 0, misses = 0, writebacks = 0;
+    uint32_t cached = 0, dirty = 0;
+    api->blk_cache_stats(&hits, &misses, &writebacks, &cached, &dirty);
+    format_cache_hits(buf, hits, misses);
+    out("Disk Cache: ");
+    out(buf);
+    out(" sectors hit, ");
+    format_size_kb(buf, (int)(cached / 2));
+    out(buf);
+    out(" cached, ");
+    format_size_kb(buf, (int)(dirty / 2));
+    out(buf);
+    out(" dirty\n");
+
+    uint64_t dhits = 0, dmisses = 0;
+    uint32_t dentries = 0;
+    api->dcache_stats(&dhits, &dmisses, &dentries);
+    format_cache_hits(buf, dhits, dmisses);
+    out("Name Cache: ");
+    out(buf);
+    out(" lookups hit, ");
+    format_num(buf, dentries);
+    out(buf);
+    out(" names\n\n");
 
     // Processes
     int proc_count = api->get_process_count();
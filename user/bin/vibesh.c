@@ -274,28 +274,32 @@ static void do_tab_completion(const char *prompt) {
     }
 
     // Open directory
-    void *dir = k->open(dir_path);
-    if (!dir || !k->is_dir(dir)) return;
+    void *dir = k->opendir(dir_path);
+    if (!dir) return;
 
     // Find matches
     char matches[10][PATH_MAX];  // Up to 10 matches
+    int match_dir[10];
     int match_count = 0;
     int prefix_len = strlen(prefix);
 
-    char name[256];
-    uint8_t type;
-    int idx = 0;
+    vfs_dirent_t ents[8];
+    int n;
 
-    while (match_count < 10 && k->readdir(dir, idx, name, sizeof(name), &type) == 0) {
-        idx++;
-        if (name[0] == '.') continue;  // Skip hidden files
+    while (match_count < 10 && (n = k->readdir_batch(dir, ents, 8)) > 0) {
+        for (int i = 0; i < n && match_count < 10; i++) {
+            const char *name = ents[i].name;
+            if (name[0] == '.') continue;  // Skip hidden files
 
-        // Check if name starts with prefix
-        if (strncmp(name, prefix, prefix_len) == 0) {
-            strcpy(matches[match_count], name);
-            match_count++;
+            // Check if name starts with prefix
+            if (strncmp(name, prefix, prefix_len) == 0) {
+                strcpy(matches[match_count], name);
+                match_dir[match_count] = (ents[i].type == DIRENT_DIR);
+                match_count++;
+            }
         }
     }
+    k->closedir(dir);
 
     if (match_count == 0) {
         return;  // No matches
@@ -321,14 +325,7 @@ static void do_tab_completion(const char *prompt) {
         }
 
         // Add trailing / for directories or space for files/commands
-        // Check if it's a directory
-        char full_path[PATH_MAX];
-        strcpy(full_path, dir_path);
-        if (full_path[strlen(full_path) - 1] != '/') strcat(full_path, "/");
-        strcat(full_path, match);
-        void *node = k->open(full_path);
-
-        char suffix = (node && k->is_dir(node)) ? '/' : ' ';
+        char suffix = match_dir[0] ? '/' : ' ';
         if (cmd_len < CMD_MAX - 1) {
             for (int j = cmd_len; j >= cmd_pos; j--) {
                 cmd_buf[j + 1] = cmd_buf[j];
@@ -15,6 +15,32 @@ typedef unsigned int uint32_t;
 typedef unsigned long uint64_t;
 typedef signed short int16_t;
 
+// Directory entry from readdir_batch (must match kernel/vfs.h)
+#define DIRENT_FILE 1
+#define DIRENT_DIR  2
+typedef struct vfs_dirent {
+    char name[256];
+    uint8_t type;       // DIRENT_FILE or DIRENT_DIR
+    uint8_t attr;       // FAT attribute bits (0x01 read-only, 0x02 hidden, ...)
+    uint32_t size;      // File size in bytes
+} vfs_dirent_t;
+
+// poll(): sockets and windows to wait on, and what for
+#define POLL_TCP     1      // handle is a TCP socket
+#define POLL_TLS     2      // handle is a TLS socket
+#define POLL_WINDOW  3      // handle is a window id (POLL_IN: an event waits)
+
+#define POLL_IN   1         // Something to read (or accept); EOF counts
+#define POLL_OUT  2         // Room to send
+#define POLL_HUP  4         // Closed - always reported
+
+typedef struct poll_item {
+    int type;               // POLL_TCP / POLL_TLS / POLL_WINDOW
+    int handle;
+    int events;             // POLL_IN | POLL_OUT wanted
+    int revents;            // Filled in by poll()
+} poll_item_t;
+
 // Kernel API structure (must match kernel/kapi.h)
 typedef struct kapi {
     uint32_t version;
@@ -210,6 +236,67 @@ typedef struct kapi {
     int (*dma_fb_copy)(uint32_t *dst, const uint32_t *src,      // Full framebuffer copy
                        uint32_t width, uint32_t height);
     int (*dma_fill)(void *dst, uint32_t value, uint32_t len);   // Fill with 32-bit value
+
+    // Scheduling priority (nice -20..19, lower runs first; pid 0 = self)
+    int (*set_priority)(int pid, int nice);                      // Returns 0 or -1
+    int (*get_priority)(int pid, int *nice);                     // Returns 0 or -1
+    void (*sched_latency)(uint64_t *wakeups, uint64_t *total_us, // Sleep wakeup-to-run delay
+                          uint64_t *max_us, int reset);
+
+    // High resolution time (tickless timer)
+    uint64_t (*get_time_ns)(void);                               // Monotonic ns since boot
+    void (*sleep_us)(uint32_t us);                               // Sleep at least us microseconds
+
+    // Disk block cache (write-back)
+    int (*sync)(void);                                           // Flush to disk, 0 or -1
+    void (*blk_cache_stats)(uint64_t *hits, uint64_t *misses,    // Sectors served from cache /
+                            uint64_t *writebacks,                // read from disk / written,
+                            uint32_t *cached, uint32_t *dirty);  // sectors held / unwritten
+
+    // Positional file I/O (write() above replaces the whole file)
+    int (*write_at)(void *file, const char *buf, size_t size,    // Write at offset, extending
+                    size_t offset);                              // the file; bytes or -1
+    int (*truncate)(void *file, size_t size);                    // Cut or zero-extend, 0 or -1
+
+    // Raw disk reads, all n queued before waiting (benchmarks)
+    int (*blk_read_batch)(const uint32_t *sectors, int n,        // n reads of count sectors
+                          uint32_t count, void *buf);            // into buf back to back, 0/-1
+
+    // Directory entry cache
+    void (*dcache_stats)(uint64_t *hits, uint64_t *misses,       // Name lookups answered from
+                         uint32_t *entries);                     // cache / scanned / names held
+
+    // Directory streams (one pass, vs readdir's index per call)
+    void *(*opendir)(const char *path);                          // NULL if not a directory
+    int   (*readdir_batch)(void *dir, struct vfs_dirent *ents,   // Up to max entries; count,
+                           int max);                             // 0 at the end, -1 on error
+    void  (*closedir)(void *dir);
+
+    // Program image cache
+    void (*exec_cache_stats)(uint64_t *hits, uint64_t *misses,   // Starts served from cache /
+                             uint64_t *bytes);                   // loaded from disk, bytes held
+
+    // TCP counters
+    void (*tcp_stats)(uint64_t *timeouts, uint64_t *fast_retransmits,   // Retransmissions, and
+                      uint64_t *ooo_segments);                          // segments received out of order
+
+    // TCP server sockets
+    int (*tcp_listen)(uint16_t port, int backlog);   // Listening socket or -1
+    int (*tcp_accept)(int listener);                  // Waiting connection or -1 (doesn't block)
+
+    // Network stack cost per layer, see NET_PROF_* in kernel/net.h
+    int (*net_prof)(uint64_t *packets, uint64_t *ns, int max);  // Returns layer count
+
+    // Non-blocking DNS: 1 = *ip set, 0 = query out (ask again), -1 = no such host
+    int (*dns_lookup)(const char *hostname, uint32_t *ip);
+
+    // Waiting on the network without spinning. Timeouts in ms, 0xffffffff = none.
+    int (*tcp_recv_wait)(int sock, void *buf, uint32_t maxlen, uint32_t timeout_ms);  // 0 on timeout
+    int (*tcp_accept_wait)(int listener, uint32_t timeout_ms);                       // -1 on timeout
+    int (*tls_recv_wait)(int sock, void *buf, uint32_t maxlen, uint32_t timeout_ms);  // 0 on timeout
+    int (*poll)(struct poll_item *items, int count, int timeout_ms);  // Ready count, 0 on timeout; -1 = no timeout
+    int (*window_has_event)(int wid);   // Set by the desktop: window_poll_event has one waiting
+    void (*poll_wake)(void);            // Desktop calls it after queueing a window event
 } kapi_t;
 
 // TTF glyph info (returned by ttf_get_glyph)
@@ -279,6 +366,18 @@ typedef struct {
 // Network helper: make IP address from bytes
 #define MAKE_IP(a,b,c,d) (((uint32_t)(a)<<24)|((uint32_t)(b)<<16)|((uint32_t)(c)<<8)|(uint32_t)(d))
 
+// Stack size: programs get a 256KB stack unless they ask for more. Put
+// VIBE_STACK_SIZE(1024 * 1024) at file scope in one source file; the kernel
+// reads it from an ELF note when loading the program (max 8MB).
+#define VIBE_STACK_SIZE(bytes) \
+    __asm__(".pushsection .note.vibeos.stack, \"a\"\n" \
+            ".balign 4\n" \
+            ".long 7, 4, 1\n"          /* namesz, descsz, NT_VIBEOS_STACK */ \
+            ".asciz \"VibeOS\"\n" \
+            ".balign 4\n" \
+            ".long " #bytes "\n" \
+            ".popsection")
+
 // ============ String Functions ============
 
 static inline size_t strlen(const char *s) {